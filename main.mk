@@ -10,9 +10,23 @@ SUBMAKEFILES := \
     src/sip_to_lad.mk \
     src/plot_glasgow_solver_outputs.mk \
     src/plot_glasgow_solver_proofs.mk \
-    src/create_random_graph.mk
+    src/create_random_graph.mk \
+    src/solve_with_session.mk
 
-override CXXFLAGS += -O3 -march=native -std=c++17 -Isrc/ -W -Wall -g -ggdb3 -pthread
+# Bulk bitset operations pick AVX2 or AVX-512 code at runtime, so we don't
+# need -march=native to be fast. Small bitsets are handled inline, though, and
+# without -mpopcnt each of their popcounts is a call into libgcc, so on x86-64
+# we assume POPCNT, which every x86-64 CPU from the last fifteen years has.
+# Build with ARCH_CXXFLAGS= for a binary that runs on any x86-64 CPU, or with
+# ARCH_CXXFLAGS=-march=native if it will only ever be run on the machine that
+# built it.
+ifeq ($(shell uname -m), x86_64)
+ARCH_CXXFLAGS ?= -mpopcnt
+else
+ARCH_CXXFLAGS ?=
+endif
+
+override CXXFLAGS += -O3 $(ARCH_CXXFLAGS) -std=c++17 -Isrc/ -W -Wall -g -ggdb3 -pthread
 
 ifeq ($(shell uname -s), Linux)
 override LDFLAGS += -pthread -lstdc++fs
@@ -27,5 +27,207 @@ if ! grep '^solution_count = 6$' <(./glasgow_subgraph_solver --count-solutions -
     exit 1
 fi
 
-true
+scratch_dir=$(mktemp -d)
+trap 'rm -rf "$scratch_dir"' EXIT
+
+# with a checkpoint every restart, the last one left behind is what we'd have
+# if the run had been interrupted just before it finished
+if ! grep '^solution_count = 69857$' <(./glasgow_subgraph_solver --format csv --count-solutions --checkpoint $scratch_dir/random --checkpoint-interval 0 test-instances/random-p7.csv test-instances/random-t30.csv ) ; then
+    echo "checkpointing enumerate test failed" 1>&1
+    exit 1
+fi
+
+if ! grep '^solution_count [1-9]' $scratch_dir/random ; then
+    echo "checkpointing didn't leave a partial checkpoint" 1>&1
+    exit 1
+fi
+
+if ! grep '^solution_count = 69857$' <(./glasgow_subgraph_solver --format csv --count-solutions --resume $scratch_dir/random test-instances/random-p7.csv test-instances/random-t30.csv ) ; then
+    echo "resume enumerate test failed" 1>&1
+    exit 1
+fi
+
+# random-p7 finishes too quickly to stop part way through, so interrupt a count
+# that takes a few seconds, and make sure that carrying on loses nothing
+if ! grep '^status = aborted$' <(./glasgow_subgraph_solver --format csv --count-solutions --timeout 1 --checkpoint $scratch_dir/slow --checkpoint-interval 0 test-instances/slow-count-p8.csv test-instances/slow-count-t30.csv ) ; then
+    echo "interrupted checkpointing test failed" 1>&1
+    exit 1
+fi
+
+if ! grep '^solution_count = 20406638$' <(./glasgow_subgraph_solver --format csv --count-solutions --resume $scratch_dir/slow test-instances/slow-count-p8.csv test-instances/slow-count-t30.csv ) ; then
+    echo "resume after interruption test failed" 1>&1
+    exit 1
+fi
+
+./glasgow_subgraph_solver --format csv --count-solutions --checkpoint $scratch_dir/labelled --checkpoint-interval 0 test-instances/random-p7-labelled.csv test-instances/random-t30-labelled.csv
+
+if ! grep 'is for a different problem' <(./glasgow_subgraph_solver --format csv --count-solutions --resume $scratch_dir/labelled test-instances/random-p7-labelled.csv test-instances/random-t30-relabelled.csv 2>&1 ) ; then
+    echo "resume with different edge labels test failed" 1>&1
+    exit 1
+fi
+
+# a session should agree with the command line, and build the target side of
+# the model once for each group of settings, however they are interleaved
+session_patterns=(test-instances/random-p7.csv test-instances/random-p7.csv,induced test-instances/random-p7.csv,locally-injective
+    test-instances/random-p7.csv test-instances/random-p7.csv,induced test-instances/random-p7.csv,noninjective)
+session_options=("" --induced --locally-injective "" --induced --noninjective)
+
+if ! diff <(./solve_with_session --format csv --count-solutions test-instances/random-t30.csv "${session_patterns[@]}" | grep '^solution_count' ) \
+    <(for o in "${session_options[@]}" ; do ./glasgow_subgraph_solver --format csv --count-solutions $o test-instances/random-p7.csv test-instances/random-t30.csv ; done | grep '^solution_count' ) ; then
+    echo "session enumerate test failed" 1>&1
+    exit 1
+fi
+
+if ! grep -x 4 <(./solve_with_session --format csv --count-solutions test-instances/random-t30.csv "${session_patterns[@]}" | grep -c '^target_cache = hit$' ) ; then
+    echo "session target cache test failed" 1>&1
+    exit 1
+fi
+
+if ! diff <(./solve_with_session --format csv --concurrently test-instances/c3c2.csv test-instances/c3.csv,induced test-instances/c3.csv test-instances/trident.csv test-instances/random-p7.csv | grep '^status' ) \
+    <(for p in "--induced test-instances/c3.csv" "test-instances/c3.csv" "test-instances/trident.csv" "--format csv test-instances/random-p7.csv" ; do ./glasgow_subgraph_solver $p test-instances/c3c2.csv ; done | grep '^status' ) ; then
+    echo "concurrent session test failed" 1>&1
+    exit 1
+fi
+
+# threaded counting shares out the tree, and should find each solution once
+for o in "" --induced --locally-injective --noninjective ; do
+    if ! diff <(./glasgow_subgraph_solver --format csv --count-solutions $o test-instances/random-p7.csv test-instances/random-t30.csv | grep '^solution_count' ) \
+        <(./glasgow_subgraph_solver --format csv --count-solutions --threads 4 $o test-instances/random-p7.csv test-instances/random-t30.csv | grep '^solution_count' ) ; then
+        echo "threaded enumerate test failed for '$o'" 1>&1
+        exit 1
+    fi
+done
+
+# deterministic threaded counting restarts, and relies upon the duplicate
+# filter to count each solution once
+for o in "" --induced ; do
+    if ! diff <(./glasgow_subgraph_solver --format csv --count-solutions $o test-instances/random-p7.csv test-instances/random-t30.csv | grep '^solution_count' ) \
+        <(./glasgow_subgraph_solver --format csv --count-solutions --threads 4 --deterministic $o test-instances/random-p7.csv test-instances/random-t30.csv | grep '^solution_count' ) ; then
+        echo "deterministic threaded enumerate test failed for '$o'" 1>&1
+        exit 1
+    fi
+done
+
+if ! grep '^duplicate_filter_hits = [1-9]' <(./glasgow_subgraph_solver --format csv --count-solutions --threads 4 --deterministic test-instances/random-p7.csv test-instances/random-t30.csv ) ; then
+    echo "duplicate filter test failed" 1>&1
+    exit 1
+fi
 
+# pinning threads and copying the target per node mustn't change the answer,
+# whether or not there are several nodes here
+for o in "" --deterministic ; do
+    if ! diff <(./glasgow_subgraph_solver --format csv --count-solutions --induced test-instances/random-p7.csv test-instances/random-t30.csv | grep '^solution_count' ) \
+        <(./glasgow_subgraph_solver --format csv --count-solutions --induced --threads 4 --numa $o test-instances/random-p7.csv test-instances/random-t30.csv | grep '^solution_count' ) ; then
+        echo "numa enumerate test failed for '$o'" 1>&1
+        exit 1
+    fi
+done
+
+# a target cache is saved the first time, then used, and is noticed if it is
+# for some other target
+if ! diff <(for i in 1 2 ; do ./glasgow_subgraph_solver --format csv --count-solutions --target-cache $scratch_dir/target-cache test-instances/random-p7.csv test-instances/random-t30.csv ; done | grep -E '^(solution_count|target_cache) ' ) \
+    <(echo solution_count = 69857 ; echo target_cache = missing ; echo solution_count = 69857 ; echo target_cache = hit ) ; then
+    echo "target cache test failed" 1>&1
+    exit 1
+fi
+
+if ! diff <(./glasgow_subgraph_solver --format csv --count-solutions --target-cache $scratch_dir/target-cache test-instances/random-p7.csv test-instances/random-t30-labelled.csv | grep -E '^(solution_count|target_cache) ' ) \
+    <(echo solution_count = 69857 ; echo target_cache = stale ) ; then
+    echo "stale target cache test failed" 1>&1
+    exit 1
+fi
+
+# batch mode should agree with the command line for each pattern, whatever
+# order they finish in, and a pattern that can't be read is an error only for
+# that pattern
+batch_patterns=(test-instances/random-p7.csv test-instances/random-p7-labelled.csv)
+
+if ! diff <(./glasgow_subgraph_solver --format csv --count-solutions --batch-workers 2 --batch <(printf '%s\n' "${batch_patterns[@]}" ) test-instances/random-t30-labelled.csv |
+            awk '/^pattern_file = / { p = $3 } /^solution_count = / { print p, $3 }' | sort ) \
+    <(for p in "${batch_patterns[@]}" ; do echo $p $(./glasgow_subgraph_solver --format csv --count-solutions $p test-instances/random-t30-labelled.csv | sed -n -e 's/^solution_count = //p' ) ; done | sort ) ; then
+    echo "batch enumerate test failed" 1>&1
+    exit 1
+fi
+
+if ./glasgow_subgraph_solver --format csv --batch <(printf '%s\n' test-instances/does-not-exist.csv "${batch_patterns[@]}" ) test-instances/random-t30-labelled.csv > $scratch_dir/batch ; then
+    echo "batch with a missing pattern didn't fail" 1>&1
+    exit 1
+fi
+
+if ! grep -x 'batch_true = 2' $scratch_dir/batch || ! grep -x 'batch_errors = 1' $scratch_dir/batch ; then
+    echo "batch with a missing pattern test failed" 1>&1
+    exit 1
+fi
+
+# database mode should agree with the command line for each target, including
+# those a prefilter rejects without building a model
+database_targets=(test-instances/random-t30.csv test-instances/c3.csv test-instances/longtrident.csv
+    test-instances/random-t30-labelled.csv test-instances/c3c2.csv)
+database_results='/^target_file = / { t = $3 } /^status = / { s = $3 } /^solution_count = [1-9]/ { s = s " " $3 } /^$/ && t { print t, s ; t = "" }'
+
+if ! diff <(./glasgow_subgraph_solver --format csv --count-solutions --batch-workers 2 --database <(printf '%s\n' "${database_targets[@]}" ) test-instances/random-p7.csv |
+            awk "$database_results" | sort ) \
+    <(for t in "${database_targets[@]}" ; do echo target_file = $t ; ./glasgow_subgraph_solver --format csv --count-solutions test-instances/random-p7.csv $t ; echo ; done |
+            awk "$database_results" | sort ) ; then
+    echo "database enumerate test failed" 1>&1
+    exit 1
+fi
+
+if ! grep -x 'prefilter_rejected = 2' <(./glasgow_subgraph_solver --format csv --database <(printf '%s\n' "${database_targets[@]}" ) test-instances/random-p7.csv ) ; then
+    echo "database prefilter test failed" 1>&1
+    exit 1
+fi
+
+# a short server session on standard input and output should give the same
+# counts as the command line, keep going after a bad query, and finish at quit
+server_results='/^id = / { i = $3 } /^status = / { s = $3 } /^solution_count = / { s = s " " $3 } /^$/ && i { print i, s ; i = "" }'
+
+if ! diff <(printf '%s\n' "load t test-instances/random-t30.csv format=csv" \
+                "solve 1 t test-instances/random-p7.csv format=csv count-solutions" \
+                "solve 2 nosuch test-instances/random-p7.csv format=csv count-solutions" \
+                "solve 3 t test-instances/random-p7.csv format=csv count-solutions induced" \
+                quit | timeout 60 ./glasgow_subgraph_solver --serve - | awk "$server_results" | sort ) \
+    <(echo 1 true 69857 ; echo 2 error ; echo 3 true 1770 ) ; then
+    echo "server session test failed" 1>&1
+    exit 1
+fi
+
+# worker processes should agree with sequential search
+for instance in "--format lad test-instances/small test-instances/large" "--format lad --induced test-instances/small test-instances/large" \
+        "--induced test-instances/c3.csv test-instances/c3c2.csv" "--format csv test-instances/random-p7.csv test-instances/random-t30.csv" \
+        "--format csv test-instances/random-p7.csv test-instances/c3c2.csv" ; do
+    if ! diff <(./glasgow_subgraph_solver $instance | grep '^status' ) <(./glasgow_subgraph_solver --processes 2 $instance | grep '^status' ) ; then
+        echo "processes test failed for '$instance'" 1>&1
+        exit 1
+    fi
+done
+
+# if every worker process dies, that's an error, not an answer. this instance
+# takes much longer than we'll wait, but the time limit stops us hanging if
+# the workers somehow survive.
+./create_random_graph --seed 9 30 0.5 > $scratch_dir/hard-pattern.csv
+./create_random_graph --seed 10 150 0.5 > $scratch_dir/hard-target.csv
+./glasgow_subgraph_solver --processes 2 --timeout 60 --format csv --induced $scratch_dir/hard-pattern.csv $scratch_dir/hard-target.csv > $scratch_dir/lost 2>&1 &
+solver_pid=$!
+for i in $(seq 100) ; do
+    workers=$(pgrep -P $solver_pid)
+    [[ $(echo $workers | wc -w ) == 2 ]] && break
+    sleep 0.1
+done
+kill -KILL $workers
+
+if wait $solver_pid || ! grep 'All 2 worker processes were lost' $scratch_dir/lost ; then
+    echo "lost workers test failed" 1>&1
+    exit 1
+fi
+
+# whichever portfolio configuration wins, the answer should be the same
+for instance in "--format lad test-instances/small test-instances/large" "--format lad --induced test-instances/small test-instances/large" \
+        "--format csv test-instances/random-p7.csv test-instances/random-t30.csv" ; do
+    if ! diff <(./glasgow_subgraph_solver $instance | grep '^status' ) <(./glasgow_subgraph_solver --threads 4 --portfolio $instance | grep '^status' ) ; then
+        echo "portfolio test failed for '$instance'" 1>&1
+        exit 1
+    fi
+done
+
+true
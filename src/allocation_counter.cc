@@ -0,0 +1,20 @@
+/* vim: set sw=4 sts=4 et foldmethod=syntax : */
+
+#include "allocation_counter.hh"
+
+namespace
+{
+    // thread local, so counting doesn't make threads fight over a cache line
+    thread_local unsigned long long number_of_allocations = 0;
+}
+
+auto allocations_on_this_thread() -> unsigned long long
+{
+    return number_of_allocations;
+}
+
+auto note_an_allocation_on_this_thread() -> void
+{
+    ++number_of_allocations;
+}
+
@@ -0,0 +1,19 @@
+/* vim: set sw=4 sts=4 et foldmethod=syntax : */
+
+#ifndef GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_ALLOCATION_COUNTER_HH
+#define GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_ALLOCATION_COUNTER_HH 1
+
+/**
+ * How many times has the global operator new been called on this thread so
+ * far? Programs that link in count_allocations.cc get a replacement operator
+ * new that keeps track of this, so that the amount of heap allocation done
+ * during search can be reported, and regressions are easy to spot. The
+ * library itself doesn't replace anything, so for other programs this is
+ * always zero. Take the difference between two calls to measure something.
+ */
+auto allocations_on_this_thread() -> unsigned long long;
+
+/// called by the replacement operator new
+auto note_an_allocation_on_this_thread() -> void;
+
+#endif
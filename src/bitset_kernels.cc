@@ -0,0 +1,528 @@
+/* vim: set sw=4 sts=4 et foldmethod=syntax : */
+
+#include "bitset_kernels.hh"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#  define GLASGOW_SUBGRAPH_SOLVER_X86_KERNELS 1
+#  include <immintrin.h>
+#endif
+
+namespace
+{
+    auto scalar_and_assign(BitWord * a, const BitWord * b, unsigned n_words) -> void
+    {
+        for (unsigned i = 0 ; i < n_words ; ++i)
+            a[i] &= b[i];
+    }
+
+    auto scalar_or_assign(BitWord * a, const BitWord * b, unsigned n_words) -> void
+    {
+        for (unsigned i = 0 ; i < n_words ; ++i)
+            a[i] |= b[i];
+    }
+
+    auto scalar_and_not_assign(BitWord * a, const BitWord * b, unsigned n_words) -> void
+    {
+        for (unsigned i = 0 ; i < n_words ; ++i)
+            a[i] &= ~b[i];
+    }
+
+    auto scalar_popcount(const BitWord * a, unsigned n_words) -> unsigned
+    {
+        unsigned result = 0;
+        for (unsigned i = 0 ; i < n_words ; ++i)
+            result += __builtin_popcountll(a[i]);
+        return result;
+    }
+
+    auto scalar_any(const BitWord * a, unsigned n_words) -> bool
+    {
+        for (unsigned i = 0 ; i < n_words ; ++i)
+            if (0 != a[i])
+                return true;
+        return false;
+    }
+
+    auto scalar_and_assign_count(BitWord * a, const BitWord * b, unsigned n_words) -> unsigned
+    {
+        unsigned result = 0;
+        for (unsigned i = 0 ; i < n_words ; ++i) {
+            a[i] &= b[i];
+            result += __builtin_popcountll(a[i]);
+        }
+        return result;
+    }
+
+    auto scalar_or_assign_count(BitWord * a, const BitWord * b, unsigned n_words) -> unsigned
+    {
+        unsigned result = 0;
+        for (unsigned i = 0 ; i < n_words ; ++i) {
+            a[i] |= b[i];
+            result += __builtin_popcountll(a[i]);
+        }
+        return result;
+    }
+
+    auto scalar_and_not_assign_count(BitWord * a, const BitWord * b, unsigned n_words) -> unsigned
+    {
+        unsigned result = 0;
+        for (unsigned i = 0 ; i < n_words ; ++i) {
+            a[i] &= ~b[i];
+            result += __builtin_popcountll(a[i]);
+        }
+        return result;
+    }
+
+    auto scalar_and_count(const BitWord * a, const BitWord * b, unsigned n_words) -> unsigned
+    {
+        unsigned result = 0;
+        for (unsigned i = 0 ; i < n_words ; ++i)
+            result += __builtin_popcountll(a[i] & b[i]);
+        return result;
+    }
+
+    auto scalar_is_subset(const BitWord * a, const BitWord * b, unsigned n_words) -> bool
+    {
+        for (unsigned i = 0 ; i < n_words ; ++i)
+            if (0 != (a[i] & ~b[i]))
+                return false;
+        return true;
+    }
+
+#ifdef GLASGOW_SUBGRAPH_SOLVER_X86_KERNELS
+    // the scalar kernels that count, except that we're allowed to use the popcnt
+    // instruction even if we weren't compiled with it
+    __attribute__((target("popcnt")))
+    auto popcnt_popcount(const BitWord * a, unsigned n_words) -> unsigned
+    {
+        unsigned result = 0;
+        for (unsigned i = 0 ; i < n_words ; ++i)
+            result += __builtin_popcountll(a[i]);
+        return result;
+    }
+
+    __attribute__((target("popcnt")))
+    auto popcnt_and_assign_count(BitWord * a, const BitWord * b, unsigned n_words) -> unsigned
+    {
+        unsigned result = 0;
+        for (unsigned i = 0 ; i < n_words ; ++i) {
+            a[i] &= b[i];
+            result += __builtin_popcountll(a[i]);
+        }
+        return result;
+    }
+
+    __attribute__((target("popcnt")))
+    auto popcnt_or_assign_count(BitWord * a, const BitWord * b, unsigned n_words) -> unsigned
+    {
+        unsigned result = 0;
+        for (unsigned i = 0 ; i < n_words ; ++i) {
+            a[i] |= b[i];
+            result += __builtin_popcountll(a[i]);
+        }
+        return result;
+    }
+
+    __attribute__((target("popcnt")))
+    auto popcnt_and_not_assign_count(BitWord * a, const BitWord * b, unsigned n_words) -> unsigned
+    {
+        unsigned result = 0;
+        for (unsigned i = 0 ; i < n_words ; ++i) {
+            a[i] &= ~b[i];
+            result += __builtin_popcountll(a[i]);
+        }
+        return result;
+    }
+
+    __attribute__((target("popcnt")))
+    auto popcnt_and_count(const BitWord * a, const BitWord * b, unsigned n_words) -> unsigned
+    {
+        unsigned result = 0;
+        for (unsigned i = 0 ; i < n_words ; ++i)
+            result += __builtin_popcountll(a[i] & b[i]);
+        return result;
+    }
+
+    __attribute__((target("avx2")))
+    inline auto avx2_load(const BitWord * a) -> __m256i
+    {
+        return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a));
+    }
+
+    __attribute__((target("avx2")))
+    inline auto avx2_store(BitWord * a, __m256i x) -> void
+    {
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(a), x);
+    }
+
+    // AVX2 has no vector popcount, so we use a nibble lookup table and then
+    // sum bytes horizontally (Mula, Kurz and Lemire, "Faster Population Counts
+    // Using AVX2 Instructions"). This gives a count for each 64-bit lane.
+    __attribute__((target("avx2")))
+    inline auto avx2_lane_popcounts(__m256i x) -> __m256i
+    {
+        const __m256i lookup = _mm256_setr_epi8(
+                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        const __m256i low_mask = _mm256_set1_epi8(0x0f);
+
+        __m256i lo = _mm256_and_si256(x, low_mask);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), low_mask);
+        __m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+        return _mm256_sad_epu8(bytes, _mm256_setzero_si256());
+    }
+
+    __attribute__((target("avx2")))
+    inline auto avx2_sum_lanes(__m256i x) -> unsigned
+    {
+        return _mm256_extract_epi64(x, 0) + _mm256_extract_epi64(x, 1) + _mm256_extract_epi64(x, 2) + _mm256_extract_epi64(x, 3);
+    }
+
+    __attribute__((target("avx2")))
+    auto avx2_and_assign(BitWord * a, const BitWord * b, unsigned n_words) -> void
+    {
+        unsigned i = 0;
+        for ( ; i + 4 <= n_words ; i += 4)
+            avx2_store(a + i, _mm256_and_si256(avx2_load(a + i), avx2_load(b + i)));
+        for ( ; i < n_words ; ++i)
+            a[i] &= b[i];
+    }
+
+    __attribute__((target("avx2")))
+    auto avx2_or_assign(BitWord * a, const BitWord * b, unsigned n_words) -> void
+    {
+        unsigned i = 0;
+        for ( ; i + 4 <= n_words ; i += 4)
+            avx2_store(a + i, _mm256_or_si256(avx2_load(a + i), avx2_load(b + i)));
+        for ( ; i < n_words ; ++i)
+            a[i] |= b[i];
+    }
+
+    __attribute__((target("avx2")))
+    auto avx2_and_not_assign(BitWord * a, const BitWord * b, unsigned n_words) -> void
+    {
+        unsigned i = 0;
+        for ( ; i + 4 <= n_words ; i += 4)
+            avx2_store(a + i, _mm256_andnot_si256(avx2_load(b + i), avx2_load(a + i)));
+        for ( ; i < n_words ; ++i)
+            a[i] &= ~b[i];
+    }
+
+    __attribute__((target("avx2,popcnt")))
+    auto avx2_popcount(const BitWord * a, unsigned n_words) -> unsigned
+    {
+        __m256i totals = _mm256_setzero_si256();
+        unsigned i = 0;
+        for ( ; i + 4 <= n_words ; i += 4)
+            totals = _mm256_add_epi64(totals, avx2_lane_popcounts(avx2_load(a + i)));
+
+        unsigned result = avx2_sum_lanes(totals);
+        for ( ; i < n_words ; ++i)
+            result += __builtin_popcountll(a[i]);
+        return result;
+    }
+
+    __attribute__((target("avx2")))
+    auto avx2_any(const BitWord * a, unsigned n_words) -> bool
+    {
+        unsigned i = 0;
+        for ( ; i + 4 <= n_words ; i += 4) {
+            __m256i x = avx2_load(a + i);
+            if (! _mm256_testz_si256(x, x))
+                return true;
+        }
+        for ( ; i < n_words ; ++i)
+            if (0 != a[i])
+                return true;
+        return false;
+    }
+
+    __attribute__((target("avx2,popcnt")))
+    auto avx2_and_assign_count(BitWord * a, const BitWord * b, unsigned n_words) -> unsigned
+    {
+        __m256i totals = _mm256_setzero_si256();
+        unsigned i = 0;
+        for ( ; i + 4 <= n_words ; i += 4) {
+            __m256i x = _mm256_and_si256(avx2_load(a + i), avx2_load(b + i));
+            avx2_store(a + i, x);
+            totals = _mm256_add_epi64(totals, avx2_lane_popcounts(x));
+        }
+
+        unsigned result = avx2_sum_lanes(totals);
+        for ( ; i < n_words ; ++i) {
+            a[i] &= b[i];
+            result += __builtin_popcountll(a[i]);
+        }
+        return result;
+    }
+
+    __attribute__((target("avx2,popcnt")))
+    auto avx2_or_assign_count(BitWord * a, const BitWord * b, unsigned n_words) -> unsigned
+    {
+        __m256i totals = _mm256_setzero_si256();
+        unsigned i = 0;
+        for ( ; i + 4 <= n_words ; i += 4) {
+            __m256i x = _mm256_or_si256(avx2_load(a + i), avx2_load(b + i));
+            avx2_store(a + i, x);
+            totals = _mm256_add_epi64(totals, avx2_lane_popcounts(x));
+        }
+
+        unsigned result = avx2_sum_lanes(totals);
+        for ( ; i < n_words ; ++i) {
+            a[i] |= b[i];
+            result += __builtin_popcountll(a[i]);
+        }
+        return result;
+    }
+
+    __attribute__((target("avx2,popcnt")))
+    auto avx2_and_not_assign_count(BitWord * a, const BitWord * b, unsigned n_words) -> unsigned
+    {
+        __m256i totals = _mm256_setzero_si256();
+        unsigned i = 0;
+        for ( ; i + 4 <= n_words ; i += 4) {
+            __m256i x = _mm256_andnot_si256(avx2_load(b + i), avx2_load(a + i));
+            avx2_store(a + i, x);
+            totals = _mm256_add_epi64(totals, avx2_lane_popcounts(x));
+        }
+
+        unsigned result = avx2_sum_lanes(totals);
+        for ( ; i < n_words ; ++i) {
+            a[i] &= ~b[i];
+            result += __builtin_popcountll(a[i]);
+        }
+        return result;
+    }
+
+    __attribute__((target("avx2,popcnt")))
+    auto avx2_and_count(const BitWord * a, const BitWord * b, unsigned n_words) -> unsigned
+    {
+        __m256i totals = _mm256_setzero_si256();
+        unsigned i = 0;
+        for ( ; i + 4 <= n_words ; i += 4)
+            totals = _mm256_add_epi64(totals, avx2_lane_popcounts(_mm256_and_si256(avx2_load(a + i), avx2_load(b + i))));
+
+        unsigned result = avx2_sum_lanes(totals);
+        for ( ; i < n_words ; ++i)
+            result += __builtin_popcountll(a[i] & b[i]);
+        return result;
+    }
+
+    __attribute__((target("avx2")))
+    auto avx2_is_subset(const BitWord * a, const BitWord * b, unsigned n_words) -> bool
+    {
+        unsigned i = 0;
+        for ( ; i + 4 <= n_words ; i += 4)
+            if (! _mm256_testc_si256(avx2_load(b + i), avx2_load(a + i)))
+                return false;
+        for ( ; i < n_words ; ++i)
+            if (0 != (a[i] & ~b[i]))
+                return false;
+        return true;
+    }
+
+    // For AVX-512, the tail is handled using masked loads and stores, rather
+    // than dropping back to scalar code. We avoid _mm512_andnot_si512 and
+    // _mm512_reduce_add_epi64, because some GCC versions give spurious
+    // uninitialised variable warnings for them.
+    __attribute__((target("avx512f")))
+    inline auto avx512_tail_mask(unsigned remaining) -> __mmask8
+    {
+        return __mmask8((1u << remaining) - 1);
+    }
+
+    __attribute__((target("avx512f")))
+    inline auto avx512_and_not(__m512i x, __m512i y) -> __m512i
+    {
+        return _mm512_and_si512(x, _mm512_xor_si512(y, _mm512_set1_epi64(-1)));
+    }
+
+    __attribute__((target("avx512f")))
+    inline auto avx512_sum_lanes(__m512i x) -> unsigned
+    {
+        alignas(64) unsigned long long lanes[8];
+        _mm512_store_si512(lanes, x);
+        return lanes[0] + lanes[1] + lanes[2] + lanes[3] + lanes[4] + lanes[5] + lanes[6] + lanes[7];
+    }
+
+    __attribute__((target("avx512f")))
+    auto avx512_and_assign(BitWord * a, const BitWord * b, unsigned n_words) -> void
+    {
+        unsigned i = 0;
+        for ( ; i + 8 <= n_words ; i += 8)
+            _mm512_storeu_si512(a + i, _mm512_and_si512(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i)));
+        if (i < n_words) {
+            __mmask8 m = avx512_tail_mask(n_words - i);
+            _mm512_mask_storeu_epi64(a + i, m, _mm512_and_si512(_mm512_maskz_loadu_epi64(m, a + i), _mm512_maskz_loadu_epi64(m, b + i)));
+        }
+    }
+
+    __attribute__((target("avx512f")))
+    auto avx512_or_assign(BitWord * a, const BitWord * b, unsigned n_words) -> void
+    {
+        unsigned i = 0;
+        for ( ; i + 8 <= n_words ; i += 8)
+            _mm512_storeu_si512(a + i, _mm512_or_si512(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i)));
+        if (i < n_words) {
+            __mmask8 m = avx512_tail_mask(n_words - i);
+            _mm512_mask_storeu_epi64(a + i, m, _mm512_or_si512(_mm512_maskz_loadu_epi64(m, a + i), _mm512_maskz_loadu_epi64(m, b + i)));
+        }
+    }
+
+    __attribute__((target("avx512f")))
+    auto avx512_and_not_assign(BitWord * a, const BitWord * b, unsigned n_words) -> void
+    {
+        unsigned i = 0;
+        for ( ; i + 8 <= n_words ; i += 8)
+            _mm512_storeu_si512(a + i, avx512_and_not(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i)));
+        if (i < n_words) {
+            __mmask8 m = avx512_tail_mask(n_words - i);
+            _mm512_mask_storeu_epi64(a + i, m, avx512_and_not(_mm512_maskz_loadu_epi64(m, a + i), _mm512_maskz_loadu_epi64(m, b + i)));
+        }
+    }
+
+    __attribute__((target("avx512f,avx512vpopcntdq")))
+    auto avx512_popcount(const BitWord * a, unsigned n_words) -> unsigned
+    {
+        __m512i totals = _mm512_setzero_si512();
+        unsigned i = 0;
+        for ( ; i + 8 <= n_words ; i += 8)
+            totals = _mm512_add_epi64(totals, _mm512_popcnt_epi64(_mm512_loadu_si512(a + i)));
+        if (i < n_words)
+            totals = _mm512_add_epi64(totals, _mm512_popcnt_epi64(_mm512_maskz_loadu_epi64(avx512_tail_mask(n_words - i), a + i)));
+        return avx512_sum_lanes(totals);
+    }
+
+    __attribute__((target("avx512f")))
+    auto avx512_any(const BitWord * a, unsigned n_words) -> bool
+    {
+        unsigned i = 0;
+        for ( ; i + 8 <= n_words ; i += 8) {
+            __m512i x = _mm512_loadu_si512(a + i);
+            if (0 != _mm512_test_epi64_mask(x, x))
+                return true;
+        }
+        if (i < n_words) {
+            __m512i x = _mm512_maskz_loadu_epi64(avx512_tail_mask(n_words - i), a + i);
+            if (0 != _mm512_test_epi64_mask(x, x))
+                return true;
+        }
+        return false;
+    }
+
+    __attribute__((target("avx512f,avx512vpopcntdq")))
+    auto avx512_and_assign_count(BitWord * a, const BitWord * b, unsigned n_words) -> unsigned
+    {
+        __m512i totals = _mm512_setzero_si512();
+        unsigned i = 0;
+        for ( ; i + 8 <= n_words ; i += 8) {
+            __m512i x = _mm512_and_si512(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+            _mm512_storeu_si512(a + i, x);
+            totals = _mm512_add_epi64(totals, _mm512_popcnt_epi64(x));
+        }
+        if (i < n_words) {
+            __mmask8 m = avx512_tail_mask(n_words - i);
+            __m512i x = _mm512_and_si512(_mm512_maskz_loadu_epi64(m, a + i), _mm512_maskz_loadu_epi64(m, b + i));
+            _mm512_mask_storeu_epi64(a + i, m, x);
+            totals = _mm512_add_epi64(totals, _mm512_popcnt_epi64(x));
+        }
+        return avx512_sum_lanes(totals);
+    }
+
+    __attribute__((target("avx512f,avx512vpopcntdq")))
+    auto avx512_or_assign_count(BitWord * a, const BitWord * b, unsigned n_words) -> unsigned
+    {
+        __m512i totals = _mm512_setzero_si512();
+        unsigned i = 0;
+        for ( ; i + 8 <= n_words ; i += 8) {
+            __m512i x = _mm512_or_si512(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+            _mm512_storeu_si512(a + i, x);
+            totals = _mm512_add_epi64(totals, _mm512_popcnt_epi64(x));
+        }
+        if (i < n_words) {
+            __mmask8 m = avx512_tail_mask(n_words - i);
+            __m512i x = _mm512_or_si512(_mm512_maskz_loadu_epi64(m, a + i), _mm512_maskz_loadu_epi64(m, b + i));
+            _mm512_mask_storeu_epi64(a + i, m, x);
+            totals = _mm512_add_epi64(totals, _mm512_popcnt_epi64(x));
+        }
+        return avx512_sum_lanes(totals);
+    }
+
+    __attribute__((target("avx512f,avx512vpopcntdq")))
+    auto avx512_and_not_assign_count(BitWord * a, const BitWord * b, unsigned n_words) -> unsigned
+    {
+        __m512i totals = _mm512_setzero_si512();
+        unsigned i = 0;
+        for ( ; i + 8 <= n_words ; i += 8) {
+            __m512i x = avx512_and_not(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+            _mm512_storeu_si512(a + i, x);
+            totals = _mm512_add_epi64(totals, _mm512_popcnt_epi64(x));
+        }
+        if (i < n_words) {
+            __mmask8 m = avx512_tail_mask(n_words - i);
+            __m512i x = avx512_and_not(_mm512_maskz_loadu_epi64(m, a + i), _mm512_maskz_loadu_epi64(m, b + i));
+            _mm512_mask_storeu_epi64(a + i, m, x);
+            totals = _mm512_add_epi64(totals, _mm512_popcnt_epi64(x));
+        }
+        return avx512_sum_lanes(totals);
+    }
+
+    __attribute__((target("avx512f,avx512vpopcntdq")))
+    auto avx512_and_count(const BitWord * a, const BitWord * b, unsigned n_words) -> unsigned
+    {
+        __m512i totals = _mm512_setzero_si512();
+        unsigned i = 0;
+        for ( ; i + 8 <= n_words ; i += 8)
+            totals = _mm512_add_epi64(totals, _mm512_popcnt_epi64(_mm512_and_si512(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i))));
+        if (i < n_words) {
+            __mmask8 m = avx512_tail_mask(n_words - i);
+            totals = _mm512_add_epi64(totals, _mm512_popcnt_epi64(_mm512_and_si512(_mm512_maskz_loadu_epi64(m, a + i), _mm512_maskz_loadu_epi64(m, b + i))));
+        }
+        return avx512_sum_lanes(totals);
+    }
+
+    __attribute__((target("avx512f")))
+    auto avx512_is_subset(const BitWord * a, const BitWord * b, unsigned n_words) -> bool
+    {
+        unsigned i = 0;
+        for ( ; i + 8 <= n_words ; i += 8) {
+            __m512i x = avx512_and_not(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+            if (0 != _mm512_test_epi64_mask(x, x))
+                return false;
+        }
+        if (i < n_words) {
+            __mmask8 m = avx512_tail_mask(n_words - i);
+            __m512i x = avx512_and_not(_mm512_maskz_loadu_epi64(m, a + i), _mm512_maskz_loadu_epi64(m, b + i));
+            if (0 != _mm512_test_epi64_mask(x, x))
+                return false;
+        }
+        return true;
+    }
+#endif
+
+    auto select_bitset_kernels() -> BitsetKernels
+    {
+#ifdef GLASGOW_SUBGRAPH_SOLVER_X86_KERNELS
+        // we run as a static initialiser, so we might be earlier than libgcc's own set up
+        __builtin_cpu_init();
+
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq"))
+            return BitsetKernels{ "avx512", avx512_and_assign, avx512_or_assign, avx512_and_not_assign, avx512_popcount, avx512_any,
+                avx512_and_assign_count, avx512_or_assign_count, avx512_and_not_assign_count, avx512_and_count, avx512_is_subset };
+
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+            return BitsetKernels{ "avx2", avx2_and_assign, avx2_or_assign, avx2_and_not_assign, avx2_popcount, avx2_any,
+                avx2_and_assign_count, avx2_or_assign_count, avx2_and_not_assign_count, avx2_and_count, avx2_is_subset };
+
+        if (__builtin_cpu_supports("popcnt"))
+            return BitsetKernels{ "popcnt", scalar_and_assign, scalar_or_assign, scalar_and_not_assign, popcnt_popcount, scalar_any,
+                popcnt_and_assign_count, popcnt_or_assign_count, popcnt_and_not_assign_count, popcnt_and_count, scalar_is_subset };
+#endif
+
+        return BitsetKernels{ "scalar", scalar_and_assign, scalar_or_assign, scalar_and_not_assign, scalar_popcount, scalar_any,
+            scalar_and_assign_count, scalar_or_assign_count, scalar_and_not_assign_count, scalar_and_count, scalar_is_subset };
+    }
+}
+
+const BitsetKernels bitset_kernels = select_bitset_kernels();
+
@@ -0,0 +1,64 @@
+/* vim: set sw=4 sts=4 et foldmethod=syntax : */
+
+#ifndef GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_BITSET_KERNELS_HH
+#define GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_BITSET_KERNELS_HH 1
+
+using BitWord = unsigned long long;
+
+/**
+ * Bulk operations over arrays of bit words. We have a scalar implementation
+ * that works everywhere, one that also uses the popcnt instruction, and
+ * vectorised AVX2 and AVX-512 implementations, each selected when the CPU we
+ * are running on supports it, so a binary built without -march=native (or
+ * even -mpopcnt) still runs fast everywhere.
+ */
+struct BitsetKernels
+{
+    /// Which implementation is this, for stats output?
+    const char * name;
+
+    /// a &= b
+    auto (* and_assign)(BitWord * a, const BitWord * b, unsigned n_words) -> void;
+
+    /// a |= b
+    auto (* or_assign)(BitWord * a, const BitWord * b, unsigned n_words) -> void;
+
+    /// a &= ~b
+    auto (* and_not_assign)(BitWord * a, const BitWord * b, unsigned n_words) -> void;
+
+    /// number of set bits in a
+    auto (* popcount)(const BitWord * a, unsigned n_words) -> unsigned;
+
+    /// is any bit in a set?
+    auto (* any)(const BitWord * a, unsigned n_words) -> bool;
+
+    /// a &= b, returning the number of bits left set in a
+    auto (* and_assign_count)(BitWord * a, const BitWord * b, unsigned n_words) -> unsigned;
+
+    /// a |= b, returning the number of bits now set in a
+    auto (* or_assign_count)(BitWord * a, const BitWord * b, unsigned n_words) -> unsigned;
+
+    /// a &= ~b, returning the number of bits left set in a
+    auto (* and_not_assign_count)(BitWord * a, const BitWord * b, unsigned n_words) -> unsigned;
+
+    /// number of set bits in a & b, without writing it anywhere
+    auto (* and_count)(const BitWord * a, const BitWord * b, unsigned n_words) -> unsigned;
+
+    /// is every bit set in a also set in b? stops as soon as the answer is known
+    auto (* is_subset)(const BitWord * a, const BitWord * b, unsigned n_words) -> bool;
+};
+
+/**
+ * Below this many words, calling out to a vectorised kernel costs more than it
+ * saves, so bitsets should just use an inline loop instead.
+ */
+inline constexpr unsigned bitset_kernels_minimum_words = 4;
+
+/**
+ * The best kernels for this CPU, picked once at startup using CPUID. Because
+ * this is set up by a static initialiser, it must not be used from other
+ * static initialisers.
+ */
+extern const BitsetKernels bitset_kernels;
+
+#endif
@@ -1,23 +1,27 @@
 /* vim: set sw=4 sts=4 et foldmethod=syntax : */
 
 #include "cheap_all_different.hh"
+#include "fixed_bitset.hh"
 
+#include <algorithm>
 #include <tuple>
 #include <type_traits>
 
 using std::conditional_t;
+using std::fill;
 using std::tuple;
 using std::shared_ptr;
 using std::vector;
 
 namespace
 {
-    template <bool proof_>
+    template <bool proof_, typename Bitset_>
     auto cheap_all_different_with_optional_proofs(
-            unsigned target_size,
-            vector<HomomorphismDomain> & domains,
+            const HomomorphismDomainsView<Bitset_> & domains,
+            HomomorphismDomainTrail<Bitset_> & trail,
+            CheapAllDifferentScratch<Bitset_> & scratch,
             const shared_ptr<Proof> & proof,
-            const HomomorphismModel * const model) -> bool
+            const HomomorphismModel<Bitset_> * const model) -> bool
     {
         // Pick domains smallest first; ties are broken by smallest .v first.
         // For each count p we have a linked list, whose first member is
@@ -26,14 +30,16 @@ namespace
         // int the "count==domains.size()" bucket.
         // The "first" array is sized to be able to hold domains.size()+1
         // elements
-        vector<int> first(target_size + 1, -1), next(target_size, -1);
+        auto & first = scratch.first, & next = scratch.next;
+        fill(first.begin(), first.begin() + domains.size() + 1, -1);
+        scratch.changed.clear();
 
         [[ maybe_unused ]] conditional_t<proof_, vector<NamedVertex>, tuple<> > lhs, hall_lhs, hall_rhs;
 
         // Iterate backwards, because we insert elements at the head of
         // lists and we want the sort to be stable
         for (int i = int(domains.size()) - 1 ; i >= 0; --i) {
-            unsigned count = domains.at(i).count;
+            unsigned count = domains.count(domains[i]);
             if (count > domains.size())
                 count = domains.size();
             next.at(i) = first.at(count);
@@ -41,8 +47,10 @@ namespace
         }
 
         // counting all-different
-        SVOBitset domains_so_far{ target_size, 0 }, hall{ target_size, 0 };
-        unsigned neighbours_so_far = 0;
+        auto & domains_so_far = scratch.domains_so_far, & hall = scratch.hall;
+        domains_so_far.reset();
+        hall.reset();
+        unsigned neighbours_so_far = 0, domains_so_far_popcount = 0;
 
         [[ maybe_unused ]] conditional_t<proof_, unsigned, tuple<> > last_outputted_hall_size{};
 
@@ -50,41 +58,45 @@ namespace
             // iterate over linked lists
             int domain_index = first[i];
             while (domain_index != -1) {
-                auto & d = domains.at(domain_index);
+                auto v = domains[domain_index];
+                auto & d_values = domains.values(v);
+                auto & d_count = domains.count(v);
 
                 if constexpr (proof_)
-                    lhs.push_back(model->pattern_vertex_for_proof(d.v));
+                    lhs.push_back(model->pattern_vertex_for_proof(v));
 
                 [[ maybe_unused ]] conditional_t<proof_, unsigned, tuple<> > old_d_values_count;
                 if constexpr (proof_)
-                    old_d_values_count = d.values.count();
+                    old_d_values_count = d_values.count();
 
-                d.values.intersect_with_complement(hall);
-                d.count = d.values.count();
+                if (0 != d_values.intersection_count(hall)) {
+                    trail.save(v);
+                    d_count = d_values.intersect_with_complement_and_count(hall);
+                    scratch.changed.push_back(v);
+                }
 
                 if constexpr (proof_)
-                    if (last_outputted_hall_size != hall.count() && d.count != old_d_values_count) {
+                    if (last_outputted_hall_size != hall.count() && d_count != old_d_values_count) {
                         last_outputted_hall_size = hall.count();
                         proof->emit_hall_set_or_violator(hall_lhs, hall_rhs);
                     }
 
-                if (0 == d.count)
+                if (0 == d_count)
                     return false;
 
-                domains_so_far |= d.values;
+                // often d adds nothing new, in which case we can skip the union
+                // and the popcount entirely
+                if (! d_values.is_subset_of(domains_so_far))
+                    domains_so_far_popcount = domains_so_far.union_with_and_count(d_values);
                 ++neighbours_so_far;
 
-                unsigned domains_so_far_popcount = domains_so_far.count();
-
                 if (domains_so_far_popcount < neighbours_so_far) {
                     // hall violator, so we fail (after outputting a proof)
                     if constexpr (proof_) {
                         vector<NamedVertex> rhs;
-                        auto d = domains_so_far;
-                        for (auto v = d.find_first() ; v != decltype(d)::npos ; v = d.find_first()) {
-                            d.reset(v);
+                        domains_so_far.for_each_set_bit([&] (unsigned v) {
                             rhs.push_back(model->target_vertex_for_proof(v));
-                        }
+                        });
                         proof->emit_hall_set_or_violator(lhs, rhs);
                     }
                     return false;
@@ -97,11 +109,9 @@ namespace
                         for (auto & l : lhs)
                             hall_lhs.push_back(l);
                         hall_rhs.clear();
-                        auto d = domains_so_far;
-                        for (auto v = d.find_first() ; v != decltype(d)::npos ; v = d.find_first()) {
-                            d.reset(v);
+                        domains_so_far.for_each_set_bit([&] (unsigned v) {
                             hall_rhs.push_back(model->target_vertex_for_proof(v));
-                        }
+                        });
                     }
                 }
                 domain_index = next[domain_index];
@@ -112,12 +122,26 @@ namespace
     }
 }
 
-auto cheap_all_different(unsigned target_size, vector<HomomorphismDomain> & domains, const shared_ptr<Proof> & proof,
-        const HomomorphismModel * const model) -> bool
+template <typename Bitset_>
+auto cheap_all_different(const HomomorphismDomainsView<Bitset_> & domains, HomomorphismDomainTrail<Bitset_> & trail,
+        CheapAllDifferentScratch<Bitset_> & scratch, const shared_ptr<Proof> & proof, const HomomorphismModel<Bitset_> * const model) -> bool
 {
     if (! proof.get())
-        return cheap_all_different_with_optional_proofs<false>(target_size, domains, proof, model);
+        return cheap_all_different_with_optional_proofs<false>(domains, trail, scratch, proof, model);
     else
-        return cheap_all_different_with_optional_proofs<true>(target_size, domains, proof, model);
+        return cheap_all_different_with_optional_proofs<true>(domains, trail, scratch, proof, model);
 }
 
+template auto cheap_all_different(const HomomorphismDomainsView<FixedBitset<1> > &, HomomorphismDomainTrail<FixedBitset<1> > &,
+        CheapAllDifferentScratch<FixedBitset<1> > &, const shared_ptr<Proof> &, const HomomorphismModel<FixedBitset<1> > * const) -> bool;
+template auto cheap_all_different(const HomomorphismDomainsView<FixedBitset<2> > &, HomomorphismDomainTrail<FixedBitset<2> > &,
+        CheapAllDifferentScratch<FixedBitset<2> > &, const shared_ptr<Proof> &, const HomomorphismModel<FixedBitset<2> > * const) -> bool;
+template auto cheap_all_different(const HomomorphismDomainsView<FixedBitset<4> > &, HomomorphismDomainTrail<FixedBitset<4> > &,
+        CheapAllDifferentScratch<FixedBitset<4> > &, const shared_ptr<Proof> &, const HomomorphismModel<FixedBitset<4> > * const) -> bool;
+template auto cheap_all_different(const HomomorphismDomainsView<FixedBitset<8> > &, HomomorphismDomainTrail<FixedBitset<8> > &,
+        CheapAllDifferentScratch<FixedBitset<8> > &, const shared_ptr<Proof> &, const HomomorphismModel<FixedBitset<8> > * const) -> bool;
+template auto cheap_all_different(const HomomorphismDomainsView<FixedBitset<16> > &, HomomorphismDomainTrail<FixedBitset<16> > &,
+        CheapAllDifferentScratch<FixedBitset<16> > &, const shared_ptr<Proof> &, const HomomorphismModel<FixedBitset<16> > * const) -> bool;
+template auto cheap_all_different(const HomomorphismDomainsView<SVOBitset> &, HomomorphismDomainTrail<SVOBitset> &,
+        CheapAllDifferentScratch<SVOBitset> &, const shared_ptr<Proof> &, const HomomorphismModel<SVOBitset> * const) -> bool;
+
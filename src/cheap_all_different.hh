@@ -9,7 +9,30 @@
 
 #include <vector>
 
-auto cheap_all_different(unsigned target_size, std::vector<HomomorphismDomain> & domains, const std::shared_ptr<Proof> & proof,
-        const HomomorphismModel * const) -> bool;
+/**
+ * Working space for cheap_all_different, so that it does not have to allocate
+ * every time it is called. After a call, changed lists the pattern vertices
+ * whose domains lost values, so the caller can tell who needs to know.
+ */
+template <typename Bitset_>
+struct CheapAllDifferentScratch
+{
+    std::vector<int> first, next;
+    Bitset_ domains_so_far, hall;
+    std::vector<unsigned> changed;
+
+    CheapAllDifferentScratch(unsigned pattern_size, unsigned target_size) :
+        first(target_size + 1),
+        next(target_size),
+        domains_so_far(target_size, 0),
+        hall(target_size, 0)
+    {
+        changed.reserve(pattern_size);
+    }
+};
+
+template <typename Bitset_>
+auto cheap_all_different(const HomomorphismDomainsView<Bitset_> & domains, HomomorphismDomainTrail<Bitset_> & trail,
+        CheapAllDifferentScratch<Bitset_> & scratch, const std::shared_ptr<Proof> & proof, const HomomorphismModel<Bitset_> * const) -> bool;
 
 #endif
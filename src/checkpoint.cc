@@ -0,0 +1,123 @@
+/* vim: set sw=4 sts=4 et foldmethod=syntax : */
+
+#include "checkpoint.hh"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+using std::getline;
+using std::ifstream;
+using std::istringstream;
+using std::ofstream;
+using std::stoull;
+using std::string;
+
+namespace
+{
+    const string magic = "glasgow_subgraph_solver_checkpoint 1";
+
+    auto read_line(ifstream & in, const string & filename, const string & key) -> string
+    {
+        string line;
+        if (! getline(in, line) || 0 != line.compare(0, key.length() + 1, key + " "))
+            throw CheckpointError{ "Checkpoint file '" + filename + "' is missing '" + key + "'" };
+        return line.substr(key.length() + 1);
+    }
+}
+
+CheckpointError::CheckpointError(const string & message) noexcept :
+    _what(message)
+{
+}
+
+auto CheckpointError::what() const noexcept -> const char *
+{
+    return _what.c_str();
+}
+
+auto write_checkpoint(const string & filename, const Checkpoint & checkpoint) -> void
+{
+    string temporary_filename = filename + ".tmp";
+
+    {
+        ofstream out{ temporary_filename };
+        if (! out)
+            throw CheckpointError{ "Unable to write checkpoint file '" + temporary_filename + "'" };
+
+        out << magic << '\n';
+        out << "fingerprint " << checkpoint.fingerprint << '\n';
+        out << "nodes " << checkpoint.nodes << '\n';
+        out << "propagations " << checkpoint.propagations << '\n';
+        out << "restarts " << checkpoint.restarts << '\n';
+        out << "solution_count " << checkpoint.solution_count << '\n';
+        out << "restarts_schedule " << checkpoint.restarts_schedule_position << '\n';
+        out << "random " << checkpoint.random_state << '\n';
+        out << "nogoods " << checkpoint.nogood_sizes.size() << '\n';
+
+        auto literal = checkpoint.nogood_literals.begin();
+        for (auto & size : checkpoint.nogood_sizes) {
+            out << size;
+            for (unsigned i = 0 ; i < size ; ++i, ++literal)
+                out << ' ' << literal->first << ' ' << literal->second;
+            out << '\n';
+        }
+
+        out.flush();
+        if (! out)
+            throw CheckpointError{ "Error writing checkpoint file '" + temporary_filename + "'" };
+    }
+
+    if (0 != std::rename(temporary_filename.c_str(), filename.c_str()))
+        throw CheckpointError{ "Unable to move checkpoint file '" + temporary_filename + "' to '" + filename + "'" };
+}
+
+auto read_checkpoint(const string & filename) -> Checkpoint
+{
+    ifstream in{ filename };
+    if (! in)
+        throw CheckpointError{ "Unable to read checkpoint file '" + filename + "'" };
+
+    string line;
+    if (! getline(in, line) || line != magic)
+        throw CheckpointError{ "File '" + filename + "' is not a checkpoint" };
+
+    Checkpoint result;
+    try {
+        result.fingerprint = read_line(in, filename, "fingerprint");
+        result.nodes = stoull(read_line(in, filename, "nodes"));
+        result.propagations = stoull(read_line(in, filename, "propagations"));
+        result.restarts = stoull(read_line(in, filename, "restarts"));
+        result.solution_count = loooong{ read_line(in, filename, "solution_count") };
+        result.restarts_schedule_position = read_line(in, filename, "restarts_schedule");
+        result.random_state = read_line(in, filename, "random");
+
+        auto n_nogoods = stoull(read_line(in, filename, "nogoods"));
+        for (unsigned long long n = 0 ; n < n_nogoods ; ++n) {
+            if (! getline(in, line))
+                throw CheckpointError{ "Checkpoint file '" + filename + "' is truncated" };
+
+            istringstream nogood{ line };
+            unsigned size;
+            if (! (nogood >> size))
+                throw CheckpointError{ "Checkpoint file '" + filename + "' has a bad nogood" };
+            result.nogood_sizes.push_back(size);
+            for (unsigned i = 0 ; i < size ; ++i) {
+                unsigned p, t;
+                if (! (nogood >> p >> t))
+                    throw CheckpointError{ "Checkpoint file '" + filename + "' has a bad nogood" };
+                result.nogood_literals.emplace_back(p, t);
+            }
+        }
+    }
+    catch (const CheckpointError &) {
+        throw;
+    }
+    catch (const std::exception &) {
+        // from stoull, or from loooong
+        throw CheckpointError{ "Checkpoint file '" + filename + "' contains a bad number" };
+    }
+
+    return result;
+}
+
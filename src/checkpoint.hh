@@ -0,0 +1,60 @@
+/* vim: set sw=4 sts=4 et foldmethod=syntax : */
+
+#ifndef GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_CHECKPOINT_HH
+#define GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_CHECKPOINT_HH 1
+
+#include "loooong.hh"
+
+#include <exception>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Thrown if a checkpoint can't be read or written, or is for a different
+ * problem.
+ */
+class CheckpointError :
+    public std::exception
+{
+    private:
+        std::string _what;
+
+    public:
+        explicit CheckpointError(const std::string & message) noexcept;
+
+        auto what() const noexcept -> const char * override;
+};
+
+/**
+ * Everything needed to carry on a restarting search from where it left off.
+ * Checkpoints are only taken between restarts, when every nogood is in the
+ * store and nothing in the search tree is open, so the nogoods (together
+ * with the solution count, when counting) say exactly what has been done.
+ */
+struct Checkpoint
+{
+    /// to make sure we resume the same problem, with the same settings
+    std::string fingerprint;
+
+    unsigned long long nodes = 0, propagations = 0, restarts = 0;
+    loooong solution_count = 0;
+
+    /// from RestartsSchedule::position()
+    std::string restarts_schedule_position;
+
+    /// the searcher's random number generator, as written by operator<<
+    std::string random_state;
+
+    /// each nogood is a length followed by that many (pattern, target) pairs
+    std::vector<unsigned> nogood_sizes;
+    std::vector<std::pair<unsigned, unsigned> > nogood_literals;
+};
+
+/// write a checkpoint to a temporary file, and then move it into place,
+/// so that a crash half way through can't destroy the previous checkpoint
+auto write_checkpoint(const std::string & filename, const Checkpoint & checkpoint) -> void;
+
+auto read_checkpoint(const std::string & filename) -> Checkpoint;
+
+#endif
@@ -2,6 +2,7 @@
 
 #include "clique.hh"
 #include "watches.hh"
+#include "fixed_bitset.hh"
 #include "svo_bitset.hh"
 #include "proof.hh"
 #include "configuration.hh"
@@ -62,19 +63,37 @@ namespace
     {
         vector<EntryType_> data;
 
+        auto index(int x) const -> unsigned
+        {
+            return x;
+        }
+
         EntryType_ & operator[] (int x)
         {
             return data[x];
         }
     };
 
+    template <typename Bitset_>
+    auto convert_bitset(unsigned size, const SVOBitset & from) -> Bitset_
+    {
+        if constexpr (is_same<Bitset_, SVOBitset>::value)
+            return from;
+        else {
+            Bitset_ result{ size, 0 };
+            from.for_each_set_bit([&] (unsigned v) { result.set(v); });
+            return result;
+        }
+    }
+
+    template <typename Bitset_>
     struct CliqueRunner
     {
         const CliqueParams & params;
         Incumbent incumbent;
 
         int size;
-        vector<SVOBitset> adj, connected_table;
+        vector<Bitset_> adj, connected_table;
         vector<int> order, invorder;
 
         Watches<int, FlatWatchTable> watches;
@@ -86,7 +105,7 @@ namespace
         CliqueRunner(const InputGraph & g, const CliqueParams & p) :
             params(p),
             size(g.size()),
-            adj(g.size(), SVOBitset{ unsigned(size), 0 }),
+            adj(g.size(), Bitset_{ unsigned(size), 0 }),
             order(size),
             invorder(size),
             space(nullptr)
@@ -117,7 +136,7 @@ namespace
             if (params.connected) {
                 connected_table.resize(size);
                 for (int v = 0 ; v < size ; ++v)
-                    connected_table[v] = params.connected(order.at(v), [&] (int x) { return invorder.at(x); });
+                    connected_table[v] = convert_bitset<Bitset_>(unsigned(size), params.connected(order.at(v), [&] (int x) { return invorder.at(x); }));
             }
         }
 
@@ -127,12 +146,12 @@ namespace
         }
 
         auto colour_class_order(
-                const SVOBitset & p,
+                const Bitset_ & p,
                 int * p_order,
                 int * p_bounds,
                 int & p_end) -> void
         {
-            SVOBitset p_left = p;      // not coloured yet
+            Bitset_ p_left = p;      // not coloured yet
             unsigned colour = 0;         // current colour
             p_end = 0;
 
@@ -141,14 +160,13 @@ namespace
                 // next colour
                 ++colour;
                 // things that can still be given this colour
-                SVOBitset q = p_left;
+                Bitset_ q = p_left;
 
                 // while we can still give something this colour
-                while (q.any()) {
-                    // first thing we can colour
-                    int v = q.find_first();
+                for (auto v = q.find_first() ; v != Bitset_::npos ; v = q.find_next(v)) {
+                    // v is the first thing we can colour, and q only ever loses
+                    // things, so we never need to look before v again
                     p_left.reset(v);
-                    q.reset(v);
 
                     // can't give anything adjacent to this the same colour
                     q.intersect_with_complement(adj[v]);
@@ -162,8 +180,8 @@ namespace
         }
 
         auto connected_colour_class_order(
-                const SVOBitset & p,
-                const SVOBitset & a,
+                const Bitset_ & p,
+                const Bitset_ & a,
                 int * p_order,
                 int * p_bounds,
                 int & p_end) -> void
@@ -171,7 +189,7 @@ namespace
             unsigned colour = 0;         // current colour
             p_end = 0;
 
-            SVOBitset p_left = p; // not coloured yet
+            Bitset_ p_left = p; // not coloured yet
             p_left.intersect_with_complement(a);
 
             // while we've things left to colour
@@ -179,14 +197,13 @@ namespace
                 // next colour
                 ++colour;
                 // things that can still be given this colour
-                SVOBitset q = p_left;
+                Bitset_ q = p_left;
 
                 // while we can still give something this colour
-                while (q.any()) {
-                    // first thing we can colour
-                    int v = q.find_first();
+                for (auto v = q.find_first() ; v != Bitset_::npos ; v = q.find_next(v)) {
+                    // v is the first thing we can colour, and q only ever loses
+                    // things, so we never need to look before v again
                     p_left.reset(v);
-                    q.reset(v);
 
                     // can't give anything adjacent to this the same colour
                     q.intersect_with_complement(adj[v]);
@@ -206,14 +223,13 @@ namespace
                 // next colour
                 ++colour;
                 // things that can still be given this colour
-                SVOBitset q = p_left;
+                Bitset_ q = p_left;
 
                 // while we can still give something this colour
-                while (q.any()) {
-                    // first thing we can colour
-                    int v = q.find_first();
+                for (auto v = q.find_first() ; v != Bitset_::npos ; v = q.find_next(v)) {
+                    // v is the first thing we can colour, and q only ever loses
+                    // things, so we never need to look before v again
                     p_left.reset(v);
-                    q.reset(v);
 
                     // can't give anything adjacent to this the same colour
                     q.intersect_with_complement(adj[v]);
@@ -227,13 +243,13 @@ namespace
         }
 
         auto colour_class_order_2df(
-                const SVOBitset & p,
+                const Bitset_ & p,
                 int * p_order,
                 int * p_bounds,
                 int * defer,
                 int & p_end) -> void
         {
-            SVOBitset p_left = p;      // not coloured yet
+            Bitset_ p_left = p;      // not coloured yet
             unsigned colour = 0;         // current colour
             p_end = 0;
 
@@ -244,15 +260,14 @@ namespace
                 // next colour
                 ++colour;
                 // things that can still be given this colour
-                SVOBitset q = p_left;
+                Bitset_ q = p_left;
 
                 // while we can still give something this colour
                 unsigned number_with_this_colour = 0;
-                while (q.any()) {
-                    // first thing we can colour
-                    int v = q.find_first();
+                for (auto v = q.find_first() ; v != Bitset_::npos ; v = q.find_next(v)) {
+                    // v is the first thing we can colour, and q only ever loses
+                    // things, so we never need to look before v again
                     p_left.reset(v);
-                    q.reset(v);
 
                     // can't give anything adjacent to this the same colour
                     q.intersect_with_complement(adj[v]);
@@ -281,12 +296,12 @@ namespace
         }
 
         auto colour_class_order_sorted(
-                const SVOBitset & p,
+                const Bitset_ & p,
                 int * p_order,
                 int * p_bounds,
                 int & p_end) -> void
         {
-            SVOBitset p_left = p;      // not coloured yet
+            Bitset_ p_left = p;      // not coloured yet
             unsigned colour = 0;         // current colour
             p_end = 0;
 
@@ -303,14 +318,13 @@ namespace
                 // next colour
                 ++colour;
                 // things that can still be given this colour
-                SVOBitset q = p_left;
+                Bitset_ q = p_left;
 
                 // while we can still give something this colour
-                while (q.any()) {
-                    // first thing we can colour
-                    int v = q.find_first();
+                for (auto v = q.find_first() ; v != Bitset_::npos ; v = q.find_next(v)) {
+                    // v is the first thing we can colour, and q only ever loses
+                    // things, so we never need to look before v again
                     p_left.reset(v);
-                    q.reset(v);
 
                     // can't give anything adjacent to this the same colour
                     q.intersect_with_complement(adj[v]);
@@ -375,8 +389,8 @@ namespace
                 unsigned long long & find_nodes,
                 unsigned long long & prove_nodes,
                 vector<int> & c,
-                SVOBitset & p,
-                conditional_t<connected_, const SVOBitset &, int> a,
+                Bitset_ & p,
+                conditional_t<connected_, const Bitset_ &, int> a,
                 int spacepos) -> SearchResult
         {
             ++nodes;
@@ -490,19 +504,23 @@ namespace
                 }
 
                 // filter p to contain vertices adjacent to v
-                SVOBitset new_p = p;
-                new_p &= adj[v];
+                Bitset_ new_p = p;
+                unsigned new_p_count = new_p.intersect_with_and_count(adj[v]);
 
                 if (params.restarts_schedule->might_restart())
                     watches.propagate(v,
                             [&] (int literal) { return c.end() == find(c.begin(), c.end(), literal); },
-                            [&] (int literal) { new_p.reset(literal); }
-                            );
+                            [&] (int literal) {
+                                if (new_p.test(literal)) {
+                                    new_p.reset(literal);
+                                    --new_p_count;
+                                }
+                            });
 
                 if (params.proof)
                     params.proof->start_level(depth + 1);
 
-                if (new_p.any()) {
+                if (0 != new_p_count) {
                     auto new_a = a;
 
                     if constexpr (connected_) {
@@ -566,7 +584,7 @@ namespace
             bool done = false;
             unsigned number_of_restarts = 0;
 
-            SVOBitset p{ unsigned(size), 0 };
+            Bitset_ p{ unsigned(size), 0 };
             for (int i = 0 ; i < size ; ++i)
                 p.set(i);
 
@@ -585,9 +603,9 @@ namespace
 
                 auto new_p = p;
                 vector<int> c;
-                conditional_t<connected_, SVOBitset, int> a{ };
+                conditional_t<connected_, Bitset_, int> a{ };
                 if constexpr (connected_)
-                    a = SVOBitset{ unsigned(size), 0 };
+                    a = Bitset_{ unsigned(size), 0 };
 
                 switch (expand<connected_>(params.proof_is_for_hom ? 1 : 0, result.nodes, result.find_nodes, result.prove_nodes, c, new_p, a, 0)) {
                     case SearchResult::Complete:
@@ -644,7 +662,9 @@ auto solve_clique_problem(const InputGraph & graph, const CliqueParams & params)
         }
     }
 
-    CliqueRunner runner{ graph, params };
-    return params.connected ? runner.run<true>() : runner.run<false>();
+    return with_bitset_for_size(graph.size(), [&] (auto bitset_type) {
+            CliqueRunner<typename decltype(bitset_type)::Type> runner{ graph, params };
+            return params.connected ? runner.template run<true>() : runner.template run<false>();
+            });
 }
 
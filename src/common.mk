@@ -8,22 +8,31 @@ SOURCES := \
     formats/lad.cc \
     formats/read_file_format.cc \
     formats/vfmcs.cc \
+    allocation_counter.cc \
+    bitset_kernels.cc \
+    checkpoint.cc \
     cheap_all_different.cc \
     clique.cc \
     common_subgraph.cc \
     configuration.cc \
     graph_traits.cc \
     homomorphism.cc \
+    homomorphism_batch.cc \
     homomorphism_domain.cc \
     homomorphism_model.cc \
+    homomorphism_prefilter.cc \
     homomorphism_searcher.cc \
+    homomorphism_server.cc \
+    homomorphism_session.cc \
     homomorphism_traits.cc \
     lackey.cc \
     proof.cc \
     restarts.cc \
+    shared_memory.cc \
     svo_bitset.cc \
     sip_decomposer.cc \
     symmetries.cc \
+    target_cache.cc \
     thread_utils.cc \
     timeout.cc \
     verify.cc \
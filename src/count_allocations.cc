@@ -0,0 +1,40 @@
+/* vim: set sw=4 sts=4 et foldmethod=syntax : */
+
+// Replaces the global operator new, so that allocations_on_this_thread()
+// means something. This is linked into the solver programs rather than being
+// part of libcommon.a, so that anything else using the library keeps its own
+// allocator.
+
+#include "allocation_counter.hh"
+
+#include <cstdlib>
+#include <new>
+
+using std::bad_alloc;
+using std::free;
+using std::malloc;
+using std::size_t;
+
+// the array and nothrow forms of operator new go through this one
+auto operator new (size_t size) -> void *
+{
+    note_an_allocation_on_this_thread();
+    if (0 == size)
+        size = 1;
+
+    if (void * result = malloc(size))
+        return result;
+
+    throw bad_alloc{ };
+}
+
+auto operator delete (void * p) noexcept -> void
+{
+    free(p);
+}
+
+auto operator delete (void * p, size_t) noexcept -> void
+{
+    free(p);
+}
+
@@ -0,0 +1,294 @@
+/* vim: set sw=4 sts=4 et foldmethod=syntax : */
+
+#ifndef GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_FIXED_BITSET_HH
+#define GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_FIXED_BITSET_HH 1
+
+#include "bitset_kernels.hh"
+#include "svo_bitset.hh"
+
+#include <algorithm>
+#include <limits>
+
+/**
+ * A bitset whose width is known at compile time. This has the same interface
+ * as SVOBitset, but it never needs to check whether it is long or short, all
+ * its loops have a constant trip count, and it takes up only as much space as
+ * it needs. The size passed to the constructor must fit in n_words_ words.
+ * Each bitset is aligned to its own size, up to a cache line, so a vector of
+ * them is a matrix whose rows are aligned for the vectorised kernels.
+ */
+template <unsigned n_words_>
+class alignas(n_words_ * sizeof(BitWord) < 64 ? n_words_ * sizeof(BitWord) : 64) FixedBitset
+{
+    private:
+        static const constexpr int bits_per_word = sizeof(BitWord) * 8;
+
+        BitWord _data[n_words_] = { };
+
+    public:
+        static constexpr const unsigned npos = std::numeric_limits<unsigned>::max();
+
+        FixedBitset() = default;
+
+        FixedBitset(unsigned, unsigned bits)
+        {
+            std::fill(&_data[0], &_data[n_words_], bits);
+        }
+
+        FixedBitset(const FixedBitset &) = default;
+
+        auto operator= (const FixedBitset &) -> FixedBitset & = default;
+
+        /// the raw words, for reading and writing target caches
+        auto words() const -> const BitWord *
+        {
+            return _data;
+        }
+
+        auto words() -> BitWord *
+        {
+            return _data;
+        }
+
+        auto number_of_words() const -> unsigned
+        {
+            return n_words_;
+        }
+
+        auto any() const -> bool
+        {
+            if constexpr (n_words_ < bitset_kernels_minimum_words) {
+                for (unsigned i = 0 ; i < n_words_ ; ++i)
+                    if (0 != _data[i])
+                        return true;
+                return false;
+            }
+            else
+                return bitset_kernels.any(_data, n_words_);
+        }
+
+        auto find_first() const -> unsigned
+        {
+            for (unsigned i = 0 ; i < n_words_ ; ++i) {
+                int x = __builtin_ffsll(_data[i]);
+                if (0 != x)
+                    return i * bits_per_word + x - 1;
+            }
+            return npos;
+        }
+
+        /// first set bit strictly after a, or npos
+        auto find_next(unsigned a) const -> unsigned
+        {
+            const BitWord * b = _data;
+            unsigned i = (a + 1) / bits_per_word;
+            if (i >= n_words_)
+                return npos;
+
+            BitWord w = b[i] & (~BitWord{ 0 } << ((a + 1) % bits_per_word));
+            while (0 == w) {
+                if (++i >= n_words_)
+                    return npos;
+                w = b[i];
+            }
+
+            return i * bits_per_word + __builtin_ctzll(w);
+        }
+
+        /// last set bit, or npos
+        auto find_last() const -> unsigned
+        {
+            const BitWord * b = _data;
+            for (unsigned i = n_words_ ; i > 0 ; --i)
+                if (0 != b[i - 1])
+                    return i * bits_per_word - 1 - __builtin_clzll(b[i - 1]);
+            return npos;
+        }
+
+        /**
+         * Call f with each set bit, in increasing order. This skips empty words,
+         * and does not need a copy of the bitset. It is fine for f to reset bits
+         * that have already been visited, but any other changes to this bitset
+         * from inside f may or may not be seen.
+         */
+        template <typename F_>
+        auto for_each_set_bit(const F_ & f) const -> void
+        {
+            const BitWord * b = _data;
+            for (unsigned i = 0 ; i < n_words_ ; ++i)
+                for (BitWord w = b[i] ; 0 != w ; w &= (w - 1))
+                    f(i * bits_per_word + __builtin_ctzll(w));
+        }
+
+        auto reset(int a) -> void
+        {
+            _data[a / bits_per_word] &= ~(BitWord{ 1 } << (a % bits_per_word));
+        }
+
+        auto reset() -> void
+        {
+            std::fill(&_data[0], &_data[n_words_], 0);
+        }
+
+        auto set(int a) -> void
+        {
+            _data[a / bits_per_word] |= (BitWord{ 1 } << (a % bits_per_word));
+        }
+
+        auto test(int a) const -> bool
+        {
+            return _data[a / bits_per_word] & (BitWord{ 1 } << (a % bits_per_word));
+        }
+
+        auto operator&= (const FixedBitset & other) -> FixedBitset &
+        {
+            if constexpr (n_words_ < bitset_kernels_minimum_words) {
+                for (unsigned i = 0 ; i < n_words_ ; ++i)
+                    _data[i] &= other._data[i];
+            }
+            else
+                bitset_kernels.and_assign(_data, other._data, n_words_);
+
+            return *this;
+        }
+
+        auto operator|= (const FixedBitset & other) -> FixedBitset &
+        {
+            if constexpr (n_words_ < bitset_kernels_minimum_words) {
+                for (unsigned i = 0 ; i < n_words_ ; ++i)
+                    _data[i] |= other._data[i];
+            }
+            else
+                bitset_kernels.or_assign(_data, other._data, n_words_);
+
+            return *this;
+        }
+
+        auto intersect_with_complement(const FixedBitset & other) -> void
+        {
+            if constexpr (n_words_ < bitset_kernels_minimum_words) {
+                for (unsigned i = 0 ; i < n_words_ ; ++i)
+                    _data[i] &= ~other._data[i];
+            }
+            else
+                bitset_kernels.and_not_assign(_data, other._data, n_words_);
+        }
+
+        auto count() const -> unsigned
+        {
+            if constexpr (n_words_ < bitset_kernels_minimum_words) {
+                unsigned result = 0;
+                for (unsigned i = 0 ; i < n_words_ ; ++i)
+                    result += __builtin_popcountll(_data[i]);
+                return result;
+            }
+            else
+                return bitset_kernels.popcount(_data, n_words_);
+        }
+
+        /// *this &= other, returning count() afterwards
+        auto intersect_with_and_count(const FixedBitset & other) -> unsigned
+        {
+            if constexpr (n_words_ < bitset_kernels_minimum_words) {
+                unsigned result = 0;
+                for (unsigned i = 0 ; i < n_words_ ; ++i)
+                    result += __builtin_popcountll(_data[i] &= other._data[i]);
+                return result;
+            }
+            else
+                return bitset_kernels.and_assign_count(_data, other._data, n_words_);
+        }
+
+        /// intersect_with_complement(other), returning count() afterwards
+        auto intersect_with_complement_and_count(const FixedBitset & other) -> unsigned
+        {
+            if constexpr (n_words_ < bitset_kernels_minimum_words) {
+                unsigned result = 0;
+                for (unsigned i = 0 ; i < n_words_ ; ++i)
+                    result += __builtin_popcountll(_data[i] &= ~other._data[i]);
+                return result;
+            }
+            else
+                return bitset_kernels.and_not_assign_count(_data, other._data, n_words_);
+        }
+
+        /// *this |= other, returning count() afterwards
+        auto union_with_and_count(const FixedBitset & other) -> unsigned
+        {
+            if constexpr (n_words_ < bitset_kernels_minimum_words) {
+                unsigned result = 0;
+                for (unsigned i = 0 ; i < n_words_ ; ++i)
+                    result += __builtin_popcountll(_data[i] |= other._data[i]);
+                return result;
+            }
+            else
+                return bitset_kernels.or_assign_count(_data, other._data, n_words_);
+        }
+
+        /// how many bits are set in both *this and other?
+        auto intersection_count(const FixedBitset & other) const -> unsigned
+        {
+            if constexpr (n_words_ < bitset_kernels_minimum_words) {
+                unsigned result = 0;
+                for (unsigned i = 0 ; i < n_words_ ; ++i)
+                    result += __builtin_popcountll(_data[i] & other._data[i]);
+                return result;
+            }
+            else
+                return bitset_kernels.and_count(_data, other._data, n_words_);
+        }
+
+        /// is every bit set in *this also set in other?
+        auto is_subset_of(const FixedBitset & other) const -> bool
+        {
+            if constexpr (n_words_ < bitset_kernels_minimum_words) {
+                for (unsigned i = 0 ; i < n_words_ ; ++i)
+                    if (0 != (_data[i] & ~other._data[i]))
+                        return false;
+                return true;
+            }
+            else
+                return bitset_kernels.is_subset(_data, other._data, n_words_);
+        }
+};
+
+/**
+ * Passed to the callback by with_bitset_for_size, to tell it which bitset
+ * type it should use.
+ */
+template <typename Bitset_>
+struct BitsetTypeTag
+{
+    using Type = Bitset_;
+
+    /// For stats output
+    const char * name;
+};
+
+/**
+ * Call callback with a BitsetTypeTag for the narrowest bitset type that can
+ * hold size bits, falling back to SVOBitset for anything too big for a
+ * FixedBitset. Everything that shares bitsets with a given search must be
+ * instantiated with the same type, so this should be done once, at the top.
+ */
+template <typename Callback_>
+auto with_bitset_for_size(unsigned size, const Callback_ & callback) -> auto
+{
+    const constexpr unsigned bits_per_word = sizeof(BitWord) * 8;
+    unsigned n_words = (size + bits_per_word - 1) / bits_per_word;
+
+    if (n_words <= 1)
+        return callback(BitsetTypeTag<FixedBitset<1> >{ "fixed1" });
+    else if (n_words <= 2)
+        return callback(BitsetTypeTag<FixedBitset<2> >{ "fixed2" });
+    else if (n_words <= 4)
+        return callback(BitsetTypeTag<FixedBitset<4> >{ "fixed4" });
+    else if (n_words <= 8)
+        return callback(BitsetTypeTag<FixedBitset<8> >{ "fixed8" });
+    else if (n_words <= 16)
+        return callback(BitsetTypeTag<FixedBitset<16> >{ "fixed16" });
+    else
+        return callback(BitsetTypeTag<SVOBitset>{ "svo" });
+}
+
+#endif
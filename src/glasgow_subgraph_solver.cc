@@ -2,6 +2,9 @@
 
 #include "formats/read_file_format.hh"
 #include "homomorphism.hh"
+#include "homomorphism_batch.hh"
+#include "homomorphism_prefilter.hh"
+#include "homomorphism_server.hh"
 #include "sip_decomposer.hh"
 #include "lackey.hh"
 #include "symmetries.hh"
@@ -11,33 +14,48 @@
 
 #include <boost/program_options.hpp>
 
+#include <atomic>
 #include <chrono>
+#include <csignal>
 #include <cstdlib>
 #include <ctime>
 #include <exception>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <vector>
 
 #include <unistd.h>
 
 namespace po = boost::program_options;
 
+using std::atomic;
 using std::boolalpha;
 using std::cerr;
+using std::cin;
 using std::cout;
 using std::endl;
 using std::exception;
 using std::function;
+using std::getline;
+using std::ifstream;
+using std::istream;
 using std::list;
 using std::localtime;
 using std::make_pair;
 using std::make_shared;
 using std::make_unique;
+using std::map;
+using std::mutex;
+using std::nullopt;
+using std::optional;
 using std::pair;
 using std::put_time;
 using std::string;
+using std::unique_lock;
 using std::vector;
 
 using std::chrono::duration_cast;
@@ -47,6 +65,186 @@ using std::chrono::seconds;
 using std::chrono::steady_clock;
 using std::chrono::system_clock;
 
+namespace
+{
+    // so that a signal can stop the search cleanly, and so write a checkpoint
+    atomic<Timeout *> timeout_for_signals{ nullptr };
+    atomic<bool> interrupted{ false };
+
+    auto stop_on_signal(int) -> void
+    {
+        interrupted = true;
+        if (auto timeout = timeout_for_signals.load())
+            timeout->trigger_early_abort();
+    }
+
+    atomic<HomomorphismServer *> server_for_signals{ nullptr };
+
+    auto stop_server_on_signal(int) -> void
+    {
+        if (auto server = server_for_signals.load())
+            server->stop();
+    }
+
+    // solve every pattern in a list against one target, or one pattern against
+    // every target in a list, printing results as they finish
+    auto solve_batch(const po::variables_map & options_vars, const HomomorphismParams & params,
+            const string & pattern_format_name, const string & target_format_name) -> int
+    {
+        bool database = options_vars.count("database");
+        string batch_file = options_vars[database ? "database" : "batch"].as<string>();
+        string fixed_file = options_vars["pattern-file"].as<string>();
+        string fixed_name = database ? "pattern" : "target", listed_name = database ? "target" : "pattern";
+
+        ifstream batch_infile;
+        if (batch_file != "-") {
+            batch_infile.open(batch_file);
+            if (! batch_infile) {
+                cerr << "Error: cannot read " << (database ? "database" : "batch") << " file '" << batch_file << "'" << endl;
+                return EXIT_FAILURE;
+            }
+        }
+        istream & batch_in = (batch_file == "-") ? cin : batch_infile;
+
+        auto start_time = steady_clock::now();
+        auto fixed = read_file_format(database ? pattern_format_name : target_format_name, fixed_file);
+        auto fixed_read_time = duration_cast<milliseconds>(steady_clock::now() - start_time);
+
+        cout << (database ? "database_file = " : "batch_file = ") << batch_file << endl;
+        cout << fixed_name << "_file = " << fixed_file << endl;
+        cout << fixed_name << "_vertices = " << fixed.size() << endl;
+        cout << fixed_name << "_directed_edges = " << fixed.number_of_directed_edges() << endl;
+        cout << fixed_name << "_read_time = " << fixed_read_time.count() << endl;
+        cout << endl;
+
+        // read the list as we go, so files can be streamed in
+        auto next_file = [&] () -> optional<string> {
+            string line;
+            while (getline(batch_in, line))
+                if (! line.empty())
+                    return line;
+            return nullopt;
+        };
+
+        auto read_listed = [&] (const string & filename) -> InputGraph {
+            return read_file_format(database ? target_format_name : pattern_format_name, filename);
+        };
+
+        unsigned n_listed = 0, n_true = 0, n_false = 0, n_aborted = 0, n_errors = 0, n_rejected = 0;
+        map<string, unsigned> n_rejected_by;
+        auto report = [&] (const HomomorphismBatchResult & r) {
+            ++n_listed;
+            cout << listed_name << "_file = " << r.file << endl;
+            cout << listed_name << "_index = " << r.index << endl;
+            cout << "status = ";
+            if (! r.error.empty()) {
+                ++n_errors;
+                cout << "error" << endl;
+                cout << "error = " << r.error << endl;
+            }
+            else if (r.rejected_by) {
+                ++n_false;
+                ++n_rejected;
+                ++n_rejected_by[r.rejected_by];
+                cout << "false" << endl;
+                cout << "prefilter = " << r.rejected_by << endl;
+            }
+            else if (r.aborted) {
+                ++n_aborted;
+                cout << "aborted" << endl;
+            }
+            else if ((! r.result.mapping.empty()) || (params.count_solutions && r.result.solution_count > 0)) {
+                ++n_true;
+                cout << "true" << endl;
+            }
+            else {
+                ++n_false;
+                cout << "false" << endl;
+            }
+
+            if (r.error.empty() && ! r.rejected_by) {
+                if (params.count_solutions)
+                    cout << "solution_count = " << r.result.solution_count << endl;
+                cout << "nodes = " << r.result.nodes << endl;
+                cout << "propagations = " << r.result.propagations << endl;
+
+                if (! r.result.mapping.empty()) {
+                    auto & pattern = database ? fixed : *r.graph;
+                    auto & target = database ? *r.graph : fixed;
+                    cout << "mapping = ";
+                    for (auto v : r.result.mapping)
+                        cout << "(" << pattern.vertex_name(v.first) << " -> " << target.vertex_name(v.second) << ") ";
+                    cout << endl;
+                }
+            }
+
+            cout << "read_time = " << r.read_time.count() << endl;
+            cout << "runtime = " << r.solve_time.count() << endl;
+            cout << "worker = " << r.worker << endl;
+            cout << endl;
+        };
+
+        unsigned n_workers = options_vars.count("batch-workers") ? options_vars["batch-workers"].as<unsigned>() : 0;
+        seconds timeout_each = options_vars.count("timeout") ? seconds{ options_vars["timeout"].as<int>() } : 0s;
+
+        if (database)
+            solve_homomorphism_database(fixed, next_file, read_listed, params, timeout_each, n_workers, report);
+        else
+            solve_homomorphism_batch(fixed, next_file, read_listed, params, timeout_each, n_workers, report);
+
+        cout << "batch_" << listed_name << "s = " << n_listed << endl;
+        cout << "batch_true = " << n_true << endl;
+        cout << "batch_false = " << n_false << endl;
+        cout << "batch_aborted = " << n_aborted << endl;
+        cout << "batch_errors = " << n_errors << endl;
+        cout << "prefilter_rejected = " << n_rejected << endl;
+        for (auto & name : homomorphism_prefilter_names())
+            cout << "prefilter_rejected_" << name << " = " << n_rejected_by[name] << endl;
+        cout << "prefilter_rejection_rate = " << (n_listed > 0 ? double(n_rejected) / n_listed : 0.0) << endl;
+        cout << "runtime = " << duration_cast<milliseconds>(steady_clock::now() - start_time).count() << endl;
+
+        return 0 == n_errors ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // keep some targets loaded, and answer queries about them until told to stop
+    auto serve(const po::variables_map & options_vars, const HomomorphismParams & params,
+            const string & pattern_format_name, const string & target_format_name) -> int
+    {
+        string where = options_vars["serve"].as<string>();
+        unsigned n_workers = options_vars.count("serve-workers") ? options_vars["serve-workers"].as<unsigned>() : 0;
+        seconds default_timeout = options_vars.count("timeout") ? seconds{ options_vars["timeout"].as<int>() } : 0s;
+
+        HomomorphismServer server{ params, pattern_format_name, target_format_name, default_timeout, n_workers };
+
+        if (options_vars.count("serve-target"))
+            for (auto & s : options_vars["serve-target"].as<vector<string> >()) {
+                auto p = s.find('=');
+                if (p == string::npos) {
+                    cerr << "Invalid --serve-target '" << s << "', expected NAME=FILE" << endl;
+                    return EXIT_FAILURE;
+                }
+                server.load_target(s.substr(0, p), s.substr(p + 1));
+                cout << "serve_target = " << s << endl;
+            }
+
+        cout << "serving = " << where << endl;
+        cout << endl;
+        cout.flush();
+
+        if (where == "-")
+            server.serve_stream(STDIN_FILENO, STDOUT_FILENO);
+        else {
+            server_for_signals = &server;
+            signal(SIGTERM, stop_server_on_signal);
+            signal(SIGINT, stop_server_on_signal);
+            server.serve_socket(where);
+            server_for_signals = nullptr;
+        }
+
+        return EXIT_SUCCESS;
+    }
+}
+
 auto main(int argc, char * argv[]) -> int
 {
     try {
@@ -81,6 +279,8 @@ auto main(int argc, char * argv[]) -> int
             ("restart-minimum",      po::value<int>(),         "Specify a minimum number of backtracks before a timed restart can trigger")
             ("luby-constant",        po::value<int>(),         "Specify the starting constant / multiplier for Luby restarts")
             ("value-ordering",       po::value<string>(),      "Specify value-ordering heuristic (biased / degree / antidegree / random / none)")
+            ("nogood-minimisation",                            "Try to shorten nogoods before storing them")
+            ("nogood-memory-limit",  po::value<unsigned long long>(), "Delete less useful nogoods when they use more than this many megabytes (0 for no limit)")
             ("pattern-symmetries",                             "Eliminate pattern symmetries (requires Gap)")
             ("target-symmetries",                              "Eliminate target symmetries (requires Gap)");
         display_options.add(search_options);
@@ -89,16 +289,48 @@ auto main(int argc, char * argv[]) -> int
         mangling_options.add_options()
             ("no-clique-detection",                            "Disable clique / independent set detection")
             ("no-supplementals",                               "Do not use supplemental graphs")
-            ("no-nds",                                         "Do not use neighbourhood degree sequences");
+            ("no-nds",                                         "Do not use neighbourhood degree sequences")
+            ("target-cache",         po::value<string>(),      "Load the preprocessed target graph from this file, or save it there if it is missing or out of date");
         display_options.add(mangling_options);
 
         po::options_description parallel_options{ "Advanced parallelism options" };
         parallel_options.add_options()
             ("threads",              po::value<unsigned>(),    "Use threaded search, with this many threads (0 to auto-detect)")
+            ("processes",            po::value<unsigned>(),    "Use this many forked worker processes instead of threads, sharing nogoods through shared memory (0 to auto-detect)")
+            ("worker-hang-timeout",  po::value<unsigned>(),    "Kill a worker process that goes this many seconds without restarting")
             ("triggered-restarts",                             "Have one thread trigger restarts (more nondeterminism, better performance)")
-            ("delay-thread-creation",                          "Do not create threads until after the first restart");
+            ("delay-thread-creation",                          "Do not create threads until after the first restart")
+            ("deterministic",                                  "Make threaded search reproducible, by restarting after a number of backtracks and sharing nogoods in a fixed order")
+            ("portfolio",                                      "Have threads use a mix of value orderings, restarts and supplemental graphs, and report which finished first")
+            ("numa",                                           "Pin threads to CPUs, grouped by NUMA node, with a copy of the target graph for each node")
+            ("shared-nogood-size-limit", po::value<unsigned>(), "Only share nogoods with at most this many literals between threads (ignored when counting)");
         display_options.add(parallel_options);
 
+        po::options_description checkpoint_options{ "Checkpointing options" };
+        checkpoint_options.add_options()
+            ("checkpoint",           po::value<string>(),      "Periodically save enough to carry on with the search to this file (sequential search only)")
+            ("checkpoint-interval",  po::value<unsigned>(),    "Seconds between checkpoints (default 60)")
+            ("resume",               po::value<string>(),      "Carry on from this checkpoint file");
+        display_options.add(checkpoint_options);
+
+        po::options_description batch_options{ "Batch options" };
+        batch_options.add_options()
+            ("batch",                po::value<string>(),      "Solve every pattern listed in this file (one per line, or - to read them from standard input) "
+                                                               "against one target, which is then the only file given")
+            ("database",             po::value<string>(),      "Solve one pattern, which is then the only file given, against every target listed in this file "
+                                                               "(one per line, or - to read them from standard input)")
+            ("batch-workers",        po::value<unsigned>(),    "How many patterns or targets to solve at once in batch or database mode (0 to auto-detect, the default)");
+        display_options.add(batch_options);
+
+        po::options_description server_options{ "Server options" };
+        server_options.add_options()
+            ("serve",                po::value<string>(),      "Keep running, answering queries from this Unix domain socket (or - for standard input and "
+                                                               "output) about targets kept in memory, instead of solving one problem")
+            ("serve-target",         po::value<vector<string> >(),
+                                                               "Load a target as NAME=FILE before answering any queries (may be used multiple times)")
+            ("serve-workers",        po::value<unsigned>(),    "How many queries to solve at once in server mode (0 to auto-detect, the default)");
+        display_options.add(server_options);
+
         vector<string> pattern_less_thans, target_occur_less_thans;
         po::options_description symmetry_options{ "Manual symmetry options" };
         symmetry_options.add_options()
@@ -173,8 +405,47 @@ auto main(int argc, char * argv[]) -> int
             return EXIT_SUCCESS;
         }
 
+        /* In batch mode, the only file given is the target, and in database
+         * mode, it is the pattern. */
+        bool batch = options_vars.count("batch") || options_vars.count("database");
+        if (batch) {
+            if (options_vars.count("batch") && options_vars.count("database")) {
+                cerr << "Batch mode cannot be used with --database" << endl;
+                return EXIT_FAILURE;
+            }
+
+            if (! options_vars.count("pattern-file") || options_vars.count("target-file")) {
+                if (options_vars.count("database"))
+                    cout << "Usage: " << argv[0] << " [options] --database targets-list pattern" << endl;
+                else
+                    cout << "Usage: " << argv[0] << " [options] --batch patterns-list target" << endl;
+                return EXIT_FAILURE;
+            }
+
+            for (auto & o : { "print-all-solutions", "decomposition", "pattern-symmetries", "target-symmetries", "prove", "send-to-lackey" })
+                if (options_vars.count(o)) {
+                    cerr << "Batch mode cannot be used with --" << o << endl;
+                    return EXIT_FAILURE;
+                }
+        }
+
+        /* In server mode, files come from the queries. */
+        bool serving = options_vars.count("serve");
+        if (serving) {
+            if (batch || options_vars.count("pattern-file")) {
+                cout << "Usage: " << argv[0] << " [options] --serve socket|-" << endl;
+                return EXIT_FAILURE;
+            }
+
+            for (auto & o : { "print-all-solutions", "decomposition", "pattern-symmetries", "target-symmetries", "prove", "send-to-lackey", "target-cache" })
+                if (options_vars.count(o)) {
+                    cerr << "Server mode cannot be used with --" << o << endl;
+                    return EXIT_FAILURE;
+                }
+        }
+
         /* No algorithm or no input file specified? Show a message and exit. */
-        if (! options_vars.count("pattern-file") || ! options_vars.count("target-file")) {
+        else if ((! batch) && (! options_vars.count("pattern-file") || ! options_vars.count("target-file"))) {
             cout << "Usage: " << argv[0] << " [options] pattern target" << endl;
             return EXIT_FAILURE;
         }
@@ -196,16 +467,41 @@ auto main(int argc, char * argv[]) -> int
         params.induced = options_vars.count("induced");
         params.count_solutions = options_vars.count("count-solutions") || options_vars.count("enumerate") || options_vars.count("print-all-solutions");
 
-        params.triggered_restarts = options_vars.count("triggered-restarts") || options_vars.count("parallel");
+        params.deterministic = options_vars.count("deterministic");
+        if (params.deterministic && (options_vars.count("triggered-restarts") ||
+                    (options_vars.count("restarts") && options_vars["restarts"].as<string>() == "timed"))) {
+            cerr << "Deterministic search cannot use triggered or timed restarts" << endl;
+            return EXIT_FAILURE;
+        }
+
+        params.portfolio = options_vars.count("portfolio");
+        params.numa = options_vars.count("numa");
+        params.triggered_restarts = (options_vars.count("triggered-restarts") || options_vars.count("parallel")) && ! params.deterministic;
 
         if (options_vars.count("threads"))
             params.n_threads = options_vars["threads"].as<unsigned>();
         else if (options_vars.count("parallel"))
             params.n_threads = 0;
 
+        if (options_vars.count("processes"))
+            params.n_processes = options_vars["processes"].as<unsigned>();
+        if (options_vars.count("worker-hang-timeout"))
+            params.worker_hang_timeout = options_vars["worker-hang-timeout"].as<unsigned>();
+
         if (options_vars.count("delay-thread-creation") || options_vars.count("parallel"))
             params.delay_thread_creation = true;
 
+        if (options_vars.count("shared-nogood-size-limit"))
+            params.shared_nogood_size_limit = options_vars["shared-nogood-size-limit"].as<unsigned>();
+
+        if (options_vars.count("checkpoint"))
+            params.checkpoint_file = options_vars["checkpoint"].as<string>();
+        if (options_vars.count("checkpoint-interval"))
+            params.checkpoint_interval = options_vars["checkpoint-interval"].as<unsigned>();
+        if (options_vars.count("resume"))
+            params.resume_from = options_vars["resume"].as<string>();
+        bool checkpointing = ! params.checkpoint_file.empty() || ! params.resume_from.empty();
+
         if (options_vars.count("restarts")) {
             string restarts_policy = options_vars["restarts"].as<string>();
             if (restarts_policy == "luby") {
@@ -241,9 +537,12 @@ auto main(int argc, char * argv[]) -> int
             }
         }
         else {
-            if (params.count_solutions && ! options_vars.count("parallel"))
+            // threaded counting without restarts uses work stealing instead,
+            // unless it has to be deterministic. checkpoints are taken at
+            // restarts, so we need them even when counting.
+            if (params.count_solutions && ! (params.deterministic && 1 != params.n_threads) && ! checkpointing)
                 params.restarts_schedule = make_unique<NoRestartsSchedule>();
-            else if (options_vars.count("parallel"))
+            else if (options_vars.count("parallel") && ! params.deterministic)
                 params.restarts_schedule = make_unique<TimedRestartsSchedule>(TimedRestartsSchedule::default_duration, TimedRestartsSchedule::default_minimum_backtracks);
             else
                 params.restarts_schedule = make_unique<LubyRestartsSchedule>(LubyRestartsSchedule::default_multiplier);
@@ -267,6 +566,10 @@ auto main(int argc, char * argv[]) -> int
             }
         }
 
+        params.minimise_nogoods = options_vars.count("nogood-minimisation");
+        if (options_vars.count("nogood-memory-limit"))
+            params.nogood_memory_limit = options_vars["nogood-memory-limit"].as<unsigned long long>() * 1024 * 1024;
+
         params.clique_detection = ! options_vars.count("no-clique-detection");
         params.distance3 = options_vars.count("distance3");
         params.k4 = options_vars.count("k4");
@@ -274,6 +577,8 @@ auto main(int argc, char * argv[]) -> int
             params.number_of_exact_path_graphs = options_vars["n-exact-path-graphs"].as<int>();
         params.no_supplementals = options_vars.count("no-supplementals");
         params.no_nds = options_vars.count("no-nds");
+        if (options_vars.count("target-cache"))
+            params.target_cache_file = options_vars["target-cache"].as<string>();
         params.clique_size_constraints = options_vars.count("cliques");
         params.clique_size_constraints_on_supplementals = options_vars.count("cliques-on-supplementals");
 
@@ -336,6 +641,11 @@ auto main(int argc, char * argv[]) -> int
         string default_format_name = options_vars.count("format") ? options_vars["format"].as<string>() : "auto";
         string pattern_format_name = options_vars.count("pattern-format") ? options_vars["pattern-format"].as<string>() : default_format_name;
         string target_format_name = options_vars.count("target-format") ? options_vars["target-format"].as<string>() : default_format_name;
+
+        if (batch)
+            return solve_batch(options_vars, params, pattern_format_name, target_format_name);
+        if (serving)
+            return serve(options_vars, params, pattern_format_name, target_format_name);
         auto pattern = read_file_format(pattern_format_name, options_vars["pattern-file"].as<string>());
         auto target = read_file_format(target_format_name, options_vars["target-file"].as<string>());
 
@@ -370,8 +680,11 @@ auto main(int argc, char * argv[]) -> int
         else
             params.propagate_using_lackey = PropagateUsingLackey::Never;
 
+        // with threads, solutions can turn up on more than one thread at once
+        mutex print_mutex;
         if (options_vars.count("print-all-solutions")) {
             params.enumerate_callback = [&] (const VertexToVertexMapping & mapping) -> bool {
+                unique_lock<mutex> lock{ print_mutex };
                 cout << "mapping = ";
                 for (auto v : mapping)
                     cout << "(" << pattern.vertex_name(v.first) << " -> " << target.vertex_name(v.second) << ") ";
@@ -399,6 +712,13 @@ auto main(int argc, char * argv[]) -> int
         /* Prepare and start timeout */
         params.timeout = make_shared<Timeout>(options_vars.count("timeout") ? seconds{ options_vars["timeout"].as<int>() } : 0s);
 
+        /* If we're checkpointing, being told to stop should leave a checkpoint behind */
+        if (checkpointing) {
+            timeout_for_signals = params.timeout.get();
+            signal(SIGTERM, stop_on_signal);
+            signal(SIGINT, stop_on_signal);
+        }
+
         /* Start the clock */
         params.start_time = steady_clock::now();
 
@@ -438,7 +758,7 @@ auto main(int argc, char * argv[]) -> int
         auto overall_time = duration_cast<milliseconds>(steady_clock::now() - params.start_time);
 
         cout << "status = ";
-        if (params.timeout->aborted())
+        if (params.timeout->aborted() || interrupted)
             cout << "aborted";
         else if ((! result.mapping.empty()) || (params.count_solutions && result.solution_count > 0))
             cout << "true";
@@ -1,9 +1,10 @@
 TARGET := glasgow_subgraph_solver
 
 SOURCES := \
+    count_allocations.cc \
     glasgow_subgraph_solver.cc
 
-TGT_PREREQS := run-tests.bash libcommon.a
+TGT_PREREQS := run-tests.bash libcommon.a solve_with_session create_random_graph
 ifeq ($(shell uname -s), Linux)
 TGT_LDLIBS := libcommon.a $(boost_ldlibs) -lstdc++fs
 else
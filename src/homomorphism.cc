@@ -1,13 +1,19 @@
 /* vim: set sw=4 sts=4 et foldmethod=syntax : */
 
 #include "homomorphism.hh"
+#include "allocation_counter.hh"
+#include "bitset_kernels.hh"
+#include "checkpoint.hh"
 #include "clique.hh"
 #include "configuration.hh"
+#include "fixed_bitset.hh"
 #include "graph_traits.hh"
 #include "homomorphism_domain.hh"
 #include "homomorphism_model.hh"
 #include "homomorphism_searcher.hh"
 #include "homomorphism_traits.hh"
+#include "shared_memory.hh"
+#include "target_cache.hh"
 #include "thread_utils.hh"
 #include "proof.hh"
 
@@ -20,21 +26,33 @@
 #include <mutex>
 #include <optional>
 #include <thread>
-#include <unordered_set>
+#include <unordered_map>
 #include <utility>
 
 #include <boost/thread/barrier.hpp>
-#include <boost/functional/hash.hpp>
+
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 using std::atomic;
+using std::call_once;
+using std::equal;
+using std::find;
 using std::function;
 using std::make_optional;
+using std::list;
 using std::make_unique;
 using std::map;
+using std::max;
 using std::move;
 using std::mutex;
+using std::numeric_limits;
+using std::once_flag;
 using std::optional;
 using std::pair;
+using std::shared_ptr;
 using std::size_t;
 using std::sort;
 using std::string;
@@ -42,44 +60,87 @@ using std::thread;
 using std::to_string;
 using std::unique_lock;
 using std::unique_ptr;
-using std::unordered_set;
+using std::unordered_multimap;
 using std::vector;
 
 using std::chrono::duration_cast;
 using std::chrono::milliseconds;
+using std::chrono::seconds;
 using std::chrono::steady_clock;
+using std::chrono::system_clock;
 using std::chrono::operator""ms;
+using std::chrono::operator""us;
+
+using std::this_thread::sleep_for;
 
 using boost::barrier;
-using boost::hash_combine;
 
 namespace
 {
+    template <typename Bitset_>
     struct HomomorphismSolver
     {
-        using Domains = vector<HomomorphismDomain>;
+        using Domains = HomomorphismDomains<Bitset_>;
 
-        const HomomorphismModel & model;
+        const HomomorphismModel<Bitset_> & model;
         const HomomorphismParams & params;
 
-        HomomorphismSolver(const HomomorphismModel & m, const HomomorphismParams & p) :
+        HomomorphismSolver(const HomomorphismModel<Bitset_> & m, const HomomorphismParams & p) :
             model(m),
             params(p)
         {
         }
     };
 
+    // Enough to stop a checkpoint being resumed on a different problem, or
+    // with settings that change what nogoods or the solution count mean. The
+    // graphs are hashed as they were read, so that anything the model might
+    // look at, such as edge labels, is included.
+    template <typename Bitset_>
+    auto checkpoint_fingerprint(const InputGraph & pattern, const InputGraph & target,
+            const HomomorphismModel<Bitset_> & model, const HomomorphismParams & params) -> string
+    {
+        unsigned long long hash = 14695981039346656037ull;
+        auto mix = [&] (unsigned long long x) {
+            hash = (hash ^ x) * 1099511628211ull;
+        };
+
+        mix(fingerprint_target_graph(pattern));
+        mix(fingerprint_target_graph(target));
+
+        for (auto & [ a, b ] : model.pattern_less_thans_in_convenient_order)
+            mix((static_cast<unsigned long long>(a) << 32) | b);
+        for (auto & [ a, b ] : model.target_occur_less_thans_in_convenient_order)
+            mix((static_cast<unsigned long long>(a) << 32) | b);
+
+        return to_string(model.pattern_size) + " " + to_string(model.target_size) + " " + to_string(hash)
+            + " induced=" + to_string(params.induced) + " injectivity=" + to_string(static_cast<int>(params.injectivity))
+            + " count=" + to_string(params.count_solutions);
+    }
+
+    template <typename Bitset_>
     struct SequentialSolver :
-        HomomorphismSolver
+        HomomorphismSolver<Bitset_>
     {
-        using HomomorphismSolver::HomomorphismSolver;
+        using HomomorphismSolver<Bitset_>::model;
+        using HomomorphismSolver<Bitset_>::params;
+        using typename HomomorphismSolver<Bitset_>::Domains;
+
+        // from checkpoint_fingerprint, if we are checkpointing or resuming
+        string fingerprint;
+
+        SequentialSolver(const HomomorphismModel<Bitset_> & m, const HomomorphismParams & p, const string & f) :
+            HomomorphismSolver<Bitset_>(m, p),
+            fingerprint(f)
+        {
+        }
 
         auto solve() -> HomomorphismResult
         {
             HomomorphismResult result;
 
             // domains
-            Domains domains(model.pattern_size, HomomorphismDomain{ model.target_size });
+            Domains domains(model.pattern_size, model.target_size);
             if (! model.initialise_domains(domains)) {
                 result.complete = true;
                 model.add_extra_stats(result.extra_stats);
@@ -88,40 +149,103 @@ namespace
 
             // assignments
             HomomorphismAssignments assignments;
-            assignments.values.reserve(model.pattern_size);
+            assignments.reserve(model.pattern_size);
 
             // start search timer
             auto search_start_time = steady_clock::now();
+            auto search_start_allocations = allocations_on_this_thread();
 
             // do the search
             bool done = false;
             unsigned number_of_restarts = 0;
 
-            HomomorphismSearcher searcher(model, params, [] (const HomomorphismAssignments &) -> bool { return true; });
+            HomomorphismSearcher<Bitset_> searcher(model, params, [] (const HomomorphismAssignments &) -> bool { return true; });
+
+            // checkpoints are taken between restarts, when the nogoods say
+            // everything about what has been done so far
+            if (! params.resume_from.empty()) {
+                auto checkpoint = read_checkpoint(params.resume_from);
+                if (checkpoint.fingerprint != fingerprint)
+                    throw CheckpointError{ "Checkpoint file '" + params.resume_from + "' is for a different problem, or used different settings" };
+
+                result.nodes = checkpoint.nodes;
+                result.propagations = checkpoint.propagations;
+                result.solution_count = checkpoint.solution_count;
+                number_of_restarts = checkpoint.restarts;
+                params.restarts_schedule->restore_position(checkpoint.restarts_schedule_position);
+                searcher.set_random_state(checkpoint.random_state);
+
+                vector<HomomorphismAssignment> literals;
+                auto literal = checkpoint.nogood_literals.begin();
+                for (auto & size : checkpoint.nogood_sizes) {
+                    literals.clear();
+                    for (unsigned i = 0 ; i < size ; ++i, ++literal) {
+                        if (literal->first >= model.pattern_size || literal->second >= model.target_size)
+                            throw CheckpointError{ "Checkpoint file '" + params.resume_from + "' has a nogood that doesn't fit this problem" };
+                        literals.push_back(HomomorphismAssignment{ literal->first, literal->second });
+                    }
+                    searcher.watches.gather_nogood(literals.data(), size);
+                }
+
+                result.extra_stats.emplace_back("resumed_nogoods = " + to_string(checkpoint.nogood_sizes.size()));
+            }
+
+            unsigned long long checkpoints_written = 0;
+            auto last_checkpoint_time = steady_clock::now();
+            loooong solution_count_at_restart = result.solution_count;
+            string random_state_at_restart;
+
+            auto save_checkpoint = [&] (unsigned long long restarts, const loooong & solution_count, const string & random_state) {
+                Checkpoint checkpoint;
+                checkpoint.fingerprint = fingerprint;
+                checkpoint.nodes = result.nodes;
+                checkpoint.propagations = result.propagations;
+                checkpoint.restarts = restarts;
+                checkpoint.solution_count = solution_count;
+                checkpoint.restarts_schedule_position = params.restarts_schedule->position();
+                checkpoint.random_state = random_state;
+                searcher.watches.for_each_nogood([&] (const HomomorphismAssignment * literals, unsigned size) {
+                        checkpoint.nogood_sizes.push_back(size);
+                        for (unsigned i = 0 ; i < size ; ++i)
+                            checkpoint.nogood_literals.emplace_back(literals[i].pattern_vertex, literals[i].target_vertex);
+                        });
+
+                write_checkpoint(params.checkpoint_file, checkpoint);
+                ++checkpoints_written;
+                last_checkpoint_time = steady_clock::now();
+            };
 
             while (! done) {
+                if (! params.checkpoint_file.empty() && steady_clock::now() - last_checkpoint_time >= seconds{ params.checkpoint_interval })
+                    save_checkpoint(number_of_restarts, result.solution_count, searcher.random_state());
+                solution_count_at_restart = result.solution_count;
+                if (! params.checkpoint_file.empty())
+                    random_state_at_restart = searcher.random_state();
+
                 ++number_of_restarts;
 
                 // start watching new nogoods
                 done = searcher.watches.apply_new_nogoods(
                         [&] (const HomomorphismAssignment & assignment) {
-                            for (auto & d : domains)
-                                if (d.v == assignment.pattern_vertex) {
-                                    d.values.reset(assignment.target_vertex);
-                                    d.count = d.values.count();
-                                    done = done || (0 == d.count);
-                                    break;
-                                }
+                            auto & values = domains.values[assignment.pattern_vertex];
+                            values.reset(assignment.target_vertex);
+                            domains.counts[assignment.pattern_vertex] = values.count();
+                            done = done || (0 == domains.counts[assignment.pattern_vertex]);
                         });
 
                 if (done)
                     break;
 
                 searcher.watches.clear_new_nogoods();
+                // when counting, nogoods also say what has already been counted, so
+                // we can't throw any away
+                if (! params.count_solutions)
+                    searcher.watches.reduce(params.nogood_memory_limit);
 
                 ++result.propagations;
                 if (searcher.propagate(true, domains, assignments, params.propagate_using_lackey != PropagateUsingLackey::Never)) {
                     auto assignments_copy = assignments;
+                    assignments_copy.reserve(model.pattern_size);
 
                     switch (searcher.restarting_search(assignments_copy, domains, result.nodes, result.propagations,
                                 result.solution_count, 0, *params.restarts_schedule)) {
@@ -143,6 +267,11 @@ namespace
                             break;
 
                         case SearchResult::Aborted:
+                            // anything found since the last restart will be
+                            // found again when we resume from here, as long
+                            // as we make the same random choices again
+                            if (! params.checkpoint_file.empty())
+                                save_checkpoint(number_of_restarts - 1, solution_count_at_restart, random_state_at_restart);
                             done = true;
                             break;
 
@@ -162,18 +291,23 @@ namespace
 
             if (params.restarts_schedule->might_restart())
                 result.extra_stats.emplace_back("restarts = " + to_string(number_of_restarts));
+            if (! params.checkpoint_file.empty())
+                result.extra_stats.emplace_back("checkpoints_written = " + to_string(checkpoints_written));
 
             result.extra_stats.emplace_back("shape_graphs = " + to_string(model.max_graphs));
 
             result.extra_stats.emplace_back("search_time = " + to_string(
                         duration_cast<milliseconds>(steady_clock::now() - search_start_time).count()));
+            result.extra_stats.emplace_back("search_allocations = " + to_string(allocations_on_this_thread() - search_start_allocations));
+            searcher.add_extra_stats(result.extra_stats);
 
             if (might_have_watches(params)) {
-                result.extra_stats.emplace_back("nogoods_size = " + to_string(searcher.watches.nogoods.size()));
+                result.extra_stats.emplace_back("nogoods_size = " + to_string(searcher.watches.number_of_nogoods));
 
                 map<int, int> nogoods_lengths;
-                for (auto & n : searcher.watches.nogoods)
-                    nogoods_lengths[n.literals.size()]++;
+                searcher.watches.for_each_nogood([&] (const HomomorphismAssignment *, unsigned size) {
+                        nogoods_lengths[size]++;
+                        });
 
                 string nogoods_lengths_str;
                 for (auto & n : nogoods_lengths) {
@@ -188,37 +322,297 @@ namespace
         }
     };
 
-    struct VertexToVertexMappingHash
+    // A 128-bit fingerprint of a solution. This only depends upon which target
+    // vertex each pattern vertex is mapped to, and not upon the order in which
+    // the assignments were made, so different threads get the same answer.
+    struct SolutionFingerprint
+    {
+        unsigned long long first, second;
+
+        explicit SolutionFingerprint(const HomomorphismAssignments & assignments, unsigned pattern_size) :
+            first(0x9e3779b97f4a7c15ull),
+            second(0xd1b54a32d192ed03ull)
+        {
+            for (unsigned p = 0 ; p < pattern_size ; ++p) {
+                first = mix(first ^ assignments.target_of[p]);
+                second = mix(second + (static_cast<unsigned long long>(assignments.target_of[p]) << 32) + p);
+            }
+        }
+
+        static auto mix(unsigned long long x) -> unsigned long long
+        {
+            x ^= x >> 30;
+            x *= 0xbf58476d1ce4e5b9ull;
+            x ^= x >> 27;
+            x *= 0x94d049bb133111ebull;
+            x ^= x >> 31;
+            return x;
+        }
+
+        auto operator== (const SolutionFingerprint & other) const -> bool
+        {
+            return first == other.first && second == other.second;
+        }
+    };
+
+    struct SolutionFingerprintHash
     {
-        auto operator() (const VertexToVertexMapping & v) const -> size_t
+        auto operator() (const SolutionFingerprint & f) const -> size_t
         {
-            size_t result{ 0 };
-            for (auto & [ p, t ] : v) {
-                hash_combine(result, p);
-                hash_combine(result, t);
+            return f.first;
+        }
+    };
+
+    // When counting with threads, two threads can find the same solution
+    // before either has heard about the nogood the other posts to cover it, so
+    // we remember what has been found. A solution can be forgotten once the
+    // thread that found it has exported that nogood, and every other thread
+    // has then imported it. We move to a new generation whenever every thread
+    // has exported everything at least once since the last move, which means
+    // anything found three or more generations ago is safe to drop.
+    //
+    // Solutions are looked up by fingerprint, and split between shards that
+    // each have their own lock. Each shard also keeps the full solutions, in
+    // case two fingerprints ever collide. Shards catch up with generation
+    // moves the next time they are used.
+    class DuplicateSolutionFilter
+    {
+        private:
+            static const constexpr unsigned number_of_shards = 64;
+            static const constexpr unsigned number_of_generations = 3;
+
+            struct Generation
+            {
+                unsigned long long number = 0;
+                unordered_multimap<SolutionFingerprint, size_t, SolutionFingerprintHash> offsets;
+                vector<unsigned> solutions;
+            };
+
+            struct alignas(64) Shard
+            {
+                mutex shard_mutex;
+                Generation generations[number_of_generations];
+                unsigned long long hits = 0, misses = 0, collisions = 0;
+            };
+
+            unsigned _pattern_size;
+            unique_ptr<Shard []> _shards;
+            atomic<unsigned long long> _generation{ 0 };
+
+            mutex _move_mutex;
+            vector<unsigned long long> _exports_at_last_move;
+
+            auto same_solution(const Generation & g, size_t offset, const HomomorphismAssignments & assignments) const -> bool
+            {
+                return equal(g.solutions.begin() + offset, g.solutions.begin() + offset + _pattern_size, assignments.target_of.begin());
             }
+
+        public:
+            explicit DuplicateSolutionFilter(unsigned pattern_size) :
+                _pattern_size(pattern_size),
+                _shards(new Shard[number_of_shards])
+            {
+            }
+
+            /// returns true if this solution hasn't been seen before
+            auto insert(const HomomorphismAssignments & assignments) -> bool
+            {
+                SolutionFingerprint fingerprint{ assignments, _pattern_size };
+                auto & shard = _shards[fingerprint.second % number_of_shards];
+                unique_lock<mutex> lock{ shard.shard_mutex };
+
+                auto current = _generation.load();
+                for (auto & g : shard.generations) {
+                    if (g.number + number_of_generations <= current && ! g.offsets.empty()) {
+                        g.offsets.clear();
+                        g.solutions.clear();
+                    }
+                    else {
+                        auto [ begin, end ] = g.offsets.equal_range(fingerprint);
+                        for (auto i = begin ; i != end ; ++i) {
+                            if (same_solution(g, i->second, assignments)) {
+                                ++shard.hits;
+                                return false;
+                            }
+                            ++shard.collisions;
+                        }
+                    }
+                }
+
+                auto & g = shard.generations[current % number_of_generations];
+                if (g.number != current) {
+                    g.offsets.clear();
+                    g.solutions.clear();
+                    g.number = current;
+                }
+                g.offsets.emplace(fingerprint, g.solutions.size());
+                g.solutions.insert(g.solutions.end(), assignments.target_of.begin(), assignments.target_of.begin() + _pattern_size);
+                ++shard.misses;
+                return true;
+            }
+
+            auto maybe_move_generation(const vector<unique_ptr<atomic<unsigned long long> > > & exports) -> void
+            {
+                unique_lock<mutex> lock{ _move_mutex };
+                _exports_at_last_move.resize(exports.size());
+                for (unsigned t = 0 ; t < exports.size() ; ++t)
+                    if (exports[t]->load() == _exports_at_last_move[t])
+                        return;
+
+                for (unsigned t = 0 ; t < exports.size() ; ++t)
+                    _exports_at_last_move[t] = exports[t]->load();
+                ++_generation;
+            }
+
+            auto add_extra_stats(list<string> & extra_stats) -> void
+            {
+                unsigned long long hits = 0, misses = 0, collisions = 0;
+                for (unsigned s = 0 ; s < number_of_shards ; ++s) {
+                    unique_lock<mutex> lock{ _shards[s].shard_mutex };
+                    hits += _shards[s].hits;
+                    misses += _shards[s].misses;
+                    collisions += _shards[s].collisions;
+                }
+
+                extra_stats.emplace_back("duplicate_filter_generations = " + to_string(_generation.load()));
+                extra_stats.emplace_back("duplicate_filter_hits = " + to_string(hits));
+                extra_stats.emplace_back("duplicate_filter_misses = " + to_string(misses));
+                extra_stats.emplace_back("duplicate_filter_fingerprint_collisions = " + to_string(collisions));
+            }
+    };
+
+    // With --portfolio, each thread searches in its own way, rather than
+    // differing only by random seed. Thread 0 does what params say, and the
+    // others cycle through these. They all solve the same problem, so any
+    // nogood is valid for everyone, but threads that don't restart never
+    // get to import them.
+    struct PortfolioConfiguration
+    {
+        ValueOrdering value_ordering;
+        bool restarts;
+        bool supplemental_graphs;
+
+        auto name() const -> string
+        {
+            string result = "value_ordering=";
+            switch (value_ordering) {
+                case ValueOrdering::None:       result += "none"; break;
+                case ValueOrdering::Biased:     result += "biased"; break;
+                case ValueOrdering::Degree:     result += "degree"; break;
+                case ValueOrdering::AntiDegree: result += "antidegree"; break;
+                case ValueOrdering::Random:     result += "random"; break;
+            }
+            result += restarts ? ",restarts=yes" : ",restarts=no";
+            result += supplemental_graphs ? ",search_supplementals=yes" : ",search_supplementals=no";
             return result;
         }
     };
 
-    struct ThreadedSolver : HomomorphismSolver
+    auto portfolio_configuration(const HomomorphismParams & params, unsigned t) -> PortfolioConfiguration
+    {
+        static const PortfolioConfiguration others[] = {
+            { ValueOrdering::Degree,     true,  true },
+            { ValueOrdering::Biased,     false, true },
+            { ValueOrdering::Biased,     true,  false },
+            { ValueOrdering::AntiDegree, true,  true },
+            { ValueOrdering::Degree,     false, true },
+            { ValueOrdering::Random,     true,  false }
+        };
+
+        if (0 == t)
+            return PortfolioConfiguration{ params.value_ordering_heuristic, true, true };
+
+        auto result = others[(t - 1) % (sizeof(others) / sizeof(others[0]))];
+
+        // deterministic threads have to restart together
+        if (params.deterministic)
+            result.restarts = true;
+
+        return result;
+    }
+
+    // With --numa, threads are pinned to CPUs, with consecutive threads
+    // sharing a NUMA node, and each node gets its own copy of the target
+    // rows. The copy is made by the first thread to arrive on that node, so
+    // the memory it touches first is local to that node.
+    template <typename Bitset_>
+    class NumaPlacement
+    {
+        private:
+            const HomomorphismModel<Bitset_> & _model;
+            unsigned _n_threads;
+            vector<vector<unsigned> > _nodes;
+            vector<once_flag> _replica_made;
+            vector<unique_ptr<HomomorphismTargetRows<Bitset_> > > _replicas;
+            atomic<unsigned long long> _replication_time{ 0 }, _replica_bytes{ 0 }, _replicas_made{ 0 }, _pin_failures{ 0 };
+
+        public:
+            NumaPlacement(const HomomorphismModel<Bitset_> & m, unsigned n) :
+                _model(m),
+                _n_threads(n),
+                _nodes(numa_nodes_and_cpus()),
+                _replica_made(_nodes.size()),
+                _replicas(_nodes.size())
+            {
+            }
+
+            /// pin the calling thread, and return the rows it should use
+            auto place(unsigned t, list<string> & thread_stats) -> const HomomorphismTargetRows<Bitset_> *
+            {
+                // split the threads into a contiguous block for each node
+                unsigned node = (t * _nodes.size()) / _n_threads;
+                unsigned first_on_node = (node * _n_threads + _nodes.size() - 1) / _nodes.size();
+                unsigned cpu = _nodes[node][(t - first_on_node) % _nodes[node].size()];
+
+                if (pin_this_thread_to_cpu(cpu))
+                    thread_stats.emplace_back("cpu = " + to_string(cpu));
+                else
+                    ++_pin_failures;
+                thread_stats.emplace_back("numa_node = " + to_string(node));
+
+                call_once(_replica_made[node], [&] () {
+                        auto replication_start_time = steady_clock::now();
+                        _replicas[node] = make_unique<HomomorphismTargetRows<Bitset_> >(_model.copy_target_rows());
+                        _replication_time += duration_cast<milliseconds>(steady_clock::now() - replication_start_time).count();
+                        _replica_bytes += _replicas[node]->bytes();
+                        ++_replicas_made;
+                        });
+
+                return _replicas[node].get();
+            }
+
+            auto add_extra_stats(list<string> & extra_stats) const -> void
+            {
+                extra_stats.emplace_back("numa_nodes = " + to_string(_nodes.size()));
+                extra_stats.emplace_back("numa_replicas = " + to_string(_replicas_made.load()));
+                extra_stats.emplace_back("numa_replica_bytes = " + to_string(_replica_bytes.load()));
+                extra_stats.emplace_back("numa_replication_time = " + to_string(_replication_time.load()));
+                extra_stats.emplace_back("numa_pin_failures = " + to_string(_pin_failures.load()));
+            }
+    };
+
+    template <typename Bitset_>
+    struct ThreadedSolver : HomomorphismSolver<Bitset_>
     {
+        using HomomorphismSolver<Bitset_>::model;
+        using HomomorphismSolver<Bitset_>::params;
+        using typename HomomorphismSolver<Bitset_>::Domains;
+
         unsigned n_threads;
 
-        ThreadedSolver(const HomomorphismModel & m, const HomomorphismParams & p, unsigned t) :
-            HomomorphismSolver(m, p),
+        ThreadedSolver(const HomomorphismModel<Bitset_> & m, const HomomorphismParams & p, unsigned t) :
+            HomomorphismSolver<Bitset_>(m, p),
             n_threads(t)
         {
         }
 
         auto solve() -> HomomorphismResult
         {
-            mutex common_result_mutex;
             HomomorphismResult common_result;
             string by_thread_nodes, by_thread_propagations;
 
             // domains
-            Domains common_domains(model.pattern_size, HomomorphismDomain{ model.target_size });
+            Domains common_domains(model.pattern_size, model.target_size);
             if (! model.initialise_domains(common_domains)) {
                 common_result.complete = true;
                 return common_result;
@@ -230,108 +624,217 @@ namespace
             vector<thread> threads;
             threads.reserve(n_threads);
 
-            vector<unique_ptr<HomomorphismSearcher> > searchers{ n_threads };
+            vector<unique_ptr<HomomorphismSearcher<Bitset_> > > searchers{ n_threads };
+
+            // each thread exports its nogoods through its own ring, and the
+            // other threads pick them up whenever they restart, so nobody has
+            // to wait for anyone else. we also count how often each thread
+            // has managed to export everything it has.
+            vector<unique_ptr<NogoodRing<HomomorphismAssignment> > > rings;
+            vector<unique_ptr<atomic<unsigned long long> > > exports;
+            for (unsigned t = 0 ; t < n_threads ; ++t) {
+                rings.push_back(make_unique<NogoodRing<HomomorphismAssignment> >(max(1u << 16, 4 * (model.pattern_size + 1)), n_threads, t));
+                exports.push_back(make_unique<atomic<unsigned long long> >(0));
+            }
+
+            vector<optional<PortfolioConfiguration> > configurations(n_threads);
+            atomic<int> first_to_finish{ -1 };
+            if (params.portfolio) {
+                for (unsigned t = 0 ; t < n_threads ; ++t) {
+                    configurations[t] = portfolio_configuration(params, t);
+                    if (! configurations[t]->restarts)
+                        for (auto & ring : rings)
+                            ring->ignore_reader(t);
+                }
+            }
+
+            // nogoods are only a shortcut when we're not counting, so we can
+            // choose not to share long ones
+            unsigned shared_nogood_size_limit = params.count_solutions ? numeric_limits<unsigned>::max() : params.shared_nogood_size_limit;
+
+            GloballyRemovedValues globally_removed_values(model.pattern_size, model.target_size);
+
+            atomic<unsigned long long> restart_synchroniser{ 0 };
+
+            DuplicateSolutionFilter duplicate_filter{ model.pattern_size };
+
+            // to be deterministic, threads only pick up nogoods between a pair
+            // of barriers, when everyone has exported everything from the same
+            // restart, and then everyone stops at the same restart once anyone
+            // has finished.
+            barrier before_import_barrier{ n_threads }, after_import_barrier{ n_threads };
+            vector<char> finished(n_threads, false);
 
-            barrier wait_for_new_nogoods_barrier{ n_threads }, synced_nogoods_barrier{ n_threads };
-            atomic<bool> restart_synchroniser{ false };
+            vector<HomomorphismResult> thread_results(n_threads);
 
-            mutex duplicate_filter_set_mutex;
-            unordered_set<VertexToVertexMapping, VertexToVertexMappingHash> duplicate_filter_set;
+            optional<NumaPlacement<Bitset_> > numa_placement;
+            if (params.numa)
+                numa_placement.emplace(model, n_threads);
 
             function<auto (unsigned) -> void> work_function = [&searchers, &common_domains, &threads, &work_function,
-                        &model = this->model, &params = this->params, n_threads = this->n_threads,
-                        &common_result, &common_result_mutex, &by_thread_nodes, &by_thread_propagations,
-                        &wait_for_new_nogoods_barrier, &synced_nogoods_barrier, &restart_synchroniser,
-                        &duplicate_filter_set, &duplicate_filter_set_mutex] (unsigned t) -> void
+                        &model = this->model, &params = this->params, n_threads = this->n_threads, &thread_results,
+                        &rings, &exports, shared_nogood_size_limit, &globally_removed_values, &restart_synchroniser,
+                        &duplicate_filter, &before_import_barrier, &after_import_barrier, &finished, &numa_placement,
+                        &configurations, &first_to_finish] (unsigned t) -> void
             {
                 // do the search
-                HomomorphismResult thread_result;
+                auto & thread_result = thread_results[t];
 
                 bool just_the_first_thread = (0 == t) && params.delay_thread_creation;
 
-                searchers[t] = make_unique<HomomorphismSearcher>(model, params, [&] (const HomomorphismAssignments & a) -> bool {
-                        VertexToVertexMapping v;
-                        searchers[t]->expand_to_full_result(a, v);
-                        unique_lock<mutex> lock{ duplicate_filter_set_mutex };
-                        return duplicate_filter_set.insert(v).second;
+                // pin before creating our searcher, so its memory is local too
+                const HomomorphismTargetRows<Bitset_> * target_rows = nullptr;
+                if (numa_placement)
+                    target_rows = numa_placement->place(t, thread_result.extra_stats);
+
+                searchers[t] = make_unique<HomomorphismSearcher<Bitset_> >(model, params, [&] (const HomomorphismAssignments & a) -> bool {
+                        return duplicate_filter.insert(a);
                         });
+                if (target_rows)
+                    searchers[t]->set_target_rows(target_rows);
                 if (0 != t)
                     searchers[t]->set_seed(t);
+                if (configurations[t]) {
+                    searchers[t]->set_value_ordering(configurations[t]->value_ordering);
+                    searchers[t]->set_use_supplemental_graphs(configurations[t]->supplemental_graphs);
+                    thread_result.extra_stats.emplace_back("portfolio_configuration = " + configurations[t]->name());
+                }
+                bool importing = ! configurations[t] || configurations[t]->restarts;
+                if (! params.deterministic)
+                    searchers[t]->set_globally_removed_values(&globally_removed_values);
 
                 unsigned number_of_restarts = 0;
+                auto search_start_allocations = allocations_on_this_thread();
 
                 Domains domains = common_domains;
 
                 HomomorphismAssignments thread_assignments;
-                thread_assignments.values.reserve(model.pattern_size);
+                thread_assignments.reserve(model.pattern_size);
 
                 // each thread needs its own restarts schedule
                 unique_ptr<RestartsSchedule> thread_restarts_schedule;
-                if (0 == t || ! params.triggered_restarts)
+                if (! importing)
+                    thread_restarts_schedule = make_unique<NoRestartsSchedule>();
+                else if (0 == t || ! params.triggered_restarts || params.deterministic)
                     thread_restarts_schedule.reset(params.restarts_schedule->clone());
                 else
                     thread_restarts_schedule = make_unique<SyncedRestartSchedule>(restart_synchroniser);
 
+                // nogoods that didn't fit in our ring yet
+                vector<HomomorphismAssignment> unexported_literals, scratch;
+                vector<unsigned> unexported_ends;
+                unsigned long long nogoods_exported = 0, nogoods_imported = 0, export_deferrals = 0;
+
                 while (true) {
                     ++number_of_restarts;
 
-                    if (! just_the_first_thread) {
-                        wait_for_new_nogoods_barrier.wait();
+                    auto & watches = searchers[t]->watches;
 
-                        for (unsigned u = 0 ; u < n_threads ; ++u)
-                            if (t != u)
-                                searchers[t]->watches.gather_nogoods_from(searchers[u]->watches);
+                    // export anything new, oldest first
+                    for (auto & n : watches.need_to_watch) {
+                        if (watches.nogood_size(n) > shared_nogood_size_limit)
+                            continue;
+                        unexported_literals.insert(unexported_literals.end(), watches.nogood_literals(n), watches.nogood_literals(n) + watches.nogood_size(n));
+                        unexported_ends.push_back(unexported_literals.size());
+                    }
 
-                        // start watching new nogoods
-                        if (searchers[t]->watches.apply_new_nogoods(
-                                [&] (const HomomorphismAssignment & assignment) {
-                                    for (auto & d : domains)
-                                        if (d.v == assignment.pattern_vertex) {
-                                            d.values.reset(assignment.target_vertex);
-                                            d.count = d.values.count();
-                                            break;
-                                        }
-                                }))
+                    unsigned start = 0, n_exported = 0;
+                    bool removed_anything = false;
+                    for ( ; n_exported < unexported_ends.size() ; ++n_exported) {
+                        auto literals = unexported_literals.data() + start;
+                        auto size = unexported_ends[n_exported] - start;
+                        if (! rings[t]->post(literals, size))
                             break;
+                        if (1 == size && globally_removed_values.remove(literals[0].pattern_vertex, literals[0].target_vertex))
+                            removed_anything = true;
+                        start = unexported_ends[n_exported];
+                    }
+                    if (removed_anything)
+                        globally_removed_values.version.fetch_add(1, std::memory_order_release);
+
+                    nogoods_exported += n_exported;
+                    if (n_exported == unexported_ends.size()) {
+                        unexported_literals.clear();
+                        unexported_ends.clear();
+                        exports[t]->fetch_add(1);
+                    }
+                    else {
+                        ++export_deferrals;
+                        unexported_literals.erase(unexported_literals.begin(), unexported_literals.begin() + start);
+                        unexported_ends.erase(unexported_ends.begin(), unexported_ends.begin() + n_exported);
+                        for (auto & e : unexported_ends)
+                            e -= start;
+                    }
 
-                        if (0 == t) {
-                            restart_synchroniser.store(false);
-                            duplicate_filter_set.clear();
-                        }
+                    bool synchronise = params.deterministic && ! just_the_first_thread;
+                    if (synchronise)
+                        before_import_barrier.wait();
+
+                    // import whatever the other threads have exported so far
+                    for (unsigned u = 0 ; u < n_threads ; ++u)
+                        if (t != u && importing)
+                            rings[u]->read_new(t, scratch, [&] (const HomomorphismAssignment * literals, unsigned size) {
+                                    watches.gather_nogood(literals, size);
+                                    ++nogoods_imported;
+                                    });
+
+                    // start watching new nogoods
+                    bool done = watches.apply_new_nogoods(
+                            [&] (const HomomorphismAssignment & assignment) {
+                                auto & values = domains.values[assignment.pattern_vertex];
+                                values.reset(assignment.target_vertex);
+                                domains.counts[assignment.pattern_vertex] = values.count();
+                            });
+
+                    if (synchronise) {
+                        finished[t] = done;
+                        after_import_barrier.wait();
+                        done = finished.end() != find(finished.begin(), finished.end(), true);
+                    }
 
-                        synced_nogoods_barrier.wait();
+                    if (done)
+                        break;
 
-                        searchers[t]->watches.clear_new_nogoods();
-                    }
+                    watches.clear_new_nogoods();
+                    // when counting, nogoods also say what has already been counted, so
+                    // we can't throw any away
+                    if (params.count_solutions)
+                        duplicate_filter.maybe_move_generation(exports);
+                    else
+                        watches.reduce(params.nogood_memory_limit);
 
                     ++thread_result.propagations;
                     if (searchers[t]->propagate(true, domains, thread_assignments, params.propagate_using_lackey != PropagateUsingLackey::Never)) {
                         auto assignments_copy = thread_assignments;
+                        assignments_copy.reserve(model.pattern_size);
 
                         switch (searchers[t]->restarting_search(assignments_copy, domains, thread_result.nodes, thread_result.propagations,
                                     thread_result.solution_count, 0, *thread_restarts_schedule)) {
                             case SearchResult::Satisfiable:
                                 searchers[t]->save_result(assignments_copy, thread_result);
                                 thread_result.complete = true;
-                                params.timeout->trigger_early_abort();
-                                searchers[t]->watches.post_nogood(Nogood<HomomorphismAssignment>{ });
+                                if (! params.deterministic)
+                                    params.timeout->trigger_early_abort();
+                                watches.post_nogood(Nogood<HomomorphismAssignment>{ });
                                 break;
 
                             case SearchResult::SatisfiableButKeepGoing:
                                 thread_result.complete = true;
-                                params.timeout->trigger_early_abort();
-                                searchers[t]->watches.post_nogood(Nogood<HomomorphismAssignment>{ });
+                                if (! params.deterministic)
+                                    params.timeout->trigger_early_abort();
+                                watches.post_nogood(Nogood<HomomorphismAssignment>{ });
                                 break;
 
                             case SearchResult::Unsatisfiable:
                             case SearchResult::UnsatisfiableAndBackjumpUsingLackey:
                                 thread_result.complete = true;
-                                params.timeout->trigger_early_abort();
-                                searchers[t]->watches.post_nogood(Nogood<HomomorphismAssignment>{ });
+                                if (! params.deterministic)
+                                    params.timeout->trigger_early_abort();
+                                watches.post_nogood(Nogood<HomomorphismAssignment>{ });
                                 break;
 
                             case SearchResult::Aborted:
-                                searchers[t]->watches.post_nogood(Nogood<HomomorphismAssignment>{ });
+                                watches.post_nogood(Nogood<HomomorphismAssignment>{ });
                                 break;
 
                             case SearchResult::Restart:
@@ -340,12 +843,18 @@ namespace
                     }
                     else {
                         thread_result.complete = true;
-                        searchers[t]->watches.post_nogood(Nogood<HomomorphismAssignment>{ });
-                        params.timeout->trigger_early_abort();
+                        watches.post_nogood(Nogood<HomomorphismAssignment>{ });
+                        if (! params.deterministic)
+                            params.timeout->trigger_early_abort();
+                    }
+
+                    if (thread_result.complete) {
+                        int nobody = -1;
+                        first_to_finish.compare_exchange_strong(nobody, t);
                     }
 
                     if (0 == t)
-                        restart_synchroniser.store(true);
+                        restart_synchroniser.fetch_add(1);
                     thread_restarts_schedule->did_a_restart();
 
                     if (params.delay_thread_creation && just_the_first_thread) {
@@ -363,8 +872,27 @@ namespace
                     for (auto & th : threads)
                         th.join();
 
-                unique_lock<mutex> lock{ common_result_mutex };
-                if (! thread_result.mapping.empty())
+                thread_result.extra_stats.emplace_back("search_allocations = " + to_string(allocations_on_this_thread() - search_start_allocations));
+                thread_result.extra_stats.emplace_back("nogoods_exported = " + to_string(nogoods_exported));
+                thread_result.extra_stats.emplace_back("nogoods_imported = " + to_string(nogoods_imported));
+                thread_result.extra_stats.emplace_back("nogood_export_deferrals = " + to_string(export_deferrals));
+                searchers[t]->add_extra_stats(thread_result.extra_stats);
+            };
+
+            if (params.delay_thread_creation)
+                work_function(0);
+            else {
+                for (unsigned u = 0 ; u < n_threads ; ++u)
+                    threads.emplace_back([&, u] () { work_function(u); });
+
+                for (auto & th : threads)
+                    th.join();
+            }
+
+            // in thread order, so that the lowest numbered thread's solution wins
+            for (unsigned t = 0 ; t < n_threads ; ++t) {
+                auto & thread_result = thread_results[t];
+                if (common_result.mapping.empty())
                     common_result.mapping = move(thread_result.mapping);
                 common_result.nodes += thread_result.nodes;
                 common_result.propagations += thread_result.propagations;
@@ -375,26 +903,631 @@ namespace
 
                 by_thread_nodes.append(" " + to_string(thread_result.nodes));
                 by_thread_propagations.append(" " + to_string(thread_result.propagations));
-            };
+            }
 
-            if (params.delay_thread_creation)
-                work_function(0);
-            else {
-                for (unsigned u = 0 ; u < n_threads ; ++u)
-                    threads.emplace_back([&, u] () { work_function(u); });
+            if (params.count_solutions)
+                duplicate_filter.add_extra_stats(common_result.extra_stats);
+            if (params.portfolio) {
+                // deterministic threads can finish at the same restart, so
+                // the lowest numbered one wins, as it does for the mapping
+                int winner = first_to_finish.load();
+                if (params.deterministic)
+                    for (unsigned t = n_threads ; t-- > 0 ; )
+                        if (thread_results[t].complete)
+                            winner = t;
+                if (-1 != winner) {
+                    common_result.extra_stats.emplace_back("portfolio_winner = " + to_string(winner));
+                    common_result.extra_stats.emplace_back("portfolio_winning_configuration = " + configurations[winner]->name());
+                }
+            }
+            if (numa_placement)
+                numa_placement->add_extra_stats(common_result.extra_stats);
+            common_result.extra_stats.emplace_back("by_thread_nodes =" + by_thread_nodes);
+            common_result.extra_stats.emplace_back("by_thread_propagations =" + by_thread_propagations);
+            common_result.extra_stats.emplace_back("search_time = " + to_string(
+                        duration_cast<milliseconds>(steady_clock::now() - search_start_time).count()));
 
-                for (auto & th : threads)
-                    th.join();
+            return common_result;
+        }
+    };
+
+    // Counting or enumerating with threads, without restarts. Rather than
+    // having every thread search the whole tree and throwing away duplicate
+    // solutions, the tree is shared out: idle threads steal values from the
+    // shallowest open node of a busy thread, and search beneath them. Each
+    // part of the tree is searched exactly once, so there is no need to look
+    // out for duplicates.
+    template <typename Bitset_>
+    struct WorkStealingSolver : HomomorphismSolver<Bitset_>
+    {
+        using HomomorphismSolver<Bitset_>::model;
+        using HomomorphismSolver<Bitset_>::params;
+        using typename HomomorphismSolver<Bitset_>::Domains;
+
+        unsigned n_threads;
+
+        WorkStealingSolver(const HomomorphismModel<Bitset_> & m, const HomomorphismParams & p, unsigned t) :
+            HomomorphismSolver<Bitset_>(m, p),
+            n_threads(t)
+        {
+        }
+
+        auto solve() -> HomomorphismResult
+        {
+            mutex common_result_mutex;
+            HomomorphismResult common_result;
+            string by_thread_nodes;
+
+            // domains
+            Domains common_domains(model.pattern_size, model.target_size);
+            if (! model.initialise_domains(common_domains)) {
+                common_result.complete = true;
+                return common_result;
+            }
+
+            // start search timer
+            auto search_start_time = steady_clock::now();
+
+            // these all have to exist before anyone can start stealing
+            vector<unique_ptr<HomomorphismSearcher<Bitset_> > > searchers;
+            for (unsigned t = 0 ; t < n_threads ; ++t) {
+                searchers.push_back(make_unique<HomomorphismSearcher<Bitset_> >(model, params,
+                            [] (const HomomorphismAssignments &) -> bool { return true; }));
+                searchers.back()->enable_work_stealing();
             }
 
+            // the first thread starts off with the whole tree. when this gets
+            // to zero, there is nothing left to steal.
+            atomic<unsigned> busy{ 1 };
+            atomic<bool> aborted{ false }, stopped_by_callback{ false };
+
+            optional<NumaPlacement<Bitset_> > numa_placement;
+            if (params.numa)
+                numa_placement.emplace(model, n_threads);
+
+            auto work_function = [&] (unsigned t) -> void {
+                HomomorphismResult thread_result;
+
+                // our searcher already exists, but our domains and the
+                // target rows can still be local
+                if (numa_placement)
+                    searchers[t]->set_target_rows(numa_placement->place(t, thread_result.extra_stats));
+
+                auto search_start_allocations = allocations_on_this_thread();
+
+                Domains domains = common_domains;
+                HomomorphismAssignments assignments;
+                assignments.reserve(model.pattern_size);
+                NoRestartsSchedule no_restarts;
+
+                unsigned long long work_stolen = 0;
+                StolenWork work;
+                bool have_work = (0 == t), whole_tree = (0 == t);
+
+                // everyone does the same root propagation, so that stolen
+                // decisions can be replayed from the same place
+                ++thread_result.propagations;
+                if (! searchers[t]->propagate(true, domains, assignments, params.propagate_using_lackey != PropagateUsingLackey::Never)) {
+                    if (0 == t)
+                        --busy;
+                    have_work = false;
+                }
+
+                while (true) {
+                    if (have_work) {
+                        auto assignments_copy = assignments;
+                        assignments_copy.reserve(model.pattern_size);
+
+                        auto result = whole_tree
+                            ? searchers[t]->restarting_search(assignments_copy, domains, thread_result.nodes, thread_result.propagations,
+                                    thread_result.solution_count, 0, no_restarts)
+                            : searchers[t]->search_stolen_work(work, assignments_copy, domains, thread_result.nodes, thread_result.propagations,
+                                    thread_result.solution_count, no_restarts);
+                        whole_tree = false;
+                        --busy;
+
+                        if (SearchResult::Satisfiable == result) {
+                            // the enumerate callback asked us to stop
+                            searchers[t]->save_result(assignments_copy, thread_result);
+                            stopped_by_callback = true;
+                            params.timeout->trigger_early_abort();
+                            break;
+                        }
+                        else if (SearchResult::Aborted == result) {
+                            aborted = true;
+                            break;
+                        }
+                    }
+
+                    // look for more work, starting with our neighbours
+                    have_work = false;
+                    for (unsigned u = 1 ; u < n_threads && ! have_work ; ++u)
+                        have_work = searchers[(t + u) % n_threads]->share_work(work, busy);
+
+                    if (have_work)
+                        ++work_stolen;
+                    else if (0 == busy.load())
+                        break;
+                    else if (params.timeout->should_abort()) {
+                        aborted = true;
+                        break;
+                    }
+                    else
+                        sleep_for(100us);
+                }
+
+                thread_result.extra_stats.emplace_back("search_allocations = " + to_string(allocations_on_this_thread() - search_start_allocations));
+                thread_result.extra_stats.emplace_back("work_stolen = " + to_string(work_stolen));
+                searchers[t]->add_extra_stats(thread_result.extra_stats);
+
+                unique_lock<mutex> lock{ common_result_mutex };
+                if (! thread_result.mapping.empty())
+                    common_result.mapping = move(thread_result.mapping);
+                common_result.nodes += thread_result.nodes;
+                common_result.propagations += thread_result.propagations;
+                common_result.solution_count += thread_result.solution_count;
+                for (auto & x : thread_result.extra_stats)
+                    common_result.extra_stats.push_back("t" + to_string(t) + "_" + x);
+
+                by_thread_nodes.append(" " + to_string(thread_result.nodes));
+            };
+
+            vector<thread> threads;
+            for (unsigned t = 0 ; t < n_threads ; ++t)
+                threads.emplace_back([&, t] () { work_function(t); });
+            for (auto & th : threads)
+                th.join();
+
+            common_result.complete = stopped_by_callback || ! aborted;
+
+            if (numa_placement)
+                numa_placement->add_extra_stats(common_result.extra_stats);
             common_result.extra_stats.emplace_back("by_thread_nodes =" + by_thread_nodes);
-            common_result.extra_stats.emplace_back("by_thread_propagations =" + by_thread_propagations);
             common_result.extra_stats.emplace_back("search_time = " + to_string(
                         duration_cast<milliseconds>(steady_clock::now() - search_start_time).count()));
 
             return common_result;
         }
     };
+
+    // What each worker process tells the parent. This lives in shared memory,
+    // so it survives the worker dying, and must only hold atomics. The
+    // heartbeat is only updated between restarts, so the parent also treats
+    // search progress as a sign of life.
+    struct alignas(64) WorkerStatus
+    {
+        atomic<unsigned long long> heartbeat{ 0 }, nodes{ 0 }, propagations{ 0 }, restarts{ 0 },
+            nogoods_exported{ 0 }, nogoods_imported{ 0 };
+        HomomorphismProgress progress;
+    };
+
+    // How the search ended, also in shared memory. Whoever claims the result
+    // fills in the mapping before saying it's ready, so if a worker dies half
+    // way through, we just don't have a result.
+    struct SharedSearchState
+    {
+        atomic<bool> stop{ false };
+        atomic<int> claimed_by{ -1 };
+        atomic<bool> result_ready{ false };
+        bool satisfiable = false;
+        unsigned mapping_size = 0;
+    };
+
+    auto milliseconds_now() -> unsigned long long
+    {
+        return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Like ThreadedSolver, but with forked worker processes rather than
+    // threads, so that a worker that crashes, is killed for using too much
+    // memory, or hangs, can't take the search down with it. The model is
+    // built before forking, so every worker sees it (and its target rows)
+    // through the same copy-on-write mapping, and never writes to it. The
+    // nogood rings, the result, and a stop flag live in shared memory.
+    template <typename Bitset_>
+    struct MultiProcessSolver : HomomorphismSolver<Bitset_>
+    {
+        using HomomorphismSolver<Bitset_>::model;
+        using HomomorphismSolver<Bitset_>::params;
+        using typename HomomorphismSolver<Bitset_>::Domains;
+
+        unsigned n_workers;
+
+        MultiProcessSolver(const HomomorphismModel<Bitset_> & m, const HomomorphismParams & p, unsigned n) :
+            HomomorphismSolver<Bitset_>(m, p),
+            n_workers(n)
+        {
+        }
+
+        // runs in the child, and never returns
+        [[ noreturn ]] auto work(unsigned w, const Domains & common_domains, SharedSearchState & state, WorkerStatus & status,
+                vector<unique_ptr<NogoodRing<HomomorphismAssignment> > > & rings, int * mapping_from, int * mapping_to) -> void
+        {
+            int exit_status = EXIT_SUCCESS;
+            atomic<bool> finished{ false };
+
+            // we have our own copy of the timeout, which nobody else will
+            // trigger, so keep an eye out for someone else finishing, or for
+            // the parent going away
+            pid_t parent = getppid();
+            thread watcher([&] () {
+                    while (! finished.load()) {
+                        if (state.stop.load() || getppid() != parent) {
+                            params.timeout->trigger_early_abort();
+                            break;
+                        }
+                        sleep_for(10ms);
+                    }
+                    });
+
+            try {
+                HomomorphismSearcher<Bitset_> searcher(model, params, [] (const HomomorphismAssignments &) -> bool { return true; });
+                if (0 != w)
+                    searcher.set_seed(w);
+                if (params.portfolio) {
+                    auto configuration = portfolio_configuration(params, w);
+                    searcher.set_value_ordering(configuration.value_ordering);
+                    searcher.set_use_supplemental_graphs(configuration.supplemental_graphs);
+                }
+
+                // not owned, it lives in shared memory
+                searcher.set_progress(shared_ptr<HomomorphismProgress>{ shared_ptr<void>{ }, &status.progress });
+
+                auto & watches = searcher.watches;
+                unique_ptr<RestartsSchedule> restarts_schedule{ params.restarts_schedule->clone() };
+
+                Domains domains = common_domains;
+                HomomorphismAssignments assignments;
+                assignments.reserve(model.pattern_size);
+
+                HomomorphismResult worker_result;
+                vector<HomomorphismAssignment> unexported_literals, scratch;
+                vector<unsigned> unexported_ends;
+
+                auto claim = [&] (bool satisfiable) {
+                    int nobody = -1;
+                    if (state.claimed_by.compare_exchange_strong(nobody, w)) {
+                        state.satisfiable = satisfiable;
+                        unsigned n = 0;
+                        for (auto & [ p, t ] : worker_result.mapping)
+                            if (n < model.pattern_size) {
+                                mapping_from[n] = p;
+                                mapping_to[n] = t;
+                                ++n;
+                            }
+                        state.mapping_size = n;
+                        state.result_ready.store(true, std::memory_order_release);
+                    }
+                    state.stop = true;
+                };
+
+                while (! state.stop.load()) {
+                    status.heartbeat = milliseconds_now();
+
+                    // export anything new, and hang on to anything that
+                    // doesn't fit yet
+                    for (auto & n : watches.need_to_watch) {
+                        if (watches.nogood_size(n) > params.shared_nogood_size_limit)
+                            continue;
+                        unexported_literals.insert(unexported_literals.end(), watches.nogood_literals(n), watches.nogood_literals(n) + watches.nogood_size(n));
+                        unexported_ends.push_back(unexported_literals.size());
+                    }
+
+                    unsigned start = 0, n_exported = 0;
+                    for ( ; n_exported < unexported_ends.size() ; ++n_exported) {
+                        if (! rings[w]->post(unexported_literals.data() + start, unexported_ends[n_exported] - start))
+                            break;
+                        start = unexported_ends[n_exported];
+                    }
+                    status.nogoods_exported += n_exported;
+                    unexported_literals.erase(unexported_literals.begin(), unexported_literals.begin() + start);
+                    unexported_ends.erase(unexported_ends.begin(), unexported_ends.begin() + n_exported);
+                    for (auto & e : unexported_ends)
+                        e -= start;
+
+                    for (unsigned u = 0 ; u < n_workers ; ++u)
+                        if (w != u)
+                            rings[u]->read_new(w, scratch, [&] (const HomomorphismAssignment * literals, unsigned size) {
+                                    watches.gather_nogood(literals, size);
+                                    ++status.nogoods_imported;
+                                    });
+
+                    if (watches.apply_new_nogoods(
+                                [&] (const HomomorphismAssignment & assignment) {
+                                    auto & values = domains.values[assignment.pattern_vertex];
+                                    values.reset(assignment.target_vertex);
+                                    domains.counts[assignment.pattern_vertex] = values.count();
+                                })) {
+                        claim(false);
+                        break;
+                    }
+
+                    watches.clear_new_nogoods();
+                    watches.reduce(params.nogood_memory_limit);
+
+                    ++worker_result.propagations;
+                    if (searcher.propagate(true, domains, assignments, params.propagate_using_lackey != PropagateUsingLackey::Never)) {
+                        auto assignments_copy = assignments;
+                        assignments_copy.reserve(model.pattern_size);
+
+                        auto result = searcher.restarting_search(assignments_copy, domains, worker_result.nodes, worker_result.propagations,
+                                worker_result.solution_count, 0, *restarts_schedule);
+
+                        if (SearchResult::Satisfiable == result) {
+                            searcher.save_result(assignments_copy, worker_result);
+                            claim(true);
+                        }
+                        else if (SearchResult::Unsatisfiable == result || SearchResult::UnsatisfiableAndBackjumpUsingLackey == result)
+                            claim(false);
+                        else if (SearchResult::Restart != result) {
+                            // aborted, or keep going, which only happens when
+                            // counting, which we don't do
+                            break;
+                        }
+                    }
+                    else
+                        claim(false);
+
+                    status.nodes = worker_result.nodes;
+                    status.propagations = worker_result.propagations;
+                    ++status.restarts;
+                    restarts_schedule->did_a_restart();
+                }
+
+                status.nodes = worker_result.nodes;
+                status.propagations = worker_result.propagations;
+            }
+            catch (...) {
+                exit_status = EXIT_FAILURE;
+            }
+
+            finished = true;
+            watcher.join();
+
+            // don't run any destructors or atexit handlers that belong to
+            // the parent, such as the timeout's
+            _exit(exit_status);
+        }
+
+        auto solve() -> HomomorphismResult
+        {
+            HomomorphismResult result;
+
+            Domains common_domains(model.pattern_size, model.target_size);
+            if (! model.initialise_domains(common_domains)) {
+                result.complete = true;
+                return result;
+            }
+
+            auto search_start_time = steady_clock::now();
+
+            unsigned capacity = max(1u << 16, 4 * (model.pattern_size + 1));
+            SharedMemory shared{ (1u << 16) + sizeof(SharedSearchState) + n_workers * sizeof(WorkerStatus) + 2 * sizeof(int) * model.pattern_size
+                + n_workers * NogoodRing<HomomorphismAssignment>::bytes_needed(capacity, n_workers) };
+
+            auto & state = *shared.make<SharedSearchState>();
+            auto statuses = shared.make_array<WorkerStatus>(n_workers);
+            auto mapping_from = shared.make_array<int>(model.pattern_size);
+            auto mapping_to = shared.make_array<int>(model.pattern_size);
+
+            vector<unique_ptr<NogoodRing<HomomorphismAssignment> > > rings;
+            for (unsigned w = 0 ; w < n_workers ; ++w)
+                rings.push_back(make_unique<NogoodRing<HomomorphismAssignment> >(capacity, n_workers, w,
+                            shared.allocate(NogoodRing<HomomorphismAssignment>::bytes_needed(capacity, n_workers))));
+
+            // a child of a process with other threads can only safely call
+            // async-signal-safe functions, and our workers do much more than
+            // that, so the timeout's thread has to go, and we keep an eye on
+            // the time limit ourselves instead
+            auto deadline = params.timeout->hand_over_deadline();
+            if (threads_in_this_process() > 1)
+                throw UnsupportedConfiguration{ "Multi-process search must be started from a process with no other threads" };
+
+            // start everyone
+            vector<pid_t> pids(n_workers, -1);
+            vector<string> how_ended(n_workers);
+            vector<unsigned long long> nodes_last_seen(n_workers, 0), last_sign_of_life(n_workers, milliseconds_now());
+            unsigned workers_lost = 0, workers_running = 0;
+            for (unsigned w = 0 ; w < n_workers ; ++w) {
+                statuses[w].heartbeat = milliseconds_now();
+                pid_t pid = fork();
+                if (0 == pid)
+                    work(w, common_domains, state, statuses[w], rings, mapping_from, mapping_to);
+                else if (-1 == pid) {
+                    how_ended[w] = "fork_failed";
+                    ++workers_lost;
+                    for (auto & r : rings)
+                        r->ignore_reader(w);
+                }
+                else {
+                    pids[w] = pid;
+                    ++workers_running;
+                }
+            }
+
+            // see what happens to each worker, and write off anything that
+            // dies or hangs, so that the others don't wait to share with it
+            auto reap = [&] (unsigned w, int wait_status) {
+                pids[w] = -1;
+                --workers_running;
+                if (how_ended[w].empty()) {
+                    if (WIFEXITED(wait_status) && EXIT_SUCCESS == WEXITSTATUS(wait_status))
+                        how_ended[w] = "exited";
+                    else {
+                        how_ended[w] = WIFSIGNALED(wait_status) ? "signal_" + to_string(WTERMSIG(wait_status))
+                            : "exit_status_" + to_string(WEXITSTATUS(wait_status));
+                        ++workers_lost;
+                    }
+                }
+                for (auto & r : rings)
+                    r->ignore_reader(w);
+            };
+
+            while (workers_running > 0 && ! state.stop.load()) {
+                if (deadline && system_clock::now() >= *deadline)
+                    params.timeout->expire();
+                if (params.timeout->should_abort())
+                    break;
+
+                for (unsigned w = 0 ; w < n_workers ; ++w) {
+                    if (-1 == pids[w])
+                        continue;
+
+                    // read the clock last, so that nothing is in its future
+                    auto heartbeat = statuses[w].heartbeat.load();
+                    auto nodes = statuses[w].progress.nodes.load();
+                    auto now = milliseconds_now();
+                    if (nodes != nodes_last_seen[w]) {
+                        nodes_last_seen[w] = nodes;
+                        last_sign_of_life[w] = now;
+                    }
+                    last_sign_of_life[w] = max(last_sign_of_life[w], heartbeat);
+
+                    int wait_status = 0;
+                    if (pids[w] == waitpid(pids[w], &wait_status, WNOHANG))
+                        reap(w, wait_status);
+                    else if (0 != params.worker_hang_timeout && how_ended[w].empty() &&
+                            now - last_sign_of_life[w] > 1000ull * params.worker_hang_timeout) {
+                        how_ended[w] = "killed_after_hanging";
+                        ++workers_lost;
+                        kill(pids[w], SIGKILL);
+                    }
+                }
+
+                sleep_for(10ms);
+            }
+
+            // tell everyone to stop, give them a moment, and then make sure
+            state.stop = true;
+            auto give_up_waiting_at = steady_clock::now() + 1000ms;
+            while (workers_running > 0) {
+                for (unsigned w = 0 ; w < n_workers ; ++w) {
+                    int wait_status = 0;
+                    if (-1 != pids[w] && pids[w] == waitpid(pids[w], &wait_status, WNOHANG))
+                        reap(w, wait_status);
+                }
+
+                if (workers_running > 0 && steady_clock::now() > give_up_waiting_at) {
+                    for (unsigned w = 0 ; w < n_workers ; ++w)
+                        if (-1 != pids[w]) {
+                            how_ended[w] = "killed_after_stopping";
+                            kill(pids[w], SIGKILL);
+                            int wait_status = 0;
+                            waitpid(pids[w], &wait_status, 0);
+                            reap(w, wait_status);
+                        }
+                }
+                else
+                    sleep_for(1ms);
+            }
+
+            if (state.result_ready.load(std::memory_order_acquire)) {
+                result.complete = true;
+                if (state.satisfiable)
+                    for (unsigned n = 0 ; n < state.mapping_size ; ++n)
+                        result.mapping.emplace(mapping_from[n], mapping_to[n]);
+                result.extra_stats.emplace_back("winning_worker = " + to_string(state.claimed_by.load()));
+            }
+            else if (! params.timeout->should_abort()) {
+                // nobody finished and we weren't told to stop, so everyone
+                // was lost, and saying there's no solution would be a lie
+                string how;
+                for (unsigned w = 0 ; w < n_workers ; ++w)
+                    how.append(" w" + to_string(w) + "=" + how_ended[w]);
+                throw WorkersLostError{ "All " + to_string(n_workers) + " worker processes were lost before the search finished:" + how };
+            }
+
+            string by_worker_nodes;
+            for (unsigned w = 0 ; w < n_workers ; ++w) {
+                result.nodes += statuses[w].nodes;
+                result.propagations += statuses[w].propagations;
+                by_worker_nodes.append(" " + to_string(statuses[w].nodes.load()));
+                result.extra_stats.emplace_back("w" + to_string(w) + "_ended = " + how_ended[w]);
+                result.extra_stats.emplace_back("w" + to_string(w) + "_restarts = " + to_string(statuses[w].restarts.load()));
+                result.extra_stats.emplace_back("w" + to_string(w) + "_nogoods_exported = " + to_string(statuses[w].nogoods_exported.load()));
+                result.extra_stats.emplace_back("w" + to_string(w) + "_nogoods_imported = " + to_string(statuses[w].nogoods_imported.load()));
+            }
+
+            result.extra_stats.emplace_back("workers = " + to_string(n_workers));
+            result.extra_stats.emplace_back("workers_lost = " + to_string(workers_lost));
+            result.extra_stats.emplace_back("shared_memory_bytes = " + to_string(shared.size()));
+            result.extra_stats.emplace_back("by_worker_nodes =" + by_worker_nodes);
+            result.extra_stats.emplace_back("search_time = " + to_string(
+                        duration_cast<milliseconds>(steady_clock::now() - search_start_time).count()));
+
+            return result;
+        }
+    };
+
+    template <typename Bitset_>
+    auto solve_using_model(const InputGraph & target, const InputGraph & pattern, const HomomorphismParams & params) -> HomomorphismResult
+    {
+        HomomorphismModel<Bitset_> model(target, pattern, params);
+
+        if (! model.prepare()) {
+            HomomorphismResult result;
+            result.extra_stats.emplace_back("model_consistent = false");
+            result.complete = true;
+            if (params.proof)
+                params.proof->finish_unsat_proof();
+            return result;
+        }
+
+        if ((! params.checkpoint_file.empty() || ! params.resume_from.empty())) {
+            if (1 != params.n_threads || 1 != params.n_processes)
+                throw UnsupportedConfiguration{ "Checkpointing can only be used with sequential search" };
+            if (! might_have_watches(params))
+                throw UnsupportedConfiguration{ "Checkpointing requires restarts" };
+            if (params.proof)
+                throw UnsupportedConfiguration{ "Checkpointing cannot be used with proof logging" };
+        }
+
+        // with counting, everyone has to see the whole tree, so nobody can win
+        if (params.portfolio && params.count_solutions)
+            throw UnsupportedConfiguration{ "Portfolio search cannot be used when counting solutions" };
+
+        HomomorphismResult result;
+        if (1 != params.n_processes) {
+            if (1 != params.n_threads)
+                throw UnsupportedConfiguration{ "Cannot use both threads and processes" };
+            if (params.count_solutions)
+                throw UnsupportedConfiguration{ "Multi-process search cannot be used when counting solutions" };
+            if (params.deterministic)
+                throw UnsupportedConfiguration{ "Multi-process search cannot be deterministic" };
+            if (params.lackey)
+                throw UnsupportedConfiguration{ "Multi-process search cannot be used with a lackey" };
+            if (! params.restarts_schedule->might_restart())
+                throw UnsupportedConfiguration{ "Multi-process search requires restarts" };
+
+            MultiProcessSolver<Bitset_> solver(model, params, how_many_threads(params.n_processes));
+            result = solver.solve();
+        }
+        else if (1 == params.n_threads) {
+            string fingerprint;
+            if (! params.checkpoint_file.empty() || ! params.resume_from.empty())
+                fingerprint = checkpoint_fingerprint(pattern, target, model, params);
+
+            SequentialSolver<Bitset_> solver(model, params, fingerprint);
+            result = solver.solve();
+        }
+        else if (params.count_solutions && ! params.deterministic && ! params.restarts_schedule->might_restart()) {
+            WorkStealingSolver<Bitset_> solver(model, params, how_many_threads(params.n_threads));
+            result = solver.solve();
+        }
+        else {
+            if (! params.restarts_schedule->might_restart())
+                throw UnsupportedConfiguration{ "Threaded search requires restarts, unless counting solutions" };
+
+            unsigned n_threads = how_many_threads(params.n_threads);
+            ThreadedSolver<Bitset_> solver(model, params, n_threads);
+            result = solver.solve();
+        }
+
+        if (params.proof && result.complete && result.mapping.empty())
+            params.proof->finish_unsat_proof();
+
+        return result;
+    }
 }
 
 auto solve_homomorphism_problem(
@@ -408,8 +1541,12 @@ auto solve_homomorphism_problem(
         // but can be adapted to support most of them
         if (1 != params.n_threads)
             throw UnsupportedConfiguration{ "Proof logging cannot yet be used with threads" };
+        if (1 != params.n_processes)
+            throw UnsupportedConfiguration{ "Proof logging cannot yet be used with multiple processes" };
         if (params.clique_detection)
             throw UnsupportedConfiguration{ "Proof logging cannot yet be used with clique detection" };
+        if (! params.target_cache_file.empty() || params.in_memory_target_cache)
+            throw UnsupportedConfiguration{ "Proof logging cannot yet be used with a target cache" };
         if (params.lackey)
             throw UnsupportedConfiguration{ "Proof logging cannot yet be used with a lackey" };
         if (! params.pattern_less_constraints.empty() || ! params.target_occur_less_constraints.empty())
@@ -529,36 +1666,92 @@ auto solve_homomorphism_problem(
         return result;
     }
     else {
-        // just solve the problem
-        HomomorphismModel model(target, pattern, params);
+        // just solve the problem, using the narrowest bitsets that will do
+        return with_bitset_for_size(max(pattern.size(), target.size()), [&] (auto bitset_type) {
+                auto result = solve_using_model<typename decltype(bitset_type)::Type>(target, pattern, params);
+                result.extra_stats.emplace_back(string{ "bitset_type = " } + bitset_type.name);
+                result.extra_stats.emplace_back(string{ "bitset_kernels = " } + bitset_kernels.name);
+                return result;
+                });
+    }
+}
 
-        if (! model.prepare()) {
-            HomomorphismResult result;
-            result.extra_stats.emplace_back("model_consistent = false");
-            result.complete = true;
-            if (params.proof)
-                params.proof->finish_unsat_proof();
-            return result;
-        }
 
-        HomomorphismResult result;
-        if (1 == params.n_threads) {
-            SequentialSolver solver(model, params);
-            result = solver.solve();
-        }
-        else {
-            if (! params.restarts_schedule->might_restart())
-                throw UnsupportedConfiguration{ "Threaded search requires restarts" };
+auto prepare_target_cache(
+        const InputGraph & target,
+        const HomomorphismParams & params) -> void
+{
+    if (params.target_cache_file.empty() && ! params.in_memory_target_cache)
+        throw UnsupportedConfiguration{ "No target cache to prepare" };
+
+    // with no pattern vertices, preparing the model does nothing except build
+    // and save the target side
+    InputGraph no_pattern{ 0, false, false };
+    with_bitset_for_size(target.size(), [&] (auto bitset_type) {
+            HomomorphismModel<typename decltype(bitset_type)::Type> model(target, no_pattern, params);
+            model.prepare();
+            });
+}
 
-            unsigned n_threads = how_many_threads(params.n_threads);
-            ThreadedSolver solver(model, params, n_threads);
-            result = solver.solve();
-        }
+WorkersLostError::WorkersLostError(const string & message) noexcept :
+    _what(message)
+{
+}
 
-        if (params.proof && result.complete && result.mapping.empty())
-            params.proof->finish_unsat_proof();
+auto WorkersLostError::what() const noexcept -> const char *
+{
+    return _what.c_str();
+}
 
-        return result;
-    }
+auto copy_homomorphism_params(const HomomorphismParams & params) -> HomomorphismParams
+{
+    if (params.lackey)
+        throw UnsupportedConfiguration{ "A lackey cannot be shared between problems" };
+    if (params.proof)
+        throw UnsupportedConfiguration{ "Proof logging cannot be shared between problems" };
+    if (! params.extra_shapes.empty())
+        throw UnsupportedConfiguration{ "Extra shapes cannot be shared between problems" };
+
+    HomomorphismParams result;
+    result.timeout = params.timeout;
+    result.start_time = params.start_time;
+    result.induced = params.induced;
+    result.injectivity = params.injectivity;
+    result.count_solutions = params.count_solutions;
+    result.enumerate_callback = params.enumerate_callback;
+    result.progress = params.progress;
+    result.value_ordering_heuristic = params.value_ordering_heuristic;
+    if (params.restarts_schedule)
+        result.restarts_schedule.reset(params.restarts_schedule->clone());
+    result.nogood_size_limit = params.nogood_size_limit;
+    result.minimise_nogoods = params.minimise_nogoods;
+    result.nogood_memory_limit = params.nogood_memory_limit;
+    result.n_threads = params.n_threads;
+    result.n_processes = params.n_processes;
+    result.worker_hang_timeout = params.worker_hang_timeout;
+    result.delay_thread_creation = params.delay_thread_creation;
+    result.triggered_restarts = params.triggered_restarts;
+    result.deterministic = params.deterministic;
+    result.portfolio = params.portfolio;
+    result.numa = params.numa;
+    result.shared_nogood_size_limit = params.shared_nogood_size_limit;
+    result.clique_detection = params.clique_detection;
+    result.distance3 = params.distance3;
+    result.k4 = params.k4;
+    result.no_supplementals = params.no_supplementals;
+    result.number_of_exact_path_graphs = params.number_of_exact_path_graphs;
+    result.clique_size_constraints = params.clique_size_constraints;
+    result.clique_size_constraints_on_supplementals = params.clique_size_constraints_on_supplementals;
+    result.no_nds = params.no_nds;
+    result.pattern_less_constraints = params.pattern_less_constraints;
+    result.target_occur_less_constraints = params.target_occur_less_constraints;
+    result.send_partials_to_lackey = params.send_partials_to_lackey;
+    result.propagate_using_lackey = params.propagate_using_lackey;
+    result.checkpoint_file = params.checkpoint_file;
+    result.checkpoint_interval = params.checkpoint_interval;
+    result.resume_from = params.resume_from;
+    result.target_cache_file = params.target_cache_file;
+    result.in_memory_target_cache = params.in_memory_target_cache;
+    return result;
 }
 
@@ -11,7 +11,10 @@
 #include "value_ordering.hh"
 #include "vertex_to_vertex_mapping.hh"
 #include "proof-fwd.hh"
+#include "target_cache-fwd.hh"
 
+#include <atomic>
+#include <exception>
 #include <functional>
 #include <list>
 #include <memory>
@@ -32,6 +35,21 @@ enum class PropagateUsingLackey
     RootAndBackjump
 };
 
+/**
+ * Counters that a search updates as it goes, so that another thread can
+ * watch how far it has got. Nodes are added in batches, so lag a little, and
+ * the result has the exact numbers at the end.
+ */
+struct HomomorphismProgress
+{
+    static constexpr unsigned long long node_batch_size = 1024;
+
+    std::atomic<unsigned long long> nodes{ 0 };
+
+    /// only counted as they are found when counting solutions
+    std::atomic<unsigned long long> solutions{ 0 };
+};
+
 struct HomomorphismParams
 {
     /// Timeout handler
@@ -52,6 +70,9 @@ struct HomomorphismParams
     /// Print solutions, for enumerating
     std::function<auto (const VertexToVertexMapping &) -> bool> enumerate_callback;
 
+    /// If not null, updated as the search goes (but not by worker processes)
+    std::shared_ptr<HomomorphismProgress> progress;
+
     /// Which value-ordering heuristic?
     ValueOrdering value_ordering_heuristic = ValueOrdering::Biased;
 
@@ -61,16 +82,51 @@ struct HomomorphismParams
     /// Largest size of nogood to store (0 disables nogoods)
     unsigned nogood_size_limit = std::numeric_limits<unsigned>::max();
 
+    /// Try to drop literals from nogoods before storing them? Off by default,
+    /// because on random instances it doesn't save any nodes, and costs time.
+    bool minimise_nogoods = false;
+
+    /// Throw away less useful nogoods if they use more than this many bytes (0 for no
+    /// limit). Ignored when counting solutions, where every nogood is needed.
+    unsigned long long nogood_memory_limit = 1ull << 30;
+
     /// How many threads to use (1 for sequential, 0 to auto-detect). Must be
     /// used in conjunction with restarts.
     unsigned n_threads = 1;
 
+    /// How many worker processes to use instead of threads (1 to not fork,
+    /// 0 to auto-detect). Must be used in conjunction with restarts, and the
+    /// solve must be started from a process with no other threads, apart
+    /// from the timeout's own thread, which is stopped before forking.
+    unsigned n_processes = 1;
+
+    /// With worker processes, kill any that go this many seconds without
+    /// restarting or making progress (0 to never do this). If every worker
+    /// is lost, the solve throws WorkersLostError.
+    unsigned worker_hang_timeout = 0;
+
     /// Do one restart before launching remaining threads?
     bool delay_thread_creation = false;
 
     /// Trigger restarts using the first thread?
     bool triggered_restarts = false;
 
+    /// Make threaded search reproducible? This needs a restarts schedule that
+    /// doesn't depend upon time.
+    bool deterministic = false;
+
+    /// Have threads search in different ways (value ordering, restarts,
+    /// supplemental graphs), rather than differing only by random seed?
+    bool portfolio = false;
+
+    /// Pin threads to CPUs, grouped by NUMA node, and give each node its own
+    /// copy of the target graph rows?
+    bool numa = false;
+
+    /// Largest size of nogood to share between threads. Ignored when counting
+    /// solutions, where every nogood must be shared.
+    unsigned shared_nogood_size_limit = std::numeric_limits<unsigned>::max();
+
     /// Are we allowed to do clique detection?
     bool clique_detection = true;
 
@@ -113,6 +169,24 @@ struct HomomorphismParams
     /// Propagate using the lackey?
     PropagateUsingLackey propagate_using_lackey = PropagateUsingLackey::Never;
 
+    /// If not empty, periodically save enough to carry on with the search
+    /// to this file, between restarts.
+    std::string checkpoint_file;
+
+    /// Seconds between checkpoints.
+    unsigned checkpoint_interval = 60;
+
+    /// If not empty, carry on from this checkpoint.
+    std::string resume_from;
+
+    /// If not empty, take the target side of the model from this file, or
+    /// build it as usual and save it here if the file is missing or out of date.
+    std::string target_cache_file;
+
+    /// If not null, used instead of target_cache_file, for a target that is
+    /// solved against many times by this process.
+    std::shared_ptr<InMemoryTargetCache> in_memory_target_cache;
+
     /// Optional proof handler
     std::shared_ptr<Proof> proof;
 };
@@ -138,9 +212,43 @@ struct HomomorphismResult
     bool complete = false;
 };
 
+/**
+ * Thrown if every worker process dies or hangs before the search finishes, so
+ * that we don't know the answer.
+ */
+class WorkersLostError :
+    public std::exception
+{
+    private:
+        std::string _what;
+
+    public:
+        explicit WorkersLostError(const std::string & message) noexcept;
+
+        auto what() const noexcept -> const char * override;
+};
+
 auto solve_homomorphism_problem(
         const InputGraph & pattern,
         const InputGraph & target,
         const HomomorphismParams & params) -> HomomorphismResult;
 
+/**
+ * Build the target side of the model, as it would be for an undirected,
+ * unlabelled pattern, and save it to the target cache that params names, so
+ * that solves that follow can all use it, rather than all building it at
+ * once. Does nothing if the cache is already good.
+ */
+auto prepare_target_cache(
+        const InputGraph & target,
+        const HomomorphismParams & params) -> void;
+
+/**
+ * A copy of params, for solving another problem with the same settings. The
+ * restarts schedule is cloned, and the timeout and callback are shared, so
+ * callers will usually want to replace those. Throws UnsupportedConfiguration
+ * if there is a lackey, a proof or extra shapes, which belong to one problem.
+ */
+auto copy_homomorphism_params(const HomomorphismParams & params) -> HomomorphismParams;
+
 #endif
@@ -0,0 +1,208 @@
+/* vim: set sw=4 sts=4 et foldmethod=syntax : */
+
+#include "homomorphism_batch.hh"
+#include "homomorphism_prefilter.hh"
+#include "configuration.hh"
+#include "target_cache.hh"
+#include "thread_utils.hh"
+#include "timeout.hh"
+#include "verify.hh"
+
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using std::current_exception;
+using std::exception;
+using std::exception_ptr;
+using std::function;
+using std::make_shared;
+using std::make_unique;
+using std::mutex;
+using std::optional;
+using std::rethrow_exception;
+using std::string;
+using std::thread;
+using std::unique_lock;
+using std::vector;
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+
+namespace
+{
+    auto check_batch_params(const HomomorphismParams & params) -> void
+    {
+        if (1 != params.n_processes)
+            throw UnsupportedConfiguration{ "Batch mode cannot be used with multiple processes" };
+        if (! params.checkpoint_file.empty() || ! params.resume_from.empty())
+            throw UnsupportedConfiguration{ "Batch mode cannot be used with checkpointing" };
+    }
+
+    // hand out files to workers, get solve to fill in a result for each, and
+    // report them one at a time. If next_file throws, that becomes an error
+    // for the item it was getting. If report throws, nothing more is handed
+    // out, and the first such exception is thrown again once everyone stops.
+    auto run_batch_workers(
+            const function<auto () -> optional<string> > & next_file,
+            unsigned n_workers,
+            const function<auto (HomomorphismBatchResult &) -> void> & solve,
+            const function<auto (const HomomorphismBatchResult &) -> void> & report) -> void
+    {
+        mutex next_mutex, report_mutex;
+        unsigned next_index = 0;
+        bool give_up = false;
+        exception_ptr report_failure;
+
+        // returns false if there was nothing left to do
+        auto solve_next = [&] (unsigned worker) -> bool {
+            HomomorphismBatchResult r;
+            r.worker = worker;
+
+            {
+                unique_lock<mutex> lock{ next_mutex };
+                if (give_up)
+                    return false;
+
+                try {
+                    auto file = next_file();
+                    if (! file)
+                        return false;
+                    r.file = *file;
+                }
+                catch (const exception & e) {
+                    r.error = e.what();
+                }
+                r.index = next_index++;
+            }
+
+            if (r.error.empty()) {
+                try {
+                    solve(r);
+                }
+                catch (const exception & e) {
+                    r.error = e.what();
+                }
+            }
+
+            try {
+                unique_lock<mutex> lock{ report_mutex };
+                report(r);
+            }
+            catch (...) {
+                unique_lock<mutex> lock{ next_mutex };
+                if (! report_failure)
+                    report_failure = current_exception();
+                give_up = true;
+                return false;
+            }
+
+            return true;
+        };
+
+        auto work = [&] (unsigned worker) {
+            while (solve_next(worker))
+                ;
+        };
+
+        vector<thread> workers;
+        for (unsigned w = 1, w_end = how_many_threads(n_workers) ; w < w_end ; ++w)
+            workers.emplace_back(work, w);
+        work(0);
+
+        for (auto & w : workers)
+            w.join();
+
+        if (report_failure)
+            rethrow_exception(report_failure);
+    }
+
+    auto solve_one(const InputGraph & pattern, const InputGraph & target, const HomomorphismParams & params,
+            seconds timeout, HomomorphismBatchResult & r) -> void
+    {
+        auto problem_params = copy_homomorphism_params(params);
+        problem_params.timeout = make_shared<Timeout>(timeout);
+        problem_params.start_time = steady_clock::now();
+        r.result = solve_homomorphism_problem(pattern, target, problem_params);
+        problem_params.timeout->stop();
+        r.aborted = problem_params.timeout->aborted();
+        r.solve_time = duration_cast<milliseconds>(steady_clock::now() - problem_params.start_time);
+
+        verify_homomorphism(pattern, target, params.injectivity == Injectivity::Injective,
+                params.injectivity == Injectivity::LocallyInjective, params.induced, r.result.mapping);
+    }
+
+    auto read_one(const function<auto (const string &) -> InputGraph> & read, HomomorphismBatchResult & r) -> void
+    {
+        auto read_start_time = steady_clock::now();
+        r.graph = make_unique<InputGraph>(read(r.file));
+        r.read_time = duration_cast<milliseconds>(steady_clock::now() - read_start_time);
+    }
+
+    auto reject(const char * rejected_by, HomomorphismBatchResult & r) -> void
+    {
+        r.rejected_by = rejected_by;
+        r.result.complete = true;
+    }
+}
+
+auto solve_homomorphism_batch(
+        const InputGraph & target,
+        const function<auto () -> optional<string> > & next_pattern_file,
+        const function<auto (const string &) -> InputGraph> & read_pattern,
+        const HomomorphismParams & params,
+        seconds timeout_per_pattern,
+        unsigned n_workers,
+        const function<auto (const HomomorphismBatchResult &) -> void> & report) -> void
+{
+    check_batch_params(params);
+
+    auto batch_params = copy_homomorphism_params(params);
+    if (batch_params.target_cache_file.empty())
+        batch_params.in_memory_target_cache = make_shared<InMemoryTargetCache>();
+
+    // build the target side of the model before any workers start, rather
+    // than having all of them build it at once
+    prepare_target_cache(target, batch_params);
+
+    auto target_summary = summarise_for_prefilter(target);
+
+    run_batch_workers(next_pattern_file, n_workers, [&] (HomomorphismBatchResult & r) {
+            read_one(read_pattern, r);
+            if (auto rejected_by = prefilter_homomorphism_problem(summarise_for_prefilter(*r.graph), target_summary, params))
+                reject(rejected_by, r);
+            else
+                solve_one(*r.graph, target, batch_params, timeout_per_pattern, r);
+            }, report);
+}
+
+auto solve_homomorphism_database(
+        const InputGraph & pattern,
+        const function<auto () -> optional<string> > & next_target_file,
+        const function<auto (const string &) -> InputGraph> & read_target,
+        const HomomorphismParams & params,
+        seconds timeout_per_target,
+        unsigned n_workers,
+        const function<auto (const HomomorphismBatchResult &) -> void> & report) -> void
+{
+    check_batch_params(params);
+
+    // every target is different, so there's no point in caching them
+    auto database_params = copy_homomorphism_params(params);
+    database_params.target_cache_file.clear();
+    database_params.in_memory_target_cache = nullptr;
+
+    auto pattern_summary = summarise_for_prefilter(pattern);
+
+    run_batch_workers(next_target_file, n_workers, [&] (HomomorphismBatchResult & r) {
+            read_one(read_target, r);
+            if (auto rejected_by = prefilter_homomorphism_problem(pattern_summary, summarise_for_prefilter(*r.graph), params))
+                reject(rejected_by, r);
+            else
+                solve_one(pattern, *r.graph, database_params, timeout_per_target, r);
+            }, report);
+}
+
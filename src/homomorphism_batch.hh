@@ -0,0 +1,87 @@
+/* vim: set sw=4 sts=4 et foldmethod=syntax : */
+
+#ifndef GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_HOMOMORPHISM_BATCH_HH
+#define GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_HOMOMORPHISM_BATCH_HH 1
+
+#include "formats/input_graph.hh"
+#include "homomorphism.hh"
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+
+/**
+ * What happened to one graph in a batch: a pattern, when solving many
+ * patterns against one target, or a target, when solving one pattern against
+ * a database of targets.
+ */
+struct HomomorphismBatchResult
+{
+    /// Where the graph came in the list, counting from zero.
+    unsigned index = 0;
+
+    std::string file;
+
+    /// The graph, if it could be read, so that the mapping can be named.
+    std::unique_ptr<InputGraph> graph;
+
+    HomomorphismResult result;
+
+    /// Did we run out of time on this graph?
+    bool aborted = false;
+
+    /// If not null, a prefilter showed there can't be a solution, without
+    /// building a model, and this is its name (see homomorphism_prefilter.hh).
+    const char * rejected_by = nullptr;
+
+    /// If not empty, the graph could not be read or solved, and this says why.
+    std::string error;
+
+    std::chrono::milliseconds read_time{ 0 }, solve_time{ 0 };
+
+    /// Which worker thread solved it.
+    unsigned worker = 0;
+};
+
+/**
+ * Solve many patterns against the same target, using n_workers threads that
+ * each take the next pattern from next_pattern_file until it returns
+ * nullopt. Each pattern gets its own copy of params (see
+ * copy_homomorphism_params), and its own timeout. The target side of the
+ * model is built before any workers start, and shared through the target
+ * cache file that params names, or through an InMemoryTargetCache if it
+ * doesn't name one; patterns whose parameters make a different target model
+ * (directed or labelled patterns, say) build that once more. Patterns are
+ * prefiltered against a summary of the target, and solutions are checked
+ * before being reported. report is called once per pattern, in the order the
+ * patterns finish, and never by more than one thread at once. If
+ * next_pattern_file throws, that is reported as an error for the pattern it
+ * was getting, and the batch carries on. If report throws, no more patterns
+ * are started, and the exception is thrown once the running ones finish.
+ */
+auto solve_homomorphism_batch(
+        const InputGraph & target,
+        const std::function<auto () -> std::optional<std::string> > & next_pattern_file,
+        const std::function<auto (const std::string &) -> InputGraph> & read_pattern,
+        const HomomorphismParams & params,
+        std::chrono::seconds timeout_per_pattern,
+        unsigned n_workers,
+        const std::function<auto (const HomomorphismBatchResult &) -> void> & report) -> void;
+
+/**
+ * The other way round: solve one pattern against many targets, in the same
+ * way. The pattern is summarised once, and most targets are expected to be
+ * rejected by the prefilters, without a model ever being built for them.
+ */
+auto solve_homomorphism_database(
+        const InputGraph & pattern,
+        const std::function<auto () -> std::optional<std::string> > & next_target_file,
+        const std::function<auto (const std::string &) -> InputGraph> & read_target,
+        const HomomorphismParams & params,
+        std::chrono::seconds timeout_per_target,
+        unsigned n_workers,
+        const std::function<auto (const HomomorphismBatchResult &) -> void> & report) -> void;
+
+#endif
@@ -5,20 +5,187 @@
 
 #include "svo_bitset.hh"
 
-struct HomomorphismDomain
+#include <utility>
+#include <vector>
+
+/**
+ * The domains of every pattern vertex, laid out as a structure of arrays. The
+ * remaining values for pattern vertex v are the bitset values[v], so the
+ * values form a matrix with one row per pattern vertex, and the counts and
+ * fixed flags are kept in their own dense arrays. With a FixedBitset the words
+ * of every row live in one contiguous block, so propagators that sweep over
+ * every domain walk through memory in order; an SVOBitset that is too big to
+ * store inline keeps its words in a separate allocation, so only the row
+ * headers are contiguous. Either way, picking a variable to branch on only
+ * needs to scan the counts.
+ */
+template <typename Bitset_>
+struct HomomorphismDomains
 {
-    unsigned v;
-    unsigned count;
-    bool fixed = false;
-    SVOBitset values;
+    std::vector<Bitset_> values;
+    std::vector<unsigned> counts;
+    std::vector<unsigned char> fixed;
+
+    HomomorphismDomains(unsigned pattern_size, unsigned target_size) :
+        values(pattern_size, Bitset_{ target_size, 0 }),
+        counts(pattern_size, 0),
+        fixed(pattern_size, false)
+    {
+    }
 
-    explicit HomomorphismDomain(unsigned s) :
-        values(s, 0)
+    auto size() const -> unsigned
     {
+        return counts.size();
     }
+};
+
+/**
+ * Some of the domains in a HomomorphismDomains, as a list of pattern vertices.
+ * Search uses this to hand propagators just the domains that are still in
+ * play at the current node, without copying the domains themselves. This
+ * does not own anything, and being const does not make the domains const.
+ * Search builds its lists in increasing order, so sweeping over a view goes
+ * through the matrix from front to back.
+ */
+template <typename Bitset_>
+class HomomorphismDomainsView
+{
+    private:
+        HomomorphismDomains<Bitset_> * _domains;
+        const unsigned * _vertices;
+        unsigned _size;
+
+    public:
+        HomomorphismDomainsView(HomomorphismDomains<Bitset_> & domains, const std::vector<unsigned> & vertices) :
+            _domains(&domains),
+            _vertices(vertices.data()),
+            _size(vertices.size())
+        {
+        }
+
+        /// the same domains, but a different selection of them
+        auto with_vertices(const std::vector<unsigned> & vertices) const -> HomomorphismDomainsView
+        {
+            return HomomorphismDomainsView{ *_domains, vertices };
+        }
+
+        auto begin() const -> const unsigned *
+        {
+            return _vertices;
+        }
+
+        auto end() const -> const unsigned *
+        {
+            return _vertices + _size;
+        }
+
+        auto size() const -> unsigned
+        {
+            return _size;
+        }
+
+        /// which pattern vertex is the ith domain in this view for?
+        auto operator[] (unsigned i) const -> unsigned
+        {
+            return _vertices[i];
+        }
+
+        auto values(unsigned v) const -> Bitset_ &
+        {
+            return _domains->values[v];
+        }
+
+        auto count(unsigned v) const -> unsigned &
+        {
+            return _domains->counts[v];
+        }
+
+        auto fixed(unsigned v) const -> unsigned char &
+        {
+            return _domains->fixed[v];
+        }
+};
+
+/**
+ * Remembers what domains looked like before they were changed, so that they
+ * can be put back on backtrack rather than having to copy every domain at
+ * every search node. Each domain is saved at most once per level, just before
+ * it is first changed. Saved copies are reused, so once the trail has been as
+ * deep as it needs to go, it stops allocating.
+ */
+template <typename Bitset_>
+class HomomorphismDomainTrail
+{
+    private:
+        HomomorphismDomains<Bitset_> * _domains = nullptr;
+
+        std::vector<unsigned long long> _saved_at_level;
+        std::vector<Bitset_> _saved_values;
+        std::vector<unsigned> _saved_counts;
+        std::vector<unsigned char> _saved_fixed;
+        std::vector<std::pair<unsigned, unsigned long long> > _saved_vertices_and_levels;
+        unsigned _size = 0;
+
+        std::vector<std::pair<unsigned, unsigned long long> > _levels;
+        unsigned long long _current_level = 0, _next_level = 1;
+
+    public:
+        /// start recording changes to these domains, with no levels open
+        auto attach(HomomorphismDomains<Bitset_> & domains) -> void
+        {
+            _domains = &domains;
+            _saved_at_level.assign(domains.size(), 0);
+            _size = 0;
+            _levels.clear();
+            _current_level = 0;
+        }
+
+        auto push_level() -> void
+        {
+            _levels.emplace_back(_size, _current_level);
+            _current_level = _next_level++;
+        }
+
+        /// put back everything that has changed since the matching push_level
+        auto pop_level() -> void
+        {
+            auto [ size, level ] = _levels.back();
+            _levels.pop_back();
+
+            while (_size > size) {
+                --_size;
+                auto [ v, saved_at_level ] = _saved_vertices_and_levels[_size];
+                _domains->values[v] = _saved_values[_size];
+                _domains->counts[v] = _saved_counts[_size];
+                _domains->fixed[v] = _saved_fixed[_size];
+                _saved_at_level[v] = saved_at_level;
+            }
+
+            _current_level = level;
+        }
+
+        /// call this before changing the domain of v. if no level is open, changes are permanent
+        auto save(unsigned v) -> void
+        {
+            if (_levels.empty() || _saved_at_level[v] == _current_level)
+                return;
+
+            if (_size == _saved_counts.size()) {
+                _saved_values.push_back(_domains->values[v]);
+                _saved_counts.push_back(_domains->counts[v]);
+                _saved_fixed.push_back(_domains->fixed[v]);
+                _saved_vertices_and_levels.emplace_back(v, _saved_at_level[v]);
+            }
+            else {
+                _saved_values[_size] = _domains->values[v];
+                _saved_counts[_size] = _domains->counts[v];
+                _saved_fixed[_size] = _domains->fixed[v];
+                _saved_vertices_and_levels[_size] = { v, _saved_at_level[v] };
+            }
 
-    HomomorphismDomain(const HomomorphismDomain &) = default;
-    HomomorphismDomain(HomomorphismDomain &&) = default;
+            ++_size;
+            _saved_at_level[v] = _current_level;
+        }
 };
 
 #endif
@@ -4,32 +4,47 @@
 #include "homomorphism_traits.hh"
 #include "configuration.hh"
 #include "clique.hh"
+#include "fixed_bitset.hh"
+#include "target_cache.hh"
 
+#include <algorithm>
 #include <chrono>
+#include <cstdint>
 #include <functional>
 #include <list>
 #include <map>
 #include <set>
 #include <sstream>
 #include <string>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
+using std::copy;
+using std::find;
 using std::greater;
+using std::int32_t;
+using std::is_trivially_copyable_v;
 using std::list;
 using std::make_optional;
 using std::make_unique;
 using std::map;
 using std::max;
+using std::min;
+using std::move;
 using std::nullopt;
 using std::optional;
 using std::pair;
 using std::set;
 using std::shared_ptr;
+using std::size_t;
 using std::string;
 using std::string_view;
 using std::stringstream;
 using std::to_string;
+using std::uint64_t;
+using std::uint8_t;
+using std::unique_ptr;
 using std::vector;
 
 using std::chrono::duration_cast;
@@ -48,10 +63,11 @@ namespace
             params.extra_shapes.size();
     }
 
+    template <typename Bitset_>
     auto find_clique(
             const shared_ptr<Timeout> & timeout,
             unsigned size,
-            const vector<SVOBitset> & rows,
+            const Bitset_ * rows,
             unsigned g,
             unsigned max_graphs,
             unsigned v,
@@ -109,13 +125,24 @@ namespace
     }
 }
 
-struct HomomorphismModel::Imp
+template <typename Bitset_>
+struct HomomorphismModel<Bitset_>::Imp
 {
     const HomomorphismParams & params;
 
     vector<PatternAdjacencyBitsType> pattern_adjacencies_bits;
-    vector<SVOBitset> pattern_graph_rows;
-    vector<SVOBitset> target_graph_rows, forward_target_graph_rows, reverse_target_graph_rows;
+    vector<vector<unsigned> > pattern_neighbours;
+    vector<Bitset_> pattern_graph_rows;
+    vector<Bitset_> target_graph_rows, forward_target_graph_rows, reverse_target_graph_rows;
+
+    // where the target rows actually live: either the vectors above, or a
+    // mapped target cache file, or one kept in memory
+    const Bitset_ * target_rows = nullptr, * forward_target_rows = nullptr, * reverse_target_rows = nullptr;
+    shared_ptr<const TargetCacheFile> target_cache;
+    bool use_target_cache = false, target_from_cache = false, target_cache_zero_copy = false, target_cache_saved = false;
+    string target_cache_status;
+    uint64_t target_fingerprint = 0;
+    vector<string> vertex_label_names, edge_label_names;
 
     vector<vector<int> > patterns_degrees, targets_degrees;
     int largest_target_degree = 0;
@@ -135,12 +162,14 @@ struct HomomorphismModel::Imp
     mutable list<string> target_cliques_build_times, target_cliques_solve_times, target_cliques_solve_find_nodes, target_cliques_solve_prove_nodes;
 
     Imp(const HomomorphismParams & p) :
-        params(p)
+        params(p),
+        use_target_cache(p.in_memory_target_cache || ! p.target_cache_file.empty())
     {
     }
 };
 
-HomomorphismModel::HomomorphismModel(const InputGraph & target, const InputGraph & pattern, const HomomorphismParams & params) :
+template <typename Bitset_>
+HomomorphismModel<Bitset_>::HomomorphismModel(const InputGraph & target, const InputGraph & pattern, const HomomorphismParams & params) :
     _imp(new Imp(params)),
     max_graphs(calculate_n_shape_graphs(params)),
     pattern_size(pattern.size()),
@@ -166,7 +195,7 @@ HomomorphismModel::HomomorphismModel(const InputGraph & target, const InputGraph
         _imp->directed = true;
 
     // recode pattern to a bit graph, and strip out loops
-    _imp->pattern_graph_rows.resize(pattern_size * max_graphs, SVOBitset(pattern_size, 0));
+    _imp->pattern_graph_rows.resize(pattern_size * max_graphs, Bitset_(pattern_size, 0));
     _imp->pattern_loops.resize(pattern_size);
     for (unsigned i = 0 ; i < pattern_size ; ++i) {
         for (unsigned j = 0 ; j < pattern_size ; ++j) {
@@ -208,50 +237,78 @@ HomomorphismModel::HomomorphismModel(const InputGraph & target, const InputGraph
                 }
     }
 
-    // recode target to a bit graph, and take out loops
-    _imp->target_graph_rows.resize(target_size * max_graphs, SVOBitset{ target_size, 0 });
-    _imp->target_loops.resize(target_size);
-    target.for_each_edge([&] (int f, int t, string_view) {
-        if (f == t)
-            _imp->target_loops[f] = 1;
-        else
-            _imp->target_graph_rows[f * max_graphs + 0].set(t);
-    });
-
-    // if directed, do both directions
-    if (pattern.directed()) {
-        _imp->forward_target_graph_rows.resize(target_size, SVOBitset{ target_size, 0 });
-        _imp->reverse_target_graph_rows.resize(target_size, SVOBitset{ target_size, 0 });
-        target.for_each_edge([&] (int f, int t, string_view l) {
-            if (f != t && l != "unlabelled") {
-                _imp->forward_target_graph_rows[f].set(t);
-                _imp->reverse_target_graph_rows[t].set(f);
-            }
-        });
+    // use a cached copy of the target side of the model, if we have a good one
+    if (_imp->use_target_cache) {
+        if (! _imp->params.extra_shapes.empty())
+            throw UnsupportedConfiguration{ "Target caching cannot be used with extra shapes" };
+
+        // an in memory cache only ever sees one target, so there's no need
+        // to look at it to tell whether it has changed
+        if (! _imp->params.in_memory_target_cache)
+            _imp->target_fingerprint = fingerprint_target_graph(target);
+        _imp->target_from_cache = _load_target_cache(vertex_labels_map, next_vertex_label, edge_labels_map, next_edge_label);
     }
 
-    // target vertex labels
-    if (pattern.has_vertex_labels()) {
-        for (unsigned i = 0 ; i < target_size ; ++i) {
-            if (vertex_labels_map.emplace(target.vertex_label(i), next_vertex_label).second)
-                ++next_vertex_label;
+    if (! _imp->target_from_cache) {
+        // recode target to a bit graph, and take out loops
+        _imp->target_graph_rows.resize(target_size * max_graphs, Bitset_{ target_size, 0 });
+        _imp->target_loops.resize(target_size);
+        target.for_each_edge([&] (int f, int t, string_view) {
+            if (f == t)
+                _imp->target_loops[f] = 1;
+            else
+                _imp->target_graph_rows[f * max_graphs + 0].set(t);
+        });
+
+        // if directed, do both directions
+        if (pattern.directed()) {
+            _imp->forward_target_graph_rows.resize(target_size, Bitset_{ target_size, 0 });
+            _imp->reverse_target_graph_rows.resize(target_size, Bitset_{ target_size, 0 });
+            target.for_each_edge([&] (int f, int t, string_view l) {
+                if (f != t && l != "unlabelled") {
+                    _imp->forward_target_graph_rows[f].set(t);
+                    _imp->reverse_target_graph_rows[t].set(f);
+                }
+            });
         }
 
-        _imp->target_vertex_labels.resize(target_size);
-        for (unsigned i = 0 ; i < target_size ; ++i)
-            _imp->target_vertex_labels[i] = vertex_labels_map.find(string{ target.vertex_label(i) })->second;
-    }
+        // target vertex labels
+        if (pattern.has_vertex_labels()) {
+            for (unsigned i = 0 ; i < target_size ; ++i) {
+                if (vertex_labels_map.emplace(target.vertex_label(i), next_vertex_label).second)
+                    ++next_vertex_label;
+            }
 
-    // target edge labels
-    if (pattern.has_edge_labels()) {
-        _imp->target_edge_labels.resize(target_size * target_size);
-        target.for_each_edge([&] (int f, int t, string_view l) {
-            auto r = edge_labels_map.emplace(l, next_edge_label);
-            if (r.second)
-                ++next_edge_label;
+            _imp->target_vertex_labels.resize(target_size);
+            for (unsigned i = 0 ; i < target_size ; ++i)
+                _imp->target_vertex_labels[i] = vertex_labels_map.find(string{ target.vertex_label(i) })->second;
+        }
 
-            _imp->target_edge_labels[f * target_size + t] = r.first->second;
-        });
+        // target edge labels
+        if (pattern.has_edge_labels()) {
+            _imp->target_edge_labels.resize(target_size * target_size);
+            target.for_each_edge([&] (int f, int t, string_view l) {
+                auto r = edge_labels_map.emplace(l, next_edge_label);
+                if (r.second)
+                    ++next_edge_label;
+
+                _imp->target_edge_labels[f * target_size + t] = r.first->second;
+            });
+        }
+
+        _imp->target_rows = _imp->target_graph_rows.data();
+        _imp->forward_target_rows = _imp->forward_target_graph_rows.data();
+        _imp->reverse_target_rows = _imp->reverse_target_graph_rows.data();
+
+        // remember what the label encodings mean, so a cache can be remapped
+        if (_imp->use_target_cache) {
+            _imp->vertex_label_names.resize(next_vertex_label);
+            for (auto & [ name, label ] : vertex_labels_map)
+                _imp->vertex_label_names[label] = name;
+            _imp->edge_label_names.resize(next_edge_label);
+            for (auto & [ name, label ] : edge_labels_map)
+                _imp->edge_label_names[label] = name;
+        }
     }
 
     auto decode = [&] (const InputGraph & g, string_view s) -> int {
@@ -333,9 +390,188 @@ HomomorphismModel::HomomorphismModel(const InputGraph & target, const InputGraph
     }
 }
 
-HomomorphismModel::~HomomorphismModel() = default;
+template <typename Bitset_>
+HomomorphismModel<Bitset_>::~HomomorphismModel() = default;
+
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::_target_cache_settings() const -> string
+{
+    return "graphs " + to_string(max_graphs)
+        + " exact_paths " + to_string(supports_exact_path_graphs(_imp->params) ? _imp->params.number_of_exact_path_graphs : 0)
+        + " distance2 " + to_string(supports_distance2_graphs(_imp->params))
+        + " distance3 " + to_string(supports_distance3_graphs(_imp->params))
+        + " k4 " + to_string(supports_k4_graphs(_imp->params))
+        + " directed " + to_string(_imp->directed)
+        + " vertex_labels " + to_string(has_vertex_labels())
+        + " edge_labels " + to_string(has_edge_labels());
+}
 
-auto HomomorphismModel::_check_label_compatibility(int p, int t) const -> bool
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::_load_target_cache(map<string, int> & vertex_labels_map, int & next_vertex_label,
+        map<string, int> & edge_labels_map, int & next_edge_label) -> bool
+{
+    auto settings_fingerprint = fingerprint_string(_target_cache_settings());
+    string filename = _imp->params.in_memory_target_cache ? "(in memory)" : _imp->params.target_cache_file;
+    shared_ptr<const TargetCacheFile> cache = _imp->params.in_memory_target_cache ?
+        _imp->params.in_memory_target_cache->find(settings_fingerprint) : map_target_cache(filename);
+    if (! cache) {
+        _imp->target_cache_status = "missing";
+        return false;
+    }
+
+    auto & header = cache->header();
+    if (cache->stale() || header.target_fingerprint != _imp->target_fingerprint
+            || header.settings_fingerprint != settings_fingerprint
+            || header.target_size != target_size || header.max_graphs != max_graphs) {
+        _imp->target_cache_status = "stale";
+        return false;
+    }
+
+    auto section = [&] (TargetCacheSection s, size_t n, size_t element_size) -> const void * {
+        auto [ data, bytes ] = cache->section(s);
+        if (bytes != n * element_size)
+            throw TargetCacheError{ "Target cache '" + filename + "' is corrupt" };
+        return data;
+    };
+
+    // if the cached rows are laid out exactly like our bitsets, use them where
+    // they are, otherwise copy them out a word at a time
+    unsigned row_words = header.row_words;
+    auto load_rows = [&] (TargetCacheSection s, unsigned n, vector<Bitset_> & rows) -> const Bitset_ * {
+        auto words = static_cast<const BitWord *>(section(s, size_t{ n } * row_words, sizeof(BitWord)));
+        if constexpr (is_trivially_copyable_v<Bitset_>) {
+            if (sizeof(Bitset_) == row_words * sizeof(BitWord)) {
+                _imp->target_cache_zero_copy = true;
+                return reinterpret_cast<const Bitset_ *>(words);
+            }
+        }
+
+        rows.resize(n, Bitset_{ target_size, 0 });
+        for (unsigned i = 0 ; i < n ; ++i)
+            copy(words + size_t{ i } * row_words, words + size_t{ i } * row_words + min(row_words, rows[i].number_of_words()), rows[i].words());
+        return rows.data();
+    };
+
+    unsigned n_directed_rows = _imp->directed ? target_size : 0;
+    _imp->target_rows = load_rows(target_cache_rows, target_size * max_graphs, _imp->target_graph_rows);
+    _imp->forward_target_rows = load_rows(target_cache_forward_rows, n_directed_rows, _imp->forward_target_graph_rows);
+    _imp->reverse_target_rows = load_rows(target_cache_reverse_rows, n_directed_rows, _imp->reverse_target_graph_rows);
+
+    auto degrees = static_cast<const int32_t *>(section(target_cache_degrees, size_t{ max_graphs } * target_size, sizeof(int32_t)));
+    for (unsigned g = 0 ; g < max_graphs ; ++g)
+        _imp->targets_degrees.at(g).assign(degrees + size_t{ g } * target_size, degrees + size_t{ g + 1 } * target_size);
+    _imp->largest_target_degree = header.largest_target_degree;
+
+    auto loops = static_cast<const uint8_t *>(section(target_cache_loops, target_size, sizeof(uint8_t)));
+    _imp->target_loops.assign(loops, loops + target_size);
+
+    // labels were encoded alongside a different pattern, so translate them
+    // into the encoding that this pattern is using
+    auto remap = [&] (TargetCacheSection names_section, map<string, int> & labels_map, int & next_label) -> vector<int> {
+        auto [ data, bytes ] = cache->section(names_section);
+        auto names = static_cast<const char *>(data);
+        vector<int> result;
+        for (size_t start = 0 ; start < bytes ; ) {
+            auto end = find(names + start, names + bytes, '\0') - names;
+            if (result.empty())
+                result.push_back(0);
+            else {
+                auto r = labels_map.emplace(string{ names + start, names + end }, next_label);
+                if (r.second)
+                    ++next_label;
+                result.push_back(r.first->second);
+            }
+            start = end + 1;
+        }
+        return result;
+    };
+
+    auto load_labels = [&] (TargetCacheSection s, size_t n, const vector<int> & labels_remap, vector<int> & labels) {
+        auto cached = static_cast<const int32_t *>(section(s, n, sizeof(int32_t)));
+        labels.resize(n);
+        for (size_t i = 0 ; i < n ; ++i) {
+            if (cached[i] < 0 || unsigned(cached[i]) >= labels_remap.size())
+                throw TargetCacheError{ "Target cache '" + filename + "' is corrupt" };
+            labels[i] = labels_remap[cached[i]];
+        }
+    };
+
+    if (has_vertex_labels())
+        load_labels(target_cache_vertex_labels, target_size, remap(target_cache_vertex_label_names, vertex_labels_map, next_vertex_label),
+                _imp->target_vertex_labels);
+
+    if (has_edge_labels())
+        load_labels(target_cache_edge_labels, size_t{ target_size } * target_size, remap(target_cache_edge_label_names, edge_labels_map, next_edge_label),
+                _imp->target_edge_labels);
+
+    if (_imp->target_cache_zero_copy)
+        _imp->target_cache = move(cache);
+
+    _imp->target_cache_status = "hit";
+    return true;
+}
+
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::_save_target_cache() const -> void
+{
+    TargetCacheHeader header{ };
+    header.target_fingerprint = _imp->target_fingerprint;
+    header.settings_fingerprint = fingerprint_string(_target_cache_settings());
+    header.target_size = target_size;
+    header.max_graphs = max_graphs;
+    header.row_words = Bitset_{ target_size, 0 }.number_of_words();
+    header.largest_target_degree = _imp->largest_target_degree;
+
+    auto row_words = [&] (const vector<Bitset_> & rows) {
+        vector<BitWord> result;
+        result.reserve(rows.size() * header.row_words);
+        for (auto & r : rows)
+            result.insert(result.end(), r.words(), r.words() + header.row_words);
+        return result;
+    };
+
+    auto rows = row_words(_imp->target_graph_rows);
+    auto forward_rows = row_words(_imp->forward_target_graph_rows);
+    auto reverse_rows = row_words(_imp->reverse_target_graph_rows);
+
+    vector<int32_t> degrees;
+    for (unsigned g = 0 ; g < max_graphs ; ++g)
+        degrees.insert(degrees.end(), _imp->targets_degrees[g].begin(), _imp->targets_degrees[g].end());
+
+    vector<uint8_t> loops(_imp->target_loops.begin(), _imp->target_loops.end());
+    vector<int32_t> vertex_labels(_imp->target_vertex_labels.begin(), _imp->target_vertex_labels.end());
+    vector<int32_t> edge_labels(_imp->target_edge_labels.begin(), _imp->target_edge_labels.end());
+
+    // label names, in encoding order, each followed by a zero byte
+    auto names = [] (const vector<string> & label_names) {
+        string result;
+        for (auto & n : label_names) {
+            result.append(n);
+            result.push_back('\0');
+        }
+        return result;
+    };
+
+    auto vertex_label_names = names(has_vertex_labels() ? _imp->vertex_label_names : vector<string>{ });
+    auto edge_label_names = names(has_edge_labels() ? _imp->edge_label_names : vector<string>{ });
+
+    auto bytes = [] (const auto & v) {
+        return pair<const void *, size_t>{ v.data(), v.size() * sizeof(v[0]) };
+    };
+
+    vector<pair<const void *, size_t> > sections{ bytes(rows), bytes(forward_rows), bytes(reverse_rows),
+            bytes(degrees), bytes(loops), bytes(vertex_labels), bytes(edge_labels), bytes(vertex_label_names), bytes(edge_label_names) };
+
+    if (_imp->params.in_memory_target_cache)
+        _imp->params.in_memory_target_cache->add(header, sections);
+    else
+        write_target_cache(_imp->params.target_cache_file, header, sections);
+
+    _imp->target_cache_saved = true;
+}
+
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::_check_label_compatibility(int p, int t) const -> bool
 {
     if (! has_vertex_labels())
         return true;
@@ -343,7 +579,8 @@ auto HomomorphismModel::_check_label_compatibility(int p, int t) const -> bool
         return pattern_vertex_label(p) == target_vertex_label(t);
 }
 
-auto HomomorphismModel::_check_loop_compatibility(int p, int t) const -> bool
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::_check_loop_compatibility(int p, int t) const -> bool
 {
     if (pattern_has_loop(p) && ! target_has_loop(t))
         return false;
@@ -353,11 +590,12 @@ auto HomomorphismModel::_check_loop_compatibility(int p, int t) const -> bool
     return true;
 }
 
-auto HomomorphismModel::_build_pattern_clique_sizes() const -> void
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::_build_pattern_clique_sizes() const -> void
 {
     for (unsigned g = 0 ; g < _imp->max_graphs_for_clique_size_constraints ; ++g) {
         for (unsigned v = 0 ; v < pattern_size ; ++v) {
-            auto c = find_clique(_imp->params.timeout, pattern_size, _imp->pattern_graph_rows, g, max_graphs, v, nullopt,
+            auto c = find_clique(_imp->params.timeout, pattern_size, _imp->pattern_graph_rows.data(), g, max_graphs, v, nullopt,
                     _imp->pattern_cliques_best_knowns[g], _imp->pattern_cliques_build_times, _imp->pattern_cliques_solve_times,
                     _imp->pattern_cliques_solve_find_nodes, _imp->pattern_cliques_solve_prove_nodes);
             _imp->pattern_cliques_sizes[g][v] = c;
@@ -367,18 +605,20 @@ auto HomomorphismModel::_build_pattern_clique_sizes() const -> void
     }
 }
 
-auto HomomorphismModel::_build_target_clique_size(int v) const -> void
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::_build_target_clique_size(int v) const -> void
 {
     if (0 == _imp->target_cliques_sizes[0][v])
         for (unsigned g = 0 ; g < _imp->max_graphs_for_clique_size_constraints ; ++g) {
-            _imp->target_cliques_sizes[g][v] = find_clique(_imp->params.timeout, target_size, _imp->target_graph_rows, g, max_graphs, v,
+            _imp->target_cliques_sizes[g][v] = find_clique(_imp->params.timeout, target_size, _imp->target_rows, g, max_graphs, v,
                     _imp->largest_pattern_clique[g], _imp->target_cliques_best_knowns[0], _imp->target_cliques_build_times,
                     _imp->target_cliques_solve_times, _imp->target_cliques_solve_find_nodes, _imp->target_cliques_solve_prove_nodes);
         }
 
 }
 
-auto HomomorphismModel::_check_clique_compatibility(int p, int t) const -> bool
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::_check_clique_compatibility(int p, int t) const -> bool
 {
     if (! _imp->params.clique_size_constraints)
         return true;
@@ -399,7 +639,8 @@ auto HomomorphismModel::_check_clique_compatibility(int p, int t) const -> bool
     return true;
 }
 
-auto HomomorphismModel::_prove_no_clique(
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::_prove_no_clique(
         unsigned g,
         int p,
         int tt) const -> void
@@ -439,7 +680,7 @@ auto HomomorphismModel::_prove_no_clique(
         vector<int> include(target_size, -1), invinclude(target_size, 0);
         int count = 0;
         for (int w = 0 ; w < int(target_size) ; ++w)
-            if (w != tt && _imp->target_graph_rows[w * max_graphs + g].test(tt)) {
+            if (w != tt && _imp->target_rows[w * max_graphs + g].test(tt)) {
                 t_clique_neighbourhood.emplace(count, target_vertex_for_proof(w));
                 include[w] = count;
                 invinclude[count] = w;
@@ -453,7 +694,7 @@ auto HomomorphismModel::_prove_no_clique(
             if (include[f] != -1)
                 for (unsigned t = 0 ; t < target_size ; ++t) {
                     if (f != t && include[t] != -1) {
-                        if (_imp->target_graph_rows[f * max_graphs + g].test(t))
+                        if (_imp->target_rows[f * max_graphs + g].test(t))
                             gv.add_edge(include[f], include[t]);
                         else if (f < t)
                             _imp->params.proof->add_hom_clique_non_edge(
@@ -479,7 +720,8 @@ auto HomomorphismModel::_prove_no_clique(
     }
 }
 
-auto HomomorphismModel::_check_degree_compatibility(
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::_check_degree_compatibility(
         int p,
         int t,
         unsigned graphs_to_consider,
@@ -503,11 +745,9 @@ auto HomomorphismModel::_check_degree_compatibility(
                     if (np.test(j))
                         n_p.push_back(j);
 
-                auto nt = target_graph_row(g, t);
-                for (auto j = nt.find_first() ; j != decltype(nt)::npos ; j = nt.find_first()) {
-                    nt.reset(j);
+                target_graph_row(g, t).for_each_set_bit([&] (unsigned j) {
                     n_t.push_back(j);
-                }
+                });
 
                 _imp->params.proof->incompatible_by_degrees(g, pattern_vertex_for_proof(p), n_p,
                         target_vertex_for_proof(t), n_t);
@@ -523,16 +763,27 @@ auto HomomorphismModel::_check_degree_compatibility(
     if (_imp->params.no_nds || do_not_do_nds_yet)
         return true;
 
-    // full compare of neighbourhood degree sequences
+    // full compare of neighbourhood degree sequences. we never look further
+    // into a target sequence than the longest pattern sequence, so only that
+    // much of it needs sorting, which matters for small patterns in big targets
     if (! targets_ndss.at(0).at(t)) {
         for (unsigned g = 0 ; g < graphs_to_consider ; ++g) {
-            targets_ndss.at(g).at(t) = vector<int>{};
-            auto ni = target_graph_row(g, t);
-            for (auto j = ni.find_first() ; j != decltype(ni)::npos ; j = ni.find_first()) {
-                ni.reset(j);
-                targets_ndss.at(g).at(t)->push_back(target_degree(g, j));
+            size_t longest_pattern_nds = 0;
+            for (auto & nds : patterns_ndss.at(g))
+                longest_pattern_nds = max(longest_pattern_nds, nds.size());
+
+            auto & nds = targets_ndss.at(g).at(t);
+            nds = vector<int>{};
+            target_graph_row(g, t).for_each_set_bit([&] (unsigned j) {
+                nds->push_back(target_degree(g, j));
+            });
+
+            if (nds->size() > longest_pattern_nds) {
+                partial_sort(nds->begin(), nds->begin() + longest_pattern_nds, nds->end(), greater<int>());
+                nds->resize(longest_pattern_nds);
             }
-            sort(targets_ndss.at(g).at(t)->begin(), targets_ndss.at(g).at(t)->end(), greater<int>());
+            else
+                sort(nds->begin(), nds->end(), greater<int>());
         }
     }
 
@@ -545,17 +796,13 @@ auto HomomorphismModel::_check_degree_compatibility(
                     // need to know the NDS together with the actual vertices
                     vector<pair<int, int> > p_nds, t_nds;
 
-                    auto np = pattern_graph_row(g, p);
-                    for (auto w = np.find_first() ; w != decltype(np)::npos ; w = np.find_first()) {
-                        np.reset(w);
+                    pattern_graph_row(g, p).for_each_set_bit([&] (unsigned w) {
                         p_nds.emplace_back(w, pattern_graph_row(g, w).count());
-                    }
+                    });
 
-                    auto nt = target_graph_row(g, t);
-                    for (auto w = nt.find_first() ; w != decltype(nt)::npos ; w = nt.find_first()) {
-                        nt.reset(w);
+                    target_graph_row(g, t).for_each_set_bit([&] (unsigned w) {
                         t_nds.emplace_back(w, target_graph_row(g, w).count());
-                    }
+                    });
 
                     sort(p_nds.begin(), p_nds.end(), [] (const pair<int, int> & a, const pair<int, int> & b) {
                             return a.second > b.second; });
@@ -583,7 +830,8 @@ auto HomomorphismModel::_check_degree_compatibility(
     return true;
 }
 
-auto HomomorphismModel::initialise_domains(vector<HomomorphismDomain> & domains) const -> bool
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::initialise_domains(HomomorphismDomains<Bitset_> & domains) const -> bool
 {
     unsigned max_graphs_for_degree_things = (_imp->params.injectivity == Injectivity::LocallyInjective ? 1 : max_graphs);
 
@@ -599,19 +847,16 @@ auto HomomorphismModel::initialise_domains(vector<HomomorphismDomain> & domains)
 
         for (unsigned g = 0 ; g < max_graphs_for_degree_things ; ++g) {
             for (unsigned i = 0 ; i < pattern_size ; ++i) {
-                auto ni = pattern_graph_row(g, i);
-                for (auto j = ni.find_first() ; j != decltype(ni)::npos ; j = ni.find_first()) {
-                    ni.reset(j);
+                pattern_graph_row(g, i).for_each_set_bit([&] (unsigned j) {
                     patterns_ndss.at(g).at(i).push_back(pattern_degree(g, j));
-                }
+                });
                 sort(patterns_ndss.at(g).at(i).begin(), patterns_ndss.at(g).at(i).end(), greater<int>());
             }
         }
     }
 
     for (unsigned i = 0 ; i < pattern_size ; ++i) {
-        domains.at(i).v = i;
-        domains.at(i).values.reset();
+        domains.values.at(i).reset();
 
         for (unsigned j = 0 ; j < target_size ; ++j) {
             bool ok = true;
@@ -626,11 +871,11 @@ auto HomomorphismModel::initialise_domains(vector<HomomorphismDomain> & domains)
                 ok = false;
 
             if (ok)
-                domains.at(i).values.set(j);
+                domains.values.at(i).set(j);
         }
 
-        domains.at(i).count = domains.at(i).values.count();
-        if (0 == domains.at(i).count)
+        domains.counts.at(i) = domains.values.at(i).count();
+        if (0 == domains.counts.at(i))
             return false;
     }
 
@@ -638,10 +883,10 @@ auto HomomorphismModel::initialise_domains(vector<HomomorphismDomain> & domains)
     if (_imp->params.proof && degree_and_nds_are_preserved(_imp->params) && ! _imp->params.no_nds) {
         for (unsigned i = 0 ; i < pattern_size ; ++i) {
             for (unsigned j = 0 ; j < target_size ; ++j) {
-                if (domains.at(i).values.test(j) &&
+                if (domains.values.at(i).test(j) &&
                         ! _check_degree_compatibility(i, j, max_graphs_for_degree_things, patterns_ndss, targets_ndss, false)) {
-                    domains.at(i).values.reset(j);
-                    if (0 == --domains.at(i).count)
+                    domains.values.at(i).reset(j);
+                    if (0 == --domains.counts.at(i))
                         return false;
                 }
             }
@@ -650,31 +895,28 @@ auto HomomorphismModel::initialise_domains(vector<HomomorphismDomain> & domains)
 
     // quick sanity check that we have enough values
     if (is_nonshrinking(_imp->params)) {
-        SVOBitset domains_union{ target_size, 0 };
-        for (auto & d : domains)
-            domains_union |= d.values;
-
-        unsigned domains_union_popcount = domains_union.count();
+        Bitset_ domains_union{ target_size, 0 };
+        unsigned domains_union_popcount = 0;
+        for (auto & d : domains.values)
+            domains_union_popcount = domains_union.union_with_and_count(d);
         if (domains_union_popcount < unsigned(pattern_size)) {
             if (_imp->params.proof) {
                 vector<NamedVertex> hall_lhs, hall_rhs;
-                for (auto & d : domains)
-                    hall_lhs.push_back(pattern_vertex_for_proof(d.v));
-                auto dd = domains_union;
-                for (auto v = dd.find_first() ; v != decltype(dd)::npos ; v = dd.find_first()) {
-                    dd.reset(v);
+                for (unsigned v = 0 ; v < pattern_size ; ++v)
+                    hall_lhs.push_back(pattern_vertex_for_proof(v));
+                domains_union.for_each_set_bit([&] (unsigned v) {
                     hall_rhs.push_back(target_vertex_for_proof(v));
-                }
+                });
                 _imp->params.proof->emit_hall_set_or_violator(hall_lhs, hall_rhs);
             }
             return false;
         }
     }
 
-    for (auto & d : domains) {
-        d.count = d.values.count();
-        if (0 == d.count && _imp->params.proof) {
-            _imp->params.proof->initial_domain_is_empty(d.v);
+    for (unsigned v = 0 ; v < pattern_size ; ++v) {
+        domains.counts[v] = domains.values[v].count();
+        if (0 == domains.counts[v] && _imp->params.proof) {
+            _imp->params.proof->initial_domain_is_empty(v);
             return false;
         }
     }
@@ -685,15 +927,11 @@ auto HomomorphismModel::initialise_domains(vector<HomomorphismDomain> & domains)
         // in which case they won't show up as being deleted during propagation.
         bool wipeout = false;
         if (! _imp->params.lackey->reduce_initial_bounds([&] (int p, int t) -> void {
-                for (auto & d : domains)
-                    if (d.v == unsigned(p)) {
-                        if (d.values.test(t)) {
-                            d.values.reset(t);
-                            if (0 == --d.count)
-                                wipeout = true;
-                        }
-                        break;
-                    }
+                if (unsigned(p) < pattern_size && domains.values[p].test(t)) {
+                    domains.values[p].reset(t);
+                    if (0 == --domains.counts[p])
+                        wipeout = true;
+                }
                 }) || wipeout) {
             return false;
         }
@@ -702,34 +940,42 @@ auto HomomorphismModel::initialise_domains(vector<HomomorphismDomain> & domains)
     return true;
 }
 
-auto HomomorphismModel::pattern_vertex_for_proof(int v) const -> NamedVertex
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::pattern_vertex_for_proof(int v) const -> NamedVertex
 {
     if (v < 0 || unsigned(v) >= _imp->pattern_vertex_proof_names.size())
         throw ProofError{ "Oops, there's a bug: v out of range in pattern" };
     return pair{ v, _imp->pattern_vertex_proof_names[v] };
 }
 
-auto HomomorphismModel::target_vertex_for_proof(int v) const -> NamedVertex
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::target_vertex_for_proof(int v) const -> NamedVertex
 {
     if (v < 0 || unsigned(v) >= _imp->target_vertex_proof_names.size())
         throw ProofError{ "Oops, there's a bug: v out of range in target" };
     return pair{ v, _imp->target_vertex_proof_names[v] };
 }
 
-auto HomomorphismModel::prepare() -> bool
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::prepare() -> bool
 {
     if (is_nonshrinking(_imp->params) && (pattern_size > target_size))
         return false;
 
+    // everything on the target side is already done if it came from a cache
+    bool build_target = ! _imp->target_from_cache;
+
     // pattern and target degrees, for the main graph
     _imp->patterns_degrees.at(0).resize(pattern_size);
-    _imp->targets_degrees.at(0).resize(target_size);
 
     for (unsigned i = 0 ; i < pattern_size ; ++i)
         _imp->patterns_degrees.at(0).at(i) = _imp->pattern_graph_rows[i * max_graphs + 0].count();
 
-    for (unsigned i = 0 ; i < target_size ; ++i)
-        _imp->targets_degrees.at(0).at(i) = _imp->target_graph_rows[i * max_graphs + 0].count();
+    if (build_target) {
+        _imp->targets_degrees.at(0).resize(target_size);
+        for (unsigned i = 0 ; i < target_size ; ++i)
+            _imp->targets_degrees.at(0).at(i) = _imp->target_graph_rows[i * max_graphs + 0].count();
+    }
 
     if (global_degree_is_preserved(_imp->params)) {
         vector<pair<int, int> > p_gds, t_gds;
@@ -755,11 +1001,9 @@ auto HomomorphismModel::prepare() -> bool
 
                         for (unsigned t = i ; t < t_gds.size() ; ++t) {
                             vector<int> n_t;
-                            auto nt = _imp->target_graph_rows[t_gds.at(t).first * max_graphs + 0];
-                            for (auto j = nt.find_first() ; j != decltype(nt)::npos ; j = nt.find_first()) {
-                                nt.reset(j);
+                            _imp->target_graph_rows[t_gds.at(t).first * max_graphs + 0].for_each_set_bit([&] (unsigned j) {
                                 n_t.push_back(j);
-                            }
+                            });
 
                             _imp->params.proof->incompatible_by_degrees(0,
                                     pattern_vertex_for_proof(p_gds.at(p).first), n_p,
@@ -779,11 +1023,12 @@ auto HomomorphismModel::prepare() -> bool
             }
     }
 
-    unsigned next_pattern_supplemental = 1, next_target_supplemental = 1;
+    unsigned next_pattern_supplemental = 1, next_target_supplemental = build_target ? 1 : max_graphs;
     // build exact path graphs
     if (supports_exact_path_graphs(_imp->params)) {
         _build_exact_path_graphs(_imp->pattern_graph_rows, pattern_size, next_pattern_supplemental, _imp->params.number_of_exact_path_graphs, _imp->directed, false);
-        _build_exact_path_graphs(_imp->target_graph_rows, target_size, next_target_supplemental, _imp->params.number_of_exact_path_graphs, _imp->directed, false);
+        if (build_target)
+            _build_exact_path_graphs(_imp->target_graph_rows, target_size, next_target_supplemental, _imp->params.number_of_exact_path_graphs, _imp->directed, false);
 
         if (_imp->params.proof) {
             for (int g = 1 ; g <= _imp->params.number_of_exact_path_graphs ; ++g) {
@@ -798,8 +1043,7 @@ auto HomomorphismModel::prepare() -> bool
                         auto n_p_q = _imp->pattern_graph_rows[p * max_graphs + 0];
                         n_p_q &= _imp->pattern_graph_rows[q * max_graphs + 0];
                         vector<NamedVertex> between_p_and_q;
-                        for (auto v = n_p_q.find_first() ; v != decltype(n_p_q)::npos ; v = n_p_q.find_first()) {
-                            n_p_q.reset(v);
+                        for (auto v = n_p_q.find_first() ; v != decltype(n_p_q)::npos ; v = n_p_q.find_next(v)) {
                             between_p_and_q.push_back(pattern_vertex_for_proof(v));
                             if (between_p_and_q.size() >= unsigned(g))
                                 break;
@@ -810,30 +1054,23 @@ auto HomomorphismModel::prepare() -> bool
 
                             vector<NamedVertex> named_n_t, named_d_n_t;
                             vector<pair<NamedVertex, vector<NamedVertex> > > named_two_away_from_t;
-                            auto n_t = _imp->target_graph_rows[t * max_graphs + 0];
-                            for (auto w = n_t.find_first() ; w != decltype(n_t)::npos ; w = n_t.find_first()) {
-                                n_t.reset(w);
+                            _imp->target_graph_rows[t * max_graphs + 0].for_each_set_bit([&] (unsigned w) {
                                 named_n_t.push_back(target_vertex_for_proof(w));
-                            }
+                            });
 
-                            auto nd_t = _imp->target_graph_rows[t * max_graphs + g];
-                            for (auto w = nd_t.find_first() ; w != decltype(nd_t)::npos ; w = nd_t.find_first()) {
-                                nd_t.reset(w);
+                            _imp->target_graph_rows[t * max_graphs + g].for_each_set_bit([&] (unsigned w) {
                                 named_d_n_t.push_back(target_vertex_for_proof(w));
-                            }
+                            });
 
-                            auto n2_t = _imp->target_graph_rows[t * max_graphs + 1];
-                            for (auto w = n2_t.find_first() ; w != decltype(n2_t)::npos ; w = n2_t.find_first()) {
-                                n2_t.reset(w);
+                            _imp->target_graph_rows[t * max_graphs + 1].for_each_set_bit([&] (unsigned w) {
                                 auto n_t_w = _imp->target_graph_rows[w * max_graphs + 0];
                                 n_t_w &= _imp->target_graph_rows[t * max_graphs + 0];
                                 vector<NamedVertex> named_n_t_w;
-                                for (auto x = n_t_w.find_first() ; x != decltype(n_t_w)::npos ; x = n_t_w.find_first()) {
-                                    n_t_w.reset(x);
+                                n_t_w.for_each_set_bit([&] (unsigned x) {
                                     named_n_t_w.push_back(target_vertex_for_proof(x));
-                                }
+                                });
                                 named_two_away_from_t.emplace_back(target_vertex_for_proof(w), named_n_t_w);
-                            }
+                            });
 
                             _imp->params.proof->create_exact_path_graphs(g, named_p, named_q, between_p_and_q,
                                     named_t, named_n_t, named_two_away_from_t, named_d_n_t);
@@ -846,12 +1083,14 @@ auto HomomorphismModel::prepare() -> bool
 
     if (supports_distance2_graphs(_imp->params)) {
         _build_exact_path_graphs(_imp->pattern_graph_rows, pattern_size, next_pattern_supplemental, 1, _imp->directed, true);
-        _build_exact_path_graphs(_imp->target_graph_rows, target_size, next_target_supplemental, 1, _imp->directed, true);
+        if (build_target)
+            _build_exact_path_graphs(_imp->target_graph_rows, target_size, next_target_supplemental, 1, _imp->directed, true);
     }
 
     if (supports_distance3_graphs(_imp->params)) {
         _build_distance3_graphs(_imp->pattern_graph_rows, pattern_size, next_pattern_supplemental);
-        _build_distance3_graphs(_imp->target_graph_rows, target_size, next_target_supplemental);
+        if (build_target)
+            _build_distance3_graphs(_imp->target_graph_rows, target_size, next_target_supplemental);
 
         if (_imp->params.proof) {
             for (unsigned p = 0 ; p < pattern_size ; ++p) {
@@ -887,14 +1126,12 @@ auto HomomorphismModel::prepare() -> bool
                             // find a path of length 3
                             n_p.reset(p);
                             n_p.reset(q);
-                            for (auto v = n_p.find_first() ; v != decltype(n_p)::npos && ! path_from_p_to_q_1 ; v = n_p.find_first()) {
-                                n_p.reset(v);
+                            for (auto v = n_p.find_first() ; v != decltype(n_p)::npos && ! path_from_p_to_q_1 ; v = n_p.find_next(v)) {
                                 auto n_v = _imp->pattern_graph_rows[v * max_graphs + 0];
                                 n_v.reset(v);
                                 n_v.reset(p);
                                 n_v.reset(q);
-                                for (auto w = n_v.find_first() ; w != decltype(n_v)::npos && ! path_from_p_to_q_1 ; w = n_v.find_first()) {
-                                    n_v.reset(w);
+                                for (auto w = n_v.find_first() ; w != decltype(n_v)::npos && ! path_from_p_to_q_1 ; w = n_v.find_next(w)) {
                                     if (_imp->pattern_graph_rows[w * max_graphs + 0].test(q)) {
                                         path_from_p_to_q_1 = pattern_vertex_for_proof(v);
                                         path_from_p_to_q_2 = pattern_vertex_for_proof(w);
@@ -914,22 +1151,19 @@ auto HomomorphismModel::prepare() -> bool
                         set<NamedVertex> d2_from_t_set, d3_from_t_set;
                         auto n_t = _imp->target_graph_rows[t * max_graphs + 0];
                         n_t.set(t);
-                        for (auto v = n_t.find_first() ; v != decltype(n_t)::npos ; v = n_t.find_first()) {
-                            n_t.reset(v);
+                        n_t.for_each_set_bit([&] (unsigned v) {
                             d1_from_t.push_back(target_vertex_for_proof(v));
                             auto n_v = _imp->target_graph_rows[v * max_graphs + 0];
                             n_v.set(v);
-                            for (auto w = n_v.find_first() ; w != decltype(n_v)::npos ; w = n_v.find_first()) {
-                                n_v.reset(w);
+                            n_v.for_each_set_bit([&] (unsigned w) {
                                 d2_from_t_set.insert(target_vertex_for_proof(w));
                                 auto n_w = _imp->target_graph_rows[w * max_graphs + 0];
                                 n_w.set(w);
-                                for (auto x = n_w.find_first() ; x != decltype(n_w)::npos ; x = n_w.find_first()) {
-                                    n_w.reset(x);
+                                n_w.for_each_set_bit([&] (unsigned x) {
                                     d3_from_t_set.insert(target_vertex_for_proof(x));
-                                }
-                            }
-                        }
+                                });
+                            });
+                        });
 
                         d2_from_t.assign(d2_from_t_set.begin(), d2_from_t_set.end());
                         d3_from_t.assign(d3_from_t_set.begin(), d3_from_t_set.end());
@@ -950,7 +1184,8 @@ auto HomomorphismModel::prepare() -> bool
 
     if (supports_k4_graphs(_imp->params)) {
         _build_k4_graphs(_imp->pattern_graph_rows, pattern_size, next_pattern_supplemental);
-        _build_k4_graphs(_imp->target_graph_rows, target_size, next_target_supplemental);
+        if (build_target)
+            _build_k4_graphs(_imp->target_graph_rows, target_size, next_target_supplemental);
     }
 
     for (auto & [ shape, injective, count ] : _imp->params.extra_shapes) {
@@ -970,11 +1205,9 @@ auto HomomorphismModel::prepare() -> bool
                     for (unsigned t = 0 ; t < target_size ; ++t) {
                         auto named_t = target_vertex_for_proof(t);
                         vector<NamedVertex> named_n_t;
-                        auto n_t = _imp->target_graph_rows[t * max_graphs + next_pattern_supplemental - 1];
-                        for (auto v = n_t.find_first() ; v != decltype(n_t)::npos ; v = n_t.find_first()) {
-                            n_t.reset(v);
+                        _imp->target_graph_rows[t * max_graphs + next_pattern_supplemental - 1].for_each_set_bit([&] (unsigned v) {
                             named_n_t.push_back(target_vertex_for_proof(v));
-                        }
+                        });
                         _imp->params.proof->hack_in_shape_graph(next_pattern_supplemental - 1, named_p, named_q, named_t, named_n_t);
                     }
                 }
@@ -989,28 +1222,34 @@ auto HomomorphismModel::prepare() -> bool
     // pattern and target degrees, for supplemental graphs
     for (unsigned g = 1 ; g < max_graphs ; ++g) {
         _imp->patterns_degrees.at(g).resize(pattern_size);
-        _imp->targets_degrees.at(g).resize(target_size);
-    }
-
-    for (unsigned g = 1 ; g < max_graphs ; ++g) {
         for (unsigned i = 0 ; i < pattern_size ; ++i)
             _imp->patterns_degrees.at(g).at(i) = _imp->pattern_graph_rows[i * max_graphs + g].count();
+    }
+
+    if (build_target) {
+        for (unsigned g = 1 ; g < max_graphs ; ++g) {
+            _imp->targets_degrees.at(g).resize(target_size);
+            for (unsigned i = 0 ; i < target_size ; ++i)
+                _imp->targets_degrees.at(g).at(i) = _imp->target_graph_rows[i * max_graphs + g].count();
+        }
 
         for (unsigned i = 0 ; i < target_size ; ++i)
-            _imp->targets_degrees.at(g).at(i) = _imp->target_graph_rows[i * max_graphs + g].count();
+            _imp->largest_target_degree = max(_imp->largest_target_degree, _imp->targets_degrees[0][i]);
     }
 
-    for (unsigned i = 0 ; i < target_size ; ++i)
-        _imp->largest_target_degree = max(_imp->largest_target_degree, _imp->targets_degrees[0][i]);
-
     // re-add loops
     for (unsigned i = 0 ; i < pattern_size ; ++i)
         if (_imp->pattern_loops[i])
             _imp->pattern_graph_rows[i * max_graphs + 0].set(i);
 
-    for (unsigned i = 0 ; i < target_size ; ++i)
-        if (_imp->target_loops[i])
-            _imp->target_graph_rows[i * max_graphs + 0].set(i);
+    if (build_target) {
+        for (unsigned i = 0 ; i < target_size ; ++i)
+            if (_imp->target_loops[i])
+                _imp->target_graph_rows[i * max_graphs + 0].set(i);
+
+        if (_imp->use_target_cache)
+            _save_target_cache();
+    }
 
     // pattern adjacencies, compressed
     _imp->pattern_adjacencies_bits.resize(pattern_size * pattern_size);
@@ -1020,25 +1259,29 @@ auto HomomorphismModel::prepare() -> bool
                 if (_imp->pattern_graph_rows[i * max_graphs + g].test(j))
                     _imp->pattern_adjacencies_bits[i * pattern_size + j] |= (1u << g);
 
+    // and as lists, for propagation that only wants to look at neighbours
+    _imp->pattern_neighbours.resize(pattern_size);
+    for (unsigned i = 0 ; i < pattern_size ; ++i)
+        for (unsigned j = 0 ; j < pattern_size ; ++j)
+            if (0 != _imp->pattern_adjacencies_bits[i * pattern_size + j] || 0 != _imp->pattern_adjacencies_bits[j * pattern_size + i])
+                _imp->pattern_neighbours[i].push_back(j);
+
     return true;
 }
 
-auto HomomorphismModel::_build_exact_path_graphs(vector<SVOBitset> & graph_rows, unsigned size, unsigned & idx,
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::_build_exact_path_graphs(vector<Bitset_> & graph_rows, unsigned size, unsigned & idx,
         unsigned number_of_exact_path_graphs, bool directed, bool at_most) -> void
 {
     vector<vector<unsigned> > path_counts(size, vector<unsigned>(size, 0));
 
     // count number of paths from w to v (unless directed, only w >= v, so not v to w)
     for (unsigned v = 0 ; v < size ; ++v) {
-        auto nv = graph_rows[v * max_graphs + 0];
-        for (auto c = nv.find_first() ; c != decltype(nv)::npos ; c = nv.find_first()) {
-            nv.reset(c);
-            auto nc = graph_rows[c * max_graphs + 0];
-            for (auto w = nc.find_first() ; w != decltype(nc)::npos && (directed ? true : w <= v) ; w = nc.find_first()) {
-                nc.reset(w);
+        graph_rows[v * max_graphs + 0].for_each_set_bit([&] (unsigned c) {
+            const auto & nc = graph_rows[c * max_graphs + 0];
+            for (auto w = nc.find_first() ; w != Bitset_::npos && (directed ? true : w <= v) ; w = nc.find_next(w))
                 ++path_counts[v][w];
-            }
-        }
+        });
     }
 
     for (unsigned v = 0 ; v < size ; ++v) {
@@ -1062,32 +1305,34 @@ auto HomomorphismModel::_build_exact_path_graphs(vector<SVOBitset> & graph_rows,
     idx += number_of_exact_path_graphs;
 }
 
-auto HomomorphismModel::_build_distance3_graphs(vector<SVOBitset> & graph_rows, unsigned size, unsigned & idx) -> void
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::_build_distance3_graphs(vector<Bitset_> & graph_rows, unsigned size, unsigned & idx) -> void
 {
     for (unsigned v = 0 ; v < size ; ++v) {
-        auto nv = graph_rows[v * max_graphs + 0];
+        const auto & nv = graph_rows[v * max_graphs + 0];
         graph_rows[v * max_graphs + idx] |= nv;
-        for (auto c = nv.find_first() ; c != decltype(nv)::npos ; c = nv.find_first()) {
-            nv.reset(c);
-            auto nc = graph_rows[c * max_graphs + 0];
+        nv.for_each_set_bit([&] (unsigned c) {
+            const auto & nc = graph_rows[c * max_graphs + 0];
             graph_rows[v * max_graphs + idx] |= nc;
-            for (auto w = nc.find_first() ; w != decltype(nc)::npos ; w = nc.find_first()) {
-                nc.reset(w);
+            nc.for_each_set_bit([&] (unsigned w) {
                 // v--c--w so v is within distance 3 of w's neighbours
                 graph_rows[v * max_graphs + idx] |= graph_rows[w * max_graphs + 0];
-            }
-        }
+            });
+        });
     }
 
     ++idx;
 }
 
-auto HomomorphismModel::_build_k4_graphs(vector<SVOBitset> & graph_rows, unsigned size, unsigned & idx) -> void
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::_build_k4_graphs(vector<Bitset_> & graph_rows, unsigned size, unsigned & idx) -> void
 {
     for (unsigned v = 0 ; v < size ; ++v) {
         auto nv = graph_rows[v * max_graphs + 0];
         for (unsigned w = 0 ; w < v ; ++w) {
-            if (nv.test(w)) {
+            // the intersection count is an upper bound on the number of common
+            // neighbours, so we can usually rule out a k4 without building it
+            if (nv.test(w) && nv.intersection_count(graph_rows[w * max_graphs + 0]) >= 2) {
                 // are there two common neighbours with an edge between them?
                 auto common_neighbours = graph_rows[w * max_graphs + 0];
                 common_neighbours &= nv;
@@ -1096,12 +1341,8 @@ auto HomomorphismModel::_build_k4_graphs(vector<SVOBitset> & graph_rows, unsigne
                 auto count = common_neighbours.count();
                 if (count >= 2) {
                     bool done = false;
-                    auto cn1 = common_neighbours;
-                    for (auto x = cn1.find_first() ; x != decltype(cn1)::npos && ! done ; x = cn1.find_first()) {
-                        cn1.reset(x);
-                        auto cn2 = common_neighbours;
-                        for (auto y = cn2.find_first() ; y != decltype(cn2)::npos && ! done ; y = cn2.find_first()) {
-                            cn2.reset(y);
+                    for (auto x = common_neighbours.find_first() ; x != Bitset_::npos && ! done ; x = common_neighbours.find_next(x)) {
+                        for (auto y = common_neighbours.find_first() ; y != Bitset_::npos && ! done ; y = common_neighbours.find_next(y)) {
                             if (v != w && v != x && v != y && w != x && w != y && graph_rows[x * max_graphs + 0].test(y)) {
                                 graph_rows[v * max_graphs + idx].set(w);
                                 graph_rows[w * max_graphs + idx].set(v);
@@ -1117,7 +1358,8 @@ auto HomomorphismModel::_build_k4_graphs(vector<SVOBitset> & graph_rows, unsigne
     ++idx;
 }
 
-auto HomomorphismModel::_build_extra_shape(vector<SVOBitset> & graph_rows, unsigned size, unsigned & idx, InputGraph & shape,
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::_build_extra_shape(vector<Bitset_> & graph_rows, unsigned size, unsigned & idx, InputGraph & shape,
         bool injective, int count) -> void
 {
     InputGraph master_graph(size, true, false);
@@ -1164,103 +1406,147 @@ auto HomomorphismModel::_build_extra_shape(vector<SVOBitset> & graph_rows, unsig
     ++idx;
 }
 
-auto HomomorphismModel::pattern_adjacency_bits(int p, int q) const -> PatternAdjacencyBitsType
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::pattern_adjacency_bits(int p, int q) const -> PatternAdjacencyBitsType
 {
     return _imp->pattern_adjacencies_bits[pattern_size * p + q];
 }
 
-auto HomomorphismModel::pattern_graph_row(int g, int p) const -> const SVOBitset &
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::pattern_neighbours(int p) const -> const vector<unsigned> &
+{
+    return _imp->pattern_neighbours[p];
+}
+
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::pattern_graph_row(int g, int p) const -> const Bitset_ &
 {
     return _imp->pattern_graph_rows[p * max_graphs + g];
 }
 
-auto HomomorphismModel::target_graph_row(int g, int t) const -> const SVOBitset &
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::target_graph_row(int g, int t) const -> const Bitset_ &
+{
+    return _imp->target_rows[t * max_graphs + g];
+}
+
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::forward_target_graph_row(int t) const -> const Bitset_ &
 {
-    return _imp->target_graph_rows[t * max_graphs + g];
+    return _imp->forward_target_rows[t];
 }
 
-auto HomomorphismModel::forward_target_graph_row(int t) const -> const SVOBitset &
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::reverse_target_graph_row(int t) const -> const Bitset_ &
 {
-    return _imp->forward_target_graph_rows[t];
+    return _imp->reverse_target_rows[t];
 }
 
-auto HomomorphismModel::reverse_target_graph_row(int t) const -> const SVOBitset &
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::copy_target_rows() const -> HomomorphismTargetRows<Bitset_>
 {
-    return _imp->reverse_target_graph_rows[t];
+    unsigned n_rows = target_size * max_graphs, n_directed_rows = _imp->directed ? target_size : 0;
+    return HomomorphismTargetRows<Bitset_>{ max_graphs, target_size,
+        vector<Bitset_>(_imp->target_rows, _imp->target_rows + n_rows),
+        vector<Bitset_>(_imp->forward_target_rows, _imp->forward_target_rows + n_directed_rows),
+        vector<Bitset_>(_imp->reverse_target_rows, _imp->reverse_target_rows + n_directed_rows) };
 }
 
-auto HomomorphismModel::pattern_degree(int g, int p) const -> unsigned
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::pattern_degree(int g, int p) const -> unsigned
 {
     return _imp->patterns_degrees[g][p];
 }
 
-auto HomomorphismModel::target_degree(int g, int t) const -> unsigned
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::target_degree(int g, int t) const -> unsigned
 {
     return _imp->targets_degrees[g][t];
 }
 
-auto HomomorphismModel::largest_target_degree() const -> unsigned
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::largest_target_degree() const -> unsigned
 {
     return _imp->largest_target_degree;
 }
 
-auto HomomorphismModel::has_vertex_labels() const -> bool
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::has_vertex_labels() const -> bool
 {
     return ! _imp->pattern_vertex_labels.empty();
 }
 
-auto HomomorphismModel::has_edge_labels() const -> bool
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::has_edge_labels() const -> bool
 {
     return ! _imp->pattern_edge_labels.empty();
 }
 
-auto HomomorphismModel::pattern_vertex_label(int p) const -> int
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::pattern_vertex_label(int p) const -> int
 {
     return _imp->pattern_vertex_labels[p];
 }
 
-auto HomomorphismModel::target_vertex_label(int t) const -> int
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::target_vertex_label(int t) const -> int
 {
     return _imp->target_vertex_labels[t];
 }
 
-auto HomomorphismModel::pattern_edge_label(int p, int q) const -> int
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::pattern_edge_label(int p, int q) const -> int
 {
     return _imp->pattern_edge_labels[p * pattern_size + q];
 }
 
-auto HomomorphismModel::target_edge_label(int t, int u) const -> int
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::target_edge_label(int t, int u) const -> int
 {
     return _imp->target_edge_labels[t * target_size + u];
 }
 
-auto HomomorphismModel::pattern_has_loop(int p) const -> bool
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::pattern_has_loop(int p) const -> bool
 {
     return _imp->pattern_loops[p];
 }
 
-auto HomomorphismModel::target_has_loop(int t) const -> bool
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::target_has_loop(int t) const -> bool
 {
     return _imp->target_loops[t];
 }
 
-auto HomomorphismModel::has_less_thans() const -> bool
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::has_less_thans() const -> bool
 {
     return _imp->has_less_thans;
 }
 
-auto HomomorphismModel::has_occur_less_thans() const -> bool
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::has_occur_less_thans() const -> bool
 {
     return _imp->has_occur_less_thans;
 }
 
-auto HomomorphismModel::directed() const -> bool
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::directed() const -> bool
 {
     return _imp->directed;
 }
 
-auto HomomorphismModel::add_extra_stats(list<string> & x) const -> void
+template <typename Bitset_>
+auto HomomorphismModel<Bitset_>::add_extra_stats(list<string> & x) const -> void
 {
+    if (_imp->use_target_cache) {
+        x.emplace_back("target_cache = " + _imp->target_cache_status);
+        if (_imp->target_from_cache)
+            x.emplace_back("target_cache_zero_copy = " + string{ _imp->target_cache_zero_copy ? "true" : "false" });
+        if (_imp->target_cache_saved)
+            x.emplace_back("target_cache_saved = true");
+    }
+
     if (! _imp->pattern_cliques_sizes.empty()) {
         auto join = [] (string_view t, auto & l) -> string {
             stringstream s;
@@ -1282,3 +1568,10 @@ auto HomomorphismModel::add_extra_stats(list<string> & x) const -> void
     }
 }
 
+template class HomomorphismModel<FixedBitset<1> >;
+template class HomomorphismModel<FixedBitset<2> >;
+template class HomomorphismModel<FixedBitset<4> >;
+template class HomomorphismModel<FixedBitset<8> >;
+template class HomomorphismModel<FixedBitset<16> >;
+template class HomomorphismModel<SVOBitset>;
+
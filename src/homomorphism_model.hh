@@ -4,27 +4,61 @@
 #define GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_HOMOMORPHISM_MODEL_HH 1
 
 #include "formats/input_graph.hh"
-#include "svo_bitset.hh"
 #include "homomorphism.hh"
 #include "homomorphism_domain.hh"
 #include "proof.hh"
 
+#include <map>
 #include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * A copy of the target graph rows, which is all that propagation needs from
+ * the target. Threaded search can give each NUMA node its own copy, so that
+ * the rows are in local memory.
+ */
+template <typename Bitset_>
+struct HomomorphismTargetRows
+{
+    unsigned max_graphs, target_size;
+    std::vector<Bitset_> target_graph_rows, forward_target_graph_rows, reverse_target_graph_rows;
+
+    auto target_graph_row(int g, int t) const -> const Bitset_ &
+    {
+        return target_graph_rows[t * max_graphs + g];
+    }
+
+    /// roughly how much memory this copy uses, including any out of line words
+    auto bytes() const -> unsigned long long
+    {
+        unsigned long long row_bytes = sizeof(Bitset_);
+        if (target_size > 8 * sizeof(Bitset_))
+            row_bytes += (target_size + 7) / 8;
+        return row_bytes * (target_graph_rows.size() + forward_target_graph_rows.size() + reverse_target_graph_rows.size());
+    }
+};
 
+/**
+ * Everything we know about a pattern and target pair, after preprocessing.
+ * The Bitset_ type is used for every graph row and domain, and must be able
+ * to hold max(pattern_size, target_size) bits, see with_bitset_for_size.
+ */
+template <typename Bitset_>
 class HomomorphismModel
 {
     private:
         struct Imp;
         std::unique_ptr<Imp> _imp;
 
-        auto _build_exact_path_graphs(std::vector<SVOBitset> & graph_rows, unsigned size, unsigned & idx,
+        auto _build_exact_path_graphs(std::vector<Bitset_> & graph_rows, unsigned size, unsigned & idx,
                 unsigned number_of_exact_path_graphs, bool directed, bool at_most) -> void;
 
-        auto _build_distance3_graphs(std::vector<SVOBitset> & graph_rows, unsigned size, unsigned & idx) -> void;
+        auto _build_distance3_graphs(std::vector<Bitset_> & graph_rows, unsigned size, unsigned & idx) -> void;
 
-        auto _build_k4_graphs(std::vector<SVOBitset> & graph_rows, unsigned size, unsigned & idx) -> void;
+        auto _build_k4_graphs(std::vector<Bitset_> & graph_rows, unsigned size, unsigned & idx) -> void;
 
-        auto _build_extra_shape(std::vector<SVOBitset> & graph_rows, unsigned size, unsigned & idx,
+        auto _build_extra_shape(std::vector<Bitset_> & graph_rows, unsigned size, unsigned & idx,
                 InputGraph & shape, bool injective, int count) -> void;
 
         auto _check_degree_compatibility(
@@ -48,6 +82,13 @@ class HomomorphismModel
 
         auto _prove_no_clique(unsigned g, int p, int t) const -> void;
 
+        auto _target_cache_settings() const -> std::string;
+
+        auto _load_target_cache(std::map<std::string, int> & vertex_labels_map, int & next_vertex_label,
+                std::map<std::string, int> & edge_labels_map, int & next_edge_label) -> bool;
+
+        auto _save_target_cache() const -> void;
+
     public:
         using PatternAdjacencyBitsType = uint8_t;
 
@@ -67,11 +108,18 @@ class HomomorphismModel
         auto prepare() -> bool;
 
         auto pattern_adjacency_bits(int p, int q) const -> PatternAdjacencyBitsType;
-        auto pattern_graph_row(int g, int p) const -> const SVOBitset &;
-        auto target_graph_row(int g, int t) const -> const SVOBitset &;
 
-        auto forward_target_graph_row(int t) const -> const SVOBitset &;
-        auto reverse_target_graph_row(int t) const -> const SVOBitset &;
+        /// every q with a non-zero pattern_adjacency_bits(p, q) or (q, p), in order
+        auto pattern_neighbours(int p) const -> const std::vector<unsigned> &;
+
+        auto pattern_graph_row(int g, int p) const -> const Bitset_ &;
+        auto target_graph_row(int g, int t) const -> const Bitset_ &;
+
+        auto forward_target_graph_row(int t) const -> const Bitset_ &;
+        auto reverse_target_graph_row(int t) const -> const Bitset_ &;
+
+        /// a copy of every target row, made by (and so local to) the caller
+        auto copy_target_rows() const -> HomomorphismTargetRows<Bitset_>;
 
         auto pattern_degree(int g, int p) const -> unsigned;
         auto target_degree(int g, int t) const -> unsigned;
@@ -88,7 +136,7 @@ class HomomorphismModel
         auto pattern_has_loop(int p) const -> bool;
         auto target_has_loop(int t) const -> bool;
 
-        auto initialise_domains(std::vector<HomomorphismDomain> & domains) const -> bool;
+        auto initialise_domains(HomomorphismDomains<Bitset_> & domains) const -> bool;
 
         auto add_extra_stats(std::list<std::string> &) const -> void;
 };
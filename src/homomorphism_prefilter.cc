@@ -0,0 +1,113 @@
+/* vim: set sw=4 sts=4 et foldmethod=syntax : */
+
+#include "homomorphism_prefilter.hh"
+#include "homomorphism_traits.hh"
+
+#include <algorithm>
+#include <functional>
+
+using std::greater;
+using std::map;
+using std::sort;
+using std::string;
+using std::string_view;
+using std::vector;
+
+auto summarise_for_prefilter(const InputGraph & graph) -> HomomorphismPrefilterSummary
+{
+    HomomorphismPrefilterSummary result;
+    result.vertices = graph.size();
+    result.directed = graph.directed();
+    result.has_vertex_labels = graph.has_vertex_labels();
+    result.has_edge_labels = graph.has_edge_labels();
+
+    result.degrees.resize(graph.size());
+    graph.for_each_edge([&] (int f, int t, string_view l) {
+        if (f == t)
+            ++result.loops;
+        else {
+            ++result.edges;
+            ++result.degrees[f];
+            ++result.edge_labels[string{ l }];
+        }
+    });
+    sort(result.degrees.begin(), result.degrees.end(), greater<int>());
+
+    // an unlabelled graph has every vertex labelled with the empty string
+    if (graph.has_vertex_labels())
+        for (int v = 0 ; v < graph.size() ; ++v)
+            ++result.vertex_labels[string{ graph.vertex_label(v) }];
+    else if (graph.size() > 0)
+        result.vertex_labels.emplace("", graph.size());
+
+    return result;
+}
+
+auto prefilter_homomorphism_problem(
+        const HomomorphismPrefilterSummary & pattern,
+        const HomomorphismPrefilterSummary & target,
+        const HomomorphismParams & params) -> const char *
+{
+    bool injective = is_nonshrinking(params);
+
+    // can p things go to t things? if we're injective each needs its own,
+    // otherwise they can share one
+    auto covers = [&] (unsigned long long p, unsigned long long t) -> bool {
+        return injective ? p <= t : (0 == p || 0 != t);
+    };
+
+    auto histogram_covers = [&] (const map<string, unsigned> & p, const map<string, unsigned> & t) -> bool {
+        for (auto & [ label, count ] : p) {
+            auto f = t.find(label);
+            if (! covers(count, f == t.end() ? 0 : f->second))
+                return false;
+        }
+        return true;
+    };
+
+    if (injective && pattern.vertices > target.vertices)
+        return "vertices";
+
+    // loops can only go to loops, and if we're induced, non-loops only to non-loops
+    if (! covers(pattern.loops, target.loops))
+        return "loops";
+    if (params.induced && ! covers(pattern.vertices - pattern.loops, target.vertices - target.loops))
+        return "loops";
+
+    bool undirected = ! pattern.directed && ! target.directed;
+    if (undirected && injective) {
+        if (pattern.edges > target.edges)
+            return "edges";
+
+        auto non_edges = [] (const HomomorphismPrefilterSummary & s) -> unsigned long long {
+            return (s.vertices > 0 ? 1ull * s.vertices * (s.vertices - 1) : 0) - s.edges;
+        };
+        if (params.induced && non_edges(pattern) > non_edges(target))
+            return "non_edges";
+    }
+
+    if (pattern.has_vertex_labels && ! histogram_covers(pattern.vertex_labels, target.vertex_labels))
+        return "vertex_labels";
+
+    if (undirected && pattern.has_edge_labels && ! histogram_covers(pattern.edge_labels, target.edge_labels))
+        return "edge_labels";
+
+    // this is the same test that the model does in prepare(), just sooner
+    if (global_degree_is_preserved(params)) {
+        for (unsigned i = 0 ; i < pattern.degrees.size() ; ++i)
+            if (pattern.degrees[i] > target.degrees[i])
+                return "degrees";
+    }
+    else if (degree_and_nds_are_preserved(params) && ! pattern.degrees.empty()
+            && (target.degrees.empty() || pattern.degrees.front() > target.degrees.front()))
+        return "degrees";
+
+    return nullptr;
+}
+
+auto homomorphism_prefilter_names() -> const vector<string> &
+{
+    static const vector<string> names{ "vertices", "loops", "edges", "non_edges", "vertex_labels", "edge_labels", "degrees" };
+    return names;
+}
+
@@ -0,0 +1,51 @@
+/* vim: set sw=4 sts=4 et foldmethod=syntax : */
+
+#ifndef GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_HOMOMORPHISM_PREFILTER_HH
+#define GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_HOMOMORPHISM_PREFILTER_HH 1
+
+#include "formats/input_graph.hh"
+#include "homomorphism.hh"
+
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * Enough about a graph to rule out some pattern and target pairs without
+ * building a model. A summary is made once for each graph, so when one
+ * pattern is tried against many targets (or the other way round), the
+ * fixed side is only looked at once.
+ */
+struct HomomorphismPrefilterSummary
+{
+    unsigned vertices = 0, loops = 0;
+
+    /// directed edges, not counting loops, so undirected edges count twice
+    unsigned long long edges = 0;
+
+    bool directed = false, has_vertex_labels = false, has_edge_labels = false;
+
+    /// not counting loops, largest first, as the model counts them
+    std::vector<int> degrees;
+
+    /// how many vertices or directed edges have each label
+    std::map<std::string, unsigned> vertex_labels, edge_labels;
+};
+
+auto summarise_for_prefilter(const InputGraph & graph) -> HomomorphismPrefilterSummary;
+
+/**
+ * Check some cheap necessary conditions for there to be a solution: vertex
+ * and edge counts, label histograms, degree sequence domination, and loops,
+ * depending upon what params says must be preserved. Returns nullptr if the
+ * pair passes, and otherwise the name of the first test that ruled it out.
+ */
+auto prefilter_homomorphism_problem(
+        const HomomorphismPrefilterSummary & pattern,
+        const HomomorphismPrefilterSummary & target,
+        const HomomorphismParams & params) -> const char *;
+
+/// every name that prefilter_homomorphism_problem can return, in the order it tries them
+auto homomorphism_prefilter_names() -> const std::vector<std::string> &;
+
+#endif
@@ -2,48 +2,97 @@
 
 #include "homomorphism_searcher.hh"
 #include "cheap_all_different.hh"
+#include "fixed_bitset.hh"
 
+#include <algorithm>
+#include <numeric>
 #include <optional>
+#include <sstream>
 #include <tuple>
 #include <type_traits>
 
+using std::atomic;
 using std::conditional_t;
-using std::make_optional;
+using std::fill;
+using std::find_if;
+using std::iota;
+using std::istringstream;
+using std::list;
 using std::max;
 using std::move;
+using std::mutex;
 using std::mt19937;
 using std::numeric_limits;
 using std::optional;
+using std::ostringstream;
 using std::pair;
+using std::shared_ptr;
 using std::string;
 using std::swap;
 using std::to_string;
 using std::tuple;
 using std::uniform_int_distribution;
+using std::unique_lock;
 using std::vector;
 
-HomomorphismSearcher::HomomorphismSearcher(const HomomorphismModel & m, const HomomorphismParams & p,
+template <typename Bitset_>
+HomomorphismSearcher<Bitset_>::HomomorphismSearcher(const HomomorphismModel<Bitset_> & m, const HomomorphismParams & p,
         const DuplicateSolutionFilterer & d) :
     model(m),
     params(p),
-    _duplicate_solution_filterer(d)
+    _duplicate_solution_filterer(d),
+    _scratch_at_depth(model.pattern_size + 2),
+    _in_play(model.pattern_size),
+    _occurs(model.has_occur_less_thans() ? model.target_size : 0, Bitset_{ model.pattern_size, 0 }),
+    _occurs_built(_occurs.size()),
+    _all_different_scratch(model.pattern_size, model.target_size),
+    _unit_queue(model.pattern_size, 0),
+    _changed_at(model.pattern_size, 0),
+    _neighbours_only(! params.induced && (params.injectivity == Injectivity::NonInjective
+                || (params.injectivity == Injectivity::Injective && ! params.proof))),
+    _lazy_injectivity(_neighbours_only && params.injectivity == Injectivity::Injective),
+    _used_targets(model.target_size, 0),
+    _minimise_nogoods(params.minimise_nogoods && ! params.proof && ! params.lackey)
 {
+    _value_ordering = params.value_ordering_heuristic;
+    _graphs_to_propagate = model.max_graphs;
+    _progress = params.progress;
+
     if (might_have_watches(params)) {
         watches.table.target_size = model.target_size;
         watches.table.data.resize(model.pattern_size * model.target_size);
     }
+
+    for (auto & [ a, b ] : model.pattern_less_thans_in_convenient_order) {
+        _less_than_vertices.push_back(a);
+        _less_than_vertices.push_back(b);
+    }
 }
 
-auto HomomorphismSearcher::assignments_as_proof_decisions(const HomomorphismAssignments & assignments) const -> vector<pair<int, int> >
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::root_domains(HomomorphismDomains<Bitset_> & domains) -> Domains
 {
-    vector<pair<int, int> > trail;
+    // at the root everything is in play, and with no trail levels open,
+    // any changes made are permanent
+    auto & in_play = _scratch_at_depth[0].domains_in_play;
+    in_play.resize(domains.size());
+    iota(in_play.begin(), in_play.end(), 0);
+    _trail.attach(domains);
+    return Domains{ domains, in_play };
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::assignments_as_proof_decisions(const HomomorphismAssignments & assignments) -> const vector<pair<int, int> > &
+{
+    _proof_decisions.clear();
     for (auto & a : assignments.values)
         if (a.is_decision)
-            trail.emplace_back(a.assignment.pattern_vertex, a.assignment.target_vertex);
-    return trail;
+            _proof_decisions.emplace_back(a.assignment.pattern_vertex, a.assignment.target_vertex);
+    return _proof_decisions;
 }
 
-auto HomomorphismSearcher::solution_in_proof_form(const HomomorphismAssignments & assignments) const -> vector<pair<NamedVertex, NamedVertex> >
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::solution_in_proof_form(const HomomorphismAssignments & assignments) const -> vector<pair<NamedVertex, NamedVertex> >
 {
     vector<pair<NamedVertex, NamedVertex> > solution;
     for (auto & a : assignments.values)
@@ -55,13 +104,15 @@ auto HomomorphismSearcher::solution_in_proof_form(const HomomorphismAssignments
     return solution;
 }
 
-auto HomomorphismSearcher::expand_to_full_result(const HomomorphismAssignments & assignments, VertexToVertexMapping & mapping) -> void
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::expand_to_full_result(const HomomorphismAssignments & assignments, VertexToVertexMapping & mapping) -> void
 {
     for (auto & a : assignments.values)
         mapping.emplace(a.assignment.pattern_vertex, a.assignment.target_vertex);
 }
 
-auto HomomorphismSearcher::save_result(const HomomorphismAssignments & assignments, HomomorphismResult & result) -> void
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::save_result(const HomomorphismAssignments & assignments, HomomorphismResult & result) -> void
 {
     expand_to_full_result(assignments, result.mapping);
 
@@ -71,7 +122,150 @@ auto HomomorphismSearcher::save_result(const HomomorphismAssignments & assignmen
     result.extra_stats.push_back(where);
 }
 
-auto HomomorphismSearcher::restarting_search(
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::restarting_search(
+        HomomorphismAssignments & assignments,
+        HomomorphismDomains<Bitset_> & domains,
+        unsigned long long & nodes,
+        unsigned long long & propagations,
+        loooong & solution_count,
+        int depth,
+        RestartsSchedule & restarts_schedule) -> SearchResult
+{
+    auto root = root_domains(domains);
+    auto result = restarting_search(assignments, root, nodes, propagations, solution_count, depth, restarts_schedule);
+    if (_work_stealing)
+        close_for_stealing(depth);
+    if (SearchResult::Restart == result)
+        post_staged_nogoods(root, assignments);
+    return result;
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::search_stolen_work(
+        const StolenWork & work,
+        HomomorphismAssignments & assignments,
+        HomomorphismDomains<Bitset_> & domains,
+        unsigned long long & nodes,
+        unsigned long long & propagations,
+        loooong & solution_count,
+        RestartsSchedule & restarts_schedule) -> SearchResult
+{
+    // make the same decisions as whoever we stole from, in the same way as
+    // search does. this can't fail, because it didn't for them, so if it does
+    // then we'd be quietly skipping part of the search space.
+    auto assignments_size = assignments.values.size();
+    auto new_domains = root_domains(domains);
+    unsigned depth = 0;
+    bool failed = false;
+    for ( ; depth < work.decisions.size() && ! failed ; ++depth) {
+        auto & d = work.decisions[depth];
+
+        auto & in_play = _scratch_at_depth[depth + 1].domains_in_play;
+        in_play.clear();
+        for (auto v : new_domains)
+            if (! new_domains.fixed(v))
+                in_play.push_back(v);
+        new_domains = new_domains.with_vertices(in_play);
+
+        {
+            unique_lock<mutex> lock{ _work_stealing_mutex };
+            _scratch_at_depth[depth].decision = d;
+        }
+
+        assignments.push_back({ d, true, -1, -1 });
+        _trail.push_level();
+        _trail.save(d.pattern_vertex);
+        new_domains.values(d.pattern_vertex).reset();
+        new_domains.values(d.pattern_vertex).set(d.target_vertex);
+        new_domains.count(d.pattern_vertex) = 1;
+
+        ++propagations;
+        failed = ! propagate(false, new_domains, assignments, params.propagate_using_lackey == PropagateUsingLackey::Always);
+    }
+
+    if (failed)
+        throw StolenWorkReplayError{ "replaying decision " + to_string(depth) + " of " + to_string(work.decisions.size())
+            + " for stolen work failed, but it succeeded for the thread it was stolen from" };
+
+    _stolen_node = &work;
+    auto result = restarting_search(assignments, new_domains, nodes, propagations, solution_count, depth, restarts_schedule);
+    _stolen_node = nullptr;
+    close_for_stealing(depth);
+
+    for ( ; depth > 0 ; --depth)
+        _trail.pop_level();
+    assignments.resize(assignments_size);
+
+    return result;
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::enable_work_stealing() -> void
+{
+    _work_stealing = true;
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::open_for_stealing(int depth, unsigned branch_domain, unsigned branch_v_end) -> void
+{
+    unique_lock<mutex> lock{ _work_stealing_mutex };
+    auto & s = _scratch_at_depth[depth];
+    s.open_for_stealing = true;
+    s.branch_domain = branch_domain;
+    s.next_value = 0;
+    s.end_value = branch_v_end;
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::claim_value(int depth, unsigned index) -> bool
+{
+    unique_lock<mutex> lock{ _work_stealing_mutex };
+    auto & s = _scratch_at_depth[depth];
+    if (index >= s.end_value)
+        return false;
+
+    s.next_value = index + 1;
+    s.decision = HomomorphismAssignment{ s.branch_domain, unsigned(s.branch_values[index]) };
+    return true;
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::close_for_stealing(int depth) -> void
+{
+    unique_lock<mutex> lock{ _work_stealing_mutex };
+    _scratch_at_depth[depth].open_for_stealing = false;
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::share_work(StolenWork & work, atomic<unsigned> & busy) -> bool
+{
+    unique_lock<mutex> lock{ _work_stealing_mutex };
+
+    // the shallowest node is likely to have the most work under it
+    for (unsigned depth = 0 ; depth < _scratch_at_depth.size() ; ++depth) {
+        auto & s = _scratch_at_depth[depth];
+        if (s.open_for_stealing && s.next_value < s.end_value) {
+            unsigned middle = s.next_value + (s.end_value - s.next_value) / 2;
+
+            work.decisions.clear();
+            for (unsigned d = 0 ; d < depth ; ++d)
+                work.decisions.push_back(_scratch_at_depth[d].decision);
+            work.branch_domain = s.branch_domain;
+            work.values.assign(s.branch_values.begin() + middle, s.branch_values.begin() + s.end_value);
+
+            s.end_value = middle;
+            ++busy;
+            ++_work_given_away;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::restarting_search(
         HomomorphismAssignments & assignments,
         const Domains & domains,
         unsigned long long & nodes,
@@ -82,13 +276,11 @@ auto HomomorphismSearcher::restarting_search(
 {
     if (params.proof && params.proof->super_extra_verbose()) {
         vector<pair<NamedVertex, vector<NamedVertex> > > proof_domains;
-        for (auto & d : domains) {
-            proof_domains.push_back(pair{ model.pattern_vertex_for_proof(d.v), vector<NamedVertex>{} });
-            auto values = d.values;
-            for (auto v = values.find_first() ; v != decltype(values)::npos ; v = values.find_first()) {
-                values.reset(v);
+        for (auto d : domains) {
+            proof_domains.push_back(pair{ model.pattern_vertex_for_proof(d), vector<NamedVertex>{} });
+            domains.values(d).for_each_set_bit([&] (unsigned v) {
                 proof_domains.back().second.push_back(model.target_vertex_for_proof(v));
-            }
+            });
         }
         params.proof->show_domains("entering depth " + to_string(depth), proof_domains);
     }
@@ -97,9 +289,12 @@ auto HomomorphismSearcher::restarting_search(
         return SearchResult::Aborted;
 
     ++nodes;
+    if (_progress && 0 == nodes % HomomorphismProgress::node_batch_size)
+        _progress->nodes.fetch_add(HomomorphismProgress::node_batch_size, std::memory_order_relaxed);
 
-    // find ourselves a domain, or succeed if we're all assigned
-    const HomomorphismDomain * branch_domain = find_branch_domain(domains);
+    // find ourselves a domain, or succeed if we're all assigned. if this node
+    // was stolen, whoever we stole it from has already chosen.
+    auto branch_domain = _stolen_node ? optional<unsigned>{ _stolen_node->branch_domain } : find_branch_domain(domains);
     if (! branch_domain) {
         if (params.lackey) {
             VertexToVertexMapping mapping;
@@ -123,6 +318,8 @@ auto HomomorphismSearcher::restarting_search(
             // we could be finding duplicate solutions, in threaded search
             if (_duplicate_solution_filterer(assignments)) {
                 ++solution_count;
+                if (_progress)
+                    _progress->solutions.fetch_add(1, std::memory_order_relaxed);
                 if (params.enumerate_callback) {
                     VertexToVertexMapping mapping;
                     expand_to_full_result(assignments, mapping);
@@ -138,37 +335,53 @@ auto HomomorphismSearcher::restarting_search(
     }
 
     // pull out the remaining values in this domain for branching
-    auto remaining = branch_domain->values;
-
-    vector<int> branch_v(model.target_size);
+    auto & branch_v = _scratch_at_depth[depth].branch_values;
+    branch_v.resize(model.target_size);
 
     unsigned branch_v_end = 0;
-    for (auto f_v = remaining.find_first() ; f_v != decltype(remaining)::npos ; f_v = remaining.find_first()) {
-        remaining.reset(f_v);
-        branch_v[branch_v_end++] = f_v;
+    if (_stolen_node) {
+        for (auto v : _stolen_node->values)
+            branch_v[branch_v_end++] = v;
+        _stolen_node = nullptr;
     }
+    else {
+        domains.values(*branch_domain).for_each_set_bit([&] (unsigned f_v) {
+            branch_v[branch_v_end++] = f_v;
+        });
 
-    switch (params.value_ordering_heuristic) {
-        case ValueOrdering::None:
-            break;
+        switch (_value_ordering) {
+            case ValueOrdering::None:
+                break;
 
-        case ValueOrdering::Degree:
-            degree_sort(branch_v, branch_v_end, false);
-            break;
+            case ValueOrdering::Degree:
+                degree_sort(branch_v, branch_v_end, false);
+                break;
 
-        case ValueOrdering::AntiDegree:
-            degree_sort(branch_v, branch_v_end, true);
-            break;
+            case ValueOrdering::AntiDegree:
+                degree_sort(branch_v, branch_v_end, true);
+                break;
 
-        case ValueOrdering::Biased:
-            softmax_shuffle(branch_v, branch_v_end);
-            break;
+            case ValueOrdering::Biased:
+                softmax_shuffle(branch_v, branch_v_end);
+                break;
 
-        case ValueOrdering::Random:
-            shuffle(branch_v.begin(), branch_v.begin() + branch_v_end, global_rand);
-            break;
+            case ValueOrdering::Random:
+                shuffle(branch_v.begin(), branch_v.begin() + branch_v_end, global_rand);
+                break;
+        }
     }
 
+    if (_work_stealing)
+        open_for_stealing(depth, *branch_domain, branch_v_end);
+
+    // everything that isn't fixed by now is in play below us, in the same order
+    auto & in_play = _scratch_at_depth[depth + 1].domains_in_play;
+    in_play.clear();
+    for (auto d : domains)
+        if (! domains.fixed(d))
+            in_play.push_back(d);
+    Domains new_domains = domains.with_vertices(in_play);
+
     int discrepancy_count = 0;
     bool actually_hit_a_failure = false;
 
@@ -177,26 +390,35 @@ auto HomomorphismSearcher::restarting_search(
 
     // for each value remaining...
     for (auto f_v = branch_v.begin(), f_end = branch_v.begin() + branch_v_end ; f_v != f_end ; ++f_v) {
+        // with work stealing, someone else might have taken the rest of our values
+        if (_work_stealing && ! claim_value(depth, f_v - branch_v.begin()))
+            break;
+
         if (params.proof)
-            params.proof->guessing(depth, model.pattern_vertex_for_proof(branch_domain->v), model.target_vertex_for_proof(*f_v));
+            params.proof->guessing(depth, model.pattern_vertex_for_proof(*branch_domain), model.target_vertex_for_proof(*f_v));
 
         // modified in-place by appending, we can restore by shrinking
         auto assignments_size = assignments.values.size();
 
         // make the assignment
-        assignments.values.push_back({ { branch_domain->v, unsigned(*f_v) }, true, discrepancy_count, int(branch_v_end) });
+        assignments.push_back({ { *branch_domain, unsigned(*f_v) }, true, discrepancy_count, int(branch_v_end) });
 
-        // set up new domains
-        Domains new_domains = copy_nonfixed_domains_and_make_assignment(domains, branch_domain->v, *f_v);
+        // set up new domains, remembering how to undo everything we're about to do
+        _trail.push_level();
+        _trail.save(*branch_domain);
+        new_domains.values(*branch_domain).reset();
+        new_domains.values(*branch_domain).set(*f_v);
+        new_domains.count(*branch_domain) = 1;
 
         // propagate
         ++propagations;
         if (! propagate(false, new_domains, assignments, use_lackey_for_propagation || (params.propagate_using_lackey == PropagateUsingLackey::Always))) {
             // failure? restore assignments and go on to the next thing
             if (params.proof)
-                params.proof->propagation_failure(assignments_as_proof_decisions(assignments), model.pattern_vertex_for_proof(branch_domain->v), model.target_vertex_for_proof(*f_v));
+                params.proof->propagation_failure(assignments_as_proof_decisions(assignments), model.pattern_vertex_for_proof(*branch_domain), model.target_vertex_for_proof(*f_v));
 
-            assignments.values.resize(assignments_size);
+            _trail.pop_level();
+            assignments.resize(assignments_size);
             actually_hit_a_failure = true;
 
             continue;
@@ -208,6 +430,9 @@ auto HomomorphismSearcher::restarting_search(
         // recursive search
         auto search_result = restarting_search(assignments, new_domains, nodes, propagations,
                 solution_count, depth + 1, restarts_schedule);
+        _trail.pop_level();
+        if (_work_stealing)
+            close_for_stealing(depth + 1);
 
         switch (search_result) {
             case SearchResult::Satisfiable:
@@ -218,13 +443,13 @@ auto HomomorphismSearcher::restarting_search(
 
             case SearchResult::Restart:
                 // restore assignments before posting nogoods, it's easier
-                assignments.values.resize(assignments_size);
+                assignments.resize(assignments_size);
 
                 // post nogoods for everything we've done so far
                 for (auto l = branch_v.begin() ; l != f_v ; ++l) {
-                    assignments.values.push_back({ { branch_domain->v, unsigned(*l) }, true, -2, -2 });
+                    assignments.push_back({ { *branch_domain, unsigned(*l) }, true, -2, -2 });
                     post_nogood(assignments);
-                    assignments.values.pop_back();
+                    assignments.pop_back();
                 }
 
                 return SearchResult::Restart;
@@ -237,7 +462,7 @@ auto HomomorphismSearcher::restarting_search(
                 }
 
                 // restore assignments
-                assignments.values.resize(assignments_size);
+                assignments.resize(assignments_size);
                 break;
 
             case SearchResult::UnsatisfiableAndBackjumpUsingLackey:
@@ -252,7 +477,7 @@ auto HomomorphismSearcher::restarting_search(
                 }
 
                 // restore assignments
-                assignments.values.resize(assignments_size);
+                assignments.resize(assignments_size);
                 actually_hit_a_failure = true;
                 break;
         }
@@ -277,7 +502,8 @@ auto HomomorphismSearcher::restarting_search(
         return use_lackey_for_propagation ? SearchResult::UnsatisfiableAndBackjumpUsingLackey : SearchResult::Unsatisfiable;
 }
 
-auto HomomorphismSearcher::degree_sort(
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::degree_sort(
         vector<int> & branch_v,
         unsigned branch_v_end,
         bool reverse
@@ -290,7 +516,8 @@ auto HomomorphismSearcher::degree_sort(
             });
 }
 
-auto HomomorphismSearcher::softmax_shuffle(
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::softmax_shuffle(
         vector<int> & branch_v,
         unsigned branch_v_end
         ) -> void
@@ -330,11 +557,20 @@ auto HomomorphismSearcher::softmax_shuffle(
     }
 }
 
-auto HomomorphismSearcher::post_nogood(const HomomorphismAssignments & assignments) -> void
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::post_nogood(const HomomorphismAssignments & assignments) -> void
 {
     if (! might_have_watches(params))
         return;
 
+    if (_minimise_nogoods) {
+        for (auto & a : assignments.values)
+            if (a.is_decision)
+                _staged_nogood_literals.push_back(a.assignment);
+        _staged_nogood_ends.push_back(_staged_nogood_literals.size());
+        return;
+    }
+
     Nogood<HomomorphismAssignment> nogood;
 
     for (auto & a : assignments.values)
@@ -347,59 +583,114 @@ auto HomomorphismSearcher::post_nogood(const HomomorphismAssignments & assignmen
         params.proof->post_restart_nogood(assignments_as_proof_decisions(assignments));
 }
 
-auto HomomorphismSearcher::copy_nonfixed_domains_and_make_assignment(
-        const Domains & domains,
-        unsigned branch_v,
-        unsigned f_v) -> Domains
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::minimise_nogood(const Domains & domains, HomomorphismAssignments & assignments,
+        const HomomorphismAssignment * literals, unsigned size, Nogood<HomomorphismAssignment> & nogood) -> void
 {
-    Domains new_domains;
-    new_domains.reserve(domains.size());
-    for (auto & d : domains) {
-        if (d.fixed)
+    // make the decisions again, from the root and in reverse order, propagating
+    // as we go. anything that is already assigned by the time we get to it can
+    // be dropped, and once something fails or is ruled out we can stop there.
+    nogood.literals.clear();
+    auto assignments_size = assignments.values.size();
+    _trail.push_level();
+
+    for (unsigned i = size ; i > 0 ; --i) {
+        auto & l = literals[i - 1];
+        auto & l_values = domains.values(l.pattern_vertex);
+        if (! l_values.test(l.target_vertex)) {
+            nogood.literals.push_back(l);
+            break;
+        }
+        else if (domains.fixed(l.pattern_vertex))
             continue;
 
-        new_domains.push_back(d);
-        if (d.v == branch_v) {
-            new_domains.back().values.reset();
-            new_domains.back().values.set(f_v);
-            new_domains.back().count = 1;
-        }
+        nogood.literals.push_back(l);
+        assignments.push_back({ l, true, -1, -1 });
+        _trail.save(l.pattern_vertex);
+        l_values.reset();
+        l_values.set(l.target_vertex);
+        domains.count(l.pattern_vertex) = 1;
+
+        if (! propagate(false, domains, assignments, false))
+            break;
     }
-    return new_domains;
+
+    _trail.pop_level();
+    assignments.resize(assignments_size);
 }
 
-auto HomomorphismSearcher::find_branch_domain(const Domains & domains) -> const HomomorphismDomain *
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::post_staged_nogoods(const Domains & domains, HomomorphismAssignments & assignments) -> void
 {
-    const HomomorphismDomain * result = nullptr;
-    for (auto & d : domains)
-        if (! d.fixed)
+    unsigned start = 0;
+    for (auto end : _staged_nogood_ends) {
+        minimise_nogood(domains, assignments, _staged_nogood_literals.data() + start, end - start, _minimised_nogood);
+        _nogood_literals_minimised_away += (end - start) - _minimised_nogood.literals.size();
+        watches.post_nogood(Nogood<HomomorphismAssignment>{ _minimised_nogood });
+        start = end;
+    }
+
+    _staged_nogood_literals.clear();
+    _staged_nogood_ends.clear();
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::find_branch_domain(const Domains & domains) -> optional<unsigned>
+{
+    optional<unsigned> result;
+    unsigned result_count = 0;
+    for (auto d : domains)
+        if (! domains.fixed(d)) {
+            unsigned d_count = domains.count(d);
             if ((! result) ||
-                    (d.count < result->count) ||
-                    (d.count == result->count && model.pattern_degree(0, d.v) > model.pattern_degree(0, result->v)))
-                result = &d;
+                    (d_count < result_count) ||
+                    (d_count == result_count && model.pattern_degree(0, d) > model.pattern_degree(0, *result))) {
+                result = d;
+                result_count = d_count;
+            }
+        }
     return result;
 }
 
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::target_graph_row(int g, int t) const -> const Bitset_ &
+{
+    return _target_rows ? _target_rows->target_graph_row(g, t) : model.target_graph_row(g, t);
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::forward_target_graph_row(int t) const -> const Bitset_ &
+{
+    return _target_rows ? _target_rows->forward_target_graph_rows[t] : model.forward_target_graph_row(t);
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::reverse_target_graph_row(int t) const -> const Bitset_ &
+{
+    return _target_rows ? _target_rows->reverse_target_graph_rows[t] : model.reverse_target_graph_row(t);
+}
+
+template <typename Bitset_>
 template <bool directed_, bool has_edge_labels_, bool induced_, bool verbose_proofs_>
-auto HomomorphismSearcher::propagate_adjacency_constraints(HomomorphismDomain & d, const HomomorphismAssignment & current_assignment) -> void
+auto HomomorphismSearcher<Bitset_>::propagate_adjacency_constraints(unsigned v, Bitset_ & values, unsigned & count, const HomomorphismAssignment & current_assignment) -> void
 {
-    const auto & graph_pairs_to_consider = model.pattern_adjacency_bits(current_assignment.pattern_vertex, d.v);
+    const auto & graph_pairs_to_consider = model.pattern_adjacency_bits(current_assignment.pattern_vertex, v);
 
-    [[ maybe_unused ]] conditional_t<verbose_proofs_, SVOBitset, tuple<> > before;
+    [[ maybe_unused ]] conditional_t<verbose_proofs_, Bitset_, tuple<> > before;
     if constexpr (verbose_proofs_) {
-        before = d.values;
+        before = values;
     }
 
     if constexpr (! directed_) {
         // for the original graph pair, if we're adjacent...
         if (graph_pairs_to_consider & (1u << 0)) {
             // ...then we can only be mapped to adjacent vertices
-            d.values &= model.target_graph_row(0, current_assignment.target_vertex);
+            count = values.intersect_with_and_count(target_graph_row(0, current_assignment.target_vertex));
         }
         else {
             if constexpr (induced_) {
                 // ...otherwise we can only be mapped to adjacent vertices
-                d.values.intersect_with_complement(model.target_graph_row(0, current_assignment.target_vertex));
+                count = values.intersect_with_complement_and_count(target_graph_row(0, current_assignment.target_vertex));
             }
         }
     }
@@ -407,249 +698,310 @@ auto HomomorphismSearcher::propagate_adjacency_constraints(HomomorphismDomain &
         // both forward and reverse edges to consider
         if (graph_pairs_to_consider & (1u << 0)) {
             // ...then we can only be mapped to adjacent vertices
-            d.values &= model.forward_target_graph_row(current_assignment.target_vertex);
+            count = values.intersect_with_and_count(forward_target_graph_row(current_assignment.target_vertex));
         }
         else {
             if constexpr (induced_) {
                 // ...otherwise we can only be mapped to adjacent vertices
-                d.values.intersect_with_complement(model.forward_target_graph_row(current_assignment.target_vertex));
+                count = values.intersect_with_complement_and_count(forward_target_graph_row(current_assignment.target_vertex));
             }
         }
 
-        const auto & reverse_edge_graph_pairs_to_consider = model.pattern_adjacency_bits(d.v, current_assignment.pattern_vertex);
+        const auto & reverse_edge_graph_pairs_to_consider = model.pattern_adjacency_bits(v, current_assignment.pattern_vertex);
 
         if (reverse_edge_graph_pairs_to_consider & (1u << 0)) {
             // ...then we can only be mapped to adjacent vertices
-            d.values &= model.reverse_target_graph_row(current_assignment.target_vertex);
+            count = values.intersect_with_and_count(reverse_target_graph_row(current_assignment.target_vertex));
         }
         else {
             if constexpr (induced_) {
                 // ...otherwise we can only be mapped to adjacent vertices
-                d.values.intersect_with_complement(model.reverse_target_graph_row(current_assignment.target_vertex));
+                count = values.intersect_with_complement_and_count(reverse_target_graph_row(current_assignment.target_vertex));
             }
         }
     }
 
     if constexpr (verbose_proofs_) {
-        if (before.count() != d.values.count())
+        if (before.count() != values.count())
             params.proof->propagated(model.pattern_vertex_for_proof(current_assignment.pattern_vertex), model.target_vertex_for_proof(current_assignment.target_vertex),
-                    0, before.count() - d.values.count(), model.pattern_vertex_for_proof(d.v));
-        before = d.values;
+                    0, before.count() - values.count(), model.pattern_vertex_for_proof(v));
+        before = values;
     }
 
     // and for each remaining graph pair...
-    for (unsigned g = 1 ; g < model.max_graphs ; ++g) {
+    for (unsigned g = 1 ; g < _graphs_to_propagate ; ++g) {
         // if we're adjacent...
         if (graph_pairs_to_consider & (1u << g)) {
             // ...then we can only be mapped to adjacent vertices
-            d.values &= model.target_graph_row(g, current_assignment.target_vertex);
+            count = values.intersect_with_and_count(target_graph_row(g, current_assignment.target_vertex));
         }
 
         if constexpr (verbose_proofs_) {
-            if (before.count() != d.values.count())
+            if (before.count() != values.count())
                 params.proof->propagated(model.pattern_vertex_for_proof(current_assignment.pattern_vertex), model.target_vertex_for_proof(current_assignment.target_vertex),
-                        g, before.count() - d.values.count(), model.pattern_vertex_for_proof(d.v));
-            before = d.values;
+                        g, before.count() - values.count(), model.pattern_vertex_for_proof(v));
+            before = values;
         }
     }
 
     if constexpr (has_edge_labels_) {
         // if we're adjacent in the original graph, additionally the edge labels need to match up
         if (graph_pairs_to_consider & (1u << 0)) {
-            auto check_d_values = d.values;
-
-            auto want_forward_label = model.pattern_edge_label(current_assignment.pattern_vertex, d.v);
-            for (auto c = check_d_values.find_first() ; c != decltype(check_d_values)::npos ; c = check_d_values.find_first()) {
-                check_d_values.reset(c);
-
+            auto want_forward_label = model.pattern_edge_label(current_assignment.pattern_vertex, v);
+            values.for_each_set_bit([&] (unsigned c) {
                 auto got_forward_label = model.target_edge_label(current_assignment.target_vertex, c);
-                if (got_forward_label != want_forward_label)
-                    d.values.reset(c);
-            }
+                if (got_forward_label != want_forward_label) {
+                    values.reset(c);
+                    --count;
+                }
+            });
         }
 
-        const auto & reverse_edge_graph_pairs_to_consider = model.pattern_adjacency_bits(d.v, current_assignment.pattern_vertex);
+        const auto & reverse_edge_graph_pairs_to_consider = model.pattern_adjacency_bits(v, current_assignment.pattern_vertex);
         if (reverse_edge_graph_pairs_to_consider & (1u << 0)) {
-            auto check_d_values = d.values;
-
-            auto want_reverse_label = model.pattern_edge_label(d.v, current_assignment.pattern_vertex);
-            for (auto c = check_d_values.find_first() ; c != decltype(check_d_values)::npos ; c = check_d_values.find_first()) {
-                check_d_values.reset(c);
-
+            auto want_reverse_label = model.pattern_edge_label(v, current_assignment.pattern_vertex);
+            values.for_each_set_bit([&] (unsigned c) {
                 auto got_reverse_label = model.target_edge_label(c, current_assignment.target_vertex);
-                if (got_reverse_label != want_reverse_label)
-                    d.values.reset(c);
-            }
+                if (got_reverse_label != want_reverse_label) {
+                    values.reset(c);
+                    --count;
+                }
+            });
         }
     }
 }
 
-auto HomomorphismSearcher::both_in_the_neighbourhood_of_some_vertex(unsigned v, unsigned w) -> bool
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::both_in_the_neighbourhood_of_some_vertex(unsigned v, unsigned w) -> bool
 {
-    auto i = model.pattern_graph_row(0, v);
-    i &= model.pattern_graph_row(0, w);
-    return i.any();
+    return 0 != model.pattern_graph_row(0, v).intersection_count(model.pattern_graph_row(0, w));
 }
 
-auto HomomorphismSearcher::propagate_simple_constraints(Domains & new_domains, const HomomorphismAssignment & current_assignment) -> bool
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::propagate_simple_constraints_on(const Domains & new_domains, unsigned d, const HomomorphismAssignment & current_assignment) -> bool
 {
-    // propagate for each remaining domain...
-    for (auto & d : new_domains) {
-        if (d.fixed)
-            continue;
-
-        // injectivity
-        switch (params.injectivity) {
-            case Injectivity::Injective:
-                d.values.reset(current_assignment.target_vertex);
-                break;
-            case Injectivity::LocallyInjective:
-                if (both_in_the_neighbourhood_of_some_vertex(current_assignment.pattern_vertex, d.v))
-                    d.values.reset(current_assignment.target_vertex);
-                break;
-            case Injectivity::NonInjective:
-                break;
-        }
+    auto & d_values = new_domains.values(d);
+    auto & d_count = new_domains.count(d);
+    auto old_d_count = d_count;
+
+    // only trail domains that this assignment could possibly change
+    if (params.induced || d_values.test(current_assignment.target_vertex)
+            || 0 != model.pattern_adjacency_bits(current_assignment.pattern_vertex, d)
+            || 0 != model.pattern_adjacency_bits(d, current_assignment.pattern_vertex))
+        _trail.save(d);
+    else
+        return true;
+
+    // injectivity
+    switch (params.injectivity) {
+        case Injectivity::Injective:
+            if (_lazy_injectivity) {
+                // catch up on everything used so far, now that we're here anyway
+                if (0 != d_values.intersection_count(_used_targets))
+                    d_count = d_values.intersect_with_complement_and_count(_used_targets);
+            }
+            else if (d_values.test(current_assignment.target_vertex)) {
+                d_values.reset(current_assignment.target_vertex);
+                --d_count;
+            }
+            break;
+        case Injectivity::LocallyInjective:
+            if (d_values.test(current_assignment.target_vertex) && both_in_the_neighbourhood_of_some_vertex(current_assignment.pattern_vertex, d)) {
+                d_values.reset(current_assignment.target_vertex);
+                --d_count;
+            }
+            break;
+        case Injectivity::NonInjective:
+            break;
+    }
 
-        // adjacency
-        if (! model.has_edge_labels()) {
-            if (params.induced) {
-                if (model.directed()) {
-                    if ((! params.proof) || (! params.proof->super_extra_verbose()))
-                        propagate_adjacency_constraints<true, false, true, false>(d, current_assignment);
-                    else
-                        propagate_adjacency_constraints<true, false, true, true>(d, current_assignment);
-                }
-                else {
-                    if ((! params.proof) || (! params.proof->super_extra_verbose()))
-                        propagate_adjacency_constraints<false, false, true, false>(d, current_assignment);
-                    else
-                        propagate_adjacency_constraints<false, false, true, true>(d, current_assignment);
-                }
+    // adjacency
+    if (! model.has_edge_labels()) {
+        if (params.induced) {
+            if (model.directed()) {
+                if ((! params.proof) || (! params.proof->super_extra_verbose()))
+                    propagate_adjacency_constraints<true, false, true, false>(d, d_values, d_count, current_assignment);
+                else
+                    propagate_adjacency_constraints<true, false, true, true>(d, d_values, d_count, current_assignment);
             }
             else {
-                if (model.directed()) {
-                    if ((! params.proof) || (! params.proof->super_extra_verbose()))
-                        propagate_adjacency_constraints<true, false, false, false>(d, current_assignment);
-                    else
-                        propagate_adjacency_constraints<true, false, false, true>(d, current_assignment);
-                }
-                else {
-                    if ((! params.proof) || (! params.proof->super_extra_verbose()))
-                        propagate_adjacency_constraints<false, false, false, false>(d, current_assignment);
-                    else
-                        propagate_adjacency_constraints<false, false, false, true>(d, current_assignment);
-                }
+                if ((! params.proof) || (! params.proof->super_extra_verbose()))
+                    propagate_adjacency_constraints<false, false, true, false>(d, d_values, d_count, current_assignment);
+                else
+                    propagate_adjacency_constraints<false, false, true, true>(d, d_values, d_count, current_assignment);
             }
         }
         else {
-            // edge labels are always directed
-            if (params.induced) {
+            if (model.directed()) {
                 if ((! params.proof) || (! params.proof->super_extra_verbose()))
-                    propagate_adjacency_constraints<true, true, true, false>(d, current_assignment);
+                    propagate_adjacency_constraints<true, false, false, false>(d, d_values, d_count, current_assignment);
                 else
-                    propagate_adjacency_constraints<true, true, true, true>(d, current_assignment);
+                    propagate_adjacency_constraints<true, false, false, true>(d, d_values, d_count, current_assignment);
             }
             else {
                 if ((! params.proof) || (! params.proof->super_extra_verbose()))
-                    propagate_adjacency_constraints<true, true, false, false>(d, current_assignment);
+                    propagate_adjacency_constraints<false, false, false, false>(d, d_values, d_count, current_assignment);
                 else
-                    propagate_adjacency_constraints<true, true, false, true>(d, current_assignment);
+                    propagate_adjacency_constraints<false, false, false, true>(d, d_values, d_count, current_assignment);
             }
         }
+    }
+    else {
+        // edge labels are always directed
+        if (params.induced) {
+            if ((! params.proof) || (! params.proof->super_extra_verbose()))
+                propagate_adjacency_constraints<true, true, true, false>(d, d_values, d_count, current_assignment);
+            else
+                propagate_adjacency_constraints<true, true, true, true>(d, d_values, d_count, current_assignment);
+        }
+        else {
+            if ((! params.proof) || (! params.proof->super_extra_verbose()))
+                propagate_adjacency_constraints<true, true, false, false>(d, d_values, d_count, current_assignment);
+            else
+                propagate_adjacency_constraints<true, true, false, true>(d, d_values, d_count, current_assignment);
+        }
+    }
+
+    // we might have removed values, and the fused operations above have
+    // kept the count up to date for us
+    if (0 == d_count)
+        return false;
+    else if (d_count != old_d_count)
+        domain_changed(new_domains, d);
 
-        // we might have removed values
-        d.count = d.values.count();
-        if (0 == d.count)
+    return true;
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::propagate_simple_constraints(const Domains & new_domains, const HomomorphismAssignment & current_assignment) -> bool
+{
+    if (_neighbours_only) {
+        // nothing else can be affected, and anything not in play is fixed
+        for (auto d : model.pattern_neighbours(current_assignment.pattern_vertex))
+            if ((! new_domains.fixed(d)) && ! propagate_simple_constraints_on(new_domains, d, current_assignment))
+                return false;
+    }
+    else {
+        // propagate for each remaining domain, sweeping through the matrix in order...
+        for (auto d : new_domains)
+            if ((! new_domains.fixed(d)) && ! propagate_simple_constraints_on(new_domains, d, current_assignment))
+                return false;
+    }
+
+    return true;
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::apply_used_targets(const Domains & new_domains, unsigned d) -> bool
+{
+    auto & d_values = new_domains.values(d);
+    if (0 != d_values.intersection_count(_used_targets)) {
+        _trail.save(d);
+        auto & d_count = new_domains.count(d);
+        d_count = d_values.intersect_with_complement_and_count(_used_targets);
+        if (0 == d_count)
             return false;
+        domain_changed(new_domains, d);
     }
 
     return true;
 }
 
-auto HomomorphismSearcher::propagate_less_thans(Domains & new_domains) -> bool
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::mark_in_play(const Domains & new_domains) -> void
 {
-    vector<int> find_domain(model.pattern_size, -1);
+    fill(_in_play.begin(), _in_play.end(), false);
+    for (auto d : new_domains)
+        _in_play[d] = true;
+}
 
-    for (unsigned i = 0, i_end = new_domains.size() ; i != i_end ; ++i)
-        find_domain[new_domains[i].v] = i;
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::propagate_less_thans(const Domains & new_domains) -> bool
+{
+    mark_in_play(new_domains);
 
     for (auto & [ a, b ] : model.pattern_less_thans_in_convenient_order) {
-        if (find_domain[a] == -1 || find_domain[b] == -1)
+        if (! _in_play[a] || ! _in_play[b])
             continue;
-        auto & a_domain = new_domains[find_domain[a]];
-        auto & b_domain = new_domains[find_domain[b]];
+        auto & a_values = new_domains.values(a);
+        auto & b_values = new_domains.values(b);
 
        // first value of b must be at least one after the first possible value of a
-       auto first_a = a_domain.values.find_first();
-       if (first_a == decltype(a_domain.values)::npos)
+       auto first_a = a_values.find_first();
+       if (first_a == Bitset_::npos)
            return false;
        auto first_allowed_b = first_a + 1;
 
        if (first_allowed_b >= model.target_size)
            return false;
 
-       for (auto v = b_domain.values.find_first() ; v != decltype(b_domain.values)::npos ; v = b_domain.values.find_first()) {
-           if (v >= first_allowed_b)
-               break;
-           b_domain.values.reset(v);
+       if (b_values.find_first() < first_allowed_b) {
+           _trail.save(b);
+           for (auto v = b_values.find_first() ; v != Bitset_::npos && v < first_allowed_b ; v = b_values.find_next(v))
+               b_values.reset(v);
+
+           // b has shrunk
+           new_domains.count(b) = b_values.count();
+           domain_changed(new_domains, b);
        }
 
-       // b might have shrunk (and detect empty before the next bit to make life easier)
-       b_domain.count = b_domain.values.count();
-       if (0 == b_domain.count)
+       // detect empty before the next bit to make life easier
+       if (0 == new_domains.count(b))
            return false;
     }
 
-    for (auto & [ a, b ] : model.pattern_less_thans_in_convenient_order) {
-        if (find_domain[a] == -1 || find_domain[b] == -1)
+    // upper bounds flow the other way, so going backwards means one pass is enough
+    for (auto c = model.pattern_less_thans_in_convenient_order.rbegin() ; c != model.pattern_less_thans_in_convenient_order.rend() ; ++c) {
+        auto & [ a, b ] = *c;
+        if (! _in_play[a] || ! _in_play[b])
             continue;
-        auto & a_domain = new_domains[find_domain[a]];
-        auto & b_domain = new_domains[find_domain[b]];
+        auto & a_values = new_domains.values(a);
+        auto & b_values = new_domains.values(b);
 
         // last value of a must be at least one before the last possible value of b
-        auto b_values_copy = b_domain.values;
-        auto last_b = b_domain.values.find_first();
-        for (auto v = last_b ; v != decltype(b_values_copy)::npos ; v = b_values_copy.find_first()) {
-            b_values_copy.reset(v);
-            last_b = v;
-        }
+        auto last_b = b_values.find_last();
 
         if (last_b == 0)
             return false;
         auto last_allowed_a = last_b - 1;
 
-        auto a_values_copy = a_domain.values;
-        for (auto v = a_values_copy.find_first() ; v != decltype(a_values_copy)::npos ; v = a_values_copy.find_first()) {
-            a_values_copy.reset(v);
-            if (v > last_allowed_a)
-                a_domain.values.reset(v);
+        if (a_values.find_next(last_allowed_a) != Bitset_::npos) {
+            _trail.save(a);
+            for (auto v = a_values.find_next(last_allowed_a) ; v != Bitset_::npos ; v = a_values.find_next(v))
+                a_values.reset(v);
+
+            // a has shrunk
+            new_domains.count(a) = a_values.count();
+            domain_changed(new_domains, a);
         }
 
-        // a might have shrunk
-        a_domain.count = a_domain.values.count();
-        if (0 == a_domain.count)
+        if (0 == new_domains.count(a))
             return false;
     }
 
     return true;
 }
 
-auto HomomorphismSearcher::propagate_occur_less_thans(
-        const optional<HomomorphismAssignment> & current_assignment,
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::propagate_occur_less_thans(
+        unsigned first_new_assignment,
         const HomomorphismAssignments & assignments,
-        Domains & new_domains) -> bool
+        const Domains & new_domains) -> bool
 {
-    vector<optional<SVOBitset> > occurs(model.target_size);
+    // only values that appear in a constraint get an occurs set
+    auto & occurs = _occurs;
+    for (auto & [ a, b ] : model.target_occur_less_thans_in_convenient_order)
+        _occurs_built[a] = _occurs_built[b] = false;
 
     auto build_occurs = [&] (int p) -> void {
-        if (occurs[p])
+        if (_occurs_built[p])
             return;
 
-        occurs[p] = make_optional<SVOBitset>(model.pattern_size, 0);
-        for (auto & d : new_domains)
-            if (d.values.test(p))
-                occurs[p]->set(d.v);
+        _occurs_built[p] = true;
+        occurs[p].reset();
+        for (auto d : new_domains)
+            if (new_domains.values(d).test(p))
+                occurs[p].set(d);
     };
 
     for (auto & [ a, b ] : model.target_occur_less_thans_in_convenient_order) {
@@ -658,56 +1010,67 @@ auto HomomorphismSearcher::propagate_occur_less_thans(
     }
 
     for (auto & a : assignments.values)
-        if (occurs[a.assignment.target_vertex])
-            occurs[a.assignment.target_vertex]->set(a.assignment.pattern_vertex);
+        if (_occurs_built[a.assignment.target_vertex])
+            occurs[a.assignment.target_vertex].set(a.assignment.pattern_vertex);
 
     // propagate lower bounds
     for (auto & [ a, b ] : model.target_occur_less_thans_in_convenient_order) {
-        auto first_a = occurs[a]->find_first();
-        if (first_a == SVOBitset::npos) {
+        auto first_a = occurs[a].find_first();
+        if (first_a == Bitset_::npos) {
             // no occurrence of value a, value b cannot be used either
-            occurs[b]->reset();
-            for (auto & d : new_domains)
-                if (d.values.test(b)) {
-                    d.values.reset(b);
-                    if (0 == --d.count)
+            occurs[b].reset();
+            for (auto d : new_domains)
+                if (new_domains.values(d).test(b)) {
+                    _trail.save(d);
+                    new_domains.values(d).reset(b);
+                    if (0 == --new_domains.count(d))
                         return false;
+                    domain_changed(new_domains, d);
                 }
         }
         else {
             // value a first occurs in variable x, value b cannot be used in a variable lower than x
-            for (auto & d : new_domains) {
-                if (d.v < first_a && d.values.test(b)) {
-                    occurs[b]->reset(d.v);
-                    d.values.reset(b);
-                    if (0 == --d.count)
+            for (auto d : new_domains) {
+                if (d < first_a && new_domains.values(d).test(b)) {
+                    occurs[b].reset(d);
+                    _trail.save(d);
+                    new_domains.values(d).reset(b);
+                    if (0 == --new_domains.count(d))
                         return false;
+                    domain_changed(new_domains, d);
                 }
             }
         }
     }
 
     // propagate other way: if value b must occur (because it has been assigned) then
-    // value a must go before
-    if (current_assignment) {
+    // value a must go before. decisions are also made again by unit propagation,
+    // so we only need to look at the latter.
+    for (unsigned i = first_new_assignment ; i < assignments.values.size() ; ++i) {
+        if (assignments.values[i].is_decision)
+            continue;
+
+        const auto * current_assignment = &assignments.values[i].assignment;
         for (auto & [ a, b ] : model.target_occur_less_thans_in_convenient_order) {
             if (b != current_assignment->target_vertex)
                 continue;
 
             bool saw_an_a = false;
-            for (auto & d : new_domains) {
-                if (d.v < current_assignment->pattern_vertex) {
+            for (auto d : new_domains) {
+                if (d < current_assignment->pattern_vertex) {
                     // it's before
-                    if (d.values.test(a))
+                    if (new_domains.values(d).test(a))
                         saw_an_a = true;
                 }
-                else if (d.v > current_assignment->pattern_vertex) {
+                else if (d > current_assignment->pattern_vertex) {
                     // comes after, can't use a
-                    if (d.values.test(a)) {
-                        occurs[a]->reset(d.v);
-                        d.values.reset(a);
-                        if (0 == --d.count)
+                    if (new_domains.values(d).test(a)) {
+                        occurs[a].reset(d);
+                        _trail.save(d);
+                        new_domains.values(d).reset(a);
+                        if (0 == --new_domains.count(d))
                             return false;
+                        domain_changed(new_domains, d);
                     }
                 }
             }
@@ -724,7 +1087,55 @@ auto HomomorphismSearcher::propagate_occur_less_thans(
     return true;
 }
 
-auto HomomorphismSearcher::propagate(bool initial, Domains & new_domains, HomomorphismAssignments & assignments, bool propagate_using_lackey) -> bool
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::domain_changed(const Domains & domains, unsigned v) -> void
+{
+    _changed_at[v] = ++_now;
+    if ((! domains.fixed(v)) && 1 == domains.count(v))
+        _unit_queue.set(v);
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::changed_since(const vector<unsigned> & vertices, unsigned long long when) const -> bool
+{
+    for (auto v : vertices)
+        if (_changed_at[v] > when)
+            return true;
+    return false;
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::should_run(GlobalPropagator & propagator, bool inputs_changed) -> bool
+{
+    if (propagator.must_run || inputs_changed) {
+        propagator.must_run = false;
+        ++propagator.calls;
+
+        // if it isn't idempotent, anything it changes counts as new input
+        if (! propagator.idempotent)
+            propagator.last_run = _now;
+        return true;
+    }
+
+    ++propagator.skips;
+    return false;
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::finished_running(GlobalPropagator & propagator) -> void
+{
+    if (propagator.idempotent)
+        propagator.last_run = _now;
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::propagate(bool initial, HomomorphismDomains<Bitset_> & domains, HomomorphismAssignments & assignments, bool propagate_using_lackey) -> bool
+{
+    return propagate(initial, root_domains(domains), assignments, propagate_using_lackey);
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::propagate(bool initial, const Domains & new_domains, HomomorphismAssignments & assignments, bool propagate_using_lackey) -> bool
 {
     // nogoods might be watching things in initial assignments. this is possibly not the
     // best place to put this...
@@ -735,90 +1146,138 @@ auto HomomorphismSearcher::propagate(bool initial, Domains & new_domains, Homomo
             watches.propagate(current_assignment,
                     [&] (const HomomorphismAssignment & a) { return ! assignments.contains(a); },
                     [&] (const HomomorphismAssignment & a) {
-                            for (auto & d : new_domains) {
-                                if (d.v == a.pattern_vertex) {
-                                    if (d.values.test(a.target_vertex)) {
-                                        d.values.reset(a.target_vertex);
-                                        if (0 == --d.count)
-                                            wipeout = true;
-                                    }
-                                    break;
-                                }
+                            // this only happens at the root, where every domain is in play
+                            auto & a_values = new_domains.values(a.pattern_vertex);
+                            if (a_values.test(a.target_vertex)) {
+                                _trail.save(a.pattern_vertex);
+                                a_values.reset(a.target_vertex);
+                                if (0 == --new_domains.count(a.pattern_vertex))
+                                    wipeout = true;
+                                else
+                                    domain_changed(new_domains, a.pattern_vertex);
                             }
-                        });
+                        },
+                    [&] (const HomomorphismAssignment & a) { return ! new_domains.values(a.pattern_vertex).test(a.target_vertex); });
 
             if (wipeout)
                 return false;
         }
     }
 
-    auto find_unit_domain = [&] () {
-        return find_if(new_domains.begin(), new_domains.end(), [] (HomomorphismDomain & d) {
-                return (! d.fixed) && 1 == d.count;
-                });
-    };
-
-    bool done_globals_at_least_once = false;
+    // other threads might have ruled things out since we last looked
+    if (! apply_globally_removed_values(new_domains))
+        return false;
+
+    // anything that is already unit goes on the queue, and after that, the
+    // propagators tell us when something new becomes unit
+    _used_targets.reset();
+    _unit_queue.reset();
+    for (auto d : new_domains)
+        if ((! new_domains.fixed(d)) && 1 == new_domains.count(d))
+            _unit_queue.set(d);
+
+    // the global propagators always get to run at least once
+    for (auto * g : { &_less_thans_propagator, &_occur_less_thans_propagator, &_all_different_propagator })
+        g->must_run = true;
+    _occur_less_thans_next_assignment = assignments.values.size();
+
+    while (true) {
+        // unit propagation comes first, because it is cheap and it gives the
+        // global propagators more to work with
+        if (auto branch_domain = _unit_queue.find_first() ; branch_domain != Bitset_::npos) {
+            _unit_queue.reset(branch_domain);
+
+            // this might be out of date with injectivity, and could even be empty
+            if (_lazy_injectivity && ! apply_used_targets(new_domains, branch_domain))
+                return false;
 
-    // whilst we've got a unit domain...
-    for (typename Domains::iterator branch_domain = find_unit_domain() ;
-            branch_domain != new_domains.end() || ! done_globals_at_least_once ;
-            branch_domain = find_unit_domain()) {
-        optional<HomomorphismAssignment> current_assignment;
-        if (branch_domain != new_domains.end()) {
             // what are we assigning?
-            current_assignment = HomomorphismAssignment{ branch_domain->v, unsigned(branch_domain->values.find_first()) };
+            HomomorphismAssignment current_assignment{ branch_domain, unsigned(new_domains.values(branch_domain).find_first()) };
 
             // ok, make the assignment
-            branch_domain->fixed = true;
-            assignments.values.push_back({ *current_assignment, false, -1, -1 });
+            _trail.save(branch_domain);
+            new_domains.fixed(branch_domain) = true;
+            assignments.push_back({ current_assignment, false, -1, -1 });
+
+            // every other domain implicitly loses this value, which the global
+            // propagators need to hear about
+            if (_lazy_injectivity) {
+                _used_targets.set(current_assignment.target_vertex);
+                ++_now;
+            }
 
             if (params.proof)
                 params.proof->unit_propagating(
-                        model.pattern_vertex_for_proof(current_assignment->pattern_vertex),
-                        model.target_vertex_for_proof(current_assignment->target_vertex));
+                        model.pattern_vertex_for_proof(current_assignment.pattern_vertex),
+                        model.target_vertex_for_proof(current_assignment.target_vertex));
 
             // propagate watches
             if (might_have_watches(params)) {
                 bool wipeout = false;
-                watches.propagate(*current_assignment,
+                watches.propagate(current_assignment,
                         [&] (const HomomorphismAssignment & a) { return ! assignments.contains(a); },
                         [&] (const HomomorphismAssignment & a) {
-                                for (auto & d : new_domains) {
-                                    if (d.fixed)
-                                        continue;
-
-                                    if (d.v == a.pattern_vertex) {
-                                        if (d.values.test(a.target_vertex)) {
-                                            d.values.reset(a.target_vertex);
-                                            if (0 == --d.count)
-                                                wipeout = true;
-                                        }
-                                        break;
-                                    }
+                                // anything that isn't in play was fixed further up
+                                if (new_domains.fixed(a.pattern_vertex))
+                                    return;
+
+                                auto & a_values = new_domains.values(a.pattern_vertex);
+                                if (a_values.test(a.target_vertex)) {
+                                    _trail.save(a.pattern_vertex);
+                                    a_values.reset(a.target_vertex);
+                                    if (0 == --new_domains.count(a.pattern_vertex))
+                                        wipeout = true;
+                                    else
+                                        domain_changed(new_domains, a.pattern_vertex);
                                 }
-                            });
+                            },
+                        [&] (const HomomorphismAssignment & a) { return ! new_domains.values(a.pattern_vertex).test(a.target_vertex); });
 
                 if (wipeout)
                     return false;
             }
 
             // propagate simple all different and adjacency
-            if (! propagate_simple_constraints(new_domains, *current_assignment))
+            ++_unit_propagations;
+            if (! propagate_simple_constraints(new_domains, current_assignment))
                 return false;
+
+            continue;
         }
 
-        // propagate less thans
-        if (model.has_less_thans() && ! propagate_less_thans(new_domains))
-            return false;
-        if (model.has_occur_less_thans() && ! propagate_occur_less_thans(current_assignment, assignments, new_domains))
-            return false;
+        // no units left, so try the global propagators in priority order, going
+        // back to unit propagation whenever one of them has run
+        if (model.has_less_thans() && should_run(_less_thans_propagator, changed_since(_less_than_vertices, _less_thans_propagator.last_run))) {
+            if (! propagate_less_thans(new_domains))
+                return false;
+            finished_running(_less_thans_propagator);
+            continue;
+        }
+
+        if (model.has_occur_less_thans() && should_run(_occur_less_thans_propagator,
+                    _now > _occur_less_thans_propagator.last_run || assignments.values.size() > _occur_less_thans_next_assignment)) {
+            if (! propagate_occur_less_thans(_occur_less_thans_next_assignment, assignments, new_domains))
+                return false;
+            _occur_less_thans_next_assignment = assignments.values.size();
+            finished_running(_occur_less_thans_propagator);
+            continue;
+        }
+
+        if (params.injectivity == Injectivity::Injective && should_run(_all_different_propagator, _now > _all_different_propagator.last_run)) {
+            if (_lazy_injectivity)
+                for (auto d : new_domains)
+                    if ((! new_domains.fixed(d)) && ! apply_used_targets(new_domains, d))
+                        return false;
 
-        // propagate all different
-        if (params.injectivity == Injectivity::Injective)
-            if (! cheap_all_different(model.target_size, new_domains, params.proof, &model))
+            if (! cheap_all_different(new_domains, _trail, _all_different_scratch, params.proof, &model))
                 return false;
-        done_globals_at_least_once = true;
+            for (auto v : _all_different_scratch.changed)
+                domain_changed(new_domains, v);
+            finished_running(_all_different_propagator);
+            continue;
+        }
+
+        break;
     }
 
     int dcount = 0;
@@ -832,18 +1291,19 @@ auto HomomorphismSearcher::propagate(bool initial, Domains & new_domains, Homomo
         }
         else {
             bool wipeout = false;
-            vector<int> find_domain(model.pattern_size, -1);
-            for (unsigned i = 0 ; i < new_domains.size() ; ++i)
-                find_domain[new_domains[i].v] = i;
+            mark_in_play(new_domains);
 
             auto deletion = [&] (int p, int t) -> bool {
                 if (! wipeout) {
-                    if (int d = find_domain[p] ; d != -1) {
-                        if (new_domains[d].values.test(t)) {
+                    if (_in_play[p]) {
+                        if (new_domains.values(p).test(t)) {
                             ++dcount;
-                            new_domains[d].values.reset(t);
-                            if (0 == --new_domains[d].count)
+                            _trail.save(p);
+                            new_domains.values(p).reset(t);
+                            if (0 == --new_domains.count(p))
                                 wipeout = true;
+                            else
+                                domain_changed(new_domains, p);
                             return true;
                         }
                     }
@@ -859,8 +1319,134 @@ auto HomomorphismSearcher::propagate(bool initial, Domains & new_domains, Homomo
     return true;
 }
 
-auto HomomorphismSearcher::set_seed(int t) -> void
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::set_seed(int t) -> void
 {
     global_rand.seed(t);
 }
 
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::random_state() const -> string
+{
+    ostringstream result;
+    result << global_rand;
+    return result.str();
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::set_random_state(const string & s) -> void
+{
+    istringstream in{ s };
+    in >> global_rand;
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::set_value_ordering(ValueOrdering v) -> void
+{
+    _value_ordering = v;
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::set_use_supplemental_graphs(bool b) -> void
+{
+    _graphs_to_propagate = b ? model.max_graphs : 1;
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::set_target_rows(const HomomorphismTargetRows<Bitset_> * r) -> void
+{
+    _target_rows = r;
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::set_progress(const shared_ptr<HomomorphismProgress> & p) -> void
+{
+    _progress = p;
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::set_globally_removed_values(const GloballyRemovedValues * g) -> void
+{
+    _globally_removed = g;
+    _globally_removed_values.assign(model.pattern_size, Bitset_{ model.target_size, 0 });
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::apply_globally_removed_values(const Domains & new_domains) -> bool
+{
+    if (! _globally_removed)
+        return true;
+
+    // has anything new turned up since we last looked?
+    if (auto version = _globally_removed->version.load(std::memory_order_acquire) ; version != _globally_removed_version) {
+        const constexpr unsigned bits_per_word = sizeof(BitWord) * 8;
+        for (unsigned p = 0 ; p < model.pattern_size ; ++p) {
+            bool had_any = _globally_removed_values[p].any();
+            for (unsigned i = 0 ; i < _globally_removed->words_per_row ; ++i)
+                for (BitWord w = _globally_removed->words[p * _globally_removed->words_per_row + i].load(std::memory_order_relaxed) ; 0 != w ; w &= (w - 1))
+                    _globally_removed_values[p].set(i * bits_per_word + __builtin_ctzll(w));
+            if ((! had_any) && _globally_removed_values[p].any())
+                _globally_removed_vertices.push_back(p);
+        }
+        _globally_removed_version = version;
+    }
+
+    // this includes fixed vertices, which fail if they are using a removed value
+    for (auto p : _globally_removed_vertices) {
+        auto & values = new_domains.values(p);
+        if (0 == values.intersection_count(_globally_removed_values[p]))
+            continue;
+
+        _trail.save(p);
+        auto old_count = new_domains.count(p);
+        new_domains.count(p) = values.intersect_with_complement_and_count(_globally_removed_values[p]);
+        _globally_removed_values_applied += old_count - new_domains.count(p);
+        if (0 == new_domains.count(p))
+            return false;
+        domain_changed(new_domains, p);
+    }
+
+    return true;
+}
+
+template <typename Bitset_>
+auto HomomorphismSearcher<Bitset_>::add_extra_stats(list<string> & x) const -> void
+{
+    x.emplace_back("unit_propagations = " + to_string(_unit_propagations));
+
+    if (might_have_watches(params)) {
+        x.emplace_back("nogoods_kept = " + to_string(watches.number_of_nogoods));
+        x.emplace_back("nogoods_subsumed = " + to_string(watches.nogoods_subsumed));
+        x.emplace_back("nogoods_deleted = " + to_string(watches.nogoods_deleted));
+        x.emplace_back("nogood_reductions = " + to_string(watches.reductions));
+        if (_minimise_nogoods)
+            x.emplace_back("nogood_literals_minimised_away = " + to_string(_nogood_literals_minimised_away));
+    }
+    if (_globally_removed)
+        x.emplace_back("globally_removed_values_applied = " + to_string(_globally_removed_values_applied));
+    if (_work_stealing)
+        x.emplace_back("work_given_away = " + to_string(_work_given_away));
+    for (auto * g : { &_less_thans_propagator, &_occur_less_thans_propagator, &_all_different_propagator })
+        if (0 != g->calls) {
+            x.emplace_back(string{ g->name } + "_propagations = " + to_string(g->calls));
+            x.emplace_back(string{ g->name } + "_propagations_skipped = " + to_string(g->skips));
+        }
+}
+
+StolenWorkReplayError::StolenWorkReplayError(const string & message) noexcept :
+    _what(message)
+{
+}
+
+auto StolenWorkReplayError::what() const noexcept -> const char *
+{
+    return _what.c_str();
+}
+
+template class HomomorphismSearcher<FixedBitset<1> >;
+template class HomomorphismSearcher<FixedBitset<2> >;
+template class HomomorphismSearcher<FixedBitset<4> >;
+template class HomomorphismSearcher<FixedBitset<8> >;
+template class HomomorphismSearcher<FixedBitset<16> >;
+template class HomomorphismSearcher<SVOBitset>;
+
@@ -3,14 +3,23 @@
 #ifndef GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_HOMOMORPHISM_SEARCHER_HH
 #define GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_HOMOMORPHISM_SEARCHER_HH 1
 
+#include "bitset_kernels.hh"
+#include "cheap_all_different.hh"
 #include "homomorphism.hh"
 #include "homomorphism_domain.hh"
 #include "homomorphism_model.hh"
 #include "homomorphism_traits.hh"
 #include "watches.hh"
 
+#include <atomic>
+#include <exception>
 #include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <random>
+#include <string>
 
 enum class SearchResult
 {
@@ -44,9 +53,14 @@ struct HomomorphismAssignmentWatchTable
     unsigned target_size;
     std::vector<EntryType_> data;
 
+    auto index(HomomorphismAssignment x) const -> std::size_t
+    {
+        return target_size * x.pattern_vertex + x.target_vertex;
+    }
+
     EntryType_ & operator[] (HomomorphismAssignment x)
     {
-        return data[target_size * x.pattern_vertex + x.target_vertex];
+        return data[index(x)];
     }
 };
 
@@ -58,57 +72,290 @@ struct HomomorphismAssignmentInformation
     int choice_count;
 };
 
+/**
+ * The assignments made so far, in order. A pattern vertex can appear more
+ * than once, but always with the same target. Only change values using
+ * push_back, pop_back and resize, which also keep track of what each pattern
+ * vertex is assigned to, so that contains does not need to search.
+ */
 struct HomomorphismAssignments
 {
     std::vector<HomomorphismAssignmentInformation> values;
 
-    bool contains(const HomomorphismAssignment & assignment) const
+    // indexed by pattern vertex. times_assigned counts entries in values,
+    // and target_of is only meaningful if that is not zero.
+    std::vector<unsigned> target_of, times_assigned;
+
+    auto reserve(unsigned pattern_size) -> void
+    {
+        values.reserve(pattern_size);
+        if (times_assigned.size() < pattern_size) {
+            target_of.resize(pattern_size);
+            times_assigned.resize(pattern_size);
+        }
+    }
+
+    auto push_back(const HomomorphismAssignmentInformation & a) -> void
+    {
+        auto p = a.assignment.pattern_vertex;
+        if (p >= times_assigned.size())
+            reserve(p + 1);
+        target_of[p] = a.assignment.target_vertex;
+        ++times_assigned[p];
+        values.push_back(a);
+    }
+
+    auto pop_back() -> void
     {
-        // this should not be a linear scan...
-        return values.end() != find_if(values.begin(), values.end(), [&] (const auto & a) {
-                return a.assignment == assignment;
-                });
+        --times_assigned[values.back().assignment.pattern_vertex];
+        values.pop_back();
+    }
+
+    /// only for shrinking, to undo push_backs
+    auto resize(std::size_t size) -> void
+    {
+        while (values.size() > size)
+            pop_back();
+    }
+
+    auto contains(const HomomorphismAssignment & assignment) const -> bool
+    {
+        auto p = assignment.pattern_vertex;
+        return p < times_assigned.size() && 0 != times_assigned[p] && target_of[p] == assignment.target_vertex;
+    }
+};
+
+/**
+ * Some values from a node in one thread's search, given away to another
+ * thread. The decisions lead from the root to the node.
+ */
+struct StolenWork
+{
+    std::vector<HomomorphismAssignment> decisions;
+    unsigned branch_domain;
+    std::vector<int> values;
+};
+
+/**
+ * Thrown if making the decisions in some StolenWork again fails, which would
+ * mean the thread it came from and the thread searching it disagree about
+ * what propagation does.
+ */
+class StolenWorkReplayError :
+    public std::exception
+{
+    private:
+        std::string _what;
+
+    public:
+        explicit StolenWorkReplayError(const std::string & message) noexcept;
+
+        auto what() const noexcept -> const char * override;
+};
+
+/**
+ * Values that some thread has shown can never be used, from unit nogoods, so
+ * that other threads can stop using them straight away rather than at their
+ * next restart. Bits are only ever set, without locking, and version goes up
+ * after anything new is set, so readers only need to look when it changes.
+ */
+struct GloballyRemovedValues
+{
+    unsigned words_per_row;
+    std::unique_ptr<std::atomic<BitWord> []> words;
+    std::atomic<unsigned long long> version{ 0 };
+
+    GloballyRemovedValues(unsigned pattern_size, unsigned target_size) :
+        words_per_row((target_size + sizeof(BitWord) * 8 - 1) / (sizeof(BitWord) * 8)),
+        words(new std::atomic<BitWord>[pattern_size * words_per_row]())
+    {
+    }
+
+    /// returns true if this wasn't already removed, in which case version needs bumping
+    auto remove(unsigned p, unsigned t) -> bool
+    {
+        BitWord bit = BitWord{ 1 } << (t % (sizeof(BitWord) * 8));
+        return ! (words[p * words_per_row + t / (sizeof(BitWord) * 8)].fetch_or(bit, std::memory_order_relaxed) & bit);
     }
 };
 
 using DuplicateSolutionFilterer = const std::function<auto (const HomomorphismAssignments &) -> bool>;
 
+template <typename Bitset_>
 class HomomorphismSearcher
 {
     private:
-        using Domains = std::vector<HomomorphismDomain>;
+        using Domains = HomomorphismDomainsView<Bitset_>;
 
-        const HomomorphismModel & model;
+        const HomomorphismModel<Bitset_> & model;
         const HomomorphismParams & params;
         const DuplicateSolutionFilterer _duplicate_solution_filterer;
 
         std::mt19937 global_rand;
 
-        auto assignments_as_proof_decisions(const HomomorphismAssignments & assignments) const -> std::vector<std::pair<int, int> >;
+        // domains are changed in place during search, and put back using the
+        // trail, so we don't need to copy or shuffle the domains themselves
+        HomomorphismDomainTrail<Bitset_> _trail;
+
+        // working space for each depth of search. this has one entry per
+        // pattern vertex and then some, so it is never resized, and each
+        // entry holds on to its buffers, so search doesn't need to allocate.
+        struct DepthScratch
+        {
+            std::vector<unsigned> domains_in_play;
+            std::vector<int> branch_values;
+
+            // with work stealing, which of branch_values are still ours, and
+            // which one we are currently under. guarded by _work_stealing_mutex.
+            bool open_for_stealing = false;
+            unsigned branch_domain = 0, next_value = 0, end_value = 0;
+            HomomorphismAssignment decision{ };
+        };
+
+        std::vector<DepthScratch> _scratch_at_depth;
+
+        // and similarly for propagators and proof logging
+        std::vector<unsigned char> _in_play;
+        std::vector<Bitset_> _occurs;
+        std::vector<char> _occurs_built;
+        CheapAllDifferentScratch<Bitset_> _all_different_scratch;
+        std::vector<std::pair<int, int> > _proof_decisions;
+
+        // propagation is driven by events. domains that become unit are
+        // queued, lowest pattern vertex first, and every domain remembers when
+        // it last lost a value, so a global propagator can be skipped if
+        // nothing it looks at has changed since it last ran.
+        struct GlobalPropagator
+        {
+            const char * name;
+
+            // if so, running it twice in a row can't do anything the first
+            // run didn't, so its own changes don't make it need to run again
+            bool idempotent;
+
+            bool must_run = true;
+            unsigned long long last_run = 0;
+            unsigned long long calls = 0, skips = 0;
+        };
+
+        Bitset_ _unit_queue;
+        std::vector<unsigned long long> _changed_at;
+        unsigned long long _now = 0;
+        unsigned long long _unit_propagations = 0;
+
+        // in priority order, cheapest first
+        GlobalPropagator _less_thans_propagator{ "less_thans", true };
+        GlobalPropagator _occur_less_thans_propagator{ "occur_less_thans", false };
+        GlobalPropagator _all_different_propagator{ "all_different", false };
+        std::vector<unsigned> _less_than_vertices;
+        unsigned _occur_less_thans_next_assignment = 0;
+
+        // without induced or locally injective constraints, an assignment can
+        // only affect its pattern neighbours, apart from injectivity. for
+        // injectivity, we keep the targets used during this propagation, and
+        // domains catch up with them when they are next looked at properly.
+        // this is only sound if cheap_all_different is going to run before
+        // propagation finishes, and we don't do it with proof logging.
+        bool _neighbours_only, _lazy_injectivity;
+        Bitset_ _used_targets;
+
+        auto domain_changed(const Domains & domains, unsigned v) -> void;
+
+        auto changed_since(const std::vector<unsigned> & vertices, unsigned long long when) const -> bool;
+
+        auto should_run(GlobalPropagator & propagator, bool inputs_changed) -> bool;
+
+        auto finished_running(GlobalPropagator & propagator) -> void;
+
+        auto assignments_as_proof_decisions(const HomomorphismAssignments & assignments) -> const std::vector<std::pair<int, int> > &;
 
         auto solution_in_proof_form(const HomomorphismAssignments & assignments) const -> std::vector<std::pair<NamedVertex, NamedVertex> >;
 
         template <bool directed_, bool has_edge_labels_, bool induced_, bool verbose_proofs_>
-        auto propagate_adjacency_constraints(HomomorphismDomain & d, const HomomorphismAssignment & current_assignment) -> void;
+        auto propagate_adjacency_constraints(unsigned v, Bitset_ & values, unsigned & count, const HomomorphismAssignment & current_assignment) -> void;
 
         auto both_in_the_neighbourhood_of_some_vertex(unsigned v, unsigned w) -> bool;
 
-        auto propagate_simple_constraints(Domains & new_domains, const HomomorphismAssignment & current_assignment) -> bool;
+        auto propagate_simple_constraints_on(const Domains & new_domains, unsigned d, const HomomorphismAssignment & current_assignment) -> bool;
+
+        auto propagate_simple_constraints(const Domains & new_domains, const HomomorphismAssignment & current_assignment) -> bool;
+
+        auto apply_used_targets(const Domains & new_domains, unsigned d) -> bool;
 
-        auto propagate_less_thans(Domains & new_domains) -> bool;
+        auto mark_in_play(const Domains & new_domains) -> void;
 
-        auto propagate_occur_less_thans(const std::optional<HomomorphismAssignment> &, const HomomorphismAssignments &, Domains & new_domains) -> bool;
+        auto propagate_less_thans(const Domains & new_domains) -> bool;
 
-        auto find_branch_domain(const Domains & domains) -> const HomomorphismDomain *;
+        auto propagate_occur_less_thans(unsigned first_new_assignment, const HomomorphismAssignments &, const Domains & new_domains) -> bool;
 
-        auto copy_nonfixed_domains_and_make_assignment(
+        auto root_domains(HomomorphismDomains<Bitset_> & domains) -> Domains;
+
+        auto find_branch_domain(const Domains & domains) -> std::optional<unsigned>;
+
+        auto propagate(bool initial, const Domains & new_domains, HomomorphismAssignments & assignments, bool propagate_using_lackey) -> bool;
+
+        auto restarting_search(
+                HomomorphismAssignments & assignments,
                 const Domains & domains,
-                unsigned branch_v,
-                unsigned f_v) -> Domains;
+                unsigned long long & nodes,
+                unsigned long long & propagations,
+                loooong & solution_count,
+                int depth,
+                RestartsSchedule & restarts_schedule) -> SearchResult;
 
         auto post_nogood(
                 const HomomorphismAssignments & assignments) -> void;
 
+        // our copy of the globally removed values, and the pattern vertices
+        // that have anything removed
+        const GloballyRemovedValues * _globally_removed = nullptr;
+        unsigned long long _globally_removed_version = 0, _globally_removed_values_applied = 0;
+        std::vector<Bitset_> _globally_removed_values;
+        std::vector<unsigned> _globally_removed_vertices;
+
+        auto apply_globally_removed_values(const Domains & new_domains) -> bool;
+
+        // if set, a (NUMA local) copy of the target rows to use instead of
+        // the model's
+        const HomomorphismTargetRows<Bitset_> * _target_rows = nullptr;
+
+        auto target_graph_row(int g, int t) const -> const Bitset_ &;
+        auto forward_target_graph_row(int t) const -> const Bitset_ &;
+        auto reverse_target_graph_row(int t) const -> const Bitset_ &;
+
+        // portfolio threads can search differently to what params say
+        ValueOrdering _value_ordering;
+        unsigned _graphs_to_propagate;
+
+        // usually from params, but worker processes report somewhere else
+        std::shared_ptr<HomomorphismProgress> _progress;
+
+        // with minimisation, nogoods are held here until search is back at
+        // the root, because that is where we can find out what to drop
+        bool _minimise_nogoods;
+        std::vector<HomomorphismAssignment> _staged_nogood_literals;
+        std::vector<unsigned> _staged_nogood_ends;
+        Nogood<HomomorphismAssignment> _minimised_nogood;
+        unsigned long long _nogood_literals_minimised_away = 0;
+
+        auto minimise_nogood(const Domains & domains, HomomorphismAssignments & assignments,
+                const HomomorphismAssignment * literals, unsigned size, Nogood<HomomorphismAssignment> & nogood) -> void;
+
+        auto post_staged_nogoods(const Domains & domains, HomomorphismAssignments & assignments) -> void;
+
+        // for work stealing. the node we start from might have been stolen,
+        // in which case its branch values come from here.
+        bool _work_stealing = false;
+        std::mutex _work_stealing_mutex;
+        unsigned long long _work_given_away = 0;
+        const StolenWork * _stolen_node = nullptr;
+
+        auto open_for_stealing(int depth, unsigned branch_domain, unsigned branch_v_end) -> void;
+
+        auto claim_value(int depth, unsigned index) -> bool;
+
+        auto close_for_stealing(int depth) -> void;
+
         auto softmax_shuffle(
                 std::vector<int> & branch_v,
                 unsigned branch_v_end
@@ -121,16 +368,20 @@ class HomomorphismSearcher
                 ) -> void;
 
     public:
-        HomomorphismSearcher(const HomomorphismModel & m, const HomomorphismParams & p,
+        HomomorphismSearcher(const HomomorphismModel<Bitset_> & m, const HomomorphismParams & p,
                 const DuplicateSolutionFilterer &);
 
         auto expand_to_full_result(const HomomorphismAssignments & assignments, VertexToVertexMapping & mapping) -> void;
 
-        auto propagate(bool initial, Domains & new_domains, HomomorphismAssignments & assignments, bool propagate_using_lackey) -> bool;
+        auto propagate(bool initial, HomomorphismDomains<Bitset_> & domains, HomomorphismAssignments & assignments, bool propagate_using_lackey) -> bool;
 
+        /**
+         * Search from the root. The domains are used as working space, but
+         * are back how they were when this returns.
+         */
         auto restarting_search(
                 HomomorphismAssignments & assignments,
-                const Domains & domains,
+                HomomorphismDomains<Bitset_> & domains,
                 unsigned long long & nodes,
                 unsigned long long & propagations,
                 loooong & solution_count,
@@ -139,8 +390,56 @@ class HomomorphismSearcher
 
         auto save_result(const HomomorphismAssignments & assignments, HomomorphismResult & result) -> void;
 
+        /// let other threads take work from us, using share_work
+        auto enable_work_stealing() -> void;
+
+        /**
+         * Give away the later half of the values remaining at our shallowest
+         * node that has any, returning false if we have nothing. Busy is
+         * increased before the work leaves us, so that it never looks like
+         * there is nothing left to do while work is changing hands.
+         */
+        auto share_work(StolenWork & work, std::atomic<unsigned> & busy) -> bool;
+
+        /**
+         * Search work stolen from another thread, by making its decisions
+         * again from the root domains, which are back how they were when this
+         * returns.
+         */
+        auto search_stolen_work(
+                const StolenWork & work,
+                HomomorphismAssignments & assignments,
+                HomomorphismDomains<Bitset_> & domains,
+                unsigned long long & nodes,
+                unsigned long long & propagations,
+                loooong & solution_count,
+                RestartsSchedule & restarts_schedule) -> SearchResult;
+
         auto set_seed(int n) -> void;
 
+        /// for checkpointing
+        auto random_state() const -> std::string;
+        auto set_random_state(const std::string &) -> void;
+
+        /// for threaded search, which must outlive us
+        auto set_globally_removed_values(const GloballyRemovedValues *) -> void;
+
+        /// for portfolio search, use a different value ordering heuristic
+        auto set_value_ordering(ValueOrdering) -> void;
+
+        /// for portfolio search, whether to propagate using supplemental
+        /// graphs during search (they are still used at the root)
+        auto set_use_supplemental_graphs(bool) -> void;
+
+        /// use this copy of the target rows, which must outlive us
+        auto set_target_rows(const HomomorphismTargetRows<Bitset_> *) -> void;
+
+        /// report progress here rather than to params.progress (may be null)
+        auto set_progress(const std::shared_ptr<HomomorphismProgress> &) -> void;
+
+        /// how often each propagator ran, and how often the global ones were skipped
+        auto add_extra_stats(std::list<std::string> &) const -> void;
+
         Watches<HomomorphismAssignment, HomomorphismAssignmentWatchTable> watches;
 };
 
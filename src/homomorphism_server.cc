@@ -0,0 +1,689 @@
+/* vim: set sw=4 sts=4 et foldmethod=syntax : */
+
+#include "homomorphism_server.hh"
+#include "homomorphism_session.hh"
+#include "configuration.hh"
+#include "formats/read_file_format.hh"
+#include "thread_utils.hh"
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <list>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using std::atomic;
+using std::condition_variable;
+using std::deque;
+using std::exception;
+using std::function;
+using std::istringstream;
+using std::list;
+using std::make_shared;
+using std::make_unique;
+using std::map;
+using std::move;
+using std::mutex;
+using std::ostringstream;
+using std::pair;
+using std::shared_ptr;
+using std::strerror;
+using std::string;
+using std::thread;
+using std::to_string;
+using std::unique_lock;
+using std::vector;
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+
+namespace
+{
+    // something wrong with a request, which goes back to the client rather
+    // than stopping the server
+    class BadRequest :
+        public exception
+    {
+        private:
+            string _what;
+
+        public:
+            explicit BadRequest(const string & message) :
+                _what(message)
+            {
+            }
+
+            auto what() const noexcept -> const char * override
+            {
+                return _what.c_str();
+            }
+    };
+
+    struct ResidentTarget
+    {
+        string name, file;
+        HomomorphismSession session;
+
+        ResidentTarget(const string & n, const string & f, InputGraph && g) :
+            name(n),
+            file(f),
+            session(move(g))
+        {
+        }
+    };
+
+    struct Query
+    {
+        string id;
+        HomomorphismCancellationToken cancellation;
+    };
+
+    struct Connection
+    {
+        int in_fd, out_fd;
+        bool owns_fds;
+
+        mutex write_mutex;
+        bool broken = false;
+
+        // ids are only reserved until the reply is written, but running
+        // counts everything that still has something to say
+        mutex queries_mutex;
+        condition_variable queries_cv;
+        map<string, shared_ptr<Query> > queries;
+        unsigned running = 0;
+
+        atomic<bool> finished{ false };
+
+        Connection(int i, int o, bool own) :
+            in_fd(i),
+            out_fd(o),
+            owns_fds(own)
+        {
+        }
+
+        ~Connection()
+        {
+            if (owns_fds) {
+                close(in_fd);
+                if (out_fd != in_fd)
+                    close(out_fd);
+            }
+        }
+
+        auto cancel_all() -> void
+        {
+            unique_lock<mutex> lock{ queries_mutex };
+            for (auto & [ _, q ] : queries)
+                q->cancellation.cancel();
+        }
+
+        auto write(const string & reply) -> void
+        {
+            bool just_broke = false;
+            {
+                unique_lock<mutex> lock{ write_mutex };
+                if (broken)
+                    return;
+
+                const char * p = reply.data();
+                auto left = reply.size();
+                while (left > 0) {
+                    auto n = ::write(out_fd, p, left);
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    if (n <= 0) {
+                        broken = just_broke = true;
+                        break;
+                    }
+                    p += n;
+                    left -= n;
+                }
+            }
+
+            // nobody is listening, so don't bother finishing their work
+            if (just_broke)
+                cancel_all();
+        }
+
+        auto wait_for_queries() -> void
+        {
+            unique_lock<mutex> lock{ queries_mutex };
+            queries_cv.wait(lock, [&] { return 0 == running; });
+        }
+    };
+
+    auto read_line(int fd, string & buffer, string & line) -> bool
+    {
+        while (true) {
+            auto nl = buffer.find('\n');
+            if (nl != string::npos) {
+                line = buffer.substr(0, nl);
+                buffer.erase(0, nl + 1);
+                if (! line.empty() && line.back() == '\r')
+                    line.pop_back();
+                return true;
+            }
+
+            char chunk[4096];
+            auto n = ::read(fd, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                // a last line with no newline still counts
+                if (buffer.empty())
+                    return false;
+                line = move(buffer);
+                buffer.clear();
+                return true;
+            }
+            buffer.append(chunk, n);
+        }
+    }
+
+    auto format_mapping(const InputGraph & pattern, const InputGraph & target, const VertexToVertexMapping & mapping) -> string
+    {
+        string result;
+        for (auto v : mapping)
+            result += "(" + pattern.vertex_name(v.first) + " -> " + target.vertex_name(v.second) + ") ";
+        return result;
+    }
+
+    // sends each solution back as soon as it is found
+    class SolutionStreamer :
+        public HomomorphismSolutionListener
+    {
+        private:
+            Connection & _connection;
+            const string & _id;
+
+        public:
+            SolutionStreamer(Connection & c, const string & id) :
+                _connection(c),
+                _id(id)
+            {
+            }
+
+            auto solution(const InputGraph & pattern, const InputGraph & target,
+                    const VertexToVertexMapping & mapping) -> bool override
+            {
+                _connection.write("reply = solution\nid = " + _id + "\nmapping = "
+                        + format_mapping(pattern, target, mapping) + "\n\n");
+                return true;
+            }
+    };
+
+    auto parse_seconds(const string & value) -> seconds
+    {
+        try {
+            size_t end;
+            auto n = std::stoi(value, &end);
+            if (end == value.size() && n >= 0)
+                return seconds{ n };
+        }
+        catch (const exception &) {
+        }
+        throw BadRequest{ "Invalid timeout '" + value + "'" };
+    }
+}
+
+struct HomomorphismServer::Imp
+{
+    HomomorphismParams defaults;
+    string pattern_format, target_format;
+    seconds default_timeout;
+
+    mutex targets_mutex;
+    map<string, shared_ptr<const ResidentTarget> > targets;
+
+    mutex jobs_mutex;
+    condition_variable jobs_cv;
+    deque<function<auto () -> void> > jobs;
+    bool no_more_jobs = false;
+    vector<thread> workers;
+
+    atomic<bool> stopping{ false };
+
+    // stop writes to this, to wake up serve_socket. It lives as long as we
+    // do, so unlike the listening socket, it can't be closed and its number
+    // reused while a signal handler is looking at it.
+    int wake_fds[2] = { -1, -1 };
+
+    Imp(HomomorphismParams && d, const string & p, const string & t, seconds timeout) :
+        defaults(move(d)),
+        pattern_format(p),
+        target_format(t),
+        default_timeout(timeout)
+    {
+        if (-1 == pipe(wake_fds))
+            throw UnsupportedConfiguration{ "Could not create a pipe: " + string{ strerror(errno) } };
+
+        // stopping more than once shouldn't block once the pipe is full
+        for (auto fd : wake_fds) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+    }
+
+    ~Imp()
+    {
+        close(wake_fds[0]);
+        close(wake_fds[1]);
+    }
+
+    auto work() -> void
+    {
+        while (true) {
+            function<auto () -> void> job;
+            {
+                unique_lock<mutex> lock{ jobs_mutex };
+                jobs_cv.wait(lock, [&] { return no_more_jobs || ! jobs.empty(); });
+                if (jobs.empty())
+                    return;
+                job = move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    auto load(const string & name, const string & file, const string & format) -> shared_ptr<const ResidentTarget>
+    {
+        auto target = make_shared<const ResidentTarget>(name, file, read_file_format(format, file));
+
+        unique_lock<mutex> lock{ targets_mutex };
+        targets[name] = target;
+        return target;
+    }
+
+    // only does things that are safe in a signal handler
+    auto stop() -> void
+    {
+        stopping = true;
+        char c = 0;
+        [[ maybe_unused ]] auto ignored = write(wake_fds[1], &c, 1);
+    }
+
+    auto submit_solve(const shared_ptr<Connection> & connection, const vector<string> & words) -> void
+    {
+        if (words.size() < 4)
+            throw BadRequest{ "Usage: solve ID TARGET PATTERN [options]" };
+
+        auto query = make_shared<Query>();
+        query->id = words[1];
+
+        shared_ptr<const ResidentTarget> target;
+        {
+            unique_lock<mutex> lock{ targets_mutex };
+            auto t = targets.find(words[2]);
+            if (t == targets.end())
+                throw BadRequest{ "No target named '" + words[2] + "' is loaded" };
+            target = t->second;
+        }
+
+        string pattern_file = words[3], format = pattern_format;
+        seconds timeout = default_timeout;
+        bool print_all_solutions = false;
+
+        auto params = make_shared<HomomorphismParams>(copy_homomorphism_params(defaults));
+        for (unsigned w = 4 ; w < words.size() ; ++w) {
+            auto & option = words[w];
+            if (option == "induced")
+                params->induced = true;
+            else if (option == "injective")
+                params->injectivity = Injectivity::Injective;
+            else if (option == "noninjective")
+                params->injectivity = Injectivity::NonInjective;
+            else if (option == "locally-injective")
+                params->injectivity = Injectivity::LocallyInjective;
+            else if (option == "count-solutions")
+                params->count_solutions = true;
+            else if (option == "print-all-solutions")
+                params->count_solutions = print_all_solutions = true;
+            else if (0 == option.compare(0, 8, "timeout="))
+                timeout = parse_seconds(option.substr(8));
+            else if (0 == option.compare(0, 7, "format="))
+                format = option.substr(7);
+            else
+                throw BadRequest{ "Unknown solve option '" + option + "'" };
+        }
+
+        // as the command line does when counting, unless restarts were asked for
+        if (params->count_solutions && ! defaults.count_solutions)
+            params->restarts_schedule = make_unique<NoRestartsSchedule>();
+
+        {
+            unique_lock<mutex> lock{ connection->queries_mutex };
+            if (! connection->queries.emplace(query->id, query).second)
+                throw BadRequest{ "A solve with id '" + query->id + "' is already running" };
+            ++connection->running;
+        }
+
+        unique_lock<mutex> lock{ jobs_mutex };
+        jobs.push_back([this, connection, query, target, pattern_file, format, timeout, print_all_solutions, params] {
+                solve(connection, query, *target, pattern_file, format, timeout, print_all_solutions, *params);
+                });
+        jobs_cv.notify_one();
+    }
+
+    auto solve(const shared_ptr<Connection> & connection, const shared_ptr<Query> & query,
+            const ResidentTarget & target, const string & pattern_file, const string & format,
+            seconds timeout, bool print_all_solutions, HomomorphismParams & params) -> void
+    {
+        ostringstream reply;
+        reply << "reply = solve" << '\n';
+        reply << "id = " << query->id << '\n';
+
+        milliseconds read_time{ 0 }, solve_time{ 0 };
+        try {
+            auto read_start_time = steady_clock::now();
+            auto pattern = read_file_format(format, pattern_file);
+            read_time = duration_cast<milliseconds>(steady_clock::now() - read_start_time);
+
+            HomomorphismSolveControls controls;
+            controls.timeout = timeout;
+            controls.cancellation = query->cancellation;
+            SolutionStreamer streamer{ *connection, query->id };
+            if (print_all_solutions)
+                controls.listener = &streamer;
+
+            auto solve_start_time = steady_clock::now();
+            auto result = target.session.solve(pattern, params, controls);
+            solve_time = duration_cast<milliseconds>(steady_clock::now() - solve_start_time);
+
+            if (result.rejected_by) {
+                reply << "status = false" << '\n';
+                reply << "prefilter = " << result.rejected_by << '\n';
+            }
+            else {
+                reply << "status = ";
+                if (result.aborted)
+                    reply << "aborted";
+                else if ((! result.result.mapping.empty()) || (params.count_solutions && result.result.solution_count > 0))
+                    reply << "true";
+                else
+                    reply << "false";
+                reply << '\n';
+
+                if (result.cancelled)
+                    reply << "cancelled = true" << '\n';
+                if (params.count_solutions)
+                    reply << "solution_count = " << result.result.solution_count << '\n';
+                reply << "nodes = " << result.result.nodes << '\n';
+                reply << "propagations = " << result.result.propagations << '\n';
+                if (! result.result.mapping.empty())
+                    reply << "mapping = " << format_mapping(pattern, target.session.target(), result.result.mapping) << '\n';
+            }
+        }
+        catch (const exception & e) {
+            reply << "status = error" << '\n';
+            reply << "error = " << e.what() << '\n';
+        }
+
+        reply << "read_time = " << read_time.count() << '\n';
+        reply << "runtime = " << solve_time.count() << '\n';
+        reply << '\n';
+
+        // free up the id before replying, so the client can use it again
+        // as soon as it hears back
+        {
+            unique_lock<mutex> lock{ connection->queries_mutex };
+            connection->queries.erase(query->id);
+        }
+
+        connection->write(reply.str());
+
+        unique_lock<mutex> lock{ connection->queries_mutex };
+        --connection->running;
+        connection->queries_cv.notify_all();
+    }
+
+    // returns false if this connection is done with
+    auto handle_line(const shared_ptr<Connection> & connection, const string & line) -> bool
+    {
+        vector<string> words;
+        {
+            istringstream s{ line };
+            string word;
+            while (s >> word)
+                words.push_back(word);
+        }
+
+        if (words.empty())
+            return true;
+
+        auto & command = words[0];
+        try {
+            if (command == "solve")
+                submit_solve(connection, words);
+            else if (command == "cancel") {
+                if (words.size() != 2)
+                    throw BadRequest{ "Usage: cancel ID" };
+
+                bool found = false;
+                {
+                    unique_lock<mutex> lock{ connection->queries_mutex };
+                    auto q = connection->queries.find(words[1]);
+                    if (q != connection->queries.end()) {
+                        found = true;
+                        q->second->cancellation.cancel();
+                    }
+                }
+
+                connection->write("reply = cancel\nid = " + words[1] + "\nfound = " + (found ? "true" : "false") + "\n\n");
+            }
+            else if (command == "load") {
+                if (words.size() != 3 && ! (words.size() == 4 && 0 == words[3].compare(0, 7, "format=")))
+                    throw BadRequest{ "Usage: load NAME FILE [format=F]" };
+
+                auto start_time = steady_clock::now();
+                auto target = load(words[1], words[2], words.size() == 4 ? words[3].substr(7) : target_format);
+                auto read_time = duration_cast<milliseconds>(steady_clock::now() - start_time);
+
+                connection->write("reply = load\ntarget = " + target->name
+                        + "\ntarget_file = " + target->file
+                        + "\ntarget_vertices = " + to_string(target->session.target().size())
+                        + "\ntarget_directed_edges = " + to_string(target->session.target().number_of_directed_edges())
+                        + "\nread_time = " + to_string(read_time.count()) + "\n\n");
+            }
+            else if (command == "unload") {
+                if (words.size() != 2)
+                    throw BadRequest{ "Usage: unload NAME" };
+
+                bool found;
+                {
+                    unique_lock<mutex> lock{ targets_mutex };
+                    found = targets.erase(words[1]);
+                }
+
+                connection->write("reply = unload\ntarget = " + words[1] + "\nfound = " + (found ? "true" : "false") + "\n\n");
+            }
+            else if (command == "targets") {
+                string reply = "reply = targets\n";
+                {
+                    unique_lock<mutex> lock{ targets_mutex };
+                    for (auto & [ name, target ] : targets)
+                        reply += "target = " + name + " " + target->file + "\n";
+                }
+                connection->write(reply + "\n");
+            }
+            else if (command == "quit")
+                return false;
+            else if (command == "shutdown") {
+                stop();
+                return false;
+            }
+            else
+                throw BadRequest{ "Unknown request '" + command + "'" };
+        }
+        catch (const exception & e) {
+            string reply = "reply = " + command + "\n";
+            if (command == "solve" && words.size() >= 2)
+                reply += "id = " + words[1] + "\nstatus = error\n";
+            reply += "error = " + string{ e.what() } + "\n\n";
+            connection->write(reply);
+        }
+
+        return true;
+    }
+
+    auto serve(const shared_ptr<Connection> & connection) -> void
+    {
+        string buffer, line;
+        while ((! stopping) && read_line(connection->in_fd, buffer, line))
+            if (! handle_line(connection, line))
+                break;
+
+        if (stopping)
+            connection->cancel_all();
+        connection->wait_for_queries();
+
+        // the client should see the end now, not when serve_socket next
+        // tidies up, but the descriptor stays ours until then, so that its
+        // number can't be reused by something else behind serve_socket's back
+        if (connection->owns_fds)
+            ::shutdown(connection->out_fd, SHUT_RDWR);
+        connection->finished = true;
+    }
+};
+
+HomomorphismServer::HomomorphismServer(const HomomorphismParams & defaults, const string & pattern_format,
+        const string & target_format, seconds default_timeout, unsigned n_workers) :
+    _imp(make_unique<Imp>(copy_homomorphism_params(defaults), pattern_format, target_format, default_timeout))
+{
+    if (1 != defaults.n_processes)
+        throw UnsupportedConfiguration{ "Server mode cannot be used with multiple processes" };
+    if (! defaults.checkpoint_file.empty() || ! defaults.resume_from.empty())
+        throw UnsupportedConfiguration{ "Server mode cannot be used with checkpointing" };
+    if (! defaults.target_cache_file.empty())
+        throw UnsupportedConfiguration{ "Server mode manages its own target caches" };
+
+    for (unsigned w = 0, w_end = how_many_threads(n_workers) ; w < w_end ; ++w)
+        _imp->workers.emplace_back([&] { _imp->work(); });
+}
+
+HomomorphismServer::~HomomorphismServer()
+{
+    {
+        unique_lock<mutex> lock{ _imp->jobs_mutex };
+        _imp->no_more_jobs = true;
+        _imp->jobs_cv.notify_all();
+    }
+    for (auto & w : _imp->workers)
+        w.join();
+}
+
+auto HomomorphismServer::load_target(const string & name, const string & file) -> void
+{
+    _imp->load(name, file, _imp->target_format);
+}
+
+auto HomomorphismServer::serve_stream(int in_fd, int out_fd) -> void
+{
+    // a client going away shouldn't take us with it
+    signal(SIGPIPE, SIG_IGN);
+
+    _imp->serve(make_shared<Connection>(in_fd, out_fd, false));
+}
+
+auto HomomorphismServer::serve_socket(const string & path) -> void
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un address{ };
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+        throw UnsupportedConfiguration{ "Socket path '" + path + "' is too long" };
+    path.copy(address.sun_path, path.size());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (-1 == fd)
+        throw UnsupportedConfiguration{ "Could not create a socket: " + string{ strerror(errno) } };
+
+    // a socket left behind by a server that has gone away can be replaced,
+    // but not one that something is still listening on
+    struct stat st;
+    if (0 == stat(path.c_str(), &st) && S_ISSOCK(st.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (-1 != probe) {
+            if (-1 == connect(probe, reinterpret_cast<sockaddr *>(&address), sizeof(address)) && ECONNREFUSED == errno)
+                unlink(path.c_str());
+            close(probe);
+        }
+    }
+
+    if (-1 == bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) || -1 == listen(fd, SOMAXCONN)) {
+        string error = strerror(errno);
+        close(fd);
+        throw UnsupportedConfiguration{ "Could not listen on socket '" + path + "': " + error };
+    }
+
+    list<pair<thread, shared_ptr<Connection> > > connections;
+    while (! _imp->stopping) {
+        pollfd fds[2] = { { fd, POLLIN, 0 }, { _imp->wake_fds[0], POLLIN, 0 } };
+        if (-1 == poll(fds, 2, -1)) {
+            if (EINTR == errno)
+                continue;
+            break;
+        }
+
+        if (fds[1].revents)
+            break;
+
+        int c = accept(fd, nullptr, nullptr);
+        if (-1 == c) {
+            if (EINTR == errno || ECONNABORTED == errno)
+                continue;
+            break;
+        }
+
+        // tidy up after clients that have left
+        for (auto i = connections.begin() ; i != connections.end() ; ) {
+            if (i->second->finished) {
+                i->first.join();
+                i = connections.erase(i);
+            }
+            else
+                ++i;
+        }
+
+        auto connection = make_shared<Connection>(c, c, true);
+        connections.emplace_back(thread{ [this, connection] { _imp->serve(connection); } }, connection);
+    }
+
+    _imp->stopping = true;
+    close(fd);
+    unlink(path.c_str());
+
+    // wake up anyone still waiting for requests, and give up on their solves
+    for (auto & [ _, connection ] : connections) {
+        ::shutdown(connection->in_fd, SHUT_RD);
+        connection->cancel_all();
+    }
+
+    for (auto & [ t, _ ] : connections)
+        t.join();
+}
+
+auto HomomorphismServer::stop() -> void
+{
+    _imp->stop();
+}
+
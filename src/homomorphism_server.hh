@@ -0,0 +1,74 @@
+/* vim: set sw=4 sts=4 et foldmethod=syntax : */
+
+#ifndef GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_HOMOMORPHISM_SERVER_HH
+#define GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_HOMOMORPHISM_SERVER_HH 1
+
+#include "homomorphism.hh"
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+/**
+ * A long-running solver, which keeps some targets in memory and answers
+ * pattern queries about them, so that each query doesn't pay for starting a
+ * process, parsing options, and reading and preparing the target.
+ *
+ * Queries arrive as lines of text, and replies go back as blocks of
+ * "key = value" lines, each ending with a blank line. Replies to solve
+ * queries can arrive in any order, and start with the id the query was
+ * given. Requests are:
+ *
+ *   load NAME FILE [format=F]     read a target, or replace one, and keep it
+ *   unload NAME                   forget a target, once queries using it finish
+ *   targets                       list the loaded targets
+ *   solve ID NAME PATTERN [opt]   solve a pattern file against a loaded target
+ *   cancel ID                     abort a solve that is waiting or running
+ *   quit                          close this connection, after its solves finish
+ *   shutdown                      stop the whole server
+ *
+ * Solve options are timeout=N (seconds), format=F, induced, injective,
+ * noninjective, locally-injective, count-solutions, and
+ * print-all-solutions, which sends a "reply = solution" block for each
+ * solution as it is found. Anything not given is taken from the defaults the
+ * server was started with. File names cannot contain spaces.
+ */
+class HomomorphismServer
+{
+    private:
+        struct Imp;
+        std::unique_ptr<Imp> _imp;
+
+    public:
+        /**
+         * Each solve gets its own copy of defaults (see
+         * copy_homomorphism_params), and default_timeout unless it asks for
+         * something else, and up to n_workers solves run at once (0 to
+         * auto-detect). Throws UnsupportedConfiguration if defaults
+         * ask for something that doesn't make sense for many queries, such
+         * as multiple processes or checkpointing.
+         */
+        HomomorphismServer(const HomomorphismParams & defaults, const std::string & pattern_format,
+                const std::string & target_format, std::chrono::seconds default_timeout, unsigned n_workers);
+        ~HomomorphismServer();
+
+        HomomorphismServer(const HomomorphismServer &) = delete;
+        HomomorphismServer & operator= (const HomomorphismServer &) = delete;
+
+        /// load a target before any queries arrive, throwing if it can't be read
+        auto load_target(const std::string & name, const std::string & file) -> void;
+
+        /// answer queries from one pair of file descriptors, such as standard
+        /// input and output, until end of file, quit or shutdown
+        auto serve_stream(int in_fd, int out_fd) -> void;
+
+        /// listen on a Unix domain socket, answering each connection in its own
+        /// thread, until shutdown or stop; the socket file is removed at the end
+        auto serve_socket(const std::string & path) -> void;
+
+        /// make serve_socket return, cancelling any outstanding solves. Safe to
+        /// call from a signal handler.
+        auto stop() -> void;
+};
+
+#endif
@@ -0,0 +1,211 @@
+/* vim: set sw=4 sts=4 et foldmethod=syntax : */
+
+#include "homomorphism_session.hh"
+#include "homomorphism_prefilter.hh"
+#include "configuration.hh"
+#include "target_cache.hh"
+#include "timeout.hh"
+#include "verify.hh"
+
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <mutex>
+#include <thread>
+
+using std::atomic;
+using std::condition_variable;
+using std::list;
+using std::make_shared;
+using std::make_unique;
+using std::move;
+using std::multimap;
+using std::mutex;
+using std::shared_ptr;
+using std::thread;
+using std::unique_lock;
+
+using std::chrono::operator""s;
+using std::chrono::steady_clock;
+
+struct HomomorphismCancellationToken::State
+{
+    mutex state_mutex;
+    atomic<bool> cancelled{ false };
+
+    // the solves currently using this token
+    list<Timeout *> running;
+};
+
+HomomorphismCancellationToken::HomomorphismCancellationToken() :
+    _state(make_shared<State>())
+{
+}
+
+auto HomomorphismCancellationToken::cancel() -> void
+{
+    unique_lock<mutex> lock{ _state->state_mutex };
+    _state->cancelled = true;
+    for (auto & t : _state->running)
+        t->trigger_early_abort();
+}
+
+auto HomomorphismCancellationToken::cancelled() const -> bool
+{
+    return _state->cancelled;
+}
+
+struct HomomorphismSession::Imp
+{
+    InputGraph target;
+    HomomorphismPrefilterSummary target_summary;
+    shared_ptr<InMemoryTargetCache> prepared_target;
+
+    mutex deadlines_mutex;
+    condition_variable deadlines_cv;
+    multimap<steady_clock::time_point, Timeout *> deadlines;
+    bool no_more_deadlines = false;
+    thread deadlines_thread;
+
+    Imp(InputGraph && t) :
+        target(move(t)),
+        target_summary(summarise_for_prefilter(target)),
+        prepared_target(make_shared<InMemoryTargetCache>())
+    {
+    }
+
+    auto watch_deadlines() -> void
+    {
+        unique_lock<mutex> lock{ deadlines_mutex };
+        while (! no_more_deadlines) {
+            if (deadlines.empty())
+                deadlines_cv.wait(lock);
+            else
+                deadlines_cv.wait_until(lock, deadlines.begin()->first);
+
+            auto now = steady_clock::now();
+            while ((! deadlines.empty()) && deadlines.begin()->first <= now) {
+                deadlines.begin()->second->expire();
+                deadlines.erase(deadlines.begin());
+            }
+        }
+    }
+
+    auto add_deadline(steady_clock::time_point when, Timeout * timeout) -> void
+    {
+        unique_lock<mutex> lock{ deadlines_mutex };
+        deadlines.emplace(when, timeout);
+        deadlines_cv.notify_all();
+    }
+
+    // once this returns, the timeout won't be expired behind our backs
+    auto remove_deadline(steady_clock::time_point when, Timeout * timeout) -> void
+    {
+        unique_lock<mutex> lock{ deadlines_mutex };
+        auto [ begin, end ] = deadlines.equal_range(when);
+        for (auto d = begin ; d != end ; ++d)
+            if (d->second == timeout) {
+                deadlines.erase(d);
+                break;
+            }
+    }
+};
+
+HomomorphismSession::HomomorphismSession(InputGraph && target) :
+    _imp(make_unique<Imp>(move(target)))
+{
+    _imp->deadlines_thread = thread{ [&] { _imp->watch_deadlines(); } };
+}
+
+HomomorphismSession::~HomomorphismSession()
+{
+    {
+        unique_lock<mutex> lock{ _imp->deadlines_mutex };
+        _imp->no_more_deadlines = true;
+        _imp->deadlines_cv.notify_all();
+    }
+    _imp->deadlines_thread.join();
+}
+
+auto HomomorphismSession::target() const -> const InputGraph &
+{
+    return _imp->target;
+}
+
+auto HomomorphismSession::solve(const InputGraph & pattern, const HomomorphismParams & params,
+        const HomomorphismSolveControls & controls) const -> HomomorphismSessionResult
+{
+    if (1 != params.n_processes)
+        throw UnsupportedConfiguration{ "Sessions cannot be used with multiple processes" };
+    if (! params.checkpoint_file.empty() || ! params.resume_from.empty())
+        throw UnsupportedConfiguration{ "Sessions cannot be used with checkpointing" };
+
+    HomomorphismSessionResult result;
+
+    if (auto rejected_by = prefilter_homomorphism_problem(summarise_for_prefilter(pattern), _imp->target_summary, params)) {
+        result.rejected_by = rejected_by;
+        result.result.complete = true;
+        return result;
+    }
+
+    auto solve_params = copy_homomorphism_params(params);
+    solve_params.target_cache_file.clear();
+    solve_params.in_memory_target_cache = _imp->prepared_target;
+    solve_params.progress = controls.progress;
+
+    // never has its own thread, our deadline thread expires it
+    solve_params.timeout = make_shared<Timeout>(0s);
+
+    solve_params.enumerate_callback = nullptr;
+    if (controls.listener && params.count_solutions)
+        solve_params.enumerate_callback = [&] (const VertexToVertexMapping & mapping) -> bool {
+            return controls.listener->solution(pattern, _imp->target, mapping);
+        };
+
+    auto & token = *controls.cancellation._state;
+    list<Timeout *>::iterator running;
+    {
+        unique_lock<mutex> lock{ token.state_mutex };
+        if (token.cancelled)
+            solve_params.timeout->trigger_early_abort();
+        running = token.running.insert(token.running.end(), solve_params.timeout.get());
+    }
+
+    solve_params.start_time = steady_clock::now();
+    auto deadline = solve_params.start_time + controls.timeout;
+    if (0s != controls.timeout)
+        _imp->add_deadline(deadline, solve_params.timeout.get());
+
+    // whatever happens, the token and deadline thread mustn't be left
+    // holding a timeout that's gone away
+    auto forget_timeout = [&] {
+        if (0s != controls.timeout)
+            _imp->remove_deadline(deadline, solve_params.timeout.get());
+        unique_lock<mutex> lock{ token.state_mutex };
+        token.running.erase(running);
+    };
+
+    try {
+        result.result = solve_homomorphism_problem(pattern, _imp->target, solve_params);
+    }
+    catch (...) {
+        forget_timeout();
+        throw;
+    }
+    forget_timeout();
+
+    // threaded search uses the timeout to stop other threads when it's
+    // done, so a late cancel could look like it worked
+    result.cancelled = token.cancelled && ! result.result.complete;
+    result.aborted = solve_params.timeout->aborted() || result.cancelled;
+
+    verify_homomorphism(pattern, _imp->target, params.injectivity == Injectivity::Injective,
+            params.injectivity == Injectivity::LocallyInjective, params.induced, result.result.mapping);
+
+    if (controls.listener && ! params.count_solutions && ! result.result.mapping.empty())
+        controls.listener->solution(pattern, _imp->target, result.result.mapping);
+
+    return result;
+}
+
@@ -0,0 +1,115 @@
+/* vim: set sw=4 sts=4 et foldmethod=syntax : */
+
+#ifndef GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_HOMOMORPHISM_SESSION_HH
+#define GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_HOMOMORPHISM_SESSION_HH 1
+
+#include "formats/input_graph.hh"
+#include "homomorphism.hh"
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+/**
+ * Told about solutions as they are found. With threaded search, solution can
+ * be called from more than one thread at once.
+ */
+class HomomorphismSolutionListener
+{
+    public:
+        virtual ~HomomorphismSolutionListener() = default;
+
+        /// return false to stop searching
+        virtual auto solution(const InputGraph & pattern, const InputGraph & target,
+                const VertexToVertexMapping & mapping) -> bool = 0;
+};
+
+/**
+ * Lets any thread ask a solve to stop, as soon as it next checks. Copies
+ * share their state, so one token can be given to many solves and cancel
+ * them all. Once cancelled, a token stays cancelled.
+ */
+class HomomorphismCancellationToken
+{
+    private:
+        struct State;
+        std::shared_ptr<State> _state;
+
+        friend class HomomorphismSession;
+
+    public:
+        HomomorphismCancellationToken();
+
+        auto cancel() -> void;
+
+        auto cancelled() const -> bool;
+};
+
+/**
+ * Everything about one solve that isn't about the problem itself.
+ */
+struct HomomorphismSolveControls
+{
+    /// give up after this long, 0 for never
+    std::chrono::seconds timeout{ 0 };
+
+    HomomorphismCancellationToken cancellation;
+
+    /// not owned, may be null. If counting solutions, told about each one as
+    /// it is found, and otherwise told about the solution, if there is one.
+    HomomorphismSolutionListener * listener = nullptr;
+
+    /// may be null, and can be shared between solves to get a total
+    std::shared_ptr<HomomorphismProgress> progress;
+};
+
+struct HomomorphismSessionResult
+{
+    HomomorphismResult result;
+
+    /// did we run out of time, or get cancelled?
+    bool aborted = false, cancelled = false;
+
+    /// if not null, a prefilter showed there can't be a solution without
+    /// building a model, and this is its name (see homomorphism_prefilter.hh)
+    const char * rejected_by = nullptr;
+};
+
+/**
+ * One target, kept ready for solving many patterns against, for embedding the
+ * solver in something else. The target side of the model is built by the first
+ * solve that needs it and kept in memory (see InMemoryTargetCache), once for
+ * each combination of the parameters that affect it, and later solves use it
+ * where it is rather than rebuilding it. Patterns are prefiltered against a
+ * summary of the target, and solutions are checked.
+ *
+ * Any number of threads can solve using the same session at once. Time limits
+ * are kept by one thread per session, rather than one per solve.
+ */
+class HomomorphismSession
+{
+    private:
+        struct Imp;
+        std::unique_ptr<Imp> _imp;
+
+    public:
+        explicit HomomorphismSession(InputGraph && target);
+        ~HomomorphismSession();
+
+        HomomorphismSession(const HomomorphismSession &) = delete;
+        HomomorphismSession & operator= (const HomomorphismSession &) = delete;
+
+        auto target() const -> const InputGraph &;
+
+        /**
+         * Solve a pattern against our target. Each solve uses its own copy of
+         * params (see copy_homomorphism_params), with the timeout, callback,
+         * progress and target cache replaced. Throws UnsupportedConfiguration
+         * for things that don't make sense here, such as multiple processes or
+         * checkpointing, and anything else the solver or checking throws.
+         */
+        auto solve(const InputGraph & pattern, const HomomorphismParams & params,
+                const HomomorphismSolveControls & controls = { }) const -> HomomorphismSessionResult;
+};
+
+#endif
@@ -3,14 +3,33 @@
 #include "restarts.hh"
 #include <algorithm>
 #include <cmath>
+#include <iomanip>
+#include <limits>
+#include <sstream>
 
 using std::advance;
 using std::distance;
+using std::numeric_limits;
+using std::ostringstream;
 using std::round;
+using std::setprecision;
+using std::stod;
+using std::stoull;
+using std::string;
+using std::to_string;
 
 using std::chrono::milliseconds;
 using std::chrono::steady_clock;
 
+auto RestartsSchedule::position() const -> string
+{
+    return "";
+}
+
+auto RestartsSchedule::restore_position(const string &) -> void
+{
+}
+
 auto NoRestartsSchedule::did_a_backtrack() -> void
 {
 }
@@ -78,6 +97,18 @@ auto LubyRestartsSchedule::might_restart() -> bool
     return true;
 }
 
+auto LubyRestartsSchedule::position() const -> string
+{
+    return to_string(distance(_sequence.begin(), _current_sequence));
+}
+
+auto LubyRestartsSchedule::restore_position(const string & s) -> void
+{
+    auto target = stoull(s);
+    for (auto p = (unsigned long long) distance(_sequence.cbegin(), _current_sequence) ; p < target ; ++p)
+        did_a_restart();
+}
+
 GeometricRestartsSchedule::GeometricRestartsSchedule(double v, double m) :
     _current_value(v),
     _multiplier(m)
@@ -110,8 +141,22 @@ auto GeometricRestartsSchedule::might_restart() -> bool
     return true;
 }
 
-SyncedRestartSchedule::SyncedRestartSchedule(std::atomic<bool> & a) :
-    _synchroniser(a)
+auto GeometricRestartsSchedule::position() const -> string
+{
+    ostringstream result;
+    result << setprecision(numeric_limits<double>::max_digits10) << _current_value;
+    return result.str();
+}
+
+auto GeometricRestartsSchedule::restore_position(const string & s) -> void
+{
+    _number_of_backtracks = 0;
+    _current_value = stod(s);
+}
+
+SyncedRestartSchedule::SyncedRestartSchedule(std::atomic<unsigned long long> & a) :
+    _synchroniser(a),
+    _last_seen(a.load())
 {
 }
 
@@ -121,11 +166,12 @@ auto SyncedRestartSchedule::did_a_backtrack() -> void
 
 auto SyncedRestartSchedule::did_a_restart() -> void
 {
+    _last_seen = _synchroniser.load();
 }
 
 auto SyncedRestartSchedule::should_restart() -> bool
 {
-    return _synchroniser;
+    return _synchroniser.load(std::memory_order_relaxed) != _last_seen;
 }
 
 auto SyncedRestartSchedule::might_restart() -> bool
@@ -7,6 +7,7 @@
 #include <chrono>
 #include <list>
 #include <memory>
+#include <string>
 
 class RestartsSchedule
 {
@@ -18,6 +19,14 @@ class RestartsSchedule
         virtual auto should_restart() -> bool = 0;
         virtual auto might_restart() -> bool = 0;
         virtual auto clone() -> RestartsSchedule * = 0;
+
+        /// For checkpointing, how far through the schedule we are, as of the
+        /// last restart. Schedules that depend upon time or upon other
+        /// threads have nothing to say.
+        virtual auto position() const -> std::string;
+
+        /// Go back to a position, on a schedule that has just been created.
+        virtual auto restore_position(const std::string &) -> void;
 };
 
 class NoRestartsSchedule final : public RestartsSchedule
@@ -48,6 +57,8 @@ class LubyRestartsSchedule final : public RestartsSchedule
         virtual auto should_restart() -> bool override;
         virtual auto might_restart() -> bool override;
         virtual auto clone() -> LubyRestartsSchedule * override;
+        virtual auto position() const -> std::string override;
+        virtual auto restore_position(const std::string &) -> void override;
 };
 
 class GeometricRestartsSchedule final : public RestartsSchedule
@@ -67,15 +78,18 @@ class GeometricRestartsSchedule final : public RestartsSchedule
         virtual auto should_restart() -> bool override;
         virtual auto might_restart() -> bool override;
         virtual auto clone() -> GeometricRestartsSchedule * override;
+        virtual auto position() const -> std::string override;
+        virtual auto restore_position(const std::string &) -> void override;
 };
 
 class SyncedRestartSchedule final : public RestartsSchedule
 {
     private:
-        std::atomic<bool> & _synchroniser;
+        std::atomic<unsigned long long> & _synchroniser;
+        unsigned long long _last_seen;
 
     public:
-        explicit SyncedRestartSchedule(std::atomic<bool> &);
+        explicit SyncedRestartSchedule(std::atomic<unsigned long long> &);
 
         virtual auto did_a_backtrack() -> void override;
         virtual auto did_a_restart() -> void override;
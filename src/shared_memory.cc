@@ -0,0 +1,44 @@
+/* vim: set sw=4 sts=4 et foldmethod=syntax : */
+
+#include "shared_memory.hh"
+#include "configuration.hh"
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <sys/mman.h>
+
+using std::bad_alloc;
+using std::size_t;
+using std::string;
+using std::strerror;
+
+SharedMemory::SharedMemory(size_t size) :
+    _size(size)
+{
+    _base = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == _base)
+        throw UnsupportedConfiguration{ "Could not create shared memory: " + string{ strerror(errno) } };
+}
+
+SharedMemory::~SharedMemory()
+{
+    munmap(_base, _size);
+}
+
+auto SharedMemory::allocate(size_t bytes, size_t alignment) -> void *
+{
+    size_t start = (_used + alignment - 1) / alignment * alignment;
+    if (start + bytes > _size)
+        throw bad_alloc{ };
+
+    _used = start + bytes;
+    return static_cast<char *>(_base) + start;
+}
+
+auto SharedMemory::size() const -> size_t
+{
+    return _size;
+}
+
@@ -0,0 +1,51 @@
+/* vim: set sw=4 sts=4 et foldmethod=syntax : */
+
+#ifndef GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_SHARED_MEMORY_HH
+#define GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_SHARED_MEMORY_HH 1
+
+#include <cstddef>
+#include <new>
+#include <utility>
+
+/**
+ * An anonymous memory mapping, which is shared with any processes that are
+ * forked after it is created, and which is at the same address in all of
+ * them. Memory is handed out by a simple bump allocator, and is never given
+ * back until the whole mapping goes away. Throws UnsupportedConfiguration if
+ * we can't make the mapping.
+ */
+class SharedMemory
+{
+    private:
+        void * _base;
+        std::size_t _size, _used = 0;
+
+    public:
+        explicit SharedMemory(std::size_t size);
+        ~SharedMemory();
+
+        SharedMemory(const SharedMemory &) = delete;
+        SharedMemory & operator= (const SharedMemory &) = delete;
+
+        /// zeroed memory, throws std::bad_alloc if there isn't enough left
+        auto allocate(std::size_t bytes, std::size_t alignment = 64) -> void *;
+
+        template <typename T_, typename... Args_>
+        auto make(Args_ && ... args) -> T_ *
+        {
+            return new (allocate(sizeof(T_), alignof(T_))) T_(std::forward<Args_>(args)...);
+        }
+
+        template <typename T_>
+        auto make_array(std::size_t n) -> T_ *
+        {
+            auto result = static_cast<T_ *>(allocate(sizeof(T_) * n, alignof(T_)));
+            for (std::size_t i = 0 ; i < n ; ++i)
+                new (&result[i]) T_{ };
+            return result;
+        }
+
+        auto size() const -> std::size_t;
+};
+
+#endif
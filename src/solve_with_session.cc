@@ -0,0 +1,179 @@
+/* vim: set sw=4 sts=4 et foldmethod=syntax : */
+
+#include "configuration.hh"
+#include "formats/read_file_format.hh"
+#include "homomorphism_session.hh"
+#include "restarts.hh"
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+namespace po = boost::program_options;
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::exception;
+using std::make_unique;
+using std::string;
+using std::thread;
+using std::vector;
+
+/* Solves some patterns against one target through a HomomorphismSession, so
+ * that the session can be checked against glasgow_subgraph_solver, and as an
+ * example of how to embed the solver. Each pattern can be followed by
+ * ",induced", ",noninjective" or ",locally-injective", to solve it with
+ * those settings, so that one session is used with several settings. */
+
+namespace
+{
+    struct Query
+    {
+        string spec;
+        HomomorphismParams params;
+        HomomorphismSessionResult result;
+        string error;
+    };
+}
+
+auto main(int argc, char * argv[]) -> int
+{
+    try {
+        po::options_description display_options{ "Program options" };
+        display_options.add_options()
+            ("help",                                         "Display help information")
+            ("format",            po::value<string>(),       "Specify input file format (auto, lad, vertexlabelledlad, labelledlad, dimacs)")
+            ("count-solutions",                              "Count the number of solutions")
+            ("concurrently",                                 "Solve every pattern at once, each in its own thread")
+            ;
+
+        po::options_description all_options{ "All options" };
+        all_options.add_options()
+            ("target-file",       po::value<string>(),          "Specify the target file")
+            ("pattern-files",     po::value<vector<string> >(), "Specify the pattern files, with optional settings")
+            ;
+
+        all_options.add(display_options);
+
+        po::positional_options_description positional_options;
+        positional_options
+            .add("target-file", 1)
+            .add("pattern-files", -1)
+            ;
+
+        po::variables_map options_vars;
+        po::store(po::command_line_parser(argc, argv)
+                .options(all_options)
+                .positional(positional_options)
+                .run(), options_vars);
+        po::notify(options_vars);
+
+        /* --help? Show a message, and exit. */
+        if (options_vars.count("help")) {
+            cout << "Usage: " << argv[0] << " [options] target-file pattern-file[,setting...]..." << endl;
+            cout << endl;
+            cout << display_options << endl;
+            return EXIT_SUCCESS;
+        }
+
+        if (! options_vars.count("target-file") || ! options_vars.count("pattern-files")) {
+            cout << "Usage: " << argv[0] << " [options] target-file pattern-file[,setting...]..." << endl;
+            return EXIT_FAILURE;
+        }
+
+        string format = options_vars.count("format") ? options_vars["format"].as<string>() : "auto";
+        bool count_solutions = options_vars.count("count-solutions");
+
+        HomomorphismSession session{ read_file_format(format, options_vars["target-file"].as<string>()) };
+
+        vector<Query> queries;
+        for (auto & spec : options_vars["pattern-files"].as<vector<string> >()) {
+            auto & q = queries.emplace_back();
+            q.spec = spec;
+            q.params.count_solutions = count_solutions;
+            if (count_solutions)
+                q.params.restarts_schedule = make_unique<NoRestartsSchedule>();
+            else
+                q.params.restarts_schedule = make_unique<LubyRestartsSchedule>(LubyRestartsSchedule::default_multiplier);
+        }
+
+        auto solve = [&] (Query & q) {
+            try {
+                string file = q.spec.substr(0, q.spec.find(','));
+                for (auto p = q.spec.find(',') ; p != string::npos ; ) {
+                    auto next = q.spec.find(',', p + 1);
+                    string setting = q.spec.substr(p + 1, next == string::npos ? string::npos : next - p - 1);
+                    if (setting == "induced")
+                        q.params.induced = true;
+                    else if (setting == "noninjective")
+                        q.params.injectivity = Injectivity::NonInjective;
+                    else if (setting == "locally-injective")
+                        q.params.injectivity = Injectivity::LocallyInjective;
+                    else
+                        throw UnsupportedConfiguration{ "Unknown setting '" + setting + "'" };
+                    p = next;
+                }
+
+                q.result = session.solve(read_file_format(format, file), q.params);
+            }
+            catch (const exception & e) {
+                q.error = e.what();
+            }
+        };
+
+        if (options_vars.count("concurrently")) {
+            vector<thread> threads;
+            for (auto & q : queries)
+                threads.emplace_back([&] { solve(q); });
+            for (auto & t : threads)
+                t.join();
+        }
+        else
+            for (auto & q : queries)
+                solve(q);
+
+        bool any_errors = false;
+        for (auto & q : queries) {
+            cout << "pattern = " << q.spec << endl;
+            if (! q.error.empty()) {
+                cout << "error = " << q.error << endl;
+                any_errors = true;
+            }
+            else {
+                cout << "status = ";
+                if (q.result.aborted)
+                    cout << "aborted";
+                else if ((! q.result.result.mapping.empty()) || (count_solutions && q.result.result.solution_count > 0))
+                    cout << "true";
+                else
+                    cout << "false";
+                cout << endl;
+
+                if (count_solutions)
+                    cout << "solution_count = " << q.result.result.solution_count << endl;
+                if (q.result.rejected_by)
+                    cout << "prefilter = " << q.result.rejected_by << endl;
+                for (auto & s : q.result.result.extra_stats)
+                    if (0 == s.compare(0, 12, "target_cache"))
+                        cout << s << endl;
+            }
+            cout << endl;
+        }
+
+        return any_errors ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    catch (const po::error & e) {
+        cerr << "Error: " << e.what() << endl;
+        cerr << "Try " << argv[0] << " --help" << endl;
+        return EXIT_FAILURE;
+    }
+    catch (const exception & e) {
+        cerr << "Error: " << e.what() << endl;
+        return EXIT_FAILURE;
+    }
+}
+
@@ -0,0 +1,11 @@
+TARGET := solve_with_session
+
+SOURCES := \
+    solve_with_session.cc
+
+TGT_PREREQS := libcommon.a
+ifeq ($(shell uname -s), Linux)
+TGT_LDLIBS := libcommon.a $(boost_ldlibs) -lstdc++fs
+else
+TGT_LDLIBS := libcommon.a $(boost_ldlibs)
+endif
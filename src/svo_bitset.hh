@@ -3,6 +3,8 @@
 #ifndef GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_SVO_BITSET_HH
 #define GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_SVO_BITSET_HH 1
 
+#include "bitset_kernels.hh"
+
 #include <algorithm>
 #include <array>
 #include <cstring>
@@ -11,7 +13,6 @@
 class SVOBitset
 {
     private:
-        using BitWord = unsigned long long;
         static const constexpr int bits_per_word = sizeof(BitWord) * 8;
         static const constexpr int svo_size = 16;
 
@@ -28,6 +29,16 @@ class SVOBitset
             return n_words > svo_size;
         }
 
+        auto _words() -> BitWord *
+        {
+            return _is_long() ? _data.long_data : _data.short_data;
+        }
+
+        auto _words() const -> const BitWord *
+        {
+            return _is_long() ? _data.long_data : _data.short_data;
+        }
+
     public:
         static constexpr const unsigned npos = std::numeric_limits<unsigned>::max();
 
@@ -51,12 +62,40 @@ class SVOBitset
             }
         }
 
+        SVOBitset(SVOBitset && other) noexcept
+        {
+            n_words = other.n_words;
+            if (other._is_long()) {
+                // steal the storage, and leave other empty
+                _data.long_data = other._data.long_data;
+                other.n_words = 0;
+            }
+            else
+                std::copy(&other._data.short_data[0], &other._data.short_data[svo_size], &_data.short_data[0]);
+        }
+
         ~SVOBitset()
         {
             if (_is_long())
                 delete[] _data.long_data;
         }
 
+        /// the raw words, for reading and writing target caches
+        auto words() const -> const BitWord *
+        {
+            return _words();
+        }
+
+        auto words() -> BitWord *
+        {
+            return _words();
+        }
+
+        auto number_of_words() const -> unsigned
+        {
+            return n_words;
+        }
+
         auto operator= (const SVOBitset & other) -> SVOBitset &
         {
             if (&other == this)
@@ -69,6 +108,7 @@ class SVOBitset
                 }
                 else if (n_words != other.n_words) {
                     delete[] _data.long_data;
+                    n_words = other.n_words;
                     _data.long_data = new BitWord[n_words];
                 }
 
@@ -84,23 +124,36 @@ class SVOBitset
             return *this;
         }
 
+        auto operator= (SVOBitset && other) noexcept -> SVOBitset &
+        {
+            if (&other == this)
+                return *this;
+
+            if (_is_long())
+                delete[] _data.long_data;
+
+            n_words = other.n_words;
+            if (other._is_long()) {
+                _data.long_data = other._data.long_data;
+                other.n_words = 0;
+            }
+            else
+                std::copy(&other._data.short_data[0], &other._data.short_data[svo_size], &_data.short_data[0]);
+
+            return *this;
+        }
 
         auto any() const -> bool
         {
-            if (! _is_long()) {
+            if (n_words < bitset_kernels_minimum_words) {
                 for (unsigned i = 0 ; i < n_words ; ++i)
                     if (0 != _data.short_data[i])
                         return true;
 
                 return false;
             }
-            else {
-                for (unsigned i = 0, i_end = n_words ; i < i_end ; ++i)
-                    if (0 != _data.long_data[i])
-                        return true;
-
-                return false;
-            }
+            else
+                return bitset_kernels.any(_words(), n_words);
         }
 
         auto find_first() const -> unsigned
@@ -123,6 +176,49 @@ class SVOBitset
             }
         }
 
+        /// first set bit strictly after a, or npos
+        auto find_next(unsigned a) const -> unsigned
+        {
+            const BitWord * b = _words();
+            unsigned i = (a + 1) / bits_per_word;
+            if (i >= n_words)
+                return npos;
+
+            BitWord w = b[i] & (~BitWord{ 0 } << ((a + 1) % bits_per_word));
+            while (0 == w) {
+                if (++i >= n_words)
+                    return npos;
+                w = b[i];
+            }
+
+            return i * bits_per_word + __builtin_ctzll(w);
+        }
+
+        /// last set bit, or npos
+        auto find_last() const -> unsigned
+        {
+            const BitWord * b = _words();
+            for (unsigned i = n_words ; i > 0 ; --i)
+                if (0 != b[i - 1])
+                    return i * bits_per_word - 1 - __builtin_clzll(b[i - 1]);
+            return npos;
+        }
+
+        /**
+         * Call f with each set bit, in increasing order. This skips empty words,
+         * and does not need a copy of the bitset. It is fine for f to reset bits
+         * that have already been visited, but any other changes to this bitset
+         * from inside f may or may not be seen.
+         */
+        template <typename F_>
+        auto for_each_set_bit(const F_ & f) const -> void
+        {
+            const BitWord * b = _words();
+            for (unsigned i = 0 ; i < n_words ; ++i)
+                for (BitWord w = b[i] ; 0 != w ; w &= (w - 1))
+                    f(i * bits_per_word + __builtin_ctzll(w));
+        }
+
         auto reset(int a) -> void
         {
             BitWord * b = (_is_long() ? _data.long_data : _data.short_data);
@@ -151,52 +247,113 @@ class SVOBitset
 
         auto operator&= (const SVOBitset & other) -> SVOBitset &
         {
-            if (! _is_long()) {
-                for (unsigned i = 0 ; i < svo_size ; ++i)
-                    _data.short_data[i] &= other._data.short_data[i];
-            }
-            else {
+            if (n_words < bitset_kernels_minimum_words) {
                 for (unsigned i = 0 ; i < n_words ; ++i)
-                    _data.long_data[i] &= other._data.long_data[i];
+                    _data.short_data[i] &= other._data.short_data[i];
             }
+            else
+                bitset_kernels.and_assign(_words(), other._words(), n_words);
 
             return *this;
         }
 
         auto operator|= (const SVOBitset & other) -> SVOBitset &
         {
-            if (! _is_long()) {
-                for (unsigned i = 0 ; i < svo_size ; ++i)
-                    _data.short_data[i] |= other._data.short_data[i];
-            }
-            else {
+            if (n_words < bitset_kernels_minimum_words) {
                 for (unsigned i = 0 ; i < n_words ; ++i)
-                    _data.long_data[i] |= other._data.long_data[i];
+                    _data.short_data[i] |= other._data.short_data[i];
             }
+            else
+                bitset_kernels.or_assign(_words(), other._words(), n_words);
 
             return *this;
         }
 
         auto intersect_with_complement(const SVOBitset & other) -> void
         {
-            if (! _is_long()) {
-                for (unsigned i = 0 ; i < svo_size ; ++i)
+            if (n_words < bitset_kernels_minimum_words) {
+                for (unsigned i = 0 ; i < n_words ; ++i)
                     _data.short_data[i] &= ~other._data.short_data[i];
             }
-            else {
+            else
+                bitset_kernels.and_not_assign(_words(), other._words(), n_words);
+        }
+
+        auto count() const -> unsigned
+        {
+            if (n_words < bitset_kernels_minimum_words) {
+                unsigned result = 0;
                 for (unsigned i = 0 ; i < n_words ; ++i)
-                    _data.long_data[i] &= ~other._data.long_data[i];
+                    result += __builtin_popcountll(_data.short_data[i]);
+                return result;
             }
+            else
+                return bitset_kernels.popcount(_words(), n_words);
         }
 
-        auto count() const -> unsigned
+        /// *this &= other, returning count() afterwards
+        auto intersect_with_and_count(const SVOBitset & other) -> unsigned
         {
-            unsigned result = 0;
-            const BitWord * b = (_is_long() ? _data.long_data : _data.short_data);
-            for (unsigned i = 0, i_end = n_words ; i < i_end ; ++i)
-                result += __builtin_popcountll(b[i]);
+            if (n_words < bitset_kernels_minimum_words) {
+                unsigned result = 0;
+                for (unsigned i = 0 ; i < n_words ; ++i)
+                    result += __builtin_popcountll(_data.short_data[i] &= other._data.short_data[i]);
+                return result;
+            }
+            else
+                return bitset_kernels.and_assign_count(_words(), other._words(), n_words);
+        }
+
+        /// intersect_with_complement(other), returning count() afterwards
+        auto intersect_with_complement_and_count(const SVOBitset & other) -> unsigned
+        {
+            if (n_words < bitset_kernels_minimum_words) {
+                unsigned result = 0;
+                for (unsigned i = 0 ; i < n_words ; ++i)
+                    result += __builtin_popcountll(_data.short_data[i] &= ~other._data.short_data[i]);
+                return result;
+            }
+            else
+                return bitset_kernels.and_not_assign_count(_words(), other._words(), n_words);
+        }
+
+        /// *this |= other, returning count() afterwards
+        auto union_with_and_count(const SVOBitset & other) -> unsigned
+        {
+            if (n_words < bitset_kernels_minimum_words) {
+                unsigned result = 0;
+                for (unsigned i = 0 ; i < n_words ; ++i)
+                    result += __builtin_popcountll(_data.short_data[i] |= other._data.short_data[i]);
+                return result;
+            }
+            else
+                return bitset_kernels.or_assign_count(_words(), other._words(), n_words);
+        }
 
-            return result;
+        /// how many bits are set in both *this and other?
+        auto intersection_count(const SVOBitset & other) const -> unsigned
+        {
+            if (n_words < bitset_kernels_minimum_words) {
+                unsigned result = 0;
+                for (unsigned i = 0 ; i < n_words ; ++i)
+                    result += __builtin_popcountll(_data.short_data[i] & other._data.short_data[i]);
+                return result;
+            }
+            else
+                return bitset_kernels.and_count(_words(), other._words(), n_words);
+        }
+
+        /// is every bit set in *this also set in other?
+        auto is_subset_of(const SVOBitset & other) const -> bool
+        {
+            if (n_words < bitset_kernels_minimum_words) {
+                for (unsigned i = 0 ; i < n_words ; ++i)
+                    if (0 != (_data.short_data[i] & ~other._data.short_data[i]))
+                        return false;
+                return true;
+            }
+            else
+                return bitset_kernels.is_subset(_words(), other._words(), n_words);
         }
 };
 
@@ -0,0 +1,8 @@
+/* vim: set sw=4 sts=4 et foldmethod=syntax : */
+
+#ifndef GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_TARGET_CACHE_FWD_HH
+#define GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_TARGET_CACHE_FWD_HH 1
+
+class InMemoryTargetCache;
+
+#endif
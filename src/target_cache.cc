@@ -0,0 +1,287 @@
+/* vim: set sw=4 sts=4 et foldmethod=syntax : */
+
+#include "target_cache.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <new>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::atomic;
+using std::copy;
+using std::make_unique;
+using std::map;
+using std::move;
+using std::mutex;
+using std::ofstream;
+using std::pair;
+using std::shared_ptr;
+using std::size_t;
+using std::string;
+using std::string_view;
+using std::strerror;
+using std::to_string;
+using std::uint32_t;
+using std::uint64_t;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+
+namespace
+{
+    const char magic[16] = "glasgow_target";
+    const uint32_t version = 1;
+    const uint32_t byte_order = 0x01020304;
+    const size_t section_alignment = 64;
+
+    auto align(uint64_t x) -> uint64_t
+    {
+        return (x + section_alignment - 1) / section_alignment * section_alignment;
+    }
+
+    struct Hasher
+    {
+        uint64_t hash = 14695981039346656037ull;
+
+        auto mix(uint64_t x) -> void
+        {
+            hash = (hash ^ x) * 1099511628211ull;
+        }
+
+        auto mix(string_view s) -> void
+        {
+            for (auto & c : s)
+                mix(static_cast<unsigned char>(c));
+            mix(s.length());
+        }
+    };
+
+    // fill in the rest of the header, and say how big the whole thing will be
+    auto lay_out(TargetCacheHeader & header, const vector<pair<const void *, size_t> > & sections) -> uint64_t
+    {
+        if (sections.size() != number_of_target_cache_sections)
+            throw TargetCacheError{ "Oops, there's a bug: wrong number of target cache sections" };
+
+        copy(&magic[0], &magic[sizeof(magic)], &header.magic[0]);
+        header.version = version;
+        header.byte_order = byte_order;
+
+        uint64_t offset = align(sizeof(TargetCacheHeader));
+        for (unsigned i = 0 ; i < number_of_target_cache_sections ; ++i) {
+            header.section_offsets[i] = offset;
+            header.section_sizes[i] = sections[i].second;
+            offset = align(offset + sections[i].second);
+        }
+
+        return offset;
+    }
+}
+
+TargetCacheError::TargetCacheError(const string & message) noexcept :
+    _what(message)
+{
+}
+
+auto TargetCacheError::what() const noexcept -> const char *
+{
+    return _what.c_str();
+}
+
+TargetCacheFile::TargetCacheFile(const string & filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (-1 == fd)
+        throw TargetCacheError{ "Unable to open target cache '" + filename + "': " + string{ strerror(errno) } };
+
+    struct stat s;
+    if (-1 == fstat(fd, &s)) {
+        close(fd);
+        throw TargetCacheError{ "Unable to read target cache '" + filename + "': " + string{ strerror(errno) } };
+    }
+
+    _size = s.st_size;
+    if (_size < sizeof(TargetCacheHeader)) {
+        close(fd);
+        throw TargetCacheError{ "'" + filename + "' is not a target cache" };
+    }
+
+    _base = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == _base)
+        throw TargetCacheError{ "Unable to map target cache '" + filename + "': " + string{ strerror(errno) } };
+
+    auto & h = header();
+    if (0 != std::memcmp(h.magic, magic, sizeof(magic))) {
+        munmap(_base, _size);
+        throw TargetCacheError{ "'" + filename + "' is not a target cache" };
+    }
+
+    _stale = (h.version != version || h.byte_order != byte_order);
+    if (! _stale)
+        for (unsigned i = 0 ; i < number_of_target_cache_sections ; ++i)
+            if (0 != h.section_offsets[i] % section_alignment || h.section_offsets[i] > _size
+                    || h.section_sizes[i] > _size - h.section_offsets[i]) {
+                munmap(_base, _size);
+                throw TargetCacheError{ "Target cache '" + filename + "' is corrupt" };
+            }
+
+    _mapped = true;
+}
+
+TargetCacheFile::TargetCacheFile(void * base, size_t size) :
+    _base(base),
+    _size(size),
+    _stale(false),
+    _mapped(false)
+{
+}
+
+TargetCacheFile::~TargetCacheFile()
+{
+    if (_mapped)
+        munmap(_base, _size);
+    else
+        std::free(_base);
+}
+
+auto TargetCacheFile::stale() const -> bool
+{
+    return _stale;
+}
+
+auto TargetCacheFile::header() const -> const TargetCacheHeader &
+{
+    return *static_cast<const TargetCacheHeader *>(_base);
+}
+
+auto TargetCacheFile::section(TargetCacheSection s) const -> pair<const void *, size_t>
+{
+    return pair{ static_cast<const char *>(_base) + header().section_offsets[s], header().section_sizes[s] };
+}
+
+auto TargetCacheFile::size() const -> size_t
+{
+    return _size;
+}
+
+auto map_target_cache(const string & filename) -> unique_ptr<TargetCacheFile>
+{
+    if (-1 == access(filename.c_str(), F_OK) && ENOENT == errno)
+        return nullptr;
+    return make_unique<TargetCacheFile>(filename);
+}
+
+auto write_target_cache(const string & filename, TargetCacheHeader header,
+        const vector<pair<const void *, size_t> > & sections) -> void
+{
+    lay_out(header, sections);
+
+    // several runs or threads might be building the same cache at once, so each writes
+    // its own temporary file, and the last one to finish wins
+    static atomic<unsigned> next_temporary{ 0 };
+    string temporary_filename = filename + ".tmp." + to_string(getpid()) + "." + to_string(next_temporary++);
+
+    {
+        ofstream out{ temporary_filename, std::ios::binary };
+        if (! out)
+            throw TargetCacheError{ "Unable to write target cache '" + temporary_filename + "'" };
+
+        const char padding[section_alignment] = { };
+        uint64_t written = 0;
+        auto write = [&] (const void * data, size_t bytes) {
+            out.write(static_cast<const char *>(data), bytes);
+            written += bytes;
+        };
+
+        write(&header, sizeof(header));
+        for (unsigned i = 0 ; i < number_of_target_cache_sections ; ++i) {
+            write(padding, header.section_offsets[i] - written);
+            write(sections[i].first, sections[i].second);
+        }
+
+        out.flush();
+        if (! out)
+            throw TargetCacheError{ "Error writing target cache '" + temporary_filename + "'" };
+    }
+
+    if (0 != std::rename(temporary_filename.c_str(), filename.c_str()))
+        throw TargetCacheError{ "Unable to move target cache '" + temporary_filename + "' to '" + filename + "'" };
+}
+
+struct InMemoryTargetCache::Imp
+{
+    mutable mutex caches_mutex;
+    map<uint64_t, shared_ptr<const TargetCacheFile> > caches;
+};
+
+InMemoryTargetCache::InMemoryTargetCache() :
+    _imp(make_unique<Imp>())
+{
+}
+
+InMemoryTargetCache::~InMemoryTargetCache() = default;
+
+auto InMemoryTargetCache::find(uint64_t settings_fingerprint) const -> shared_ptr<const TargetCacheFile>
+{
+    unique_lock<mutex> lock{ _imp->caches_mutex };
+    auto c = _imp->caches.find(settings_fingerprint);
+    return c == _imp->caches.end() ? nullptr : c->second;
+}
+
+auto InMemoryTargetCache::add(TargetCacheHeader header, const vector<pair<const void *, size_t> > & sections) -> void
+{
+    auto size = lay_out(header, sections);
+
+    // aligned like a mapping would be, so rows can be used where they are
+    unique_ptr<char, decltype(&std::free)> buffer{ static_cast<char *>(std::aligned_alloc(section_alignment, size)), &std::free };
+    if (! buffer)
+        throw std::bad_alloc{ };
+
+    std::memset(buffer.get(), 0, size);
+    std::memcpy(buffer.get(), &header, sizeof(header));
+    for (unsigned i = 0 ; i < number_of_target_cache_sections ; ++i)
+        if (0 != sections[i].second)
+            std::memcpy(buffer.get() + header.section_offsets[i], sections[i].first, sections[i].second);
+
+    unique_ptr<const TargetCacheFile> cache{ new TargetCacheFile{ buffer.get(), size } };
+    buffer.release();
+
+    unique_lock<mutex> lock{ _imp->caches_mutex };
+    _imp->caches.emplace(header.settings_fingerprint, move(cache));
+}
+
+auto fingerprint_target_graph(const InputGraph & target) -> uint64_t
+{
+    Hasher h;
+    h.mix(target.size());
+    h.mix(target.directed());
+    target.for_each_edge([&] (int f, int t, string_view l) {
+        h.mix((static_cast<uint64_t>(f) << 32) | static_cast<uint32_t>(t));
+        h.mix(l);
+    });
+
+    if (target.has_vertex_labels())
+        for (int v = 0 ; v < target.size() ; ++v)
+            h.mix(target.vertex_label(v));
+
+    return h.hash;
+}
+
+auto fingerprint_string(const string & s) -> uint64_t
+{
+    Hasher h;
+    h.mix(s);
+    return h.hash;
+}
+
@@ -0,0 +1,147 @@
+/* vim: set sw=4 sts=4 et foldmethod=syntax : */
+
+#ifndef GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_TARGET_CACHE_HH
+#define GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_TARGET_CACHE_HH 1
+
+#include "formats/input_graph.hh"
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Thrown if a target cache can't be read or written, or if a file we were
+ * told to use as a target cache isn't one.
+ */
+class TargetCacheError :
+    public std::exception
+{
+    private:
+        std::string _what;
+
+    public:
+        explicit TargetCacheError(const std::string & message) noexcept;
+
+        auto what() const noexcept -> const char * override;
+};
+
+/**
+ * What is in each section of a target cache file. Rows are stored as
+ * row_words words each, in the same order as the model keeps them.
+ */
+enum TargetCacheSection : unsigned
+{
+    target_cache_rows,
+    target_cache_forward_rows,
+    target_cache_reverse_rows,
+    target_cache_degrees,
+    target_cache_loops,
+    target_cache_vertex_labels,
+    target_cache_edge_labels,
+    target_cache_vertex_label_names,
+    target_cache_edge_label_names,
+    number_of_target_cache_sections
+};
+
+/**
+ * The start of a target cache file. Everything is in native byte order, and
+ * every section starts on a 64 byte boundary, so that rows can be used
+ * straight out of a read-only mapping of the file.
+ */
+struct TargetCacheHeader
+{
+    char magic[16];
+    std::uint32_t version, byte_order;
+
+    /// from fingerprint_target_graph, to spot a changed target file
+    std::uint64_t target_fingerprint;
+
+    /// everything about the parameters that changes the target side of the model
+    std::uint64_t settings_fingerprint;
+
+    std::uint32_t target_size, max_graphs, row_words, largest_target_degree;
+
+    std::uint64_t section_offsets[number_of_target_cache_sections];
+    std::uint64_t section_sizes[number_of_target_cache_sections];
+};
+
+/**
+ * A read-only target cache. Usually this is a mapping of a file, whose pages
+ * are shared with every other process that has the same file mapped, but an
+ * InMemoryTargetCache keeps the same layout in an aligned buffer instead.
+ */
+class TargetCacheFile
+{
+    private:
+        void * _base;
+        std::size_t _size;
+        bool _stale, _mapped;
+
+        TargetCacheFile(void * base, std::size_t size);
+
+        friend class InMemoryTargetCache;
+
+    public:
+        explicit TargetCacheFile(const std::string & filename);
+        ~TargetCacheFile();
+
+        TargetCacheFile(const TargetCacheFile &) = delete;
+        TargetCacheFile & operator= (const TargetCacheFile &) = delete;
+
+        /// written by a different version of the solver, or on a different kind of machine
+        auto stale() const -> bool;
+
+        auto header() const -> const TargetCacheHeader &;
+
+        /// start and size in bytes, only if not stale
+        auto section(TargetCacheSection s) const -> std::pair<const void *, std::size_t>;
+
+        auto size() const -> std::size_t;
+};
+
+/// a mapping of the file, or null if it does not exist yet
+auto map_target_cache(const std::string & filename) -> std::unique_ptr<TargetCacheFile>;
+
+/// fills in the magic, version, byte order and section table of the header,
+/// then writes to a temporary file and moves it into place
+auto write_target_cache(const std::string & filename, TargetCacheHeader header,
+        const std::vector<std::pair<const void *, std::size_t> > & sections) -> void;
+
+/**
+ * Target caches for one target, kept in memory rather than in a file, for
+ * when one process solves many patterns against a target it already has. One
+ * is kept for each combination of the settings that change the target side
+ * of the model, so alternating between settings doesn't rebuild anything.
+ * Any number of threads can use this at once.
+ */
+class InMemoryTargetCache
+{
+    private:
+        struct Imp;
+        std::unique_ptr<Imp> _imp;
+
+    public:
+        InMemoryTargetCache();
+        ~InMemoryTargetCache();
+
+        InMemoryTargetCache(const InMemoryTargetCache &) = delete;
+        InMemoryTargetCache & operator= (const InMemoryTargetCache &) = delete;
+
+        /// the cache built with these settings, or null if there isn't one yet
+        auto find(std::uint64_t settings_fingerprint) const -> std::shared_ptr<const TargetCacheFile>;
+
+        /// as for write_target_cache; if another thread got there first, its
+        /// copy is kept
+        auto add(TargetCacheHeader header, const std::vector<std::pair<const void *, std::size_t> > & sections) -> void;
+};
+
+/// a hash of everything in the target graph that the model looks at
+auto fingerprint_target_graph(const InputGraph & target) -> std::uint64_t;
+
+auto fingerprint_string(const std::string & s) -> std::uint64_t;
+
+#endif
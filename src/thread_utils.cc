@@ -2,9 +2,25 @@
 
 #include "thread_utils.hh"
 
+#include <fstream>
+#include <sstream>
+#include <string>
 #include <thread>
+#include <utility>
 
+#ifdef __linux__
+#  include <sched.h>
+#endif
+
+using std::ifstream;
+using std::getline;
+using std::istringstream;
+using std::move;
+using std::stoul;
+using std::string;
 using std::thread;
+using std::to_string;
+using std::vector;
 
 auto how_many_threads(unsigned n) -> unsigned
 {
@@ -15,3 +31,101 @@ auto how_many_threads(unsigned n) -> unsigned
     return n;
 }
 
+auto threads_in_this_process() -> unsigned
+{
+    ifstream status{ "/proc/self/status" };
+    string line;
+    while (getline(status, line))
+        if (0 == line.compare(0, 8, "Threads:"))
+            return stoul(line.substr(8));
+    return 0;
+}
+
+namespace
+{
+    // parse something like "0-3,8-11" from sysfs
+    auto parse_cpu_list(const string & s) -> vector<unsigned>
+    {
+        vector<unsigned> result;
+        istringstream in{ s };
+        string range;
+        while (getline(in, range, ',')) {
+            if (range.empty() || range == "\n")
+                continue;
+            try {
+                auto dash = range.find('-');
+                unsigned first = stoul(range.substr(0, dash));
+                unsigned last = (dash == string::npos) ? first : stoul(range.substr(dash + 1));
+                for (unsigned c = first ; c <= last ; ++c)
+                    result.push_back(c);
+            }
+            catch (const std::exception &) {
+                return vector<unsigned>{ };
+            }
+        }
+        return result;
+    }
+}
+
+auto numa_nodes_and_cpus() -> vector<vector<unsigned> >
+{
+    vector<vector<unsigned> > result;
+
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    bool have_allowed = (0 == sched_getaffinity(0, sizeof(allowed), &allowed));
+    auto usable = [&] (unsigned c) {
+        return c < CPU_SETSIZE && ((! have_allowed) || CPU_ISSET(c, &allowed));
+    };
+
+    // node numbers can have gaps, so give up after a run of missing ones
+    for (unsigned node = 0, missing = 0 ; missing < 64 ; ++node) {
+        ifstream in{ "/sys/devices/system/node/node" + to_string(node) + "/cpulist" };
+        if (! in) {
+            ++missing;
+            continue;
+        }
+        missing = 0;
+
+        string line;
+        getline(in, line);
+        vector<unsigned> cpus;
+        for (auto & c : parse_cpu_list(line))
+            if (usable(c))
+                cpus.push_back(c);
+        if (! cpus.empty())
+            result.push_back(move(cpus));
+    }
+
+    if (result.empty() && have_allowed) {
+        result.emplace_back();
+        for (unsigned c = 0 ; c < CPU_SETSIZE ; ++c)
+            if (CPU_ISSET(c, &allowed))
+                result.back().push_back(c);
+    }
+#endif
+
+    if (result.empty()) {
+        result.emplace_back();
+        for (unsigned c = 0, c_end = how_many_threads(0) ; c < c_end ; ++c)
+            result.back().push_back(c);
+    }
+
+    return result;
+}
+
+auto pin_this_thread_to_cpu([[ maybe_unused ]] unsigned cpu) -> bool
+{
+#ifdef __linux__
+    if (cpu >= CPU_SETSIZE)
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return 0 == sched_setaffinity(0, sizeof(set), &set);
+#else
+    return false;
+#endif
+}
+
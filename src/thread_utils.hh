@@ -3,6 +3,27 @@
 #ifndef GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_THREAD_UTILS_HH
 #define GLASGOW_SUBGRAPH_SOLVER_GUARD_SRC_THREAD_UTILS_HH 1
 
+#include <vector>
+
 auto how_many_threads(unsigned n) -> unsigned;
 
+/**
+ * How many threads this process has, including the caller, or 0 if we can't
+ * tell (for example, if we are not on Linux).
+ */
+auto threads_in_this_process() -> unsigned;
+
+/**
+ * The CPUs we are allowed to run on, grouped by NUMA node. Only nodes with
+ * at least one usable CPU are included. On Linux this comes from sysfs and
+ * our affinity mask; if that isn't available, everything is one node.
+ */
+auto numa_nodes_and_cpus() -> std::vector<std::vector<unsigned> >;
+
+/**
+ * Pin the calling thread to a single CPU. Returns false if we can't (for
+ * example, if we are not on Linux).
+ */
+auto pin_this_thread_to_cpu(unsigned cpu) -> bool;
+
 #endif
@@ -17,6 +17,8 @@ using std::condition_variable;
 using std::cv_status;
 using std::make_unique;
 using std::mutex;
+using std::nullopt;
+using std::optional;
 using std::thread;
 using std::unique_lock;
 
@@ -26,11 +28,13 @@ using std::chrono::system_clock;
 
 struct Timeout::Detail
 {
-    bool aborted = false;
+    atomic<bool> aborted{ false };
     thread timeout_thread;
     mutex timeout_mutex;
     condition_variable timeout_cv;
     atomic<bool> abort;
+    system_clock::time_point abort_time;
+    bool handing_over = false;
 };
 
 Timeout::Timeout(const seconds limit) :
@@ -38,14 +42,16 @@ Timeout::Timeout(const seconds limit) :
 {
     _detail->abort.store(false);
     if (0s != limit) {
-        _detail->timeout_thread = thread([limit, &detail = this->_detail] {
-                auto abort_time = system_clock::now() + limit;
+        _detail->abort_time = system_clock::now() + limit;
+        _detail->timeout_thread = thread([&detail = this->_detail] {
                 {
                     /* Sleep until either we've reached the time limit,
                      * or we've finished all the work. */
                     unique_lock<mutex> guard(detail->timeout_mutex);
                     while (! detail->abort.load()) {
-                        if (cv_status::timeout == detail->timeout_cv.wait_until(guard, abort_time)) {
+                        if (detail->handing_over)
+                            return;
+                        if (cv_status::timeout == detail->timeout_cv.wait_until(guard, detail->abort_time)) {
                             /* We've woken up, and it's due to a timeout. */
                             detail->aborted = true;
                             break;
@@ -77,6 +83,29 @@ auto Timeout::trigger_early_abort() -> void
     return _detail->abort.store(true);
 }
 
+auto Timeout::expire() -> void
+{
+    _detail->aborted.store(true);
+    _detail->abort.store(true);
+}
+
+auto Timeout::hand_over_deadline() -> optional<system_clock::time_point>
+{
+    if (! _detail->timeout_thread.joinable())
+        return nullopt;
+
+    {
+        unique_lock<mutex> guard(_detail->timeout_mutex);
+        _detail->handing_over = true;
+        _detail->timeout_cv.notify_all();
+    }
+    _detail->timeout_thread.join();
+
+    if (_detail->abort.load())
+        return nullopt;
+    return _detail->abort_time;
+}
+
 auto Timeout::stop() -> void
 {
     /* Clean up the timeout thread */
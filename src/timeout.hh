@@ -5,6 +5,7 @@
 
 #include <chrono>
 #include <memory>
+#include <optional>
 
 class Timeout
 {
@@ -20,6 +21,16 @@ class Timeout
         auto aborted() const -> bool;
         auto stop() -> void;
         auto trigger_early_abort() -> void;
+
+        /// Behave as if the limit had been reached, for when something else
+        /// is keeping track of the time, so that we don't need our own thread.
+        auto expire() -> void;
+
+        /// Stop our thread, if we have one, and return when the limit will be
+        /// reached, if that is still to come. The caller must then keep track
+        /// of the time instead, and call expire() when it is reached. For when
+        /// there mustn't be any other threads, such as before forking.
+        auto hand_over_deadline() -> std::optional<std::chrono::system_clock::time_point>;
 };
 
 #endif
@@ -4,94 +4,238 @@
 #define GLASGOW_SUBGRAPH_SOLVER_GUARD_WATCHES_HH 1
 
 #include <algorithm>
-#include <list>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
 // A nogood, aways of the form (list of decisions) -> false, where the
-// last part is implicit. If there are at least two assignments, then the
-// first two assignments are the watches (and the literals are permuted
-// when the watches are updates).
+// last part is implicit. This is only used to hand a nogood over to be
+// posted: once it is in a Watches, it lives in the arena.
 template <typename Decision_>
 struct Nogood
 {
     std::vector<Decision_> literals;
 };
 
-// Two watched literals for our nogoods store.
+// Two watched literals for our nogoods store. The watch table must give each
+// literal its own entry, and also a distinct index, for hashing.
 template <typename Decision_, template <typename> typename WatchTable_>
 struct Watches
 {
-    // nogoods stored here
-    using NogoodStore = std::list<Nogood<Decision_> >;
+    static_assert(std::is_trivially_copyable_v<Decision_>, "decisions are stored inline in the arena");
 
-    NogoodStore nogoods;
+    // Every nogood lives in one arena: two header cells giving its length and
+    // how often it has propagated, followed by its literals. A nogood is
+    // referred to by the index of its header. If there are at least two
+    // literals, the first two are the watches (and the literals are permuted
+    // when the watches are updated).
+    union ArenaCell
+    {
+        unsigned size;
+        unsigned activity;
+        Decision_ literal;
+    };
+
+    using NogoodRef = unsigned;
+
+    static const constexpr unsigned header_cells = 2;
+
+    std::vector<ArenaCell> arena;
+    unsigned number_of_nogoods = 0;
 
-    // For each watched literal, we have a list of watched things, each of
-    // which is an iterator into the global watch list (so we can reorder
-    // the literal to keep the watches as the first two elements).
-    using WatchList = std::list<typename NogoodStore::iterator>;
+    // for stats
+    unsigned long long nogoods_subsumed = 0, nogoods_deleted = 0, reductions = 0;
+
+    // For each watched literal, we have a vector of the nogoods watching it.
+    // Each also carries a blocker, which is another literal from the same
+    // nogood: if the blocker is known to be false, the nogood can't do
+    // anything, and we don't need to look at the arena at all.
+    struct Watcher
+    {
+        NogoodRef nogood;
+        Decision_ blocker;
+    };
+
+    using WatchList = std::vector<Watcher>;
 
     WatchTable_<WatchList> table;
 
     // Rather than backjumping, we update the watch list on restarts (to make
     // parallel shenanigans easier).
-    using NeedToWatch = std::list<typename NogoodStore::iterator>;
+    using NeedToWatch = std::vector<NogoodRef>;
 
     NeedToWatch need_to_watch, gathered_need_to_watch;
 
-    template <typename CanWatchFunction_, typename AssignmentIsNogoodFunction_>
+    // Nogoods of length one or two are never deleted, so we keep a hashed
+    // index of them, to check cheaply whether a new nogood says anything new.
+    // Longer nogoods aren't checked, because doing so means looking through
+    // the watches of every literal, for every nogood posted.
+    std::unordered_set<unsigned long long> short_nogoods;
+
+    auto nogood_size(NogoodRef n) const -> unsigned
+    {
+        return arena[n].size;
+    }
+
+    auto nogood_activity(NogoodRef n) -> unsigned &
+    {
+        return arena[n + 1].activity;
+    }
+
+    auto nogood_literals(NogoodRef n) -> Decision_ *
+    {
+        return &arena[n + header_cells].literal;
+    }
+
+    auto nogood_literals(NogoodRef n) const -> const Decision_ *
+    {
+        return &arena[n + header_cells].literal;
+    }
+
+    /// call f(literals, size) for every nogood we have
+    template <typename F_>
+    auto for_each_nogood(const F_ & f) const -> void
+    {
+        for (NogoodRef n = 0 ; n < arena.size() ; n += header_cells + nogood_size(n))
+            f(nogood_literals(n), nogood_size(n));
+    }
+
+    template <typename CanWatchFunction_, typename AssignmentIsNogoodFunction_, typename KnownFalseFunction_>
     auto propagate(
             Decision_ current_assignment,
             const CanWatchFunction_ & can_watch,
-            const AssignmentIsNogoodFunction_ & assignment_is_nogood) -> void
+            const AssignmentIsNogoodFunction_ & assignment_is_nogood,
+            const KnownFalseFunction_ & known_false) -> void
     {
+        // watchers we keep are compacted down as we go
         auto & watches_to_update = table[current_assignment];
-        for (auto watch_to_update = watches_to_update.begin() ; watch_to_update != watches_to_update.end() ; ) {
-            auto & nogood = **watch_to_update;
+        auto keep = watches_to_update.begin();
+        for (auto watch_to_update = watches_to_update.begin() ; watch_to_update != watches_to_update.end() ; ++watch_to_update) {
+            // this nogood is already satisfied?
+            if (known_false(watch_to_update->blocker)) {
+                *keep++ = *watch_to_update;
+                continue;
+            }
+
+            auto nogood = watch_to_update->nogood;
+            auto literals = nogood_literals(nogood);
+            auto size = nogood_size(nogood);
 
             // make the first watch the thing we just triggered
-            if (nogood.literals[0] != current_assignment)
-                std::swap(nogood.literals[0], nogood.literals[1]);
+            if (literals[0] != current_assignment)
+                std::swap(literals[0], literals[1]);
+
+            // the other watch might do as a blocker instead
+            if (known_false(literals[1])) {
+                *keep++ = Watcher{ nogood, literals[1] };
+                continue;
+            }
 
             // can we find something else to watch?
             bool success = false;
-            for (auto new_literal = next(nogood.literals.begin(), 2) ; new_literal != nogood.literals.end() ; ++new_literal) {
-                if (can_watch(*new_literal)) {
+            for (unsigned new_literal = 2 ; new_literal < size ; ++new_literal) {
+                if (can_watch(literals[new_literal])) {
                     // we can watch new_literal instead of current_assignment in this nogood
                     success = true;
 
                     // move the new watch to be the first item in the nogood
-                    std::swap(nogood.literals[0], *new_literal);
-
-                    // start watching it
-                    table[nogood.literals[0]].push_back(*watch_to_update);
-
-                    // remove the current watch, and update the loop iterator
-                    watches_to_update.erase(watch_to_update++);
+                    std::swap(literals[0], literals[new_literal]);
 
+                    // start watching it. this can't be the list we're going
+                    // through, because current_assignment can't be watched.
+                    table[literals[0]].push_back(Watcher{ nogood, literals[1] });
                     break;
                 }
             }
 
-            // found something new? nothing to propagate (and we've already updated our loop iterator in the erase)
+            // found something new? nothing to propagate, and this watch goes
             if (success)
                 continue;
 
             // no new watch, this nogood will now propagate.
-            assignment_is_nogood(nogood.literals[1]);
+            *keep++ = *watch_to_update;
+            ++nogood_activity(nogood);
+            assignment_is_nogood(literals[1]);
+        }
+
+        watches_to_update.erase(keep, watches_to_update.end());
+    }
+
+    // as above, for when there is no cheap way of telling that a literal is false
+    template <typename CanWatchFunction_, typename AssignmentIsNogoodFunction_>
+    auto propagate(
+            Decision_ current_assignment,
+            const CanWatchFunction_ & can_watch,
+            const AssignmentIsNogoodFunction_ & assignment_is_nogood) -> void
+    {
+        propagate(current_assignment, can_watch, assignment_is_nogood, [] (const Decision_ &) { return false; });
+    }
+
+    auto add_to_arena(const Decision_ * literals, unsigned size) -> NogoodRef
+    {
+        NogoodRef n = arena.size();
+        arena.emplace_back();
+        arena.back().size = size;
+        arena.emplace_back();
+        arena.back().activity = 0;
+        for (unsigned i = 0 ; i < size ; ++i) {
+            arena.emplace_back();
+            arena.back().literal = literals[i];
+        }
+
+        if (1 == size)
+            short_nogoods.insert(short_nogood_key(literals[0]));
+        else if (2 == size)
+            short_nogoods.insert(short_nogood_key(literals[0], literals[1]));
+
+        ++number_of_nogoods;
+        return n;
+    }
+
+    auto short_nogood_key(const Decision_ & a) -> unsigned long long
+    {
+        return table.index(a) + 1;
+    }
+
+    auto short_nogood_key(const Decision_ & a, const Decision_ & b) -> unsigned long long
+    {
+        auto key_a = short_nogood_key(a), key_b = short_nogood_key(b);
+        return (std::max(key_a, key_b) << 32) | std::min(key_a, key_b);
+    }
+
+    /// do we already have a nogood of length one or two that is a subset of
+    /// this one? costs one lookup for each literal and each pair of literals.
+    auto subsumed(const Decision_ * literals, unsigned size) -> bool
+    {
+        if (short_nogoods.empty())
+            return false;
 
-            // step the loop variable, only if we've not already erased it
-            ++watch_to_update;
+        for (unsigned i = 0 ; i < size ; ++i) {
+            if (short_nogoods.count(short_nogood_key(literals[i])))
+                return true;
+            for (unsigned j = i + 1 ; j < size ; ++j)
+                if (short_nogoods.count(short_nogood_key(literals[i], literals[j])))
+                    return true;
         }
+
+        return false;
     }
 
     // posts a nogood, which doesn't kick in until apply_new_nogoods() is
-    // called.
+    // called. if we already have a short nogood that is at least as strong,
+    // it is ignored.
     auto post_nogood(Nogood<Decision_> && nogood)
     {
-        nogoods.emplace_back(std::move(nogood));
-        need_to_watch.emplace_back(std::prev(nogoods.end()));
+        if (subsumed(nogood.literals.data(), nogood.literals.size()))
+            ++nogoods_subsumed;
+        else
+            need_to_watch.push_back(add_to_arena(nogood.literals.data(), nogood.literals.size()));
     }
 
     template <typename AssignmentIsNogoodFunction_>
@@ -111,28 +255,29 @@ struct Watches
 
     template <typename AssignmentIsNogoodFunction_>
     auto apply_one_new_nogood(
-            const typename NogoodStore::iterator & n,
+            NogoodRef n,
             const AssignmentIsNogoodFunction_ & assignment_is_nogood) -> bool
     {
-        if (n->literals.empty())
+        auto literals = nogood_literals(n);
+        if (0 == nogood_size(n))
             return true;
-        else if (1 == n->literals.size())
-            assignment_is_nogood(n->literals[0]);
+        else if (1 == nogood_size(n))
+            assignment_is_nogood(literals[0]);
         else {
-            table[n->literals[0]].push_back(n);
-            table[n->literals[1]].push_back(n);
+            table[literals[0]].push_back(Watcher{ n, literals[1] });
+            table[literals[1]].push_back(Watcher{ n, literals[0] });
         }
 
         return false;
     }
 
-    auto gather_nogoods_from(
-            Watches & other)
+    // like post_nogood, but for a nogood that came from another thread
+    auto gather_nogood(const Decision_ * literals, unsigned size) -> void
     {
-        for (auto & n : other.need_to_watch) {
-            nogoods.emplace_back(*n);
-            gathered_need_to_watch.emplace_back(std::prev(nogoods.end()));
-        }
+        if (subsumed(literals, size))
+            ++nogoods_subsumed;
+        else
+            gathered_need_to_watch.push_back(add_to_arena(literals, size));
     }
 
     auto clear_new_nogoods() -> void
@@ -140,6 +285,193 @@ struct Watches
         need_to_watch.clear();
         gathered_need_to_watch.clear();
     }
+
+    // If the arena is using more than memory_limit bytes (0 means no limit),
+    // throw away nogoods until it is at most half that. Nogoods of length
+    // two or less are always kept, and otherwise we prefer to keep nogoods
+    // that have propagated often, then short nogoods. Activity is halved
+    // each time, so it is mostly recent. This must only be called between
+    // clear_new_nogoods() and the next propagation, because it rebuilds the
+    // watches from scratch and so every nogood goes back to watching its
+    // first two literals.
+    auto reduce(unsigned long long memory_limit) -> void
+    {
+        if (0 == memory_limit || arena.size() * sizeof(ArenaCell) <= memory_limit)
+            return;
+
+        ++reductions;
+
+        std::vector<NogoodRef> candidates;
+        unsigned long long cells_wanted = memory_limit / 2 / sizeof(ArenaCell), cells_kept = 0;
+        for (NogoodRef n = 0 ; n < arena.size() ; n += header_cells + nogood_size(n)) {
+            if (nogood_size(n) <= 2)
+                cells_kept += header_cells + nogood_size(n);
+            else
+                candidates.push_back(n);
+        }
+
+        std::sort(candidates.begin(), candidates.end(), [&] (NogoodRef a, NogoodRef b) {
+                return std::pair{ nogood_activity(b), nogood_size(a) } < std::pair{ nogood_activity(a), nogood_size(b) };
+                });
+
+        std::vector<char> keep(arena.size(), false);
+        for (NogoodRef n = 0 ; n < arena.size() ; n += header_cells + nogood_size(n))
+            keep[n] = nogood_size(n) <= 2;
+        for (auto & n : candidates)
+            if (cells_kept + header_cells + nogood_size(n) <= cells_wanted) {
+                cells_kept += header_cells + nogood_size(n);
+                keep[n] = true;
+            }
+
+        // compact, in order
+        std::vector<ArenaCell> new_arena;
+        new_arena.reserve(cells_kept);
+        number_of_nogoods = 0;
+        for (NogoodRef n = 0 ; n < arena.size() ; n += header_cells + nogood_size(n)) {
+            if (keep[n]) {
+                new_arena.insert(new_arena.end(), arena.begin() + n, arena.begin() + n + header_cells + nogood_size(n));
+                new_arena[new_arena.size() - nogood_size(n) - 1].activity /= 2;
+                ++number_of_nogoods;
+            }
+            else
+                ++nogoods_deleted;
+        }
+        arena = std::move(new_arena);
+
+        // and rewatch everything
+        for (auto & w : table.data)
+            w.clear();
+        for (NogoodRef n = 0 ; n < arena.size() ; n += header_cells + nogood_size(n))
+            if (nogood_size(n) >= 2) {
+                auto literals = nogood_literals(n);
+                table[literals[0]].push_back(Watcher{ n, literals[1] });
+                table[literals[1]].push_back(Watcher{ n, literals[0] });
+            }
+    }
+};
+
+// A ring of nogoods, with one thread writing and any number of threads
+// reading, for sharing nogoods without locks or barriers. Each reader has its
+// own position, and nothing is overwritten until every reader has passed it:
+// if there isn't room, post() fails, and the writer should hang on to the
+// nogood and try again later, rather than waiting. The ring either owns its
+// memory, or is given memory that is shared between processes, in which case
+// the memory must be at the same address in every process (for example, by
+// being mapped before forking).
+template <typename Decision_>
+struct NogoodRing
+{
+    static_assert(std::is_trivially_copyable_v<Decision_>, "decisions are stored inline in the ring");
+
+    // each nogood is a size cell followed by its literals, and can wrap
+    // around the end
+    union Cell
+    {
+        unsigned size;
+        Decision_ literal;
+    };
+
+    struct alignas(64) Position
+    {
+        std::atomic<unsigned long long> value{ 0 };
+        std::atomic<bool> ignored{ false };
+    };
+
+    unsigned writer, n_readers;
+    unsigned long long n_cells;
+    Position * written;
+    Position * read;
+    Cell * cells;
+    std::unique_ptr<unsigned char[]> owned_memory;
+
+    static auto cells_for(unsigned capacity) -> unsigned long long
+    {
+        unsigned long long size = 1;
+        while (size < capacity)
+            size *= 2;
+        return size;
+    }
+
+    // how much memory to give the constructor, allowing for alignment
+    static auto bytes_needed(unsigned capacity, unsigned n_readers) -> std::size_t
+    {
+        return alignof(Position) + sizeof(Position) * (n_readers + 1) + sizeof(Cell) * cells_for(capacity);
+    }
+
+    // capacity is rounded up to a power of two, and must be more than the
+    // longest nogood that will be posted
+    NogoodRing(unsigned capacity, unsigned r, unsigned w, void * memory = nullptr) :
+        writer(w),
+        n_readers(r),
+        n_cells(cells_for(capacity))
+    {
+        if (! memory) {
+            owned_memory = std::make_unique<unsigned char[]>(bytes_needed(capacity, n_readers));
+            memory = owned_memory.get();
+        }
+
+        auto address = reinterpret_cast<std::uintptr_t>(memory);
+        address = (address + alignof(Position) - 1) / alignof(Position) * alignof(Position);
+        auto positions = reinterpret_cast<Position *>(address);
+        for (unsigned p = 0 ; p <= n_readers ; ++p)
+            new (&positions[p]) Position{ };
+
+        written = &positions[0];
+        read = &positions[1];
+        cells = reinterpret_cast<Cell *>(&positions[n_readers + 1]);
+    }
+
+    NogoodRing(const NogoodRing &) = delete;
+
+    auto cell(unsigned long long position) -> Cell &
+    {
+        return cells[position & (n_cells - 1)];
+    }
+
+    auto post(const Decision_ * literals, unsigned size) -> bool
+    {
+        auto end = written->value.load(std::memory_order_relaxed);
+
+        for (unsigned r = 0 ; r < n_readers ; ++r)
+            if (r != writer && ! read[r].ignored.load(std::memory_order_relaxed)
+                    && end + 1 + size - read[r].value.load(std::memory_order_acquire) > n_cells)
+                return false;
+
+        cell(end).size = size;
+        for (unsigned i = 0 ; i < size ; ++i)
+            cell(end + 1 + i).literal = literals[i];
+
+        written->value.store(end + 1 + size, std::memory_order_release);
+        return true;
+    }
+
+    // for a reader that won't read any more, so writers needn't wait for it,
+    // for example if it never restarts or if its process has died. an
+    // ignored reader must not read again.
+    auto ignore_reader(unsigned reader) -> void
+    {
+        read[reader].ignored.store(true, std::memory_order_relaxed);
+    }
+
+    // call f(literals, size) for every nogood that reader hasn't yet seen,
+    // using scratch to put each nogood back together
+    template <typename F_>
+    auto read_new(unsigned reader, std::vector<Decision_> & scratch, const F_ & f) -> void
+    {
+        auto end = written->value.load(std::memory_order_acquire);
+        auto position = read[reader].value.load(std::memory_order_relaxed);
+
+        while (position != end) {
+            unsigned size = cell(position).size;
+            scratch.clear();
+            for (unsigned i = 0 ; i < size ; ++i)
+                scratch.push_back(cell(position + 1 + i).literal);
+            f(scratch.data(), size);
+            position += 1 + size;
+        }
+
+        read[reader].value.store(position, std::memory_order_release);
+    }
 };
 
 #endif